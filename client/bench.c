@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "../common/dfs_proto.h"
+
+#define PORT 8080
+
+// Function defination
+void usage(const char *prog);
+double now_seconds();
+int bench_send(const char *file_path, int rounds);
+int bench_dfile(const char *file_path, int rounds);
+int bench_rps(int port, const char *file_path, int requests, int clients, int reconnect);
+int connect_local(int port);
+int download_once(int sock, uint32_t request_id, const char *file_path, uint64_t *bytes);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The request rate benchmark takes its own arguments
+    if (strcmp(argv[1], "rps") == 0 && argc > 3) {
+        int requests = argc > 4 ? atoi(argv[4]) : 2000;
+        int clients = argc > 5 ? atoi(argv[5]) : 1;
+        int reconnect = argc > 6 && strcmp(argv[6], "new") == 0;
+        if (requests <= 0 || clients <= 0) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return bench_rps(atoi(argv[2]), argv[3], requests, clients, reconnect) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    int rounds = argc > 3 ? atoi(argv[3]) : 10;
+    if (rounds <= 0) {
+        rounds = 10;
+    }
+
+    // Pick the benchmark
+    if (strcmp(argv[1], "send") == 0) {
+        return bench_send(argv[2], rounds) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (strcmp(argv[1], "dfile") == 0) {
+        return bench_dfile(argv[2], rounds) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    usage(argv[0]);
+    return EXIT_FAILURE;
+}
+
+// Function to print how the benchmark is used
+void usage(const char *prog) {
+    printf("Usage:\n");
+    printf("  %s send <local-file> [rounds]     compare the copy loop and sendfile() download paths\n", prog);
+    printf("  %s dfile <~/smain/path> [rounds]  download a file repeatedly through a running smain\n", prog);
+    printf("  %s rps <port> <~/smain/path> [requests] [clients] [new]\n", prog);
+    printf("      download a small file from the server on port (8080 smain, 8081 spdf, 8082 stext) with\n");
+    printf("      concurrent clients and report requests/s; 'new' opens a connection per request\n");
+}
+
+// helper to read a monotonic clock in seconds
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to measure the server side send path in isolation. For each mode a sender process
+// pushes the file over loopback TCP with dfs_send_file() exactly like the servers do, and reports
+// the CPU time it used, so the numbers show bytes/sec and sender CPU per byte before and after.
+int bench_send(const char *file_path, int rounds) {
+    const char *modes[2] = {"copy loop", "sendfile"};
+    const char *env_values[2] = {"0", "1"};
+
+    printf("%-10s %10s %12s %14s\n", "mode", "MB", "MB/s", "cpu ns/byte");
+    for (int m = 0; m < 2; m++) {
+        // Listen on an ephemeral loopback port
+        int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (listen_sock < 0 || bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(listen_sock, 1) < 0 || getsockname(listen_sock, (struct sockaddr*)&addr, &addr_len) < 0) {
+            perror("Benchmark socket setup failed");
+            return -1;
+        }
+
+        // The sender reports its CPU time in microseconds through this pipe
+        int cpu_pipe[2];
+        if (pipe(cpu_pipe) < 0) {
+            perror("pipe");
+            return -1;
+        }
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Sender: select the mode, then serve the file once per round
+            setenv("DFS_SENDFILE", env_values[m], 1);
+            int sock = accept(listen_sock, NULL, NULL);
+            for (int r = 0; r < rounds && sock >= 0; r++) {
+                int file_fd = open(file_path, O_RDONLY);
+                if (file_fd < 0 || dfs_send_file(sock, (uint32_t)r, file_fd) < 0) {
+                    perror("Sending file failed");
+                    exit(EXIT_FAILURE);
+                }
+                close(file_fd);
+            }
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            long long cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL +
+                               usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+            write(cpu_pipe[1], &cpu_us, sizeof(cpu_us));
+            exit(EXIT_SUCCESS);
+        }
+        close(listen_sock);
+        close(cpu_pipe[1]);
+
+        // Receiver: drain every round and time the whole transfer
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("Benchmark connect failed");
+            return -1;
+        }
+        uint64_t total = 0;
+        double start = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            uint64_t bytes = 0;
+            if (dfs_recv_stream(sock, -1, &bytes, NULL, 0) != 0) {
+                printf("Transfer failed in round %d\n", r);
+                return -1;
+            }
+            total += bytes;
+        }
+        double elapsed = now_seconds() - start;
+        close(sock);
+
+        long long cpu_us = 0;
+        read(cpu_pipe[0], &cpu_us, sizeof(cpu_us));
+        close(cpu_pipe[0]);
+        waitpid(pid, NULL, 0);
+
+        printf("%-10s %10.1f %12.1f %14.3f\n", modes[m], total / 1e6, total / 1e6 / elapsed,
+               total > 0 ? cpu_us * 1000.0 / total : 0.0);
+    }
+    return 0;
+}
+
+// Function to download one file through smain and discard the content
+int download_once(int sock, uint32_t request_id, const char *file_path, uint64_t *bytes) {
+    struct dfs_hdr hdr;
+    char name[DFS_MAX_TEXT + 1];
+
+    if (dfs_send_text(sock, DFS_OP_DFILE, request_id, file_path) < 0 ||
+        dfs_recv_hdr(sock, &hdr) < 0 || dfs_recv_text(sock, &hdr, name, sizeof(name)) < 0) {
+        printf("Connection closed by server.\n");
+        return -1;
+    }
+    if (hdr.opcode != DFS_OP_NAME) {
+        printf("Server: %s\n", name);
+        return -1;
+    }
+    return dfs_recv_stream(sock, -1, bytes, NULL, 0) == 0 ? 0 : -1;
+}
+
+// helper to connect to a server on the local host, returns -1 on failure
+int connect_local(int port) {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connect failed");
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    return sock;
+}
+
+// Function to measure end-to-end download throughput through a running smain
+int bench_dfile(const char *file_path, int rounds) {
+    int sock = connect_local(PORT);
+    if (sock < 0) {
+        return -1;
+    }
+
+    uint64_t total = 0;
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        uint64_t bytes = 0;
+        if (download_once(sock, (uint32_t)r + 1, file_path, &bytes) < 0) {
+            close(sock);
+            return -1;
+        }
+        total += bytes;
+    }
+    double elapsed = now_seconds() - start;
+    close(sock);
+
+    printf("%d downloads, %.1f MB in %.3f s: %.1f MB/s, %.1f requests/s\n",
+           rounds, total / 1e6, elapsed, total / 1e6 / elapsed, rounds / elapsed);
+    return 0;
+}
+
+// Function to measure how many small requests per second a server handles. Every client is a
+// process sending dfile requests back to back, either on one connection or, with reconnect,
+// on a new connection per request (what smain does when its connection pool is empty).
+// The path is sent as is, so for spdf/stext it is the server side path ("~/smain/..." works).
+int bench_rps(int port, const char *file_path, int requests, int clients, int reconnect) {
+    int per_client = (requests + clients - 1) / clients;
+
+    fflush(stdout);
+    double start = now_seconds();
+    for (int c = 0; c < clients; c++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return -1;
+        }
+        if (pid > 0) {
+            continue;
+        }
+
+        // Client process: the exit status tells the parent whether every request succeeded
+        int sock = -1;
+        for (int r = 0; r < per_client; r++) {
+            if (sock < 0 && (sock = connect_local(port)) < 0) {
+                exit(EXIT_FAILURE);
+            }
+            uint64_t bytes = 0;
+            if (download_once(sock, (uint32_t)r + 1, file_path, &bytes) < 0) {
+                exit(EXIT_FAILURE);
+            }
+            if (reconnect) {
+                close(sock);
+                sock = -1;
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    // Wait for all clients
+    int failed = 0;
+    for (int c = 0; c < clients; c++) {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    double elapsed = now_seconds() - start;
+    if (failed > 0) {
+        printf("%d of %d clients failed\n", failed, clients);
+        return -1;
+    }
+
+    int total = per_client * clients;
+    printf("%d requests from %d clients (%s) in %.3f s: %.1f requests/s, %.1f us/request\n",
+           total, clients, reconnect ? "connection per request" : "persistent connections",
+           elapsed, total / elapsed, elapsed * 1e6 / total);
+    return 0;
+}
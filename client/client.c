@@ -8,28 +8,43 @@
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <dirent.h>
 
+#include "../common/dfs_proto.h"
+#include "../common/dfs_codec.h"
+#include "../common/name_page.h"
+#include "../common/sha256.h"
+#include "../common/dfs_delta.h"
+#include "../common/dfs_range.h"
+#include "download.h"
+
 #define PORT 8080
 #define BUFSIZE 1024
 #define MAX_TOKENS 10
-// Marker to indicate the end of the command
-#define CMD_END_MARKER "END_CMD" 
 
 // Function defination
 int is_valid_extension(const char *filename);
-void send_file(int sock, char *filename, char *destination_path);
+int send_file(int sock, uint32_t request_id, char *filename, char *destination_path);
+int send_delta(int sock, uint32_t request_id, int file_fd, uint64_t size, uint64_t signatures_len);
+int send_delta_piece(void *ctx, const void *data, size_t len);
 void process_command(int sock, char *input);
 void handle_ufile(int sock, char *tokens[]);
 void handle_dfile(int sock, char *tokens[]);
 void handle_rmfile(int sock, char *tokens[]);
 void handle_dtar(int sock, char *tokens[]);
 void handle_display(int sock, char *tokens[]);
+int receive_reply(int sock, uint32_t request_id);
+int receive_stream_to_file(int sock, uint32_t request_id, char *file_name, size_t name_size, int decompress);
+
+// Request id stamped on every frame we send, replies echo it back
+static uint32_t next_request_id = 1;
+// Address of smain, large downloads open more connections to it
+static struct sockaddr_in server_addr;
 
 int main() {
     int client_sock;
-    struct sockaddr_in server_addr;
     char buffer[BUFSIZE];
 
     // Create a socket for the client
@@ -61,8 +76,11 @@ int main() {
     // Infinite loop to keep the client running
     while (1) {
         printf("client$ ");
-        // Read the user's input
-        fgets(buffer, sizeof(buffer), stdin);
+        fflush(stdout);
+        // Read the user's input, stop on end of input
+        if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
+            break;
+        }
         // Process the user's input
         process_command(client_sock, buffer);
     }
@@ -71,16 +89,12 @@ int main() {
     return 0;
 }
 
-// Function to check if the file has a valid extension
+// Function to check if the file has an extension, which ones are stored is up to the routing table of Smain
 int is_valid_extension(const char *filename) {
     // Find the last occurrence of '.' in the filename
     const char *ext = strrchr(filename, '.');
-    // If there's no '.' in the filename, it's invalid
-    if (ext == NULL) {
-        return 0;
-    }
-    // Check if the file extension is one of the valid types: .c, .pdf, or .txt
-    return strcmp(ext, ".c") == 0 || strcmp(ext, ".pdf") == 0 || strcmp(ext, ".txt") == 0;
+    // If there's no '.' in the filename, or nothing after it, it's invalid
+    return ext != NULL && ext[1] != '\0' && strchr(ext, '/') == NULL;
 }
 
 // Function to process the user's input and determine the appropriate action
@@ -125,11 +139,12 @@ void process_command(int sock, char *input) {
         }
         handle_rmfile(sock, tokens);
     } else if (strcmp(tokens[0], "dtar") == 0) {
-        // check token count for dtar
-        if(token_count != 2){
+        // check token count for dtar, the compression codec is optional
+        if(token_count != 2 && token_count != 3){
             printf("ERROR: Invalid Synopsis for %s.\n",tokens[0]);
             return;
         }
+        tokens[token_count] = NULL;
         handle_dtar(sock, tokens);
     } else if (strcmp(tokens[0], "display") == 0) {
         // check token count for display
@@ -146,9 +161,6 @@ void process_command(int sock, char *input) {
 
 // Handle ufile command (upload file to server
 void handle_ufile(int sock, char *tokens[]) { 
-    // Buffer for receiving server responses
-    char buffer[BUFSIZE];
-
     // Check if the filename and destination path are provided
     if (!tokens[1] || !tokens[2]) {
         printf("Error: Missing filename or destination path.\n");
@@ -175,114 +187,41 @@ void handle_ufile(int sock, char *tokens[]) {
         printf("Error: Destination path must start with '~/smain'\n");
         return;
     }else{
-        // send the file to the server
-        send_file(sock, filename, destination_path);
+        // send the file to the server, a server that has its content already answers at once
+        uint32_t request_id = next_request_id++;
+        if (send_file(sock, request_id, filename, destination_path) != 0) {
+            return;
+        }
 
         // Receive and display the confirmation message
-        ssize_t bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received > 0) {
-            buffer[bytes_received] = '\0';
-            printf("Server: %s\n", buffer);
-        } else if (bytes_received == 0) {
-            printf("Connection closed by server.\n");
-            exit(EXIT_SUCCESS);
-        } else {
-            perror("Error receiving data");
-        }
+        receive_reply(sock, request_id);
     }
 }
 
 // Handle dfile command (download file from server)
+// The file is received into "<name>.<version>.part" and renamed once complete. A part left by an
+// interrupted download is resumed from where it stopped, unless the file changed on the server since.
+// Large files are fetched in stripes over several connections (download.c)
 void handle_dfile(int sock, char *tokens[]) {
     // Check if the filename is provided
     if (!tokens[1]) {
         printf("Error: Missing filename for dfile.\n");
         return;
     }
-    // Extract file name
-    char *file_path = tokens[1];
-    // create a command to send to server
-    char command[BUFSIZE];
-    snprintf(command, sizeof(command), "dfile %s", file_path);
-
-    // Send the command to the server
-    if (send(sock, command, strlen(command), 0) < 0) {
-        perror("Send failed");
-        return;
-    }
-
-    // Receive the file name
-    char buff_name[BUFSIZE];
-    ssize_t bytes_received = recv(sock, buff_name, sizeof(buff_name) - 1, 0);
-    if (bytes_received < 0) {
-        // if file name is empty.
-        perror("Error receiving file name");
-        return;
-    }
-    buff_name[bytes_received] = '\0';
-
-    // Check if the first response is an error message and print appropriate message
-    const char *error_prefix = "ERROR:";
-    if (strncmp(buff_name, error_prefix, strlen(error_prefix)) == 0) {
-        printf("Server: %s\n", buff_name);
-        return;
-    }
-
-    // Create a file to save the received content
-    FILE *fp = fopen(buff_name, "wb");
-    if (!fp) {
-        perror("Error opening file for writing");
-        return;
-    }
-
-    // Receive the file content
-    char buffer_content[BUFSIZE];
-    // take value of end marker to terminate
-    size_t marker_len = strlen(CMD_END_MARKER);
-    // flage to indicate the download status
-    int download_successful = 0;
-
-    while ((bytes_received = recv(sock, buffer_content, sizeof(buffer_content), 0)) > 0) {
-        // Check for end marker
-        if (bytes_received >= marker_len && 
-            memcmp(buffer_content + bytes_received - marker_len, CMD_END_MARKER, marker_len) == 0) {
-            // Write up to the end marker and break the loop
-            fwrite(buffer_content, 1, bytes_received - marker_len, fp);
-            // set flag
-            download_successful = 1;
-            break;
-        }
-        
-        // write all the byte received from server
-        size_t written = fwrite(buffer_content, 1, bytes_received, fp);
-        if (written < (size_t)bytes_received) {
-            perror("Error writing to file");
-            break;
-        }
-    }
-
-    // if received byte is 0 then print Error
-    if (bytes_received < 0) {
-        perror("Error receiving file");
-    }
 
-    // close file descripter
-    fclose(fp);
+    // Receive the file name and content and store it in the current directory
+    int result = download_file(sock, &next_request_id, &server_addr, tokens[1]);
 
     // print msg to client based on download status
-    if (download_successful) {
+    if (result == 0) {
         printf("  Your file has been downloaded.\n");
-    } else {
-        printf("  Failed: Download interupted.!\n");
+    } else if (result == -2) {
+        printf("  Failed: Download interupted.! Run dfile again to resume it.\n");
     }
-
 }
 
 // Handle rmfile command
 void handle_rmfile(int sock, char *tokens[]) {
-    char recv_buffer[BUFSIZE];
-    char buffer[BUFSIZE];
-
     // Check if the filepath is provided
     if (!tokens[1]) {
         printf("Error: Missing filepath for rmfile.\n");
@@ -317,28 +256,19 @@ void handle_rmfile(int sock, char *tokens[]) {
         return;
     }
 
-    // construct command and Send the rmfile command to the server
-    snprintf(buffer, sizeof(buffer), "rmfile %s", file_path);
-    send(sock, buffer, strlen(buffer) + 1, 0);
+    // Send the rmfile command to the server
+    uint32_t request_id = next_request_id++;
+    if (dfs_send_text(sock, DFS_OP_RMFILE, request_id, file_path) < 0) {
+        perror("Send failed");
+        return;
+    }
 
     // Receive and display the confirmation message based on received message
-    ssize_t bytes_received = recv(sock, recv_buffer, sizeof(recv_buffer) - 1, 0);
-    if (bytes_received > 0) {
-        recv_buffer[bytes_received] = '\0';
-        printf("Server: %s\n", recv_buffer);
-    } else if (bytes_received == 0) {
-        printf("Connection closed by server.\n");
-        exit(EXIT_SUCCESS);
-    } else {
-        perror("Error receiving response from server\n");
-    }
+    receive_reply(sock, request_id);
 }
 
 // Handle dtar command
 void handle_dtar(int sock, char *tokens[]) {
-    // buffer to send to Smain
-    char command[BUFSIZE];
-
     // Check if the file extension is provided
     if (!tokens[1]) {
         printf("Error: Missing extenion for dtar.\n");
@@ -348,78 +278,45 @@ void handle_dtar(int sock, char *tokens[]) {
     // Store the extension provided by the user in a pointer variable
     char *ext = tokens[1];
 
-    // Check if the provided extension is valid
-    if(!is_valid_extension(ext)){
+    // Check if the provided extension is valid, 'all' asks for the files of every type in one archive
+    if(strcmp(ext, "all") != 0 && !is_valid_extension(ext)){
         printf("Error: Invalid file extension.\n");
         return;
     }
 
-    // Form the dtar command using the provided file extension
-    snprintf(command, sizeof(command), "dtar %s", tokens[1]);
+    // An optional codec asks for a compressed archive, e.g. "dtar .txt zstd:3". A codec this build lacks
+    // is asked for all the same, the archive is then stored compressed (and the server falls back to
+    // an uncompressed one if it lacks the codec too)
+    char command[64];
+    snprintf(command, sizeof(command), "%s", ext);
+    if (tokens[2] != NULL) {
+        struct dfs_codec_spec spec;
+        if (dfs_codec_parse(tokens[2], &spec) < 0) {
+            printf("Error: Unsupported compression codec.\n");
+            return;
+        }
+        snprintf(command, sizeof(command), "%s %s", ext, tokens[2]);
+    }
 
     // Send the command to the server
-    if (send(sock, command, strlen(command), 0) < 0) {
+    uint32_t request_id = next_request_id++;
+    if (dfs_send_text(sock, DFS_OP_DTAR, request_id, command) < 0) {
         perror("Failed to send command to server");
         return;
     }
-    
-    // Buffer to receive the tar file name from the server
-    char buff_name[BUFSIZE];
-    ssize_t bytes_received = recv(sock, buff_name, sizeof(buff_name) - 1, 0);
-    if (bytes_received < 0) {
-        // Check if the tar file name was received successfully
-        perror("Error receiving file name");
-        return;
-    }
-    buff_name[bytes_received] = '\0';
- 
-    // Check if the first response is an error message and print appropriate message
-    const char *error_prefix = "ERROR:";
-    if (strncmp(buff_name, error_prefix, strlen(error_prefix)) == 0) {
-        printf("Server: %s\n", buff_name);
-        return;
-    }
-
-    // Create a file to save the received content
-    FILE *fp = fopen(buff_name, "wb");
-    if (!fp) {
-        perror("Error opening file for writing");
-        return;
-    }
 
-    // Buffer to receive data
-    char buffer_data[BUFSIZE];
-    
-    // Receive the data and write it to the file
-    while ((bytes_received = recv(sock, buffer_data, sizeof(buffer_data), 0)) > 0) {
-        // Write received data to file
-        fwrite(buffer_data, 1, bytes_received, fp);
-
-        // Check if the received data is the end marker indicating the end of transmission
-        if (bytes_received < BUFSIZE) {
-            // If the received data is less than the buffer size, check for the end marker
-            buffer_data[bytes_received] = '\0'; // Null-terminate the buffer_data
-            if (strstr(buffer_data, "END_CMD")) {
-                break;
-            }
-        }
+    // Receive the tar file name and content and store it in the current directory
+    char file_name[BUFSIZE];
+    int result = receive_stream_to_file(sock, request_id, file_name, sizeof(file_name), 1);
+    if (result == 0) {
+        printf("File received and saved as %s\n", file_name);
+    } else if (result == -2) {
+        printf("Failed to receive data from server\n");
     }
-    // Check if there was an error while receiving data from the server
-    if (bytes_received < 0) {
-        perror("Failed to receive data from server");
-    }else{
-        printf("File received and saved as %s\n", buff_name);
-    }
-
-    // Close the file
-    fclose(fp);
 }
 
 // Handle display command
 void handle_display(int sock, char *tokens[]) {  
-    char command[BUFSIZE];
-    char buffer[BUFSIZE];
-
     // Check if the pathname is provided and is valid or not
     if (tokens[1] == NULL) {
         printf("Invalid command: Pathname not provided.\n");
@@ -429,84 +326,275 @@ void handle_display(int sock, char *tokens[]) {
         return;
     }
 
-    // Form the display command with the given pathname
-    snprintf(command, sizeof(command), "display %s", tokens[1]);
+    // The list comes a page at a time, each request continues after the last name of the previous page
+    char cursor[DFS_CURSOR_MAX + 1] = "";
+    int printed = 0;
+    do {
+        // Send the command to the server
+        char request[DFS_MAX_TEXT + 1];
+        snprintf(request, sizeof(request), "%s\n%d\n%s", tokens[1], DFS_PAGE_DEFAULT, cursor);
+        uint32_t request_id = next_request_id++;
+        if (dfs_send_text(sock, DFS_OP_DISPLAY, request_id, request) < 0) {
+            perror("Failed to send command to server");
+            return;
+        }
+        cursor[0] = '\0';
+
+        // Receive the page: file name records, notes, and the cursor of the next page or an error
+        struct dfs_hdr hdr;
+        do {
+            if (dfs_recv_hdr(sock, &hdr) < 0) {
+                printf("Connection closed by server.\n");
+                exit(EXIT_SUCCESS);
+            }
+            if (hdr.opcode == DFS_OP_DATA) {
+                // Print the file names received from the server as they arrive
+                char chunk[DFS_CHUNK_SIZE];
+                if (hdr.length > sizeof(chunk) || dfs_recv_all(sock, chunk, hdr.length) < 0) {
+                    printf("Connection closed by server.\n");
+                    exit(EXIT_SUCCESS);
+                }
+                if (!printed) {
+                    printf("Server:\n");
+                    printed = 1;
+                }
+                fwrite(chunk, 1, hdr.length, stdout);
+                continue;
+            }
+            char message[DFS_MAX_TEXT + 1];
+            if (dfs_recv_text(sock, &hdr, message, sizeof(message)) < 0) {
+                printf("Connection closed by server.\n");
+                exit(EXIT_SUCCESS);
+            }
+            // Check if the response is an error message or not and print accordingly
+            if (hdr.opcode == DFS_OP_ERROR) {
+                printf("Server: %s\n", message);
+                return;
+            } else if (hdr.opcode == DFS_OP_OK) {
+                // Notes about servers whose files are missing from the list
+                printf("%s", message);
+            } else {
+                snprintf(cursor, sizeof(cursor), "%s", message);
+            }
+        } while (hdr.opcode != DFS_OP_END);
+    } while (cursor[0] != '\0');
+    printf("\n");
+}
 
-    // Send the command to the server
-    if (send(sock, command, strlen(command), 0) < 0) {
-        perror("Failed to send command to server");
-        return;
+// Function to receive an OK/ERROR reply and show its message to the user
+int receive_reply(int sock, uint32_t request_id) {
+    struct dfs_hdr hdr;
+    char message[DFS_MAX_TEXT + 1];
+
+    if (dfs_recv_hdr(sock, &hdr) < 0 || dfs_recv_text(sock, &hdr, message, sizeof(message)) < 0) {
+        printf("Connection closed by server.\n");
+        exit(EXIT_SUCCESS);
     }
+    if (hdr.request_id != request_id) {
+        fprintf(stderr, "Reply for request %u while waiting for %u\n", hdr.request_id, request_id);
+    }
+    printf("Server: %s\n", message);
+    return hdr.opcode == DFS_OP_OK ? 0 : -1;
+}
 
-    // Receive the server's response containing the list of file names
-    ssize_t bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received < 0) {
-        perror("Error receiving data from server");
-        return;
+// Function to receive a NAME frame followed by a DATA stream and store it as a local file.
+// With decompress set a compressed archive (name ending in .gz or .zst) is unpacked while it arrives,
+// if this build has its codec.
+// Returns 0 on success, -1 if the server refused the request and -2 if the transfer broke.
+int receive_stream_to_file(int sock, uint32_t request_id, char *file_name, size_t name_size, int decompress) {
+    struct dfs_hdr hdr;
+
+    // The first frame is either the file name or an error message
+    if (dfs_recv_hdr(sock, &hdr) < 0 || dfs_recv_text(sock, &hdr, file_name, name_size) < 0) {
+        printf("Connection closed by server.\n");
+        exit(EXIT_SUCCESS);
+    }
+    if (hdr.opcode != DFS_OP_NAME) {
+        printf("Server: %s\n", file_name);
+        return -1;
+    }
+    if (hdr.request_id != request_id) {
+        fprintf(stderr, "Reply for request %u while waiting for %u\n", hdr.request_id, request_id);
     }
-    buffer[bytes_received] = '\0';  // Null-terminate the received data
 
+    // Never let the server pick a location outside the current directory
+    char *base = strrchr(file_name, '/');
+    if (base != NULL) {
+        memmove(file_name, base + 1, strlen(base + 1) + 1);
+    }
 
-    // Check if the response is an error message or not and print accordingly
-    const char *error_prefix = "ERROR:";
-    if (strncmp(buffer, error_prefix, strlen(error_prefix)) == 0) {
-        printf("Server: %s\n", buffer);
-        return;
-    }else{
-        // Print the list of file names received from the server
-        printf("Server:\n%s\n", buffer);
+    // The codec suffix is dropped, the file is stored decompressed. Without the codec in this build
+    // it is stored as it arrives
+    enum dfs_codec codec = decompress ? dfs_codec_from_name(file_name) : DFS_CODEC_NONE;
+    if (codec != DFS_CODEC_NONE && !dfs_codec_supported(codec)) {
+        printf("Codec %s is not supported, the archive is stored compressed\n", dfs_codec_name(codec));
+        codec = DFS_CODEC_NONE;
+    }
+    if (codec != DFS_CODEC_NONE) {
+        file_name[strlen(file_name) - strlen(dfs_codec_suffix(codec))] = '\0';
     }
-}
 
+    // Create a file to save the received content
+    int file_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_fd < 0) {
+        perror("Error opening file for writing");
+        // Still consume the stream so the next command starts on a frame boundary
+        if (dfs_recv_stream(sock, -1, NULL, NULL, 0) == -1) {
+            printf("Connection closed by server.\n");
+            exit(EXIT_SUCCESS);
+        }
+        return -2;
+    }
 
-// Function to send a file to the server along with the command
-void send_file(int sock, char *filename, char *destination_path) {
-    // Buffer to hold file content during transmission
-    char buffer[BUFSIZE];
-    int file_fd;
-    // Variable to store the number of bytes read from the file
-    ssize_t bytes_read;
-    // Variable to store the total size of the file
-    size_t total_size;
+    // Receive DATA frames until the END frame, each one carries its exact length
+    char message[DFS_MAX_TEXT + 1];
+    int result;
+    if (codec == DFS_CODEC_NONE) {
+        result = dfs_recv_stream(sock, file_fd, NULL, message, sizeof(message));
+    } else {
+        struct dfs_decoder *decoder = dfs_decoder_create(codec, file_fd);
+        result = dfs_recv_stream_to(sock, decoder ? dfs_decoder_write : NULL, decoder, NULL, message, sizeof(message));
+        if (decoder == NULL || (result == 0 && dfs_decoder_finish(decoder) < 0)) {
+            result = -2;
+        }
+        dfs_decoder_free(decoder);
+    }
+    close(file_fd);
+    if (result == -3) {
+        printf("Server: %s\n", message);
+    } else if (result == -2) {
+        printf("Error writing to file\n");
+    } else if (result == -1) {
+        perror("Error receiving file");
+    }
+    return result == 0 ? 0 : -2;
+}
 
+// Function to send a file to the server along with the command.
+// The command announces the size and SHA-256 of the file and the content only follows when the
+// server answers CONTINUE; a server that stores the content already links it and answers at once.
+// A server that answers DELTA has an older version of the file, only what changed is sent then.
+// Returns 0 when the reply to the upload follows, 1 when it was shown already and -1 on failure.
+int send_file(int sock, uint32_t request_id, char *filename, char *destination_path) {
     // Open the file
-    file_fd = open(filename, O_RDONLY);
+    int file_fd = open(filename, O_RDONLY);
     if (file_fd < 0) {
         // Check if file opening failed
         perror("File open failed");
-        return;
+        return -1;
     }
 
-    // Determine the size of the file by moving the file pointer to the end
-    total_size = lseek(file_fd, 0, SEEK_END);
-    // Reset the file pointer to the beginning
-    lseek(file_fd, 0, SEEK_SET);
+    // Hash the file, reading it from the start does not move its offset
+    unsigned char digest[SHA256_SIZE];
+    char hex[SHA256_HEX_SIZE + 1];
+    uint64_t size;
+    if (sha256_file(file_fd, digest, &size) < 0) {
+        perror("File read failed");
+        close(file_fd);
+        return -1;
+    }
+    sha256_hex(digest, hex);
 
-    // Allocate memory for the entire message
-    char *message = malloc(total_size + BUFSIZE + strlen(CMD_END_MARKER) + 1);
-    if (message == NULL) {
-        // Check if memory allocation failed
-        perror("Memory allocation failed");
+    // Send the command frame and wait for the server to ask for the content
+    char command[BUFSIZE];
+    snprintf(command, sizeof(command), "%s %s %llu %s", filename, destination_path, (unsigned long long)size, hex);
+    if (dfs_send_text(sock, DFS_OP_UFILE, request_id, command) < 0) {
+        perror("Send failed");
         close(file_fd);
-        return;
+        return -1;
+    }
+    struct dfs_hdr hdr;
+    char message[DFS_MAX_TEXT + 1];
+    if (dfs_recv_hdr(sock, &hdr) < 0) {
+        printf("Connection closed by server.\n");
+        exit(EXIT_SUCCESS);
+    }
+    if (hdr.opcode == DFS_OP_DELTA) {
+        // The payload holds the signatures of the server's version, too long for a text frame
+        int result = send_delta(sock, request_id, file_fd, size, hdr.length);
+        close(file_fd);
+        return result;
     }
+    if (dfs_recv_text(sock, &hdr, message, sizeof(message)) < 0) {
+        printf("Connection closed by server.\n");
+        exit(EXIT_SUCCESS);
+    }
+    if (hdr.opcode != DFS_OP_CONTINUE) {
+        // Linked to the stored content, or refused
+        printf("Server: %s\n", message);
+        close(file_fd);
+        return 1;
+    }
+
+    // Stream the content in fixed size DATA frames closed by END,
+    // so memory use does not depend on the size of the file
+    int result = 0;
+    if (dfs_send_stream(sock, request_id, file_fd) == -1) {
+        perror("Send failed");
+        result = -1;
+    }
+
+    // Clean up: close the file
+    close(file_fd);
+    return result;
+}
 
-    // Build the command string
-    snprintf(message, total_size + BUFSIZE + strlen(CMD_END_MARKER) + 1, "ufile %s %s %s", filename, destination_path, CMD_END_MARKER);
+// Where send_delta_piece() sends the pieces of a delta
+struct delta_target {
+    int sock;
+    uint32_t request_id;
+};
 
-    // Append the file content to the command string
-    ssize_t message_len = strlen(message);
-    while ((bytes_read = read(file_fd, buffer, BUFSIZE)) > 0) {
-        // Copy the chunk into the message
-        memcpy(message + message_len, buffer, bytes_read);
-         // Update the total length of the message
-        message_len += bytes_read;
+// helper to send a piece of a delta as one DATA frame
+int send_delta_piece(void *ctx, const void *data, size_t len) {
+    struct delta_target *target = ctx;
+    return dfs_send_frame(target->sock, DFS_OP_DATA, target->request_id, data, len);
+}
+
+// Function to answer a DELTA reply: receive the signatures of the server's version of the file and
+// send a delta of the file against them, closed by END (or ERROR if it could not be computed)
+int send_delta(int sock, uint32_t request_id, int file_fd, uint64_t size, uint64_t signatures_len) {
+    if (signatures_len > DELTA_MAX_SIGNATURES) {
+        printf("Signatures from the server are too large\n");
+        exit(EXIT_SUCCESS);
+    }
+    unsigned char *signatures = malloc(signatures_len > 0 ? (size_t)signatures_len : 1);
+    if (signatures == NULL || dfs_recv_all(sock, signatures, (size_t)signatures_len) < 0) {
+        printf("Connection closed by server.\n");
+        exit(EXIT_SUCCESS);
     }
 
-    // Send the entire message (command + file content) to the server
-    send(sock, message, message_len, 0);
+    // The file is mapped, the sliding window reads it at every offset
+    unsigned char *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        }
+    }
+    struct delta_target target = {sock, request_id};
+    struct dfs_delta_stats stats;
+    int result = -1;
+    if (size == 0 || data != NULL) {
+        result = dfs_delta_encode(signatures, (size_t)signatures_len, data, size, send_delta_piece, &target, &stats);
+    }
+    if (data != NULL) {
+        munmap(data, (size_t)size);
+    }
+    free(signatures);
 
-    // Clean up: free the allocated memory and close the file
-    free(message);
-    close(file_fd);
-}
\ No newline at end of file
+    // The stream is closed either way, so the server can answer
+    if (result == 0) {
+        printf("Sent %llu bytes of changes, %llu bytes were on the server already\n",
+               (unsigned long long)stats.literal, (unsigned long long)stats.copied);
+        result = dfs_send_hdr(sock, DFS_OP_END, request_id, 0);
+    } else {
+        printf("Delta could not be computed\n");
+        result = dfs_send_text(sock, DFS_OP_ERROR, request_id, "Delta could not be computed");
+    }
+    if (result < 0) {
+        perror("Send failed");
+        return -1;
+    }
+    return 0;
+}
@@ -1,22 +1,43 @@
 #!/bin/bash
 
-# Compile client.c in the Client directory
-gcc -o client client.c 
+# Sources shared by the client and all servers (frame protocol, display pages, download ranges)
+COMMON="../common/dfs_proto.c ../common/name_page.c ../common/dfs_range.c"
+# Streaming tar writer used by the servers for dtar
+TAR="../common/tar_stream.c"
+# SHA-256, names the chunks of the chunk store and the content of uploads: with libcrypto when its development files are installed
+HASH="../common/sha256.c"
+if echo '#include <openssl/evp.h>' | gcc -E - >/dev/null 2>&1; then
+    HASH="$HASH -DDFS_HAVE_OPENSSL -lcrypto"
+fi
+# Delta uploads, which replace a stored file by sending what changed (needs HASH)
+DELTA="../common/dfs_delta.c"
+# Compression codecs for dtar: gzip always, zstd when its development files are installed
+CODEC="../common/dfs_codec.c -lz"
+if echo '#include <zstd.h>' | gcc -E - >/dev/null 2>&1; then
+    CODEC="$CODEC -DDFS_HAVE_ZSTD -lzstd"
+fi
+
+# Compile client.c in the Client directory, with its striped downloads
+gcc -o client client.c download.c $COMMON $DELTA $HASH $CODEC -pthread
 echo "Compiled client.c to client"
 
+# Compile the benchmark tool
+gcc -o bench bench.c $COMMON
+echo "Compiled bench.c to bench"
+
 # Navigate to the Server directory
 cd ../server || exit
 
-# Compile smain.c
-gcc -o smain smain.c
+# Compile smain.c with its event loops, backend connection pool, dtar merging, file index, content index, file cache, shared downloads, path filters and routing table
+gcc -o smain smain.c event_loop.c frame_io.c conn_pool.c worker_pool.c tar_compress.c tar_merge.c name_index.c content_index.c file_cache.c flight.c path_filter.c route_table.c rebalance.c ../common/dfs_bloom.c ../common/dfs_dirs.c $COMMON $TAR $DELTA $HASH $CODEC -pthread
 echo "Compiled smain.c to smain"
 
-# Compile spdf.c
-gcc -o spdf spdf.c
+# Compile spdf.c with its worker pool, file index (and the feed of path filters built from it), chunk store and content index
+gcc -o spdf spdf.c worker_pool.c tar_compress.c name_index.c path_feed.c chunk_store.c content_index.c ../common/dfs_bloom.c ../common/dfs_dirs.c $COMMON $TAR $DELTA $HASH $CODEC -pthread
 echo "Compiled spdf.c to spdf"
 
-# Compile stext.c
-gcc -o stext stext.c
+# Compile stext.c with its worker pool, file index (and the feed of path filters built from it), chunk store and content index
+gcc -o stext stext.c worker_pool.c tar_compress.c name_index.c path_feed.c chunk_store.c content_index.c ../common/dfs_bloom.c ../common/dfs_dirs.c $COMMON $TAR $DELTA $HASH $CODEC -pthread
 echo "Compiled stext.c to stext"
 
 # Return to the Client directory
@@ -0,0 +1,548 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "download.h"
+#include "../common/dfs_proto.h"
+#include "../common/dfs_range.h"
+
+#define PATH_SIZE 1024
+// The map starts with the offset of the first stripe and the stripe size
+#define MAP_HEADER_SIZE 16
+
+// What happened to a stripe
+#define STRIPE_TODO 0
+#define STRIPE_TAKEN 1
+#define STRIPE_DONE 2
+
+// One more stream is only kept opening while the last one raised the throughput by this many percent
+#define STREAM_GAIN 10
+// How long the throughput of a number of streams is measured
+#define STREAM_SAMPLE_MS 300
+
+// A download cut into stripes, shared by its streams
+struct stripes {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    const char *path;
+    char version[DFS_VERSION_MAX + 1];
+    uint64_t size;
+    uint64_t first;           // offset of stripe 0
+    uint64_t stripe;          // bytes per stripe, the last one may be shorter
+    uint32_t count;
+    unsigned char *state;     // STRIPE_* of every stripe
+    uint32_t left;            // stripes not done
+    int fd;                   // the part
+    int map_fd;
+    int streams;              // streams still running
+    int limit;                // streams from this one on stop after their stripe
+    int failed;               // a stripe was refused, no more are asked for
+    int sock_lost;            // the client's connection failed
+    uint64_t received;        // bytes so far, for the throughput
+};
+
+// A connection that fetches stripes
+struct stream {
+    struct stripes *stripes;
+    int sock;
+    int index;
+    int own;                  // sock is closed when the stream ends, it is not the client's
+    uint32_t *request_id;
+    uint32_t own_request_id;
+    pthread_t thread;
+};
+
+// Where the next bytes of a stripe go
+struct stripe_sink {
+    struct stripes *stripes;
+    uint64_t offset;
+};
+
+// helper to find the part of a file left by an interrupted download ("<name>.<version>.part").
+// Returns 0 with its path, version and size, or -1 if there is none.
+static int find_partial_download(const char *file_name, char *part_path, size_t part_size, char *version, uint64_t *offset) {
+    DIR *dir = opendir(".");
+    if (dir == NULL) {
+        return -1;
+    }
+    size_t name_len = strlen(file_name);
+    size_t suffix_len = strlen(".part");
+    int found = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        struct stat st;
+        // The version sits between the name and the suffix
+        if (len <= name_len + 1 + suffix_len || len - name_len - 1 - suffix_len > DFS_VERSION_MAX ||
+            strncmp(entry->d_name, file_name, name_len) != 0 || entry->d_name[name_len] != '.' ||
+            strcmp(entry->d_name + len - suffix_len, ".part") != 0 ||
+            stat(entry->d_name, &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        // Of several parts the largest is resumed
+        if (found == 0 && (uint64_t)st.st_size <= *offset) {
+            continue;
+        }
+        snprintf(part_path, part_size, "%s", entry->d_name);
+        snprintf(version, DFS_VERSION_MAX + 1, "%.*s", (int)(len - name_len - 1 - suffix_len), entry->d_name + name_len + 1);
+        *offset = (uint64_t)st.st_size;
+        found = 0;
+    }
+    closedir(dir);
+    return found;
+}
+
+// helper to read the map of a striped part, *state gets one byte per stripe (malloc()ed).
+// Returns -1 if there is none or it is malformed.
+static int load_map(const char *map_path, uint64_t *first, uint64_t *stripe, unsigned char **state, uint32_t *count) {
+    int fd = open(map_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned char header[MAP_HEADER_SIZE];
+    if (fstat(fd, &st) < 0 || st.st_size <= MAP_HEADER_SIZE || st.st_size - MAP_HEADER_SIZE > UINT32_MAX ||
+        pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    memcpy(first, header, 8);
+    memcpy(stripe, header + 8, 8);
+    *count = (uint32_t)(st.st_size - MAP_HEADER_SIZE);
+    *state = malloc(*count);
+    if (*stripe == 0 || *state == NULL || pread(fd, *state, *count, MAP_HEADER_SIZE) != (ssize_t)*count) {
+        free(*state);
+        *state = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// helper to write the map of a download that is striped from now on
+static int create_map(const char *map_path, const struct stripes *s) {
+    int fd = open(map_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned char header[MAP_HEADER_SIZE];
+    memcpy(header, &s->first, 8);
+    memcpy(header + 8, &s->stripe, 8);
+    if (pwrite(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    for (uint32_t i = 0; i < s->count; i++) {
+        unsigned char done = s->state[i] == STRIPE_DONE;
+        if (pwrite(fd, &done, 1, MAP_HEADER_SIZE + (off_t)i) != 1) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// helper to write received bytes of a stripe at their offset of the part
+static int write_stripe(void *ctx, const void *data, size_t len) {
+    struct stripe_sink *sink = ctx;
+    const char *bytes = data;
+    size_t left = len;
+    while (left > 0) {
+        ssize_t written = pwrite(sink->stripes->fd, bytes, left, (off_t)sink->offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        left -= (size_t)written;
+        sink->offset += (uint64_t)written;
+    }
+    pthread_mutex_lock(&sink->stripes->lock);
+    sink->stripes->received += len;
+    pthread_mutex_unlock(&sink->stripes->lock);
+    return 0;
+}
+
+// helper to fetch one stripe on a connection. Returns 0 once it is written, -1 if the server refused
+// it or the file changed since the download started, and -2 if the connection failed.
+static int fetch_stripe(int sock, uint32_t request_id, struct stripes *s, uint32_t index) {
+    uint64_t offset = s->first + (uint64_t)index * s->stripe;
+    uint64_t length = s->size - offset < s->stripe ? s->size - offset : s->stripe;
+    char command[PATH_SIZE + 96];
+    snprintf(command, sizeof(command), "%s %llu %llu %s", s->path, (unsigned long long)offset,
+             (unsigned long long)length, s->version);
+    if (dfs_send_text(sock, DFS_OP_DFILE, request_id, command) < 0) {
+        return -2;
+    }
+
+    struct dfs_hdr hdr;
+    char name[PATH_SIZE];
+    if (dfs_recv_hdr(sock, &hdr) < 0 || dfs_recv_text(sock, &hdr, name, sizeof(name)) < 0) {
+        return -2;
+    }
+    if (hdr.opcode != DFS_OP_NAME) {
+        printf("Server: %s\n", name);
+        return -1;
+    }
+    uint64_t size, start;
+    char version[DFS_VERSION_MAX + 1];
+    if (dfs_range_parse_name(name, &size, version, &start) < 0 || size != s->size || start != offset ||
+        strcmp(version, s->version) != 0) {
+        // Another version is sent from its start, which is of no use to this download
+        printf("The file changed on the server during the download\n");
+        return dfs_recv_stream(sock, -1, NULL, NULL, 0) == -1 ? -2 : -1;
+    }
+
+    struct stripe_sink sink = {s, offset};
+    char message[DFS_MAX_TEXT + 1];
+    uint64_t received = 0;
+    int result = dfs_recv_stream_to(sock, write_stripe, &sink, &received, message, sizeof(message));
+    if (result == -1) {
+        return -2;
+    }
+    if (result == -3) {
+        printf("Server: %s\n", message);
+    } else if (result == -2) {
+        perror("Error writing to file");
+    }
+    return result == 0 && received == length ? 0 : -1;
+}
+
+// helper run by every stream: fetch stripes until none is left
+static void *run_stream(void *arg) {
+    struct stream *stream = arg;
+    struct stripes *s = stream->stripes;
+    pthread_mutex_lock(&s->lock);
+    while (!s->failed && stream->index < s->limit) {
+        uint32_t index = 0;
+        while (index < s->count && s->state[index] != STRIPE_TODO) {
+            index++;
+        }
+        if (index == s->count) {
+            break;
+        }
+        s->state[index] = STRIPE_TAKEN;
+        pthread_mutex_unlock(&s->lock);
+
+        int result = fetch_stripe(stream->sock, (*stream->request_id)++, s, index);
+
+        pthread_mutex_lock(&s->lock);
+        if (result == 0) {
+            // Recorded once its bytes are written, so the map never claims what the part lacks
+            unsigned char done = 1;
+            s->state[index] = STRIPE_DONE;
+            s->left--;
+            if (pwrite(s->map_fd, &done, 1, MAP_HEADER_SIZE + (off_t)index) != 1) {
+                perror("Error writing the download map");
+                s->failed = 1;
+            }
+            continue;
+        }
+        // Another stream takes over the stripe of a lost connection
+        s->state[index] = STRIPE_TODO;
+        if (result == -1) {
+            s->failed = 1;
+        } else if (!stream->own) {
+            s->sock_lost = 1;
+        }
+        break;
+    }
+    s->streams--;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    if (stream->own) {
+        close(stream->sock);
+    }
+    return NULL;
+}
+
+// helper to start a stream on sock, the caller holds the lock
+static int start_stream(struct stripes *s, struct stream *stream, int index, int sock, uint32_t *request_id) {
+    int own = index > 0;
+    stream->stripes = s;
+    stream->index = index;
+    stream->sock = sock;
+    stream->own = own;
+    stream->own_request_id = 1;
+    stream->request_id = own ? &stream->own_request_id : request_id;
+    if (pthread_create(&stream->thread, NULL, run_stream, stream) != 0) {
+        return -1;
+    }
+    s->streams++;
+    return 0;
+}
+
+// helper to connect another stream to smain, returns -1 if it could not
+static int connect_stream(const struct sockaddr_in *server) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (const struct sockaddr *)server, sizeof(*server)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// helper returning the milliseconds of the monotonic clock
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// helper to fetch the stripes that are not in yet. It starts with the client's connection and
+// opens one more stream whenever the last one raised the throughput; the first one that did not is
+// stopped again and no more are opened. Returns the number of streams used.
+static int run_streams(struct stripes *s, int sock, uint32_t *request_id, const struct sockaddr_in *server, int max_streams) {
+    struct stream streams[STRIPE_MAX_STREAMS];
+    int started = 0;
+    int growing = 1;
+    uint64_t best = 0;
+
+    pthread_mutex_lock(&s->lock);
+    s->limit = max_streams;
+    if (start_stream(s, &streams[0], 0, sock, request_id) == 0) {
+        started = 1;
+    }
+    uint64_t sample_start = now_ms();
+    uint64_t sample_bytes = s->received;
+    while (s->streams > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += STREAM_SAMPLE_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        if (pthread_cond_timedwait(&s->changed, &s->lock, &deadline) != ETIMEDOUT || !growing) {
+            continue;
+        }
+
+        // Bytes per second of the streams running now
+        uint64_t elapsed = now_ms() - sample_start;
+        uint64_t rate = elapsed > 0 ? (s->received - sample_bytes) * 1000 / elapsed : 0;
+        int todo = 0;
+        for (uint32_t i = 0; i < s->count && !todo; i++) {
+            todo = s->state[i] == STRIPE_TODO;
+        }
+        if (started > 1 && rate * 100 <= best * (100 + STREAM_GAIN)) {
+            // The last stream only shared the bandwidth the others had
+            s->limit = started - 1;
+            growing = 0;
+            continue;
+        }
+        if (started == max_streams || !todo || s->failed) {
+            growing = 0;
+            continue;
+        }
+        if (rate == 0) {
+            continue;
+        }
+        best = rate;
+        pthread_mutex_unlock(&s->lock);
+        int stream_sock = connect_stream(server);
+        pthread_mutex_lock(&s->lock);
+        if (stream_sock < 0 || start_stream(s, &streams[started], started, stream_sock, NULL) < 0) {
+            if (stream_sock >= 0) {
+                close(stream_sock);
+            }
+            growing = 0;
+            continue;
+        }
+        started++;
+        sample_start = now_ms();
+        sample_bytes = s->received;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(streams[i].thread, NULL);
+    }
+    return started;
+}
+
+// Function to download a file, see download.h
+int download_file(int sock, uint32_t *request_id, const struct sockaddr_in *server, const char *path) {
+    const char *file_name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    const char *streams_env = getenv("DFS_STREAMS");
+    int max_streams = streams_env != NULL ? atoi(streams_env) : STRIPE_MAX_STREAMS;
+    if (max_streams < 1 || max_streams > STRIPE_MAX_STREAMS) {
+        max_streams = max_streams < 1 ? 1 : STRIPE_MAX_STREAMS;
+    }
+
+    // A part is continued at its end, a striped one at its first stripe that is missing
+    char part_path[PATH_SIZE] = "";
+    char map_path[PATH_SIZE + 8] = "";
+    char version[DFS_VERSION_MAX + 1] = "";
+    uint64_t offset = 0;
+    uint64_t length = max_streams > 1 ? STRIPE_SIZE : 0;
+    uint64_t map_first = 0, map_stripe = 0;
+    unsigned char *map_state = NULL;
+    uint32_t map_count = 0, map_index = 0;
+    if (find_partial_download(file_name, part_path, sizeof(part_path), version, &offset) == 0) {
+        snprintf(map_path, sizeof(map_path), "%s.map", part_path);
+        if (load_map(map_path, &map_first, &map_stripe, &map_state, &map_count) == 0) {
+            while (map_index < map_count && map_state[map_index]) {
+                map_index++;
+            }
+            offset = map_first + (uint64_t)map_index * map_stripe;
+            length = map_stripe;
+        }
+        printf("  Resuming the download at byte %llu.\n", (unsigned long long)offset);
+    }
+    char command[PATH_SIZE + 96];
+    snprintf(command, sizeof(command), "%s %llu %llu %s", path, (unsigned long long)offset,
+             (unsigned long long)length, version);
+    uint32_t first_request_id = (*request_id)++;
+    if (dfs_send_text(sock, DFS_OP_DFILE, first_request_id, command) < 0) {
+        perror("Send failed");
+        free(map_state);
+        return -1;
+    }
+
+    // The first frame is either the file name or an error message
+    struct dfs_hdr hdr;
+    char name[PATH_SIZE];
+    if (dfs_recv_hdr(sock, &hdr) < 0 || dfs_recv_text(sock, &hdr, name, sizeof(name)) < 0) {
+        printf("Connection closed by server.\n");
+        exit(EXIT_SUCCESS);
+    }
+    if (hdr.opcode != DFS_OP_NAME) {
+        printf("Server: %s\n", name);
+        free(map_state);
+        return -1;
+    }
+    if (hdr.request_id != first_request_id) {
+        fprintf(stderr, "Reply for request %u while waiting for %u\n", hdr.request_id, first_request_id);
+    }
+    struct stripes s;
+    memset(&s, 0, sizeof(s));
+    uint64_t start;
+    if (dfs_range_parse_name(name, &s.size, s.version, &start) < 0 || (start != 0 && start != offset)) {
+        printf("Unexpected reply from the server\n");
+        dfs_recv_stream(sock, -1, NULL, NULL, 0);
+        free(map_state);
+        return -2;
+    }
+
+    // Never let the server pick a location outside the current directory
+    char *base = strrchr(name, '/');
+    if (base != NULL) {
+        memmove(name, base + 1, strlen(base + 1) + 1);
+    }
+
+    // Continue the part if the server continues it, otherwise the part is stale and starts over
+    char new_part[PATH_SIZE + DFS_VERSION_MAX + 8];
+    snprintf(new_part, sizeof(new_part), "%s.%s.part", name, s.version);
+    int resumed = part_path[0] != '\0' && start == offset && strcmp(part_path, new_part) == 0;
+    if (map_state != NULL && (!resumed || map_count != (s.size - map_first + map_stripe - 1) / map_stripe)) {
+        unlink(map_path);
+        free(map_state);
+        map_state = NULL;
+        resumed = 0;
+    }
+    if (part_path[0] != '\0' && !resumed) {
+        unlink(part_path);
+    }
+    s.fd = open(new_part, O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+    if (s.fd < 0 || (resumed && map_state == NULL && ftruncate(s.fd, (off_t)start) < 0)) {
+        perror("Error opening file for writing");
+        if (s.fd >= 0) {
+            close(s.fd);
+        }
+        free(map_state);
+        // Still consume the stream so the next command starts on a frame boundary
+        if (dfs_recv_stream(sock, -1, NULL, NULL, 0) == -1) {
+            printf("Connection closed by server.\n");
+            exit(EXIT_SUCCESS);
+        }
+        return -2;
+    }
+
+    // Receive DATA frames until the END frame, what arrived stays in the part for the next attempt
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.changed, NULL);
+    s.path = path;
+    s.map_fd = -1;
+    struct stripe_sink sink = {&s, start};
+    char message[DFS_MAX_TEXT + 1];
+    uint64_t received = 0;
+    int result = dfs_recv_stream_to(sock, write_stripe, &sink, &received, message, sizeof(message));
+    if (result == -1) {
+        printf("Connection closed by server.\n");
+        exit(EXIT_SUCCESS);
+    }
+    uint64_t expected = s.size - start;
+    if (length > 0 && length < expected) {
+        expected = length;
+    }
+    int got_all = result == 0 && received == expected;
+    int complete = got_all && map_state == NULL && start + received == s.size;
+    if (got_all && !complete) {
+        // The file is larger than a stripe: the rest is fetched in stripes of that size
+        if (map_state != NULL) {
+            s.first = map_first;
+            s.stripe = map_stripe;
+            s.count = map_count;
+        } else {
+            s.first = start;
+            s.stripe = length;
+            s.count = (uint32_t)((s.size - start + length - 1) / length);
+            map_state = calloc(s.count, 1);
+        }
+        s.state = map_state;
+        if (s.state != NULL) {
+            if ((start - s.first) / s.stripe < s.count) {
+                s.state[(start - s.first) / s.stripe] = 1;
+            }
+            for (uint32_t i = 0; i < s.count; i++) {
+                s.state[i] = s.state[i] ? STRIPE_DONE : STRIPE_TODO;
+                s.left += s.state[i] == STRIPE_TODO;
+            }
+            snprintf(map_path, sizeof(map_path), "%s.map", new_part);
+            s.map_fd = create_map(map_path, &s);
+        }
+        if (s.map_fd < 0) {
+            perror("Error writing the download map");
+        } else {
+            int streams = s.left > 0 ? run_streams(&s, sock, request_id, server, max_streams) : 0;
+            complete = s.left == 0;
+            if (streams > 1) {
+                printf("  Fetched %u stripes over %d connections.\n", s.count, streams);
+            }
+            close(s.map_fd);
+            if (complete) {
+                unlink(map_path);
+            }
+        }
+    } else if (result == -3) {
+        printf("Server: %s\n", message);
+    } else if (result == -2) {
+        printf("Error writing to file\n");
+    } else if (!complete) {
+        printf("Received %llu of %llu bytes\n", (unsigned long long)(start + received), (unsigned long long)s.size);
+    }
+    close(s.fd);
+    free(map_state);
+    pthread_cond_destroy(&s.changed);
+    pthread_mutex_destroy(&s.lock);
+    if (s.sock_lost) {
+        printf("Connection closed by server.\n");
+        exit(EXIT_SUCCESS);
+    }
+    if (complete && rename(new_part, name) == 0) {
+        return 0;
+    }
+    return -2;
+}
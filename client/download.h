@@ -0,0 +1,29 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Downloads for 'dfile': resumable, and striped over several connections when the file is large.
+//
+// A download goes into "<name>.<version>.part", renamed once complete. The first request asks for one
+// stripe (STRIPE_SIZE bytes) on the client's connection, and its reply tells the size and version of
+// the file. When the file does not fit, the rest is cut into stripes fetched by streams, each with its
+// own connection to smain, asking for one stripe at a time of that version and writing it at its
+// offset. The client's connection is the first stream; another one is opened while the last one
+// raised the throughput, up to DFS_STREAMS (default STRIPE_MAX_STREAMS, 1 asks for the whole file on
+// the client's connection).
+//
+// Stripes arrive out of order, so a striped part has holes: "<part>.map" records which stripes are in,
+// the offset of the first stripe and the stripe size (uint64 each, in host order) then one byte per
+// stripe. A part without a map holds the file up to its size.
+
+#define STRIPE_SIZE (8 * 1024 * 1024)
+#define STRIPE_MAX_STREAMS 8
+
+// Download path from smain at server into the current directory, over sock and more connections.
+// request_id is the counter of the ids used on sock. Returns 0 once the file is complete, -1 if the
+// server refused it and -2 if the download stopped early (running it again resumes it).
+int download_file(int sock, uint32_t *request_id, const struct sockaddr_in *server, const char *path);
+
+#endif
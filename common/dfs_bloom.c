@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfs_bloom.h"
+
+// helper for the 64-bit FNV-1a hash of a key, its bits mixed so paths that differ in one character spread
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Function to allocate a filter for a number of keys
+int dfs_bloom_init(struct dfs_bloom *bloom, uint64_t keys) {
+    uint64_t room = keys * 2 > DFS_BLOOM_MIN_KEYS ? keys * 2 : DFS_BLOOM_MIN_KEYS;
+    uint64_t bit_count = 64;
+    while (bit_count < room * DFS_BLOOM_BITS_PER_KEY && bit_count < DFS_BLOOM_MAX_BITS) {
+        bit_count *= 2;
+    }
+    return dfs_bloom_init_bits(bloom, bit_count, DFS_BLOOM_HASHES);
+}
+
+// Function to allocate a filter of a given shape
+int dfs_bloom_init_bits(struct dfs_bloom *bloom, uint64_t bit_count, int hashes) {
+    memset(bloom, 0, sizeof(*bloom));
+    if (bit_count < 64 || bit_count > DFS_BLOOM_MAX_BITS || (bit_count & (bit_count - 1)) != 0 || hashes < 1 || hashes > 32) {
+        return -1;
+    }
+    bloom->bits = calloc(1, (size_t)(bit_count / 8));
+    if (bloom->bits == NULL) {
+        return -1;
+    }
+    bloom->bit_count = bit_count;
+    bloom->hashes = hashes;
+    return 0;
+}
+
+// Function to free the bit array of a filter
+void dfs_bloom_free(struct dfs_bloom *bloom) {
+    free(bloom->bits);
+    memset(bloom, 0, sizeof(*bloom));
+}
+
+// Function to add a key to a filter
+void dfs_bloom_add(struct dfs_bloom *bloom, const char *key, size_t len) {
+    uint64_t hash = hash_key(key, len);
+    // The second hash must be odd to reach every bit of a power of two array
+    uint64_t step = (hash >> 32 | hash << 32) | 1;
+    for (int i = 0; i < bloom->hashes; i++) {
+        uint64_t bit = (hash + (uint64_t)i * step) & (bloom->bit_count - 1);
+        bloom->bits[bit / 8] |= (unsigned char)(1u << (bit % 8));
+    }
+    bloom->keys++;
+}
+
+// Function to test whether a key may have been added to a filter
+int dfs_bloom_test(const struct dfs_bloom *bloom, const char *key, size_t len) {
+    uint64_t hash = hash_key(key, len);
+    uint64_t step = (hash >> 32 | hash << 32) | 1;
+    for (int i = 0; i < bloom->hashes; i++) {
+        uint64_t bit = (hash + (uint64_t)i * step) & (bloom->bit_count - 1);
+        if ((bloom->bits[bit / 8] & (1u << (bit % 8))) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to estimate the false positive rate of a filter
+double dfs_bloom_false_positive_rate(const struct dfs_bloom *bloom) {
+    if (bloom->bits == NULL) {
+        return 0.0;
+    }
+    uint64_t set = 0;
+    for (uint64_t i = 0; i < bloom->bit_count / 8; i++) {
+        set += (uint64_t)__builtin_popcount(bloom->bits[i]);
+    }
+    // Every one of the bits of a key must be set
+    double share = (double)set / (double)bloom->bit_count, rate = 1.0;
+    for (int i = 0; i < bloom->hashes; i++) {
+        rate *= share;
+    }
+    return rate;
+}
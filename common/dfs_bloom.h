@@ -0,0 +1,53 @@
+#ifndef DFS_BLOOM_H
+#define DFS_BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bloom filters of the paths a server stores, so Smain answers "File not found" for a path its
+// server does not have without asking it.
+//
+// A filter is a bit array of a power of two size and a number of hash functions; a key sets (and
+// is tested against) that many bits, derived from one 64-bit hash (FNV-1a, mixed) by double
+// hashing. A key that was added always tests positive, one that was not tests positive with a
+// probability that grows with the share of bits set (about 1% at DFS_BLOOM_BITS_PER_KEY bits per key).
+//
+// The keys are paths relative to the root of the tree (~/spdf/a/b.pdf is "a/b.pdf"), of files and
+// directories. A server sends its filter in reply to a DFS_OP_FILTER request: a NAME frame
+// "<bits> <hashes> <keys>" followed by the bit array as a DATA stream. The connection then stays
+// open and the server pushes the paths it gains later on it, as DATA frames of '\0'-ended keys.
+
+#define DFS_BLOOM_BITS_PER_KEY 10
+#define DFS_BLOOM_HASHES 7
+// Filters are sized for at least this many keys, and twice the keys they start with
+#define DFS_BLOOM_MIN_KEYS 4096
+// Largest filter accepted from a server (bits)
+#define DFS_BLOOM_MAX_BITS (1ULL << 33)
+// Largest DATA frame of keys pushed after the filter
+#define DFS_BLOOM_PUSH_MAX (64 * 1024)
+
+struct dfs_bloom {
+    unsigned char *bits;
+    uint64_t bit_count;   // a power of two
+    int hashes;
+    uint64_t keys;        // keys added
+};
+
+// Allocate an empty filter with room for keys keys at the usual rate. Returns -1 if out of memory.
+int dfs_bloom_init(struct dfs_bloom *bloom, uint64_t keys);
+
+// Allocate an empty filter of bit_count bits, as described by a server. Returns -1 if the
+// description is not a valid one or out of memory.
+int dfs_bloom_init_bits(struct dfs_bloom *bloom, uint64_t bit_count, int hashes);
+
+void dfs_bloom_free(struct dfs_bloom *bloom);
+
+void dfs_bloom_add(struct dfs_bloom *bloom, const char *key, size_t len);
+
+// 0 if the key was certainly not added, 1 if it may have been
+int dfs_bloom_test(const struct dfs_bloom *bloom, const char *key, size_t len);
+
+// Chance that a key which was not added tests positive, from the share of bits set
+double dfs_bloom_false_positive_rate(const struct dfs_bloom *bloom);
+
+#endif
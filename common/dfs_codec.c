@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef DFS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "dfs_proto.h"
+#include "dfs_codec.h"
+
+// Levels used when a command names a codec without one
+#define GZIP_DEFAULT_LEVEL 6
+#define ZSTD_DEFAULT_LEVEL 3
+
+struct dfs_decoder {
+    enum dfs_codec codec;
+    int fd;
+    int in_block;  // part of a gzip member or zstd frame was seen but not its end
+    z_stream zs;
+#ifdef DFS_HAVE_ZSTD
+    ZSTD_DCtx *dctx;
+#endif
+    unsigned char out[DFS_CHUNK_SIZE];
+};
+
+// Function to parse a codec argument such as "zstd:3"
+int dfs_codec_parse(const char *text, struct dfs_codec_spec *spec) {
+    const char *colon = strchr(text, ':');
+    size_t name_len = colon ? (size_t)(colon - text) : strlen(text);
+    int max_level;
+
+    if (name_len == 4 && strncmp(text, "none", 4) == 0 && colon == NULL) {
+        spec->codec = DFS_CODEC_NONE;
+        spec->level = 0;
+        return 0;
+    } else if (name_len == 4 && strncmp(text, "gzip", 4) == 0) {
+        spec->codec = DFS_CODEC_GZIP;
+        spec->level = GZIP_DEFAULT_LEVEL;
+        max_level = 9;
+    } else if (name_len == 4 && strncmp(text, "zstd", 4) == 0) {
+        spec->codec = DFS_CODEC_ZSTD;
+        spec->level = ZSTD_DEFAULT_LEVEL;
+        max_level = 22;
+    } else {
+        return -1;
+    }
+
+    if (colon != NULL) {
+        char *end;
+        long level = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || level < 1 || level > max_level) {
+            return -1;
+        }
+        spec->level = (int)level;
+    }
+    return 0;
+}
+
+// Function to check whether this build includes a codec
+int dfs_codec_supported(enum dfs_codec codec) {
+#ifdef DFS_HAVE_ZSTD
+    (void)codec;
+    return 1;
+#else
+    return codec != DFS_CODEC_ZSTD;
+#endif
+}
+
+// Function to get the command name of a codec
+const char *dfs_codec_name(enum dfs_codec codec) {
+    switch (codec) {
+        case DFS_CODEC_GZIP:
+            return "gzip";
+        case DFS_CODEC_ZSTD:
+            return "zstd";
+        default:
+            return "none";
+    }
+}
+
+// Function to get the file name suffix of a codec's output
+const char *dfs_codec_suffix(enum dfs_codec codec) {
+    switch (codec) {
+        case DFS_CODEC_GZIP:
+            return ".gz";
+        case DFS_CODEC_ZSTD:
+            return ".zst";
+        default:
+            return "";
+    }
+}
+
+// Function to tell the codec of a received file from its name
+enum dfs_codec dfs_codec_from_name(const char *file_name) {
+    size_t len = strlen(file_name);
+    if (len > 3 && strcmp(file_name + len - 3, ".gz") == 0) {
+        return DFS_CODEC_GZIP;
+    }
+    if (len > 4 && strcmp(file_name + len - 4, ".zst") == 0) {
+        return DFS_CODEC_ZSTD;
+    }
+    return DFS_CODEC_NONE;
+}
+
+// helper to compress a block into one gzip member
+static int gzip_block(int level, const void *in, size_t len, void **out, size_t *out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 added to the window bits asks zlib for a gzip header and trailer
+    if (len > UINT_MAX || deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    uLong bound = deflateBound(&zs, (uLong)len);
+    unsigned char *buffer = malloc(bound);
+    if (buffer == NULL) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = (uInt)len;
+    zs.next_out = buffer;
+    zs.avail_out = (uInt)bound;
+    int rc = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        free(buffer);
+        return -1;
+    }
+    *out = buffer;
+    return 0;
+}
+
+#ifdef DFS_HAVE_ZSTD
+// helper to compress a block into one zstd frame, every thread keeps its compression context
+static int zstd_block(int level, const void *in, size_t len, void **out, size_t *out_len) {
+    static __thread ZSTD_CCtx *cctx;
+    if (cctx == NULL && (cctx = ZSTD_createCCtx()) == NULL) {
+        return -1;
+    }
+    size_t bound = ZSTD_compressBound(len);
+    void *buffer = malloc(bound);
+    if (buffer == NULL) {
+        return -1;
+    }
+    size_t size = ZSTD_compressCCtx(cctx, buffer, bound, in, len, level);
+    if (ZSTD_isError(size)) {
+        fprintf(stderr, "zstd compression failed: %s\n", ZSTD_getErrorName(size));
+        free(buffer);
+        return -1;
+    }
+    *out = buffer;
+    *out_len = size;
+    return 0;
+}
+#endif
+
+// Function to compress a block into a standalone gzip member or zstd frame
+int dfs_compress_block(const struct dfs_codec_spec *spec, const void *in, size_t len, void **out, size_t *out_len) {
+    switch (spec->codec) {
+        case DFS_CODEC_GZIP:
+            return gzip_block(spec->level, in, len, out, out_len);
+#ifdef DFS_HAVE_ZSTD
+        case DFS_CODEC_ZSTD:
+            return zstd_block(spec->level, in, len, out, out_len);
+#endif
+        case DFS_CODEC_NONE:
+            *out = malloc(len ? len : 1);
+            if (*out == NULL) {
+                return -1;
+            }
+            memcpy(*out, in, len);
+            *out_len = len;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Function to start decoding a compressed stream into fd
+struct dfs_decoder *dfs_decoder_create(enum dfs_codec codec, int fd) {
+    if (!dfs_codec_supported(codec)) {
+        return NULL;
+    }
+    struct dfs_decoder *decoder = calloc(1, sizeof(*decoder));
+    if (decoder == NULL) {
+        return NULL;
+    }
+    decoder->codec = codec;
+    decoder->fd = fd;
+    // 16 added to the window bits only accepts gzip members
+    if (codec == DFS_CODEC_GZIP && inflateInit2(&decoder->zs, 15 + 16) != Z_OK) {
+        free(decoder);
+        return NULL;
+    }
+#ifdef DFS_HAVE_ZSTD
+    if (codec == DFS_CODEC_ZSTD && (decoder->dctx = ZSTD_createDCtx()) == NULL) {
+        free(decoder);
+        return NULL;
+    }
+#endif
+    return decoder;
+}
+
+// helper to write decoded bytes to the output file
+static int decoder_output(struct dfs_decoder *decoder, const void *data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(decoder->fd, (const char *)data + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("File write failed");
+            return -2;
+        }
+        written += (size_t)n;
+    }
+    return 0;
+}
+
+// helper to inflate gzip input, starting over after every member
+static int gzip_write(struct dfs_decoder *decoder, const void *data, size_t len) {
+    z_stream *zs = &decoder->zs;
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = (uInt)len;
+    do {
+        uInt avail_in = zs->avail_in;
+        zs->next_out = decoder->out;
+        zs->avail_out = sizeof(decoder->out);
+        int rc = inflate(zs, Z_NO_FLUSH);
+        size_t produced = sizeof(decoder->out) - zs->avail_out;
+        // Z_BUF_ERROR only means there was nothing left to do
+        if (rc != Z_OK && rc != Z_STREAM_END && !(rc == Z_BUF_ERROR && (produced > 0 || zs->avail_in == 0))) {
+            fprintf(stderr, "gzip data is corrupt\n");
+            return -1;
+        }
+        if (rc == Z_STREAM_END) {
+            decoder->in_block = 0;
+        } else if (zs->avail_in != avail_in) {
+            decoder->in_block = 1;
+        }
+        if (decoder_output(decoder, decoder->out, produced) < 0) {
+            return -2;
+        }
+        if (rc == Z_STREAM_END) {
+            // The next block is another gzip member
+            inflateReset(zs);
+        }
+    } while (zs->avail_in > 0 || zs->avail_out == 0);
+    return 0;
+}
+
+#ifdef DFS_HAVE_ZSTD
+// helper to decompress zstd input, frames follow each other without any separator
+static int zstd_write(struct dfs_decoder *decoder, const void *data, size_t len) {
+    ZSTD_inBuffer in = {data, len, 0};
+    ZSTD_outBuffer out;
+    do {
+        out = (ZSTD_outBuffer){decoder->out, sizeof(decoder->out), 0};
+        size_t consumed = in.pos;
+        size_t rc = ZSTD_decompressStream(decoder->dctx, &out, &in);
+        if (ZSTD_isError(rc)) {
+            fprintf(stderr, "zstd data is corrupt: %s\n", ZSTD_getErrorName(rc));
+            return -1;
+        }
+        // 0 means a frame was completed and fully flushed
+        if (rc == 0) {
+            decoder->in_block = 0;
+        } else if (in.pos != consumed) {
+            decoder->in_block = 1;
+        }
+        if (decoder_output(decoder, decoder->out, out.pos) < 0) {
+            return -2;
+        }
+    } while (in.pos < in.size || out.pos == out.size);
+    return 0;
+}
+#endif
+
+// Function to decode the next piece of compressed input
+int dfs_decoder_write(void *ctx, const void *data, size_t len) {
+    struct dfs_decoder *decoder = ctx;
+    if (len == 0) {
+        return 0;
+    }
+    switch (decoder->codec) {
+        case DFS_CODEC_GZIP:
+            return gzip_write(decoder, data, len);
+#ifdef DFS_HAVE_ZSTD
+        case DFS_CODEC_ZSTD:
+            return zstd_write(decoder, data, len);
+#endif
+        default:
+            return decoder_output(decoder, data, len);
+    }
+}
+
+// Function to check that the compressed input was complete
+int dfs_decoder_finish(struct dfs_decoder *decoder) {
+    if (decoder->in_block) {
+        fprintf(stderr, "Compressed data ended in the middle of a block\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to release a decoder
+void dfs_decoder_free(struct dfs_decoder *decoder) {
+    if (decoder == NULL) {
+        return;
+    }
+    if (decoder->codec == DFS_CODEC_GZIP) {
+        inflateEnd(&decoder->zs);
+    }
+#ifdef DFS_HAVE_ZSTD
+    ZSTD_freeDCtx(decoder->dctx);
+#endif
+    free(decoder);
+}
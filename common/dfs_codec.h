@@ -0,0 +1,57 @@
+#ifndef DFS_CODEC_H
+#define DFS_CODEC_H
+
+#include <stddef.h>
+
+// Compression codecs for dtar archives.
+//
+// An archive is compressed in independent blocks: every block becomes a complete gzip member or
+// zstd frame. Both formats allow such pieces to be concatenated, so the whole stream is an ordinary
+// .tar.gz / .tar.zst file that gzip, zstd or tar can read, while the blocks can be compressed in parallel.
+//
+// zstd is only available when built with DFS_HAVE_ZSTD (compile.sh enables it when zstd.h is found).
+
+enum dfs_codec {
+    DFS_CODEC_NONE,
+    DFS_CODEC_GZIP,
+    DFS_CODEC_ZSTD
+};
+
+struct dfs_codec_spec {
+    enum dfs_codec codec;
+    int level;
+};
+
+// Parse "none", "gzip", "gzip:9", "zstd" or "zstd:3" (a missing level picks the codec's default).
+// Returns -1 if the text names no codec or the level is out of range.
+int dfs_codec_parse(const char *text, struct dfs_codec_spec *spec);
+
+// 1 if this build can compress and decompress the codec
+int dfs_codec_supported(enum dfs_codec codec);
+
+// Name as used in commands ("gzip"), and the file name suffix of its output (".gz", "" for none)
+const char *dfs_codec_name(enum dfs_codec codec);
+const char *dfs_codec_suffix(enum dfs_codec codec);
+
+// Codec whose suffix ends file_name, DFS_CODEC_NONE if there is none
+enum dfs_codec dfs_codec_from_name(const char *file_name);
+
+// Compress len bytes into one gzip member or zstd frame. *out is malloc()ed and owned by the caller.
+// Returns 0 on success, -1 on failure.
+int dfs_compress_block(const struct dfs_codec_spec *spec, const void *in, size_t len, void **out, size_t *out_len);
+
+// Streaming decompression of a sequence of blocks, written to a file as it is decoded
+struct dfs_decoder;
+
+struct dfs_decoder *dfs_decoder_create(enum dfs_codec codec, int fd);
+
+// Decode the next piece of compressed input. Returns 0, -1 if the input is corrupt and -2 if writing failed.
+// Matches dfs_sink_fn, so a decoder can be handed to dfs_recv_stream_to() directly.
+int dfs_decoder_write(void *decoder, const void *data, size_t len);
+
+// Check that the input ended on a block boundary, return -1 if it was cut short
+int dfs_decoder_finish(struct dfs_decoder *decoder);
+
+void dfs_decoder_free(struct dfs_decoder *decoder);
+
+#endif
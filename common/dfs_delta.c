@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfs_delta.h"
+#include "sha256.h"
+
+// Blocks are at least this large, and grow with the copy so it has at most DELTA_MAX_BLOCKS of them
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (1024 * 1024)
+#define DELTA_MAX_BLOCKS (16 * 1024)
+
+// Instruction codes of the delta stream, and the bytes that follow them
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_COPY_SIZE 9
+#define DELTA_LITERAL_SIZE 5
+
+struct dfs_delta_apply {
+    uint64_t copy_size;
+    uint32_t block_size;
+    uint64_t blocks;                 // full blocks of the copy, the ones a delta may refer to
+    dfs_delta_read_fn read;
+    void *read_ctx;
+    dfs_sink_fn sink;
+    void *sink_ctx;
+    unsigned char ins[DELTA_COPY_SIZE]; // instruction being received
+    size_t ins_len;
+    uint32_t literal_left;           // literal bytes of the current instruction still to come
+    unsigned char *block;            // one block of the copy
+    struct dfs_delta_stats stats;
+};
+
+// Encoded stream of a delta being computed
+struct delta_out {
+    unsigned char buf[DFS_CHUNK_SIZE];
+    size_t len;
+    uint32_t copy_first;             // run of copied blocks not written yet
+    uint32_t copy_count;
+    dfs_sink_fn sink;
+    void *ctx;
+    struct dfs_delta_stats *stats;
+};
+
+// helper to pick the block size for a copy of size bytes
+static uint32_t block_size_for(uint64_t size) {
+    uint32_t block = DELTA_MIN_BLOCK;
+    while (size / block > DELTA_MAX_BLOCKS && block < DELTA_MAX_BLOCK) {
+        block *= 2;
+    }
+    return block;
+}
+
+// helpers to write and read big-endian integers
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// helper to compute the weak checksum of a window: the sum of its bytes in the low 16 bits and
+// the sum of those sums in the high ones, both kept in a and b to roll them on
+static uint32_t weak_sum(const unsigned char *data, size_t len, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++) {
+        s1 += data[i];
+        s2 += (uint32_t)(len - i) * data[i];
+    }
+    *a = s1;
+    *b = s2;
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+// helper to compute the strong hash of a block
+static void strong_sum(const unsigned char *data, size_t len, unsigned char *out) {
+    unsigned char digest[SHA256_SIZE];
+    sha256(data, len, digest);
+    memcpy(out, digest, DELTA_STRONG_SIZE);
+}
+
+// Function to build the signatures of the receiver's copy
+int dfs_delta_sign(dfs_delta_read_fn read, void *ctx, uint64_t size, unsigned char **payload, size_t *len) {
+    uint32_t block = block_size_for(size);
+    uint64_t blocks = size / block;
+    size_t total = DELTA_HEADER_SIZE + (size_t)blocks * DELTA_SIG_SIZE;
+    unsigned char *out = malloc(total);
+    unsigned char *buf = malloc(block);
+    if (out == NULL || buf == NULL) {
+        free(out);
+        free(buf);
+        return -1;
+    }
+    put_u32(out, block);
+    put_u32(out + 4, (uint32_t)(size >> 32));
+    put_u32(out + 8, (uint32_t)size);
+
+    unsigned char *sig = out + DELTA_HEADER_SIZE;
+    for (uint64_t i = 0; i < blocks; i++, sig += DELTA_SIG_SIZE) {
+        uint32_t a, b;
+        if (read(ctx, buf, block, i * block) < 0) {
+            free(out);
+            free(buf);
+            return -1;
+        }
+        put_u32(sig, weak_sum(buf, block, &a, &b));
+        strong_sum(buf, block, sig + 4);
+    }
+    free(buf);
+    *payload = out;
+    *len = total;
+    return 0;
+}
+
+// helper to pass the encoded bytes on to the sink
+static int out_flush(struct delta_out *out) {
+    if (out->len == 0) {
+        return 0;
+    }
+    out->stats->encoded += out->len;
+    int result = out->sink(out->ctx, out->buf, out->len);
+    out->len = 0;
+    return result;
+}
+
+// helper to write the pending run of copied blocks as one instruction
+static int out_copy_run(struct delta_out *out) {
+    if (out->copy_count == 0) {
+        return 0;
+    }
+    if (out->len + DELTA_COPY_SIZE > sizeof(out->buf) && out_flush(out) < 0) {
+        return -1;
+    }
+    unsigned char *p = out->buf + out->len;
+    p[0] = DELTA_COPY;
+    put_u32(p + 1, out->copy_first);
+    put_u32(p + 5, out->copy_count);
+    out->len += DELTA_COPY_SIZE;
+    out->copy_count = 0;
+    return 0;
+}
+
+// helper to add a copied block, consecutive blocks become one instruction
+static int out_copy(struct delta_out *out, uint32_t index, uint32_t block) {
+    out->stats->copied += block;
+    if (out->copy_count > 0 && out->copy_first + out->copy_count == index && out->copy_count < UINT32_MAX) {
+        out->copy_count++;
+        return 0;
+    }
+    if (out_copy_run(out) < 0) {
+        return -1;
+    }
+    out->copy_first = index;
+    out->copy_count = 1;
+    return 0;
+}
+
+// helper to add literal bytes, split so each instruction fits in a piece
+static int out_literal(struct delta_out *out, const unsigned char *data, uint64_t len) {
+    if (len > 0 && out_copy_run(out) < 0) {
+        return -1;
+    }
+    out->stats->literal += len;
+    while (len > 0) {
+        if (out->len + DELTA_LITERAL_SIZE + 1 > sizeof(out->buf) && out_flush(out) < 0) {
+            return -1;
+        }
+        size_t room = sizeof(out->buf) - out->len - DELTA_LITERAL_SIZE;
+        size_t take = len < room ? (size_t)len : room;
+        unsigned char *p = out->buf + out->len;
+        p[0] = DELTA_LITERAL;
+        put_u32(p + 1, (uint32_t)take);
+        memcpy(p + DELTA_LITERAL_SIZE, data, take);
+        out->len += DELTA_LITERAL_SIZE + take;
+        data += take;
+        len -= take;
+    }
+    return 0;
+}
+
+// Function to compute a delta against the receiver's signatures
+int dfs_delta_encode(const unsigned char *signatures, size_t signatures_len, const unsigned char *data, uint64_t size,
+                     dfs_sink_fn sink, void *ctx, struct dfs_delta_stats *stats) {
+    struct dfs_delta_stats unused;
+    if (stats == NULL) {
+        stats = &unused;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (signatures_len < DELTA_HEADER_SIZE || (signatures_len - DELTA_HEADER_SIZE) % DELTA_SIG_SIZE != 0) {
+        return -1;
+    }
+    uint32_t block = get_u32(signatures);
+    uint64_t copy_size = (uint64_t)get_u32(signatures + 4) << 32 | get_u32(signatures + 8);
+    size_t blocks = (signatures_len - DELTA_HEADER_SIZE) / DELTA_SIG_SIZE;
+    if (block != block_size_for(copy_size) || blocks != copy_size / block) {
+        return -1;
+    }
+    const unsigned char *sigs = signatures + DELTA_HEADER_SIZE;
+
+    // Blocks by weak checksum: a chained hash table with a power of two of heads
+    size_t heads_count = 1;
+    while (heads_count < 2 * blocks) {
+        heads_count *= 2;
+    }
+    int32_t *heads = malloc(heads_count * sizeof(*heads));
+    int32_t *chain = malloc((blocks ? blocks : 1) * sizeof(*chain));
+    struct delta_out *out = malloc(sizeof(*out));
+    if (heads == NULL || chain == NULL || out == NULL) {
+        free(heads);
+        free(chain);
+        free(out);
+        return -1;
+    }
+    memset(heads, 0xff, heads_count * sizeof(*heads));
+    // Inserted backwards so a chain lists its blocks in order, the first of equal blocks wins
+    for (size_t i = blocks; i-- > 0;) {
+        size_t slot = get_u32(sigs + i * DELTA_SIG_SIZE) & (heads_count - 1);
+        chain[i] = heads[slot];
+        heads[slot] = (int32_t)i;
+    }
+    out->len = 0;
+    out->copy_count = 0;
+    out->sink = sink;
+    out->ctx = ctx;
+    out->stats = stats;
+
+    int result = 0;
+    uint64_t pos = 0;
+    uint64_t literal_start = 0;
+    uint32_t a = 0, b = 0, weak = 0;
+    int have_sum = 0;
+    while (blocks > 0 && pos + block <= size && result == 0) {
+        if (!have_sum) {
+            weak = weak_sum(data + pos, block, &a, &b);
+            have_sum = 1;
+        }
+        // Look for a block with this checksum, the strong hash is computed at most once per offset
+        int32_t match = -1;
+        int strong_done = 0;
+        unsigned char strong[DELTA_STRONG_SIZE];
+        for (int32_t i = heads[weak & (heads_count - 1)]; i >= 0; i = chain[i]) {
+            const unsigned char *sig = sigs + (size_t)i * DELTA_SIG_SIZE;
+            if (get_u32(sig) != weak) {
+                continue;
+            }
+            if (!strong_done) {
+                strong_sum(data + pos, block, strong);
+                strong_done = 1;
+            }
+            if (memcmp(strong, sig + 4, DELTA_STRONG_SIZE) == 0) {
+                match = i;
+                break;
+            }
+        }
+
+        if (match >= 0) {
+            result = out_literal(out, data + literal_start, pos - literal_start);
+            if (result == 0) {
+                result = out_copy(out, (uint32_t)match, block);
+            }
+            pos += block;
+            literal_start = pos;
+            have_sum = 0;
+        } else if (pos + block < size) {
+            // Roll the window one byte on
+            uint32_t leaving = data[pos];
+            uint32_t entering = data[pos + block];
+            a = a - leaving + entering;
+            b = b - block * leaving + a;
+            weak = (a & 0xffff) | (b << 16);
+            pos++;
+        } else {
+            break;
+        }
+    }
+    if (result == 0) {
+        result = out_literal(out, data + literal_start, size - literal_start);
+    }
+    if (result == 0) {
+        result = out_copy_run(out);
+    }
+    if (result == 0) {
+        result = out_flush(out);
+    }
+    free(heads);
+    free(chain);
+    free(out);
+    return result;
+}
+
+// Function to start rebuilding a file from a delta
+struct dfs_delta_apply *dfs_delta_apply_new(uint64_t copy_size, dfs_delta_read_fn read, void *read_ctx) {
+    struct dfs_delta_apply *apply = calloc(1, sizeof(*apply));
+    if (apply == NULL) {
+        return NULL;
+    }
+    apply->copy_size = copy_size;
+    apply->block_size = block_size_for(copy_size);
+    apply->blocks = copy_size / apply->block_size;
+    apply->read = read;
+    apply->read_ctx = read_ctx;
+    apply->block = malloc(apply->block_size);
+    if (apply->block == NULL) {
+        free(apply);
+        return NULL;
+    }
+    return apply;
+}
+
+// Function to set the destination of the rebuilt content
+void dfs_delta_apply_output(struct dfs_delta_apply *apply, dfs_sink_fn sink, void *sink_ctx) {
+    apply->sink = sink;
+    apply->sink_ctx = sink_ctx;
+}
+
+// helper to carry out a complete copy instruction
+static int apply_copy(struct dfs_delta_apply *apply) {
+    uint64_t first = get_u32(apply->ins + 1);
+    uint64_t count = get_u32(apply->ins + 5);
+    if (first + count > apply->blocks) {
+        return -1;
+    }
+    for (uint64_t i = first; i < first + count; i++) {
+        if (apply->read(apply->read_ctx, apply->block, apply->block_size, i * apply->block_size) < 0 ||
+            apply->sink(apply->sink_ctx, apply->block, apply->block_size) < 0) {
+            return -1;
+        }
+        apply->stats.copied += apply->block_size;
+    }
+    return 0;
+}
+
+// Function to take the next bytes of a delta stream
+int dfs_delta_apply_add(void *ctx, const void *data, size_t len) {
+    struct dfs_delta_apply *apply = ctx;
+    const unsigned char *p = data;
+    apply->stats.encoded += len;
+    while (len > 0) {
+        // Bytes of a literal go straight through
+        if (apply->literal_left > 0) {
+            size_t take = len < apply->literal_left ? len : apply->literal_left;
+            if (apply->sink(apply->sink_ctx, p, take) < 0) {
+                return -1;
+            }
+            apply->stats.literal += take;
+            apply->literal_left -= (uint32_t)take;
+            p += take;
+            len -= take;
+            continue;
+        }
+
+        // Otherwise collect the next instruction
+        apply->ins[apply->ins_len++] = *p++;
+        len--;
+        size_t need = apply->ins[0] == DELTA_COPY ? DELTA_COPY_SIZE :
+                      apply->ins[0] == DELTA_LITERAL ? DELTA_LITERAL_SIZE : 0;
+        if (need == 0) {
+            return -1;
+        }
+        if (apply->ins_len < need) {
+            continue;
+        }
+        apply->ins_len = 0;
+        if (apply->ins[0] == DELTA_LITERAL) {
+            apply->literal_left = get_u32(apply->ins + 1);
+        } else if (apply_copy(apply) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to check that a delta stream is complete
+int dfs_delta_apply_finish(struct dfs_delta_apply *apply, struct dfs_delta_stats *stats) {
+    if (stats != NULL) {
+        *stats = apply->stats;
+    }
+    return apply->ins_len == 0 && apply->literal_left == 0 ? 0 : -1;
+}
+
+// Function to release a rebuild
+void dfs_delta_apply_free(struct dfs_delta_apply *apply) {
+    if (apply == NULL) {
+        return;
+    }
+    free(apply->block);
+    free(apply);
+}
@@ -0,0 +1,74 @@
+#ifndef DFS_DELTA_H
+#define DFS_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfs_proto.h"
+
+// rsync style deltas, so an upload that replaces a file only sends what changed.
+//
+// The receiver cuts its copy of the file into blocks of one size and describes every block by a
+// weak rolling checksum and a strong hash (the DELTA reply of 'ufile'). The sender slides a window
+// of that size over the new version: the rolling checksum moves one byte in constant time, and the
+// strong hash is only computed where it matches a block. Matched blocks are sent as references to
+// the copy, the bytes in between as literals, and the receiver rebuilds the file from both. The
+// SHA-256 of the whole file, announced by 'ufile' before, tells whether the result is right.
+//
+// Signatures (the payload of DELTA), big-endian: uint32 block size, uint64 size of the copy, then
+// for every full block its uint32 weak checksum and the first DELTA_STRONG_SIZE bytes of its SHA-256.
+// A short last block has no signature, it is sent as a literal when it is still there.
+//
+// Delta (the payloads of the DATA frames that follow, an instruction may span frames), big-endian:
+//   'C' uint32 first block, uint32 count   copy count blocks of the copy
+//   'L' uint32 length, length bytes        literal bytes
+
+// Files shorter than this are always sent whole, their signatures would not save much
+#define DELTA_MIN_SIZE (64 * 1024)
+
+#define DELTA_STRONG_SIZE 16
+#define DELTA_SIG_SIZE (4 + DELTA_STRONG_SIZE)
+#define DELTA_HEADER_SIZE 12
+
+// Largest signature payload a sender accepts
+#define DELTA_MAX_SIGNATURES (64 * 1024 * 1024)
+
+// What a delta was made of
+struct dfs_delta_stats {
+    uint64_t copied;    // bytes taken from the copy
+    uint64_t literal;   // bytes sent
+    uint64_t encoded;   // bytes of the delta stream
+};
+
+// Reads exactly len bytes at offset of the receiver's copy, returns -1 if it can not
+typedef int (*dfs_delta_read_fn)(void *ctx, void *buf, size_t len, uint64_t offset);
+
+// Build the signatures of a copy of size bytes, read through read, into *payload (malloc()ed).
+// Returns -1 if the copy could not be read or memory ran out.
+int dfs_delta_sign(dfs_delta_read_fn read, void *ctx, uint64_t size, unsigned char **payload, size_t *len);
+
+// Compute the delta of data against a signature payload, handing the stream to sink in pieces of
+// at most DFS_CHUNK_SIZE bytes. Returns -1 if the signatures are malformed, memory ran out or the
+// sink failed; stats, when not NULL, is filled in either way.
+int dfs_delta_encode(const unsigned char *signatures, size_t signatures_len, const unsigned char *data, uint64_t size,
+                     dfs_sink_fn sink, void *ctx, struct dfs_delta_stats *stats);
+
+struct dfs_delta_apply;
+
+// Start rebuilding a file from a delta against a copy of copy_size bytes, signed with
+// dfs_delta_sign(). Returns NULL if memory ran out.
+struct dfs_delta_apply *dfs_delta_apply_new(uint64_t copy_size, dfs_delta_read_fn read, void *read_ctx);
+
+// Set where the rebuilt content goes, before the first dfs_delta_apply_add()
+void dfs_delta_apply_output(struct dfs_delta_apply *apply, dfs_sink_fn sink, void *sink_ctx);
+
+// Sink for the received delta stream (ctx is the struct dfs_delta_apply), returns -1 if it is
+// malformed, the copy could not be read or the output sink failed
+int dfs_delta_apply_add(void *ctx, const void *data, size_t len);
+
+// Check that the stream ended between two instructions, returns -1 if it did not
+int dfs_delta_apply_finish(struct dfs_delta_apply *apply, struct dfs_delta_stats *stats);
+
+void dfs_delta_apply_free(struct dfs_delta_apply *apply);
+
+#endif
@@ -0,0 +1,35 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "dfs_dirs.h"
+
+// Function to create a directory one component at a time, the ones that exist already are kept
+int dfs_make_dirs(const char *path) {
+    char *dir = strdup(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    int result = 0;
+    char *slash = dir[0] != '\0' ? strchr(dir + 1, '/') : NULL;
+    while (1) {
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            result = -1;
+            break;
+        }
+        if (slash == NULL) {
+            break;
+        }
+        *slash = '/';
+        slash = strchr(slash + 1, '/');
+    }
+    // free() must not hide the error of mkdir()
+    int saved = errno;
+    free(dir);
+    errno = saved;
+    return result;
+}
@@ -0,0 +1,11 @@
+#ifndef DFS_DIRS_H
+#define DFS_DIRS_H
+
+// Directories of uploads, created without a shell: no process is started per upload, and a client's
+// path is never read as a command line.
+
+// Create the directory at path and the ones above it that are missing, like 'mkdir -p'.
+// Returns 0 if it exists afterwards, -1 (errno set) if not.
+int dfs_make_dirs(const char *path);
+
+#endif
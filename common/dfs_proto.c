@@ -0,0 +1,436 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "dfs_proto.h"
+
+// helper to store a 32 bit value in big-endian order
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+// helper to read a 32 bit big-endian value
+static uint32_t get_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Function to encode a frame header into its wire form
+void dfs_pack_hdr(unsigned char *out, int opcode, uint32_t request_id, uint64_t length) {
+    put_u32(out, DFS_MAGIC);
+    out[4] = DFS_VERSION;
+    out[5] = (unsigned char)opcode;
+    // flags are reserved for now
+    out[6] = 0;
+    out[7] = 0;
+    put_u32(out + 8, request_id);
+    put_u32(out + 12, (uint32_t)(length >> 32));
+    put_u32(out + 16, (uint32_t)length);
+}
+
+// Function to decode a frame header, rejecting anything that is not our protocol
+int dfs_unpack_hdr(const unsigned char *in, struct dfs_hdr *hdr) {
+    if (get_u32(in) != DFS_MAGIC) {
+        fprintf(stderr, "Frame with bad magic received\n");
+        return -1;
+    }
+    if (in[4] != DFS_VERSION) {
+        fprintf(stderr, "Unsupported protocol version %d\n", in[4]);
+        return -1;
+    }
+    hdr->version = in[4];
+    hdr->opcode = in[5];
+    hdr->flags = (uint16_t)((in[6] << 8) | in[7]);
+    hdr->request_id = get_u32(in + 8);
+    hdr->length = ((uint64_t)get_u32(in + 12) << 32) | get_u32(in + 16);
+    return 0;
+}
+
+// Function to send a whole buffer, retrying on short writes
+int dfs_send_all(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Function to receive exactly len bytes, failing on error or if the peer closes early
+int dfs_recv_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Function to send only a frame header, the caller streams the payload afterwards
+int dfs_send_hdr(int sock, int opcode, uint32_t request_id, uint64_t length) {
+    unsigned char hdr[DFS_HDR_SIZE];
+    dfs_pack_hdr(hdr, opcode, request_id, length);
+    return dfs_send_all(sock, hdr, sizeof(hdr));
+}
+
+// Function to send a complete frame (header and payload)
+// Small frames go out in a single send() so a persistent connection never holds back the
+// payload behind the header waiting for an ACK (Nagle), which would stall every request.
+int dfs_send_frame(int sock, int opcode, uint32_t request_id, const void *payload, uint64_t length) {
+    if (length <= DFS_MAX_TEXT) {
+        unsigned char frame[DFS_HDR_SIZE + DFS_MAX_TEXT];
+        dfs_pack_hdr(frame, opcode, request_id, length);
+        if (length > 0) {
+            memcpy(frame + DFS_HDR_SIZE, payload, (size_t)length);
+        }
+        return dfs_send_all(sock, frame, DFS_HDR_SIZE + (size_t)length);
+    }
+    if (dfs_send_hdr(sock, opcode, request_id, length) < 0) {
+        return -1;
+    }
+    if (length > 0 && dfs_send_all(sock, payload, (size_t)length) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to send a frame whose payload is a string (without the terminating NUL)
+int dfs_send_text(int sock, int opcode, uint32_t request_id, const char *text) {
+    return dfs_send_frame(sock, opcode, request_id, text, strlen(text));
+}
+
+// Function to receive and validate the next frame header
+int dfs_recv_hdr(int sock, struct dfs_hdr *hdr) {
+    unsigned char raw[DFS_HDR_SIZE];
+    if (dfs_recv_all(sock, raw, sizeof(raw)) < 0) {
+        return -1;
+    }
+    return dfs_unpack_hdr(raw, hdr);
+}
+
+// Function to receive a text payload into buf and NUL-terminate it
+int dfs_recv_text(int sock, const struct dfs_hdr *hdr, char *buf, size_t buf_size) {
+    // Reject payloads that do not fit, but still drain them to keep the stream in sync
+    if (hdr->length > DFS_MAX_TEXT || hdr->length >= buf_size) {
+        fprintf(stderr, "Text frame too long (%llu bytes)\n", (unsigned long long)hdr->length);
+        dfs_skip_payload(sock, hdr->length);
+        return -1;
+    }
+    if (dfs_recv_all(sock, buf, (size_t)hdr->length) < 0) {
+        return -1;
+    }
+    buf[hdr->length] = '\0';
+    return 0;
+}
+
+// Function to read and throw away a payload
+int dfs_skip_payload(int sock, uint64_t length) {
+    char scratch[4096];
+    while (length > 0) {
+        size_t want = length < sizeof(scratch) ? (size_t)length : sizeof(scratch);
+        if (dfs_recv_all(sock, scratch, want) < 0) {
+            return -1;
+        }
+        length -= want;
+    }
+    return 0;
+}
+
+// Function to stream a file descriptor to the socket as DATA frames closed by END
+int dfs_send_stream(int sock, uint32_t request_id, int fd) {
+    char buffer[DFS_CHUNK_SIZE];
+    ssize_t bytes_read;
+
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Tell the receiver the stream is incomplete instead of closing it normally
+            perror("Error reading file");
+            if (dfs_send_text(sock, DFS_OP_ERROR, request_id, "ERROR: Error reading file!") < 0) {
+                return -1;
+            }
+            return -2;
+        }
+        if (dfs_send_frame(sock, DFS_OP_DATA, request_id, buffer, (uint64_t)bytes_read) < 0) {
+            return -1;
+        }
+    }
+    return dfs_send_frame(sock, DFS_OP_END, request_id, NULL, 0);
+}
+
+// helper to decide once per process whether sendfile() may be used
+static int sendfile_enabled(void) {
+    static int enabled = -1;
+    if (enabled < 0) {
+        const char *env = getenv("DFS_SENDFILE");
+        enabled = !(env != NULL && strcmp(env, "0") == 0);
+    }
+    return enabled;
+}
+
+// helper to copy len bytes of fd starting at offset to the socket through a user space buffer
+static int copy_range_to_sock(int sock, int fd, off_t offset, uint64_t len, uint64_t *sent) {
+    char buffer[DFS_CHUNK_SIZE];
+    while (len > 0) {
+        size_t want = len < sizeof(buffer) ? (size_t)len : sizeof(buffer);
+        ssize_t n = pread(fd, buffer, want, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // The file shrank or failed underneath us
+            perror("Error reading file");
+            return -2;
+        }
+        if (dfs_send_all(sock, buffer, (size_t)n) < 0) {
+            return -1;
+        }
+        offset += n;
+        len -= (uint64_t)n;
+        *sent += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Function to send a byte range of a file using the kernel's zero-copy path
+int dfs_send_range(int sock, int fd, off_t offset, uint64_t len, uint64_t *sent) {
+    *sent = 0;
+    int use_sendfile = sendfile_enabled();
+    while (len > 0 && use_sendfile) {
+        size_t want = len < 0x7ffff000 ? (size_t)len : 0x7ffff000;
+        ssize_t n = sendfile(sock, fd, &offset, want);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            // This file system can not feed sendfile(), finish with the copy loop
+            use_sendfile = 0;
+            break;
+        }
+        if (n == 0) {
+            fprintf(stderr, "File shrank while it was being sent\n");
+            return -2;
+        }
+        if (n < 0) {
+            perror("sendfile failed");
+            return errno == EIO ? -2 : -1;
+        }
+        len -= (uint64_t)n;
+        *sent += (uint64_t)n;
+    }
+    if (len > 0) {
+        return copy_range_to_sock(sock, fd, offset, len, sent);
+    }
+    return 0;
+}
+
+// Function to send a whole file as a single DATA frame using the kernel's zero-copy path
+int dfs_send_file(int sock, uint32_t request_id, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return dfs_send_stream(sock, request_id, fd);
+    }
+
+    return dfs_send_file_part(sock, request_id, fd, 0, (uint64_t)st.st_size);
+}
+
+// Function to send a part of a file as a single DATA frame using the kernel's zero-copy path
+int dfs_send_file_part(int sock, uint32_t request_id, int fd, uint64_t offset, uint64_t len) {
+    // The frame length is fixed up front, from here on the payload must be delivered completely
+    uint64_t sent;
+    if (dfs_send_hdr(sock, DFS_OP_DATA, request_id, len) < 0 ||
+        dfs_send_range(sock, fd, (off_t)offset, len, &sent) != 0) {
+        return -1;
+    }
+    return dfs_send_frame(sock, DFS_OP_END, request_id, NULL, 0);
+}
+
+// helper to copy a payload between sockets through a user space buffer
+static int copy_payload(int from_sock, int to_sock, uint64_t length) {
+    char buffer[DFS_CHUNK_SIZE];
+    while (length > 0) {
+        size_t want = length < sizeof(buffer) ? (size_t)length : sizeof(buffer);
+        if (dfs_recv_all(from_sock, buffer, want) < 0) {
+            return -1;
+        }
+        if (dfs_send_all(to_sock, buffer, want) < 0) {
+            return -2;
+        }
+        length -= want;
+    }
+    return 0;
+}
+
+// Function to move a payload between two sockets through a pipe with splice()
+int dfs_splice_payload(int from_sock, int to_sock, uint64_t length, int pipe_fds[2]) {
+    while (length > 0) {
+        // Pull up to one pipe's worth of bytes out of the source socket
+        size_t want = length < DFS_CHUNK_SIZE ? (size_t)length : DFS_CHUNK_SIZE;
+        ssize_t in = splice(from_sock, NULL, pipe_fds[1], NULL, want, SPLICE_F_MOVE);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in < 0 && errno == EINVAL) {
+            // One of the descriptors can not be spliced, copy the rest the ordinary way
+            return copy_payload(from_sock, to_sock, length);
+        }
+        if (in <= 0) {
+            return -1;
+        }
+
+        // Push everything that is now in the pipe into the destination socket. SPLICE_F_MORE corks
+        // the socket like MSG_MORE, so it is only set while more of the payload is still to come.
+        ssize_t pending = in;
+        unsigned int out_flags = (uint64_t)in < length ? SPLICE_F_MOVE | SPLICE_F_MORE : SPLICE_F_MOVE;
+        while (pending > 0) {
+            ssize_t out = splice(pipe_fds[0], NULL, to_sock, NULL, (size_t)pending, out_flags);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                return -2;
+            }
+            pending -= out;
+        }
+        length -= (uint64_t)in;
+    }
+    return 0;
+}
+
+// helper sink writing received payloads to a file descriptor
+static int write_sink(void *ctx, const void *data, size_t len) {
+    int fd = *(int *)ctx;
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, (const char *)data + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("File write failed");
+            return -1;
+        }
+        written += (size_t)n;
+    }
+    return 0;
+}
+
+// Function to receive a DATA stream up to its END frame and hand the payloads to a sink
+int dfs_recv_stream_to(int sock, dfs_sink_fn sink, void *ctx, uint64_t *total, char *errmsg, size_t errmsg_size) {
+    char buffer[DFS_CHUNK_SIZE];
+    struct dfs_hdr hdr;
+    int write_failed = 0;
+    uint64_t received = 0;
+
+    while (1) {
+        if (dfs_recv_hdr(sock, &hdr) < 0) {
+            return -1;
+        }
+        if (hdr.opcode == DFS_OP_END) {
+            break;
+        }
+        if (hdr.opcode == DFS_OP_ERROR) {
+            char message[DFS_MAX_TEXT + 1];
+            if (dfs_recv_text(sock, &hdr, message, sizeof(message)) < 0) {
+                return -1;
+            }
+            if (errmsg != NULL && errmsg_size > 0) {
+                snprintf(errmsg, errmsg_size, "%s", message);
+            }
+            return -3;
+        }
+        if (hdr.opcode != DFS_OP_DATA) {
+            fprintf(stderr, "Unexpected %s frame in data stream\n", dfs_opcode_name(hdr.opcode));
+            return -1;
+        }
+
+        // Move the payload through the buffer, one chunk at a time
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t want = remaining < sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
+            if (dfs_recv_all(sock, buffer, want) < 0) {
+                return -1;
+            }
+            remaining -= want;
+            received += want;
+
+            // After a write error keep draining so the next frame is still found
+            if (sink != NULL && !write_failed && sink(ctx, buffer, want) < 0) {
+                write_failed = 1;
+            }
+        }
+    }
+
+    if (total != NULL) {
+        *total = received;
+    }
+    return write_failed ? -2 : 0;
+}
+
+// Function to receive a DATA stream up to its END frame and write it to a file
+int dfs_recv_stream(int sock, int fd, uint64_t *total, char *errmsg, size_t errmsg_size) {
+    return dfs_recv_stream_to(sock, fd >= 0 ? write_sink : NULL, &fd, total, errmsg, errmsg_size);
+}
+
+// Function to map an opcode to a printable name
+const char *dfs_opcode_name(int opcode) {
+    switch (opcode) {
+        case DFS_OP_UFILE: return "ufile";
+        case DFS_OP_DFILE: return "dfile";
+        case DFS_OP_RMFILE: return "rmfile";
+        case DFS_OP_DTAR: return "dtar";
+        case DFS_OP_DISPLAY: return "display";
+        case DFS_OP_FILTER: return "filter";
+        case DFS_OP_LIST: return "list";
+        case DFS_OP_OK: return "ok";
+        case DFS_OP_ERROR: return "error";
+        case DFS_OP_NAME: return "name";
+        case DFS_OP_CONTINUE: return "continue";
+        case DFS_OP_DELTA: return "delta";
+        case DFS_OP_DATA: return "data";
+        case DFS_OP_END: return "end";
+        default: return "unknown";
+    }
+}
+
+// Function to check a file name against a list of suffixes
+int dfs_has_suffix(const char *name, size_t len, const char *suffixes) {
+    const char *p = suffixes + strspn(suffixes, " ");
+    while (*p != '\0') {
+        size_t suffix_len = strcspn(p, " ");
+        if (len > suffix_len && memcmp(name + len - suffix_len, p, suffix_len) == 0) {
+            return 1;
+        }
+        p += suffix_len;
+        p += strspn(p, " ");
+    }
+    return 0;
+}
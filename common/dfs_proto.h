@@ -0,0 +1,129 @@
+#ifndef DFS_PROTO_H
+#define DFS_PROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Every message exchanged between client, smain, spdf and stext is a frame:
+//
+//   offset  size  field
+//   0       4     magic       "DFS1"
+//   4       1     version     DFS_VERSION
+//   5       1     opcode      one of enum dfs_opcode
+//   6       2     flags       reserved, sent as 0
+//   8       4     request_id  echoed back on every reply frame
+//   12      8     length      payload size in bytes
+//
+// All integers are big-endian. The payload follows the header directly, so a
+// receiver (or a relay) always knows exactly how many bytes belong to a frame.
+#define DFS_MAGIC 0x44465331u
+#define DFS_VERSION 1
+#define DFS_HDR_SIZE 20
+
+// Largest payload accepted for a text frame (commands, names, messages)
+#define DFS_MAX_TEXT 4096
+
+// Size of the DATA frames produced when streaming a file, and of the
+// buffer every hop uses to move them, so memory per transfer is constant
+#define DFS_CHUNK_SIZE 65536
+
+enum dfs_opcode {
+    // Requests, payload is the textual argument list of the command
+    DFS_OP_UFILE = 0x01,
+    DFS_OP_DFILE = 0x02,
+    DFS_OP_RMFILE = 0x03,
+    DFS_OP_DTAR = 0x04,     // from Smain to a server: "<path> [<codec>]\n<suffixes>", the files it archives
+    DFS_OP_DISPLAY = 0x05,  // from Smain to a server: "<path> <suffixes>\n<limit>\n<cursor>", the files it lists
+    DFS_OP_FILTER = 0x06,   // from Smain only, no arguments: the Bloom filter of the stored paths (see dfs_bloom.h)
+    DFS_OP_LIST = 0x07,     // from Smain only, no arguments: "<size> <path>" of every stored file, NUL terminated, as a DATA stream
+
+    // Replies
+    DFS_OP_OK = 0x10,       // success, payload is a message for the user
+    DFS_OP_ERROR = 0x11,    // failure, payload is a message for the user
+    DFS_OP_NAME = 0x12,     // start of a data stream, payload is the file name
+    DFS_OP_CONTINUE = 0x13, // ufile that announced its size and hash: the content is not stored yet, send it
+    DFS_OP_DELTA = 0x14,    // like CONTINUE, but send a delta against the old file, payload is its signatures
+
+    // Data streams: any number of DATA frames closed by a single END frame
+    DFS_OP_DATA = 0x20,
+    DFS_OP_END = 0x21
+};
+
+struct dfs_hdr {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t request_id;
+    uint64_t length;
+};
+
+// Encode/decode a header to/from its DFS_HDR_SIZE wire form, decode returns -1 on bad magic or version
+void dfs_pack_hdr(unsigned char *out, int opcode, uint32_t request_id, uint64_t length);
+int dfs_unpack_hdr(const unsigned char *in, struct dfs_hdr *hdr);
+
+// Loop over send()/recv() until the whole buffer is transferred, return -1 on error or early EOF
+int dfs_send_all(int sock, const void *buf, size_t len);
+int dfs_recv_all(int sock, void *buf, size_t len);
+
+// Send a frame header alone (payload follows separately) or a whole frame
+int dfs_send_hdr(int sock, int opcode, uint32_t request_id, uint64_t length);
+int dfs_send_frame(int sock, int opcode, uint32_t request_id, const void *payload, uint64_t length);
+int dfs_send_text(int sock, int opcode, uint32_t request_id, const char *text);
+
+// Receive and validate the next frame header, return 0 on success, -1 on error or EOF
+int dfs_recv_hdr(int sock, struct dfs_hdr *hdr);
+
+// Receive a text payload of at most DFS_MAX_TEXT bytes into a NUL-terminated buffer
+int dfs_recv_text(int sock, const struct dfs_hdr *hdr, char *buf, size_t buf_size);
+
+// Read and discard a payload that the receiver is not interested in
+int dfs_skip_payload(int sock, uint64_t length);
+
+// Send everything readable from fd as DATA frames of at most DFS_CHUNK_SIZE followed by END.
+// Returns 0 on success, -1 if the socket failed and -2 if reading fd failed (an ERROR frame is sent instead of END).
+int dfs_send_stream(int sock, uint32_t request_id, int fd);
+
+// Send a regular file as one DATA frame followed by END. The payload is moved with sendfile(),
+// falling back to a read()/send() loop when the file system or socket does not support it
+// or when the environment variable DFS_SENDFILE is set to 0. Non regular files use dfs_send_stream().
+// Returns 0 on success, -1 if the connection is no longer usable and -2 if the file could not be read
+// before anything was sent (an ERROR frame was sent instead).
+int dfs_send_file(int sock, uint32_t request_id, int fd);
+
+// Same as dfs_send_file() for len bytes of a regular file starting at offset, which must lie within it
+int dfs_send_file_part(int sock, uint32_t request_id, int fd, uint64_t offset, uint64_t len);
+
+// Send len bytes of fd starting at offset to the socket, with sendfile() where possible (see dfs_send_file()).
+// *sent counts the bytes that went out. Returns 0 on success, -1 if the socket failed and -2 if the
+// file ended early or could not be read.
+int dfs_send_range(int sock, int fd, off_t offset, uint64_t len, uint64_t *sent);
+
+// Move exactly length payload bytes from one socket to another without copying them through
+// user space: splice() feeds them from from_sock into the pipe and from the pipe into to_sock.
+// pipe_fds must be an empty pipe owned by the caller. Falls back to a buffered copy when splice()
+// is not supported. Returns 0 on success, -1 if from_sock failed and -2 if to_sock failed; after a
+// failure the pipe may still hold bytes and must be replaced.
+int dfs_splice_payload(int from_sock, int to_sock, uint64_t length, int pipe_fds[2]);
+
+// Receive a DATA stream up to its END frame and write the payloads to fd (fd < 0 discards them).
+// The stream is always consumed completely unless the socket fails, so the connection stays usable.
+// Returns 0 on END, -1 if the socket failed or the stream was malformed, -2 if writing fd failed,
+// and -3 if the sender aborted with an ERROR frame (its message is copied to errmsg when given).
+int dfs_recv_stream(int sock, int fd, uint64_t *total, char *errmsg, size_t errmsg_size);
+
+// Consumer of received payload bytes, returns -1 if they could not be stored
+typedef int (*dfs_sink_fn)(void *ctx, const void *data, size_t len);
+
+// Same as dfs_recv_stream() but every payload chunk goes to sink (NULL discards them). After the sink
+// failed once the rest of the stream is drained and -2 is returned.
+int dfs_recv_stream_to(int sock, dfs_sink_fn sink, void *ctx, uint64_t *total, char *errmsg, size_t errmsg_size);
+
+// Human readable opcode name for logs
+const char *dfs_opcode_name(int opcode);
+
+// Whether the name of len bytes ends with one of the space separated suffixes (".pdf .md"), like the
+// suffix lists of the dtar and display requests Smain sends to the servers
+int dfs_has_suffix(const char *name, size_t len, const char *suffixes);
+
+#endif
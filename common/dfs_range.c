@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "dfs_range.h"
+
+// helper to check that only spaces are left
+static int only_spaces(const char *text) {
+    while (*text == ' ' || *text == '\n') {
+        text++;
+    }
+    return *text == '\0';
+}
+
+// Function to parse the range arguments of a dfile request
+int dfs_range_parse(const char *args, struct dfs_range *range) {
+    unsigned long long offset, length;
+    int end = 0;
+    memset(range, 0, sizeof(*range));
+    if (only_spaces(args)) {
+        return 0;
+    }
+    if (sscanf(args, "%llu %llu%n", &offset, &length, &end) != 2) {
+        return -1;
+    }
+    // The version is optional, a longer token than any version is malformed
+    char version[DFS_VERSION_MAX + 2] = "";
+    int version_end = 0;
+    if (!only_spaces(args + end) &&
+        (sscanf(args + end, " %57s%n", version, &version_end) != 1 || strlen(version) > DFS_VERSION_MAX ||
+         !only_spaces(args + end + version_end))) {
+        return -1;
+    }
+    range->offset = offset;
+    range->length = length;
+    snprintf(range->version, sizeof(range->version), "%s", version);
+    return 1;
+}
+
+// Function to write the version of a file
+void dfs_range_version(const struct stat *st, char *out) {
+    snprintf(out, DFS_VERSION_MAX + 1, "%llx-%llx.%lx", (unsigned long long)st->st_ino,
+             (unsigned long long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec);
+}
+
+// Function to fit a range to the file it asks for
+int dfs_range_resolve(struct dfs_range *range, uint64_t size, const char *version) {
+    if (range->version[0] != '\0' && strcmp(range->version, version) != 0) {
+        // The client's part belongs to a file that was replaced since, it starts over
+        range->offset = 0;
+    }
+    if (range->offset > size) {
+        return -1;
+    }
+    if (range->length == 0 || range->length > size - range->offset) {
+        range->length = size - range->offset;
+    }
+    snprintf(range->version, sizeof(range->version), "%s", version);
+    return 0;
+}
+
+// Function to build the NAME payload of a ranged reply
+void dfs_range_name(char *out, size_t out_size, const char *name, uint64_t size, const struct dfs_range *range) {
+    snprintf(out, out_size, "%s %llu %s %llu", name, (unsigned long long)size, range->version,
+             (unsigned long long)range->offset);
+}
+
+// Function to split the NAME payload of a ranged reply
+int dfs_range_parse_name(char *payload, uint64_t *size, char *version, uint64_t *offset) {
+    char *space = strchr(payload, ' ');
+    unsigned long long size_value, offset_value;
+    char version_value[DFS_VERSION_MAX + 2];
+    if (space == NULL || sscanf(space + 1, "%llu %57s %llu", &size_value, version_value, &offset_value) != 3 ||
+        strlen(version_value) > DFS_VERSION_MAX || offset_value > size_value) {
+        return -1;
+    }
+    *space = '\0';
+    *size = size_value;
+    *offset = offset_value;
+    snprintf(version, DFS_VERSION_MAX + 1, "%s", version_value);
+    return 0;
+}
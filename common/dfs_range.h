@@ -0,0 +1,48 @@
+#ifndef DFS_RANGE_H
+#define DFS_RANGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Ranged downloads for 'dfile', so an interrupted download is resumed instead of started over.
+//
+// A dfile request is "path", optionally followed by " <offset> <length> [<version>]" (length 0
+// meaning up to the end). The version of a file is a token that changes whenever the file is
+// replaced, from its inode and mtime; uploads never change a file in place. When a request gives a
+// version that is not the file's, the part the client holds is stale and the range is moved to the
+// start of the file (the same length, so the whole file for length 0).
+//
+// The NAME frame of the reply to a ranged request is "<name> <size> <version> <offset>": the size
+// of the whole file, its version and the offset the DATA that follows starts at. The reply to a
+// request without a range is the plain file name and the whole file, as before.
+
+// Longest version token: inode, modification seconds and nanoseconds in hex, "%llx-%llx.%lx" is at
+// most 16 + 1 + 16 + 1 + 16 = 50 characters
+#define DFS_VERSION_MAX 56
+
+struct dfs_range {
+    uint64_t offset;
+    uint64_t length;                    // 0 up to the end, exact after dfs_range_resolve()
+    char version[DFS_VERSION_MAX + 1];  // "" when the request gives none
+};
+
+// Read the range arguments that follow the path of a dfile request.
+// Returns 1 for a range, 0 if there are no arguments (the whole file) and -1 if they are malformed.
+int dfs_range_parse(const char *args, struct dfs_range *range);
+
+// Write the version of a file with this status into out, which holds DFS_VERSION_MAX + 1 bytes
+void dfs_range_version(const struct stat *st, char *out);
+
+// Fit a range to a file of size bytes with version: a request for another version starts at 0,
+// and the length is made exact. Returns -1 if the offset lies past the end of the file.
+int dfs_range_resolve(struct dfs_range *range, uint64_t size, const char *version);
+
+// Build the NAME payload of a ranged reply
+void dfs_range_name(char *out, size_t out_size, const char *name, uint64_t size, const struct dfs_range *range);
+
+// Split the NAME payload of a ranged reply, payload is cut to the file name.
+// Returns -1 if it is not one.
+int dfs_range_parse_name(char *payload, uint64_t *size, char *version, uint64_t *offset);
+
+#endif
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfs_proto.h"
+#include "name_page.h"
+
+// helper to restore the heap order below index i after its name grew smaller
+static void sift_down(struct name_page *page, size_t i) {
+    while (1) {
+        size_t largest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < page->count && strcmp(page->names[left], page->names[largest]) > 0) {
+            largest = left;
+        }
+        if (right < page->count && strcmp(page->names[right], page->names[largest]) > 0) {
+            largest = right;
+        }
+        if (largest == i) {
+            return;
+        }
+        char *swap = page->names[i];
+        page->names[i] = page->names[largest];
+        page->names[largest] = swap;
+        i = largest;
+    }
+}
+
+// helper to move a newly added name at index i up to its place in the heap
+static void sift_up(struct name_page *page, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (strcmp(page->names[i], page->names[parent]) <= 0) {
+            return;
+        }
+        char *swap = page->names[i];
+        page->names[i] = page->names[parent];
+        page->names[parent] = swap;
+        i = parent;
+    }
+}
+
+// helper for qsort() on an array of names
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to start an empty page
+int name_page_init(struct name_page *page, size_t limit, const char *cursor) {
+    memset(page, 0, sizeof(*page));
+    page->limit = limit;
+    page->cursor = cursor;
+    page->names = malloc((limit ? limit : 1) * sizeof(char *));
+    if (page->names == NULL) {
+        perror("Page allocation failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to offer a name to a page, keeping the smallest ones after the cursor
+int name_page_offer(struct name_page *page, const char *name) {
+    // A record ends at a newline, such a name can not be listed
+    if (strcmp(name, page->cursor) <= 0 || strchr(name, '\n') != NULL) {
+        return 0;
+    }
+    if (page->count == page->limit) {
+        // The page is full, the name only goes in instead of the largest one
+        page->more = 1;
+        if (page->count == 0 || strcmp(name, page->names[0]) >= 0) {
+            return 0;
+        }
+        char *copy = strdup(name);
+        if (copy == NULL) {
+            return -1;
+        }
+        free(page->names[0]);
+        page->names[0] = copy;
+        sift_down(page, 0);
+        return 0;
+    }
+    if ((page->names[page->count] = strdup(name)) == NULL) {
+        return -1;
+    }
+    sift_up(page, page->count++);
+    return 0;
+}
+
+// Function to put the names of a page in ascending order
+void name_page_sort(struct name_page *page) {
+    qsort(page->names, page->count, sizeof(char *), compare_names);
+}
+
+// Function to get the cursor of the next page
+const char *name_page_next_cursor(const struct name_page *page) {
+    return page->more && page->count > 0 ? page->names[page->count - 1] : "";
+}
+
+// Function to release a page
+void name_page_free(struct name_page *page) {
+    for (size_t i = 0; i < page->count; i++) {
+        free(page->names[i]);
+    }
+    free(page->names);
+    page->names = NULL;
+    page->count = 0;
+}
+
+// Function to split a display request into its parts
+int dfs_parse_display(char *text, char **path, char **suffixes, size_t *limit, char **cursor) {
+    *limit = DFS_PAGE_DEFAULT;
+    *cursor = "";
+
+    char *line = strchr(text, '\n');
+    if (line != NULL) {
+        *line++ = '\0';
+        char *cursor_line = strchr(line, '\n');
+        if (cursor_line != NULL) {
+            *cursor_line++ = '\0';
+            *cursor = cursor_line;
+        }
+        long requested = atol(line);
+        if (requested > 0) {
+            *limit = requested < DFS_PAGE_MAX ? (size_t)requested : DFS_PAGE_MAX;
+        }
+    }
+    // The path is the first word, as before paging existed, the suffixes Smain asks a server for follow it
+    *path = strtok(text, " \t");
+    *suffixes = *path != NULL ? strtok(NULL, "") : NULL;
+    if (*suffixes == NULL) {
+        *suffixes = "";
+    }
+    return *path == NULL ? -1 : 0;
+}
+
+// Function to send a page as records followed by the next cursor
+int dfs_send_page(int sock, uint32_t request_id, const struct name_page *page) {
+    char chunk[DFS_CHUNK_SIZE];
+    size_t used = 0;
+
+    for (size_t i = 0; i < page->count; i++) {
+        size_t len = strlen(page->names[i]);
+        // Records never span two frames
+        if (used + len + 1 > sizeof(chunk)) {
+            if (dfs_send_frame(sock, DFS_OP_DATA, request_id, chunk, used) < 0) {
+                return -1;
+            }
+            used = 0;
+        }
+        memcpy(chunk + used, page->names[i], len);
+        chunk[used + len] = '\n';
+        used += len + 1;
+    }
+    if (used > 0 && dfs_send_frame(sock, DFS_OP_DATA, request_id, chunk, used) < 0) {
+        return -1;
+    }
+    return dfs_send_text(sock, DFS_OP_END, request_id, name_page_next_cursor(page));
+}
@@ -0,0 +1,52 @@
+#ifndef NAME_PAGE_H
+#define NAME_PAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pages of a sorted file listing for 'display'.
+//
+// A display request is "path", optionally followed by "\n<limit>\n<cursor>". The reply lists at most
+// limit names that sort after cursor (strcmp() order), as DATA frames holding whole "name\n" records,
+// closed by an END frame whose payload is the cursor of the next page (empty after the last page).
+// Only the page is ever kept in memory: names are offered one by one while a directory is read and
+// a bounded max-heap keeps the smallest limit of them, however large the directory is.
+
+// Names per page when the request gives no limit, and the most a request may ask for
+#define DFS_PAGE_DEFAULT 1000
+#define DFS_PAGE_MAX 1000
+
+// Longest cursor, a file name
+#define DFS_CURSOR_MAX 255
+
+struct name_page {
+    char **names;        // max-heap while names are offered, ascending after name_page_sort()
+    size_t count;
+    size_t limit;
+    const char *cursor;  // only names after it are taken, "" for the first page
+    int more;            // a name after the page was offered too, so there is a next page
+};
+
+// Start a page of at most limit names after cursor (not copied, it must outlive the page)
+int name_page_init(struct name_page *page, size_t limit, const char *cursor);
+
+// Offer a name, it is copied if it belongs to the page. Returns -1 if memory ran out.
+int name_page_offer(struct name_page *page, const char *name);
+
+// Sort the names of the page in ascending order, no more names may be offered afterwards
+void name_page_sort(struct name_page *page);
+
+// Cursor of the page after this sorted one, "" if it is the last
+const char *name_page_next_cursor(const struct name_page *page);
+
+void name_page_free(struct name_page *page);
+
+// Split a display request into path, suffixes (the rest of its line, "" if none), limit and cursor,
+// text is modified and the pointers point into it. Returns -1 if there is no path.
+int dfs_parse_display(char *text, char **path, char **suffixes, size_t *limit, char **cursor);
+
+// Send a sorted page as DATA records and the END frame with the next cursor on a blocking socket.
+// Returns 0 on success, -1 if the socket failed.
+int dfs_send_page(int sock, uint32_t request_id, const struct name_page *page);
+
+#endif
@@ -0,0 +1,218 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef DFS_HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#include "sha256.h"
+
+// Round constants: the first 32 bits of the fractional parts of the cube roots of the first 64 primes
+static const uint32_t round_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// helper to rotate a word right
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+// helper to mix one 64 byte block into the state
+static void compress_block(uint32_t state[8], const unsigned char *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + round_k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// Function to start a hash
+void sha256_init(struct sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->total = 0;
+    ctx->used = 0;
+    ctx->evp = NULL;
+#ifdef DFS_HAVE_OPENSSL
+    EVP_MD_CTX *evp = EVP_MD_CTX_new();
+    if (evp != NULL && EVP_DigestInit_ex(evp, EVP_sha256(), NULL) == 1) {
+        ctx->evp = evp;
+    } else {
+        EVP_MD_CTX_free(evp);
+    }
+#endif
+}
+
+// Function to add bytes to a hash
+void sha256_update(struct sha256 *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    ctx->total += len;
+#ifdef DFS_HAVE_OPENSSL
+    if (ctx->evp != NULL) {
+        EVP_DigestUpdate(ctx->evp, data, len);
+        return;
+    }
+#endif
+
+    // Complete the block started by the last call first
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used < 64) {
+            return;
+        }
+        compress_block(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    // Whole blocks are hashed where they are
+    while (len >= 64) {
+        compress_block(ctx->state, p);
+        p += 64;
+        len -= 64;
+    }
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
+}
+
+// Function to finish a hash and get its digest
+void sha256_final(struct sha256 *ctx, unsigned char digest[SHA256_SIZE]) {
+#ifdef DFS_HAVE_OPENSSL
+    if (ctx->evp != NULL) {
+        EVP_DigestFinal_ex(ctx->evp, digest, NULL);
+        EVP_MD_CTX_free(ctx->evp);
+        ctx->evp = NULL;
+        return;
+    }
+#endif
+    uint64_t bits = ctx->total * 8;
+
+    // A 1 bit, zeros up to 8 bytes before a block boundary, then the length in bits
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        compress_block(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    compress_block(ctx->state, ctx->block);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+// Function to hash a buffer in one call
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_SIZE]) {
+#ifdef DFS_HAVE_OPENSSL
+    if (EVP_Digest(data, len, digest, NULL, EVP_sha256(), NULL) == 1) {
+        return;
+    }
+#endif
+    struct sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+// Function to hash a whole file, read from its start whatever its offset is
+int sha256_file(int fd, unsigned char digest[SHA256_SIZE], uint64_t *size) {
+    unsigned char buf[65536];
+    struct sha256 ctx;
+    off_t offset = 0;
+    int result = 0;
+    sha256_init(&ctx);
+    while (1) {
+        ssize_t n = pread(fd, buf, sizeof(buf), offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            result = n < 0 ? -1 : 0;
+            break;
+        }
+        sha256_update(&ctx, buf, (size_t)n);
+        offset += n;
+    }
+    sha256_final(&ctx, digest);
+    *size = (uint64_t)offset;
+    return result;
+}
+
+// Function to write a digest as lowercase hex
+void sha256_hex(const unsigned char digest[SHA256_SIZE], char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_SIZE; i++) {
+        out[2 * i] = digits[digest[i] >> 4];
+        out[2 * i + 1] = digits[digest[i] & 15];
+    }
+    out[SHA256_HEX_SIZE] = '\0';
+}
+
+// Function to read a digest from hex, in either case
+int sha256_from_hex(const char *hex, unsigned char digest[SHA256_SIZE]) {
+    for (int i = 0; i < SHA256_HEX_SIZE; i++) {
+        char c = hex[i];
+        int value;
+        if (c >= '0' && c <= '9') {
+            value = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value = c - 'A' + 10;
+        } else {
+            return -1;
+        }
+        if (i % 2 == 0) {
+            digest[i / 2] = (unsigned char)(value << 4);
+        } else {
+            digest[i / 2] |= (unsigned char)value;
+        }
+    }
+    return 0;
+}
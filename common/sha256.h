@@ -0,0 +1,42 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256 (FIPS 180-4), the hash that names the chunks of the chunk store and the content of uploads.
+//
+// OpenSSL's libcrypto is used when built with DFS_HAVE_OPENSSL (compile.sh enables it when
+// openssl/evp.h is found), which hashes with the CPU's SHA instructions where it has them; the
+// code here is used otherwise.
+
+#define SHA256_SIZE 32
+// Length of a hash written as lowercase hex, without the NUL
+#define SHA256_HEX_SIZE (2 * SHA256_SIZE)
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t total;            // bytes hashed so far
+    unsigned char block[64];   // bytes of the block not complete yet
+    size_t used;
+    void *evp;                 // libcrypto's context when it is used
+};
+
+// A hash that was started must be finished with sha256_final(), which also releases it
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, unsigned char digest[SHA256_SIZE]);
+
+// Hash len bytes in one call, with libcrypto when available
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_SIZE]);
+
+// Hash everything in the file fd from its start, *size gets its length. Returns -1 if it could not be read.
+int sha256_file(int fd, unsigned char digest[SHA256_SIZE], uint64_t *size);
+
+// Write a digest as hex into out, which must hold SHA256_HEX_SIZE + 1 bytes
+void sha256_hex(const unsigned char digest[SHA256_SIZE], char *out);
+
+// Read a digest written by sha256_hex() from the first SHA256_HEX_SIZE characters of hex, returns -1 if they are not one
+int sha256_from_hex(const char *hex, unsigned char digest[SHA256_SIZE]);
+
+#endif
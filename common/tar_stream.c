@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "dfs_proto.h"
+#include "tar_stream.h"
+
+// Header blocks of consecutive empty members are collected up to this size before they are handed out
+#define TAR_BATCH_SIZE (64 * 1024)
+// Largest values the octal fields of a ustar header can hold
+#define TAR_MAX_SIZE 077777777777ULL
+#define TAR_MAX_ID 07777777ULL
+
+// One directory on the way from the root to the current position of the walk
+struct tar_dir {
+    DIR *dir;
+    size_t path_len;  // length of its path relative to the root, including the trailing '/'
+};
+
+struct tar_stream {
+    char suffixes[DFS_MAX_TEXT + 1];
+    struct tar_dir *dirs;
+    int depth;
+    int dirs_cap;
+    char path[PATH_MAX];  // path of the current entry relative to the root
+
+    // The member found last: its header has not been produced yet, or its body has not been handed out
+    int member_fd;
+    struct stat member_st;
+    char member_name[PATH_MAX];
+    int body_ready;
+    uint64_t member_size;
+    // Member whose content comes in parts, and the bytes of it not handed out yet
+    struct tar_content content;
+    void *member_parts;
+    uint64_t body_left;
+
+    // Padding still owed for the body handed out last
+    size_t pad;
+    int trailer_done;
+    uint64_t members;
+
+    // Bytes returned by the last TAR_PIECE_BYTES
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+// helper to make room for more bytes in the output buffer
+static int buf_reserve(struct tar_stream *tar, size_t more) {
+    if (tar->len + more <= tar->cap) {
+        return 0;
+    }
+    size_t cap = tar->cap ? tar->cap : TAR_BATCH_SIZE;
+    while (cap < tar->len + more) {
+        cap *= 2;
+    }
+    char *grown = realloc(tar->buf, cap);
+    if (grown == NULL) {
+        perror("Tar buffer allocation failed");
+        return -1;
+    }
+    tar->buf = grown;
+    tar->cap = cap;
+    return 0;
+}
+
+// helper to append zero bytes to the output buffer
+static int buf_zeros(struct tar_stream *tar, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (buf_reserve(tar, len) < 0) {
+        return -1;
+    }
+    memset(tar->buf + tar->len, 0, len);
+    tar->len += len;
+    return 0;
+}
+
+// helper to enter a directory below the current one
+static int push_dir(struct tar_stream *tar, int fd, size_t path_len) {
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (tar->depth == tar->dirs_cap) {
+        int cap = tar->dirs_cap ? tar->dirs_cap * 2 : 16;
+        struct tar_dir *grown = realloc(tar->dirs, cap * sizeof(*grown));
+        if (grown == NULL) {
+            closedir(dir);
+            return -1;
+        }
+        tar->dirs = grown;
+        tar->dirs_cap = cap;
+    }
+    tar->dirs[tar->depth].dir = dir;
+    tar->dirs[tar->depth].path_len = path_len;
+    tar->depth++;
+    return 0;
+}
+
+// helper to find the size of the current member, and for one whose content comes in parts the
+// handle of its parts
+static void open_member_content(struct tar_stream *tar) {
+    tar->member_size = (uint64_t)tar->member_st.st_size;
+    if (tar->content.open == NULL) {
+        return;
+    }
+    uint64_t size;
+    tar->member_parts = tar->content.open(tar->content.arg, tar->member_fd, &size);
+    if (tar->member_parts != NULL) {
+        tar->member_size = size;
+        tar->body_left = size;
+        close(tar->member_fd);
+        tar->member_fd = -1;
+    }
+}
+
+// helper to drop the handle of the member whose content came in parts
+static void close_member_content(struct tar_stream *tar) {
+    if (tar->member_parts != NULL) {
+        tar->content.close(tar->member_parts);
+        tar->member_parts = NULL;
+    }
+}
+
+// helper to walk on to the next matching regular file and open it, return 0 once the walk is done
+static int find_member(struct tar_stream *tar) {
+    while (tar->depth > 0) {
+        struct tar_dir *top = &tar->dirs[tar->depth - 1];
+        struct dirent *entry = readdir(top->dir);
+        if (entry == NULL) {
+            closedir(top->dir);
+            tar->depth--;
+            continue;
+        }
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        size_t name_len = strlen(name);
+        if (top->path_len + name_len + 2 > sizeof(tar->path)) {
+            printf("Skipping %.*s%s: path too long\n", (int)top->path_len, tar->path, name);
+            continue;
+        }
+        memcpy(tar->path + top->path_len, name, name_len + 1);
+
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(top->dir), name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) {
+            int fd = openat(dirfd(top->dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            size_t path_len = top->path_len + name_len;
+            tar->path[path_len++] = '/';
+            if (fd < 0 || push_dir(tar, fd, path_len) < 0) {
+                printf("Skipping directory %s: %s\n", tar->path, strerror(errno));
+            }
+            continue;
+        }
+        if (type != DT_REG || !dfs_has_suffix(name, name_len, tar->suffixes)) {
+            continue;
+        }
+
+        int fd = openat(dirfd(top->dir), name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &tar->member_st) < 0 || !S_ISREG(tar->member_st.st_mode)) {
+            printf("Skipping %s: %s\n", tar->path, fd < 0 ? strerror(errno) : "not a regular file");
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        tar->member_fd = fd;
+        snprintf(tar->member_name, sizeof(tar->member_name), "%s", tar->path);
+        tar->members++;
+        open_member_content(tar);
+        return 1;
+    }
+    return 0;
+}
+
+// helper to write a number as a zero filled, NUL terminated octal field
+static void put_octal(char *field, size_t width, uint64_t value) {
+    snprintf(field, width, "%0*llo", (int)(width - 1), (unsigned long long)value);
+}
+
+// helper to fill in a header block and its checksum
+static void fill_header(char *block, const char *name, const char *prefix, char type,
+                        const struct stat *st, uint64_t size) {
+    memset(block, 0, TAR_BLOCK_SIZE);
+    memcpy(block, name, strnlen(name, 100));
+    put_octal(block + 100, 8, st->st_mode & 07777);
+    put_octal(block + 108, 8, (uint64_t)st->st_uid <= TAR_MAX_ID ? st->st_uid : 0);
+    put_octal(block + 116, 8, (uint64_t)st->st_gid <= TAR_MAX_ID ? st->st_gid : 0);
+    put_octal(block + 124, 12, size <= TAR_MAX_SIZE ? size : 0);
+    put_octal(block + 136, 12, st->st_mtime >= 0 && (uint64_t)st->st_mtime <= TAR_MAX_SIZE ? (uint64_t)st->st_mtime : 0);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    memcpy(block + 345, prefix, strnlen(prefix, 155));
+
+    // The checksum is computed with its own field taken as spaces
+    unsigned int sum = 0;
+    memset(block + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += (unsigned char)block[i];
+    }
+    snprintf(block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+}
+
+// helper to append one pax record, whose length field counts its own digits
+static int pax_record(struct tar_stream *tar, const char *key, const char *value) {
+    size_t rest = strlen(key) + strlen(value) + 3;
+    size_t total = rest + 1;
+    while (total != rest + (size_t)snprintf(NULL, 0, "%zu", total)) {
+        total = rest + (size_t)snprintf(NULL, 0, "%zu", total);
+    }
+    if (buf_reserve(tar, total + 1) < 0) {
+        return -1;
+    }
+    snprintf(tar->buf + tar->len, total + 1, "%zu %s=%s\n", total, key, value);
+    tar->len += total;
+    return 0;
+}
+
+// helper to append the header blocks of the current member, preceded by a pax header when ustar can not describe it
+static int add_member_header(struct tar_stream *tar) {
+    const struct stat *st = &tar->member_st;
+    const char *path = tar->member_name;
+    size_t path_len = strlen(path);
+    uint64_t size = tar->member_size;
+    char name[101] = "";
+    char prefix[156] = "";
+
+    // ustar keeps up to 100 bytes of name and 155 bytes of directory prefix, split at a '/'
+    int fits = path_len <= 100;
+    if (fits) {
+        memcpy(name, path, path_len + 1);
+    } else {
+        for (size_t i = path_len - 1; i > 0; i--) {
+            if (path[i] == '/' && i <= 155 && path_len - i - 1 <= 100) {
+                memcpy(prefix, path, i);
+                prefix[i] = '\0';
+                memcpy(name, path + i + 1, path_len - i);
+                fits = 1;
+                break;
+            }
+            if (path_len - i - 1 > 100) {
+                break;
+            }
+        }
+    }
+    int need_pax = !fits || size > TAR_MAX_SIZE ||
+                   (uint64_t)st->st_uid > TAR_MAX_ID || (uint64_t)st->st_gid > TAR_MAX_ID;
+
+    if (need_pax) {
+        // Collect the records after the space of the pax header block, then fill the block in
+        size_t header_at = tar->len;
+        if (buf_zeros(tar, TAR_BLOCK_SIZE) < 0) {
+            return -1;
+        }
+        size_t records_at = tar->len;
+        char number[32];
+        if (!fits && pax_record(tar, "path", path) < 0) {
+            return -1;
+        }
+        if (size > TAR_MAX_SIZE) {
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)size);
+            if (pax_record(tar, "size", number) < 0) {
+                return -1;
+            }
+        }
+        if ((uint64_t)st->st_uid > TAR_MAX_ID) {
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)st->st_uid);
+            if (pax_record(tar, "uid", number) < 0) {
+                return -1;
+            }
+        }
+        if ((uint64_t)st->st_gid > TAR_MAX_ID) {
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)st->st_gid);
+            if (pax_record(tar, "gid", number) < 0) {
+                return -1;
+            }
+        }
+        size_t records_len = tar->len - records_at;
+        size_t pad = (TAR_BLOCK_SIZE - records_len % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        if (buf_zeros(tar, pad) < 0) {
+            return -1;
+        }
+
+        const char *base = strrchr(path, '/');
+        base = base ? base + 1 : path;
+        char pax_name[101];
+        snprintf(pax_name, sizeof(pax_name), "PaxHeaders/%.89s", base);
+        fill_header(tar->buf + header_at, pax_name, "", 'x', st, records_len);
+
+        // The plain header still carries a usable, if shortened, name for readers without pax support
+        if (!fits) {
+            snprintf(name, sizeof(name), "%.100s", base);
+        }
+    }
+
+    if (buf_reserve(tar, TAR_BLOCK_SIZE) < 0) {
+        return -1;
+    }
+    fill_header(tar->buf + tar->len, name, prefix, '0', st, size);
+    tar->len += TAR_BLOCK_SIZE;
+    return 0;
+}
+
+// Function to start an archive of the files below root whose names end with one of the suffixes
+struct tar_stream *tar_stream_open(const char *root, const char *suffixes) {
+    struct tar_stream *tar = calloc(1, sizeof(*tar));
+    if (tar == NULL) {
+        perror("Tar stream allocation failed");
+        return NULL;
+    }
+    snprintf(tar->suffixes, sizeof(tar->suffixes), "%s", suffixes);
+    tar->member_fd = -1;
+
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || push_dir(tar, fd, 0) < 0) {
+        perror("Error opening directory to archive");
+        tar_stream_close(tar);
+        return NULL;
+    }
+    // Look for the first member now so the caller can tell an empty archive apart
+    find_member(tar);
+    return tar;
+}
+
+// Function to read member contents through a content source
+void tar_stream_set_content(struct tar_stream *tar, const struct tar_content *content) {
+    tar->content = *content;
+    // The first member was found by tar_stream_open() already
+    if (tar->member_fd >= 0) {
+        open_member_content(tar);
+    }
+}
+
+// helper to hand out the next part of a member whose content comes in parts. Returns 0 when the
+// content ended, the rest of the body is then owed as padding.
+static int next_member_part(struct tar_stream *tar, struct tar_piece *piece) {
+    int fd;
+    uint64_t size;
+    int result;
+    while ((result = tar->content.next(tar->member_parts, &fd, &size)) > 0 && size == 0) {
+        close(fd);
+    }
+    if (result <= 0) {
+        // The header already promised the size, keep the archive aligned
+        printf("Content of %s ended early, padding it with zeros\n", tar->member_name);
+        tar->pad = tar->body_left + (TAR_BLOCK_SIZE - tar->member_size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        tar->body_ready = 0;
+        close_member_content(tar);
+        return 0;
+    }
+    piece->kind = TAR_PIECE_FILE;
+    piece->fd = fd;
+    piece->size = size < tar->body_left ? size : tar->body_left;
+    tar->body_left -= piece->size;
+    if (tar->body_left == 0) {
+        tar->pad = (TAR_BLOCK_SIZE - tar->member_size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        tar->body_ready = 0;
+        close_member_content(tar);
+    }
+    return 1;
+}
+
+// Function to produce the next piece of the archive
+int tar_stream_next(struct tar_stream *tar, struct tar_piece *piece) {
+    memset(piece, 0, sizeof(*piece));
+    piece->fd = -1;
+
+    // The header of the member went out with the last piece, now its content follows
+    if (tar->body_ready && tar->member_parts != NULL) {
+        if (next_member_part(tar, piece)) {
+            return 0;
+        }
+    } else if (tar->body_ready) {
+        piece->kind = TAR_PIECE_FILE;
+        piece->fd = tar->member_fd;
+        piece->size = tar->member_size;
+        tar->pad = (TAR_BLOCK_SIZE - piece->size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        tar->member_fd = -1;
+        tar->body_ready = 0;
+        return 0;
+    }
+
+    tar->len = 0;
+    if (buf_zeros(tar, tar->pad) < 0) {
+        return -1;
+    }
+    tar->pad = 0;
+
+    while (tar->len < TAR_BATCH_SIZE) {
+        if (tar->member_fd < 0 && tar->member_parts == NULL && !find_member(tar)) {
+            // Two zero blocks mark the end of the archive
+            if (!tar->trailer_done) {
+                if (buf_zeros(tar, 2 * TAR_BLOCK_SIZE) < 0) {
+                    return -1;
+                }
+                tar->trailer_done = 1;
+            }
+            break;
+        }
+        if (add_member_header(tar) < 0) {
+            return -1;
+        }
+        if (tar->member_size > 0) {
+            tar->body_ready = 1;
+            break;
+        }
+        // Empty members have no body, keep collecting headers
+        close_member_content(tar);
+        if (tar->member_fd >= 0) {
+            close(tar->member_fd);
+        }
+        tar->member_fd = -1;
+    }
+
+    if (tar->len == 0) {
+        piece->kind = TAR_PIECE_END;
+        return 0;
+    }
+    piece->kind = TAR_PIECE_BYTES;
+    piece->data = tar->buf;
+    piece->len = tar->len;
+    return 0;
+}
+
+// Function to report how many members were found so far
+uint64_t tar_stream_members(const struct tar_stream *tar) {
+    return tar->members;
+}
+
+// Function to release a tar stream
+void tar_stream_close(struct tar_stream *tar) {
+    if (tar == NULL) {
+        return;
+    }
+    while (tar->depth > 0) {
+        closedir(tar->dirs[--tar->depth].dir);
+    }
+    if (tar->member_fd >= 0) {
+        close(tar->member_fd);
+    }
+    close_member_content(tar);
+    free(tar->dirs);
+    free(tar->buf);
+    free(tar);
+}
+
+// Function to send a whole archive on a blocking socket as DATA frames followed by END
+int dfs_send_tar(int sock, uint32_t request_id, struct tar_stream *tar) {
+    static const char zeros[DFS_CHUNK_SIZE];
+    struct tar_piece piece;
+
+    while (1) {
+        if (tar_stream_next(tar, &piece) < 0) {
+            return -1;
+        }
+        if (piece.kind == TAR_PIECE_END) {
+            return dfs_send_frame(sock, DFS_OP_END, request_id, NULL, 0);
+        }
+        if (piece.kind == TAR_PIECE_BYTES) {
+            if (dfs_send_frame(sock, DFS_OP_DATA, request_id, piece.data, piece.len) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        uint64_t sent = 0;
+        int rc = -1;
+        if (dfs_send_hdr(sock, DFS_OP_DATA, request_id, piece.size) == 0) {
+            rc = dfs_send_range(sock, piece.fd, 0, piece.size, &sent);
+        }
+        close(piece.fd);
+        if (rc == -2) {
+            // The header already promised piece.size bytes, keep the archive aligned
+            printf("File shrank while it was archived, padding it with zeros\n");
+            while (sent < piece.size) {
+                size_t chunk = piece.size - sent < sizeof(zeros) ? (size_t)(piece.size - sent) : sizeof(zeros);
+                if (dfs_send_all(sock, zeros, chunk) < 0) {
+                    return -1;
+                }
+                sent += chunk;
+            }
+        } else if (rc < 0) {
+            return -1;
+        }
+    }
+}
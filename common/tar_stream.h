@@ -0,0 +1,68 @@
+#ifndef TAR_STREAM_H
+#define TAR_STREAM_H
+
+#include <stdint.h>
+
+// Builds a tar archive (ustar, with pax records for long names and large sizes) of the regular
+// files below a directory whose names end with a suffix, while it is being sent: nothing is written
+// to disk and the first bytes are ready as soon as the first matching file is found.
+//
+// The archive comes out as a sequence of pieces. Header blocks and padding are produced in memory,
+// file contents are handed out as open descriptors so the sender can move them with sendfile().
+// Members are named by their path relative to the directory. Symbolic links are not followed.
+
+#define TAR_BLOCK_SIZE 512
+
+enum tar_piece_kind {
+    TAR_PIECE_BYTES,  // data/len: header blocks, padding or the end-of-archive marker
+    TAR_PIECE_FILE,   // fd/size: content of one member or a part of it, exactly size bytes from offset 0
+    TAR_PIECE_END     // the archive is complete
+};
+
+struct tar_piece {
+    enum tar_piece_kind kind;
+    const char *data;  // valid until the next call of tar_stream_next()
+    size_t len;
+    int fd;            // owned by the caller from now on, who must close it
+    uint64_t size;
+};
+
+struct tar_stream;
+
+// Source of member contents that are kept in another form than the file's own bytes (chunked
+// files, see server/chunk_store.h). open() is given the open member file and reads what it needs
+// from it: it returns NULL for a file archived as it is, otherwise a handle and the size of the real
+// content. next() then hands out the content as parts, each the first size bytes of fd (owned by the
+// archive from then on); it returns 1 for a part, 0 after the last one and -1 on failure. close()
+// releases the handle.
+struct tar_content {
+    void *(*open)(void *arg, int fd, uint64_t *size);
+    int (*next)(void *handle, int *fd, uint64_t *size);
+    void (*close)(void *handle);
+    void *arg;
+};
+
+// Start an archive of the files below root ending with one of the space separated suffixes (".c",
+// ".pdf .md", ...). Returns NULL if root can not be opened. The first member is looked up right away,
+// see tar_stream_members().
+struct tar_stream *tar_stream_open(const char *root, const char *suffixes);
+
+// Read member contents through content, before the first call of tar_stream_next(). The content of
+// one member may then come as several TAR_PIECE_FILE pieces.
+void tar_stream_set_content(struct tar_stream *tar, const struct tar_content *content);
+
+// Get the next piece of the archive, return -1 on failure (out of memory)
+int tar_stream_next(struct tar_stream *tar, struct tar_piece *piece);
+
+// Number of members found so far; 0 right after tar_stream_open() means the archive is empty
+uint64_t tar_stream_members(const struct tar_stream *tar);
+
+// Release the stream, also when it was not read to the end
+void tar_stream_close(struct tar_stream *tar);
+
+// Send the whole archive on a blocking socket as DATA frames followed by END. File contents go out
+// with sendfile(); a file that shrinks while it is archived is padded with zeros to the size in its
+// header. Returns 0 on success and -1 if the connection is no longer usable.
+int dfs_send_tar(int sock, uint32_t request_id, struct tar_stream *tar);
+
+#endif
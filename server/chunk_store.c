@@ -0,0 +1,1186 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../common/dfs_proto.h"
+#include "chunk_store.h"
+
+// Known chunks remembered at most, the cache starts over when it is full
+#define CHUNK_CACHE_MAX (256 * 1024)
+
+// A collection starts this long after files were removed, and at most once per interval (milliseconds)
+#define CHUNK_COLLECT_DELAY_MS 1000
+#define CHUNK_COLLECT_INTERVAL_MS (30 * 1000)
+
+// Temporary chunk files older than this were left by a server that stopped while writing them (s)
+#define CHUNK_TEMP_AGE (60 * 60)
+
+// FastCDC with normalized chunking: up to CHUNK_AVG a cut needs more zero bits of the gear hash
+// than after it, which keeps chunk sizes close to the average. The mask bits are the top ones,
+// they depend on the last 64 bytes.
+#define CHUNK_AVG_BITS 15
+#define MASK_SMALL (((1ULL << (CHUNK_AVG_BITS + 2)) - 1) << (64 - CHUNK_AVG_BITS - 2))
+#define MASK_LARGE (((1ULL << (CHUNK_AVG_BITS - 2)) - 1) << (64 - CHUNK_AVG_BITS + 2))
+
+// A manifest, in native byte order: the header, then one entry per chunk in file order
+#define MANIFEST_MAGIC "DFSMAN1"
+
+struct manifest_header {
+    char magic[8];           // MANIFEST_MAGIC with its NUL, which no text file starts with
+    uint64_t size;           // bytes of the file, the sum of the chunk lengths
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct manifest_entry {
+    unsigned char digest[SHA256_SIZE];
+    uint32_t len;
+};
+
+// Set of digests with a count each, open addressing; a slot is free while its count is 0
+struct digest_set {
+    unsigned char (*keys)[SHA256_SIZE];
+    uint32_t *counts;
+    size_t cap;
+    size_t count;
+};
+
+struct chunk_store {
+    char root[PATH_MAX];           // tree whose files are the manifests
+    char dir[PATH_MAX];            // chunks, in 256 subdirectories named by the first digest byte
+    int enabled;
+    int present;                   // chunks were stored, in this run or before
+    pthread_mutex_t lock;          // everything below
+    struct digest_set pins;        // chunks used by uploads and downloads in progress
+    struct digest_set cache;       // chunks known to be stored
+    struct digest_set marked;      // chunks the collection in progress keeps
+    int collecting;
+    int mark_failed;               // a chunk could not be marked, nothing may be collected
+    int released;                  // files were removed since the last collection
+    int stop;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int has_thread;
+    unsigned long temp_counter;
+    struct chunk_store_stats stats;
+};
+
+struct chunk_writer {
+    struct chunk_store *store;
+    unsigned char *buf;            // bytes of the chunk being cut, at most CHUNK_MAX
+    size_t len;
+    size_t scanned;                // bytes of buf the gear hash went over already
+    uint64_t fp;                   // gear hash at that point
+    struct manifest_entry *entries;
+    uint32_t count;
+    uint32_t cap;
+    uint64_t size;
+};
+
+struct chunk_reader {
+    struct chunk_store *store;
+    struct manifest_entry *entries;
+    uint32_t count;
+    uint32_t next;
+    uint64_t size;
+};
+
+struct chunk_content {
+    int fd;                        // the file itself when it is no manifest
+    struct chunk_reader *reader;   // its manifest otherwise
+    uint64_t *starts;              // offset of every chunk in the content, and the size at the end
+    uint32_t open_index;           // chunk open as open_fd
+    int open_fd;
+};
+
+// Random value of every byte for the gear hash, the same in every run
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// helper to fill the gear table from a splitmix64 sequence
+static void gear_init(void) {
+    uint64_t x = 0x6466732d63646321ULL;
+    for (int i = 0; i < 256; i++) {
+        x += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// helper to find the home slot of a digest, its first bytes are already uniformly spread
+static size_t home_slot(const struct digest_set *set, const unsigned char *digest) {
+    uint64_t hash;
+    memcpy(&hash, digest, sizeof(hash));
+    return hash & (set->cap - 1);
+}
+
+// helper to find the slot of a digest in a set, -1 if it is not there
+static long set_find(const struct digest_set *set, const unsigned char *digest) {
+    if (set->cap == 0) {
+        return -1;
+    }
+    for (size_t i = home_slot(set, digest); set->counts[i] != 0; i = (i + 1) & (set->cap - 1)) {
+        if (memcmp(set->keys[i], digest, SHA256_SIZE) == 0) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+// helper to put a digest in its slot, it must not be in the set yet
+static void set_place(struct digest_set *set, const unsigned char *digest, uint32_t count) {
+    size_t i = home_slot(set, digest);
+    while (set->counts[i] != 0) {
+        i = (i + 1) & (set->cap - 1);
+    }
+    memcpy(set->keys[i], digest, SHA256_SIZE);
+    set->counts[i] = count;
+    set->count++;
+}
+
+// helper to add one to the count of a digest, growing the set at half load. Returns -1 if memory ran out
+static int set_add(struct digest_set *set, const unsigned char *digest) {
+    long found = set_find(set, digest);
+    if (found >= 0) {
+        set->counts[found]++;
+        return 0;
+    }
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 1024;
+        struct digest_set grown = {malloc(cap * SHA256_SIZE), calloc(cap, sizeof(uint32_t)), cap, 0};
+        if (grown.keys == NULL || grown.counts == NULL) {
+            free(grown.keys);
+            free(grown.counts);
+            return -1;
+        }
+        for (size_t i = 0; i < set->cap; i++) {
+            if (set->counts[i] != 0) {
+                set_place(&grown, set->keys[i], set->counts[i]);
+            }
+        }
+        free(set->keys);
+        free(set->counts);
+        *set = grown;
+    }
+    set_place(set, digest, 1);
+    return 0;
+}
+
+// helper to take one off the count of a digest, its slot is freed at 0 by moving later entries back
+static void set_remove(struct digest_set *set, const unsigned char *digest) {
+    long found = set_find(set, digest);
+    if (found < 0 || --set->counts[found] > 0) {
+        return;
+    }
+    size_t hole = (size_t)found;
+    size_t mask = set->cap - 1;
+    set->count--;
+    for (size_t i = (hole + 1) & mask; set->counts[i] != 0; i = (i + 1) & mask) {
+        // An entry whose home lies cyclically after the hole, up to its slot, must stay
+        size_t home = home_slot(set, set->keys[i]);
+        int stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (stays) {
+            continue;
+        }
+        memcpy(set->keys[hole], set->keys[i], SHA256_SIZE);
+        set->counts[hole] = set->counts[i];
+        hole = i;
+    }
+    set->counts[hole] = 0;
+}
+
+// helper to empty a set and release its memory
+static void set_clear(struct digest_set *set) {
+    free(set->keys);
+    free(set->counts);
+    memset(set, 0, sizeof(*set));
+}
+
+// helper to build the path of a chunk
+static void chunk_path(const struct chunk_store *store, const unsigned char *digest, char *path, size_t size) {
+    char hex[SHA256_HEX_SIZE + 1];
+    sha256_hex(digest, hex);
+    snprintf(path, size, "%s/%.2s/%s", store->dir, hex, hex);
+}
+
+// helper to keep a chunk from being collected, a collection in progress keeps it too. Must hold the lock.
+static int pin_locked(struct chunk_store *store, const unsigned char *digest) {
+    if (store->collecting && set_add(&store->marked, digest) < 0) {
+        store->mark_failed = 1;
+    }
+    return set_add(&store->pins, digest);
+}
+
+// helper to release the chunks of a list of entries
+static void unpin_entries(struct chunk_store *store, const struct manifest_entry *entries, uint32_t count) {
+    pthread_mutex_lock(&store->lock);
+    for (uint32_t i = 0; i < count; i++) {
+        set_remove(&store->pins, entries[i].digest);
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+// helper to write a whole buffer to a descriptor
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// helper to store a new chunk: it is written to a temporary file and renamed to its digest when complete
+static int write_chunk(struct chunk_store *store, const char *path, const void *data, size_t len) {
+    char temp[PATH_MAX + 64];
+    snprintf(temp, sizeof(temp), "%s/tmp.%d.%lu", store->dir, (int)getpid(), __sync_fetch_and_add(&store->temp_counter, 1));
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Chunk creation failed");
+        return -1;
+    }
+    int failed = write_all(fd, data, len) < 0;
+    if (close(fd) != 0) {
+        failed = 1;
+    }
+    if (!failed && rename(temp, path) != 0) {
+        failed = errno != ENOENT;
+        if (!failed) {
+            // Its subdirectory was removed behind our back
+            char sub[PATH_MAX];
+            snprintf(sub, sizeof(sub), "%.*s", (int)(strrchr(path, '/') - path), path);
+            mkdir(sub, 0755);
+            failed = rename(temp, path) != 0;
+        }
+    }
+    if (failed) {
+        perror("Chunk write failed");
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+// helper to store one chunk of an upload unless it is stored already, and add it to the manifest
+static int add_chunk(struct chunk_writer *writer, const unsigned char *data, size_t len) {
+    struct chunk_store *store = writer->store;
+    if (writer->count == writer->cap) {
+        uint32_t cap = writer->cap ? writer->cap * 2 : 64;
+        struct manifest_entry *grown = realloc(writer->entries, cap * sizeof(*grown));
+        if (grown == NULL) {
+            return -1;
+        }
+        writer->entries = grown;
+        writer->cap = cap;
+    }
+    struct manifest_entry *entry = &writer->entries[writer->count];
+    sha256(data, len, entry->digest);
+    entry->len = (uint32_t)len;
+
+    // The chunk is pinned before it is looked for, so a collection can not remove it in between
+    pthread_mutex_lock(&store->lock);
+    int pinned = pin_locked(store, entry->digest) == 0;
+    int known = set_find(&store->cache, entry->digest) >= 0;
+    if (known) {
+        store->stats.cache_hits++;
+    } else {
+        store->stats.cache_misses++;
+    }
+    pthread_mutex_unlock(&store->lock);
+    if (!pinned) {
+        return -1;
+    }
+    writer->count++;
+
+    int stored = known;
+    if (!known) {
+        char path[PATH_MAX + SHA256_HEX_SIZE + 8];
+        chunk_path(store, entry->digest, path, sizeof(path));
+        struct stat st;
+        stored = stat(path, &st) == 0 && (uint64_t)st.st_size == len;
+        if (!stored && write_chunk(store, path, data, len) < 0) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&store->lock);
+    if (stored) {
+        store->stats.chunks_dup++;
+    } else {
+        store->stats.chunks_new++;
+        store->stats.bytes_written += len;
+    }
+    if (!known) {
+        if (store->cache.count >= CHUNK_CACHE_MAX) {
+            set_clear(&store->cache);
+        }
+        set_add(&store->cache, entry->digest);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
+
+// helper to find where the chunk at the start of the buffer ends. Returns 0 if more bytes are
+// needed to tell, unless final is set: the rest of the upload is in the buffer then.
+static size_t find_cut(struct chunk_writer *writer, int final) {
+    size_t len = writer->len;
+    if (len <= CHUNK_MIN) {
+        return final ? len : 0;
+    }
+    // The first CHUNK_MIN bytes can not end a chunk, the hash starts after them
+    size_t i = writer->scanned > CHUNK_MIN ? writer->scanned : CHUNK_MIN;
+    uint64_t fp = writer->fp;
+    size_t normal = len < CHUNK_AVG ? len : CHUNK_AVG;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[writer->buf[i]];
+        if (!(fp & MASK_SMALL)) {
+            return i + 1;
+        }
+    }
+    size_t limit = len < CHUNK_MAX ? len : CHUNK_MAX;
+    for (; i < limit; i++) {
+        fp = (fp << 1) + gear[writer->buf[i]];
+        if (!(fp & MASK_LARGE)) {
+            return i + 1;
+        }
+    }
+    if (limit == CHUNK_MAX || final) {
+        return limit;
+    }
+    writer->scanned = i;
+    writer->fp = fp;
+    return 0;
+}
+
+// helper to store the chunk at the start of the buffer and keep the bytes after it
+static int cut_chunk(struct chunk_writer *writer, size_t cut) {
+    if (add_chunk(writer, writer->buf, cut) < 0) {
+        return -1;
+    }
+    memmove(writer->buf, writer->buf + cut, writer->len - cut);
+    writer->len -= cut;
+    writer->scanned = 0;
+    writer->fp = 0;
+    return 0;
+}
+
+// Sink of the upload stream: the bytes are cut into chunks as they arrive
+static int chunk_writer_add(void *ctx, const void *data, size_t len) {
+    struct chunk_writer *writer = ctx;
+    const unsigned char *p = data;
+    while (len > 0) {
+        size_t take = CHUNK_MAX - writer->len < len ? CHUNK_MAX - writer->len : len;
+        memcpy(writer->buf + writer->len, p, take);
+        writer->len += take;
+        writer->size += take;
+        p += take;
+        len -= take;
+        size_t cut;
+        while ((cut = find_cut(writer, 0)) > 0) {
+            if (cut_chunk(writer, cut) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// helper to store the last chunks of an upload and write its manifest to fd
+static int chunk_writer_finish(struct chunk_writer *writer, int fd) {
+    while (writer->len > 0) {
+        if (cut_chunk(writer, find_cut(writer, 1)) < 0) {
+            return -1;
+        }
+    }
+    struct manifest_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.size = writer->size;
+    header.count = writer->count;
+    if (write_all(fd, &header, sizeof(header)) < 0 ||
+        write_all(fd, writer->entries, (size_t)writer->count * sizeof(*writer->entries)) < 0) {
+        perror("Manifest write failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to release the chunks an upload kept
+void chunk_writer_free(struct chunk_writer *writer) {
+    if (writer == NULL) {
+        return;
+    }
+    unpin_entries(writer->store, writer->entries, writer->count);
+    free(writer->entries);
+    free(writer->buf);
+    free(writer);
+}
+
+// Sink of an upload whose bytes are hashed on their way to the file or the chunk writer
+struct hashing_sink {
+    struct sha256 *hash;
+    dfs_sink_fn sink;
+    void *ctx;
+};
+
+// helper sink writing an upload as it is
+static int file_sink(void *ctx, const void *data, size_t len) {
+    if (write_all(*(int *)ctx, data, len) < 0) {
+        perror("File write failed");
+        return -1;
+    }
+    return 0;
+}
+
+// helper sink adding the bytes to the hash before passing them on
+static int hash_sink(void *ctx, const void *data, size_t len) {
+    struct hashing_sink *hashing = ctx;
+    sha256_update(hashing->hash, data, len);
+    return hashing->sink(hashing->ctx, data, len);
+}
+
+// helper to receive the content of an upload into a sink: the stream is applied first when it is
+// a delta, and the content is hashed on its way when asked to
+static int recv_content(int sock, dfs_sink_fn sink, void *ctx, struct sha256 *hash, struct dfs_delta_apply *delta) {
+    struct hashing_sink hashing = {hash, sink, ctx};
+    if (hash != NULL) {
+        sink = hash_sink;
+        ctx = &hashing;
+    }
+    if (delta == NULL) {
+        return dfs_recv_stream_to(sock, sink, ctx, NULL, NULL, 0);
+    }
+    dfs_delta_apply_output(delta, sink, ctx);
+    int received = dfs_recv_stream_to(sock, dfs_delta_apply_add, delta, NULL, NULL, 0);
+    if (received == 0 && dfs_delta_apply_finish(delta, NULL) < 0) {
+        printf("Delta ended inside an instruction\n");
+        received = -2;
+    }
+    return received;
+}
+
+// Function to receive an upload, as chunks when the store is enabled
+int chunk_store_recv_file(struct chunk_store *store, int sock, int fd, struct sha256 *hash, struct dfs_delta_apply *delta,
+                          struct chunk_writer **writer) {
+    *writer = NULL;
+    if (!chunk_store_enabled(store)) {
+        return recv_content(sock, file_sink, &fd, hash, delta);
+    }
+    struct chunk_writer *new_writer = calloc(1, sizeof(*new_writer));
+    if (new_writer == NULL || (new_writer->buf = malloc(CHUNK_MAX)) == NULL) {
+        perror("Chunk writer allocation failed");
+        free(new_writer);
+        dfs_recv_stream(sock, -1, NULL, NULL, 0);
+        return -2;
+    }
+    new_writer->store = store;
+    *writer = new_writer;
+
+    int received = recv_content(sock, chunk_writer_add, new_writer, hash, delta);
+    if (received == 0 && chunk_writer_finish(new_writer, fd) < 0) {
+        received = -2;
+    }
+    if (received == 0) {
+        pthread_mutex_lock(&store->lock);
+        store->stats.files++;
+        store->stats.bytes_in += new_writer->size;
+        pthread_mutex_unlock(&store->lock);
+    }
+    return received;
+}
+
+// helper to read the manifest in fd. Returns 0 if fd holds no manifest, 1 with the entries in
+// *entries (malloc()ed) and -1 if it is damaged or can not be read.
+static int read_manifest(int fd, struct manifest_header *header, struct manifest_entry **entries) {
+    *entries = NULL;
+    if (pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header) ||
+        memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0) {
+        return 0;
+    }
+    struct stat st;
+    size_t entries_len = (size_t)header->count * sizeof(**entries);
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size != sizeof(*header) + (uint64_t)entries_len) {
+        return -1;
+    }
+    *entries = malloc(entries_len ? entries_len : 1);
+    if (*entries == NULL || pread(fd, *entries, entries_len, sizeof(*header)) != (ssize_t)entries_len) {
+        free(*entries);
+        *entries = NULL;
+        return -1;
+    }
+    // The chunks must add up to the size of the file
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < header->count; i++) {
+        total += (*entries)[i].len;
+    }
+    if (total != header->size) {
+        free(*entries);
+        *entries = NULL;
+        return -1;
+    }
+    return 1;
+}
+
+// helper to start reading the chunks of the manifest in fd, they stay pinned until the reader is
+// closed. Returns 0 if fd holds no manifest, 1 with *reader set and -1 if the manifest is damaged.
+static int reader_open(struct chunk_store *store, int fd, struct chunk_reader **reader) {
+    struct manifest_header header;
+    struct manifest_entry *entries;
+    *reader = NULL;
+    int found = read_manifest(fd, &header, &entries);
+    if (found < 0) {
+        printf("Damaged chunk manifest\n");
+    }
+    if (found <= 0) {
+        return found;
+    }
+    struct chunk_reader *new_reader = calloc(1, sizeof(*new_reader));
+    if (new_reader == NULL) {
+        free(entries);
+        return -1;
+    }
+    new_reader->store = store;
+    new_reader->entries = entries;
+    new_reader->size = header.size;
+
+    pthread_mutex_lock(&store->lock);
+    while (new_reader->count < header.count && pin_locked(store, entries[new_reader->count].digest) == 0) {
+        new_reader->count++;
+    }
+    pthread_mutex_unlock(&store->lock);
+    *reader = new_reader;
+    if (new_reader->count < header.count) {
+        return -1;
+    }
+    return 1;
+}
+
+// helper to open the next chunk of a manifest. Returns 1 with its descriptor and length, 0 after
+// the last chunk and -1 if the chunk is missing.
+static int reader_next(struct chunk_reader *reader, int *fd, uint64_t *len) {
+    if (reader->next == reader->count) {
+        return 0;
+    }
+    struct manifest_entry *entry = &reader->entries[reader->next++];
+    char path[PATH_MAX + SHA256_HEX_SIZE + 8];
+    chunk_path(reader->store, entry->digest, path, sizeof(path));
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0) {
+        printf("Chunk %s can not be read: %s\n", path, strerror(errno));
+        return -1;
+    }
+    *len = entry->len;
+    return 1;
+}
+
+// helper to release a reader and the chunks it kept
+static void reader_close(struct chunk_reader *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    unpin_entries(reader->store, reader->entries, reader->count);
+    free(reader->entries);
+    free(reader);
+}
+
+// Function to keep the chunks of a stored file while it is linked to another name
+int chunk_store_hold_file(struct chunk_store *store, int fd, struct chunk_writer **writer) {
+    struct chunk_reader *reader = NULL;
+    *writer = NULL;
+    int found = store != NULL ? reader_open(store, fd, &reader) : 0;
+    if (found == 0) {
+        return 0;
+    }
+    struct chunk_writer *new_writer = found > 0 ? calloc(1, sizeof(*new_writer)) : NULL;
+    if (new_writer == NULL) {
+        reader_close(reader);
+        return -1;
+    }
+
+    // The chunks are pinned now, each one must still be stored
+    for (uint32_t i = 0; i < reader->count; i++) {
+        pthread_mutex_lock(&store->lock);
+        int known = set_find(&store->cache, reader->entries[i].digest) >= 0;
+        pthread_mutex_unlock(&store->lock);
+        char path[PATH_MAX + SHA256_HEX_SIZE + 8];
+        struct stat st;
+        chunk_path(store, reader->entries[i].digest, path, sizeof(path));
+        if (!known && (stat(path, &st) < 0 || (uint64_t)st.st_size != reader->entries[i].len)) {
+            printf("Chunk %s is missing\n", path);
+            free(new_writer);
+            reader_close(reader);
+            return -1;
+        }
+    }
+
+    // The writer takes over the pins of the reader
+    new_writer->store = store;
+    new_writer->entries = reader->entries;
+    new_writer->count = reader->count;
+    new_writer->size = reader->size;
+    free(reader);
+    *writer = new_writer;
+    return 0;
+}
+
+// Function to tell the size of the content of a stored file
+int chunk_store_file_size(struct chunk_store *store, int fd, uint64_t *size) {
+    struct manifest_header header;
+    struct manifest_entry *entries;
+    int found = store != NULL ? read_manifest(fd, &header, &entries) : 0;
+    if (found < 0) {
+        return -1;
+    }
+    if (found > 0) {
+        free(entries);
+        *size = header.size;
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    *size = (uint64_t)st.st_size;
+    return 0;
+}
+
+// Function to send a part of a file, reassembling a manifest from its chunks
+int chunk_store_send_file(struct chunk_store *store, int sock, uint32_t request_id, int fd, uint64_t offset, uint64_t len) {
+    struct chunk_reader *reader = NULL;
+    int found = store != NULL ? reader_open(store, fd, &reader) : 0;
+    if (found == 0) {
+        return dfs_send_file_part(sock, request_id, fd, offset, len);
+    }
+
+    // Chunks before the range are skipped without opening them, skip is left inside the first one sent
+    uint64_t skip = offset;
+    while (found > 0 && reader->next < reader->count && skip >= reader->entries[reader->next].len) {
+        skip -= reader->entries[reader->next++].len;
+    }
+
+    // Only the first chunk is opened before the reply starts, a later one that is missing drops the connection
+    int part_fd = -1;
+    uint64_t part_len = 0;
+    if (found < 0 || offset > reader->size || len > reader->size - offset ||
+        (len > 0 && reader_next(reader, &part_fd, &part_len) <= 0)) {
+        reader_close(reader);
+        return dfs_send_text(sock, DFS_OP_ERROR, request_id, "ERROR: Error reading file!") < 0 ? -1 : -2;
+    }
+
+    // The frame length is fixed up front, from here on the payload must be delivered completely
+    int result = dfs_send_hdr(sock, DFS_OP_DATA, request_id, len);
+    uint64_t left = len;
+    while (result == 0 && part_fd >= 0) {
+        uint64_t want = part_len - skip < left ? part_len - skip : left;
+        uint64_t sent;
+        if (dfs_send_range(sock, part_fd, (off_t)skip, want, &sent) != 0) {
+            result = -1;
+        }
+        close(part_fd);
+        part_fd = -1;
+        skip = 0;
+        left -= want;
+        if (result == 0 && left > 0 && reader_next(reader, &part_fd, &part_len) <= 0) {
+            result = -1;
+        }
+    }
+    reader_close(reader);
+    if (result < 0) {
+        return -1;
+    }
+    return dfs_send_frame(sock, DFS_OP_END, request_id, NULL, 0);
+}
+
+// Function to open the content of a stored file for reading at any offset
+struct chunk_content *chunk_store_content_open(struct chunk_store *store, int fd, uint64_t *size) {
+    struct chunk_content *content = calloc(1, sizeof(*content));
+    if (content == NULL) {
+        return NULL;
+    }
+    content->fd = fd;
+    content->open_fd = -1;
+    int found = store != NULL ? reader_open(store, fd, &content->reader) : 0;
+    if (found < 0) {
+        chunk_store_content_close(content);
+        return NULL;
+    }
+    if (found == 0) {
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            free(content);
+            return NULL;
+        }
+        *size = (uint64_t)st.st_size;
+        return content;
+    }
+
+    struct chunk_reader *reader = content->reader;
+    content->starts = malloc(((size_t)reader->count + 1) * sizeof(*content->starts));
+    if (content->starts == NULL) {
+        chunk_store_content_close(content);
+        return NULL;
+    }
+    content->starts[0] = 0;
+    for (uint32_t i = 0; i < reader->count; i++) {
+        content->starts[i + 1] = content->starts[i] + reader->entries[i].len;
+    }
+    *size = reader->size;
+    return content;
+}
+
+// Function to read a part of the content of a stored file
+int chunk_store_content_read(void *ctx, void *buf, size_t len, uint64_t offset) {
+    struct chunk_content *content = ctx;
+    char *out = buf;
+    while (len > 0) {
+        int fd = content->fd;
+        uint64_t in_fd = offset;
+        size_t want = len;
+        if (content->reader != NULL) {
+            // Find the chunk holding offset, the one read last is usually it or the one before it
+            struct chunk_reader *reader = content->reader;
+            if (offset >= reader->size) {
+                return -1;
+            }
+            uint32_t lo = 0, hi = reader->count - 1;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo + 1) / 2;
+                if (content->starts[mid] <= offset) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            if (content->open_fd < 0 || content->open_index != lo) {
+                if (content->open_fd >= 0) {
+                    close(content->open_fd);
+                }
+                char path[PATH_MAX + SHA256_HEX_SIZE + 8];
+                chunk_path(content->reader->store, reader->entries[lo].digest, path, sizeof(path));
+                content->open_fd = open(path, O_RDONLY | O_CLOEXEC);
+                content->open_index = lo;
+                if (content->open_fd < 0) {
+                    printf("Chunk %s can not be read: %s\n", path, strerror(errno));
+                    return -1;
+                }
+            }
+            fd = content->open_fd;
+            in_fd = offset - content->starts[lo];
+            uint64_t left = content->starts[lo + 1] - offset;
+            want = len < left ? len : (size_t)left;
+        }
+        ssize_t n = pread(fd, out, want, (off_t)in_fd);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        out += n;
+        offset += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Function to close the content of a stored file, its chunks may be collected again
+void chunk_store_content_close(struct chunk_content *content) {
+    if (content == NULL) {
+        return;
+    }
+    if (content->open_fd >= 0) {
+        close(content->open_fd);
+    }
+    reader_close(content->reader);
+    free(content->starts);
+    free(content);
+}
+
+// Content source callbacks for tar_stream: a damaged manifest is archived as it is
+static void *tar_content_open(void *arg, int fd, uint64_t *size) {
+    struct chunk_reader *reader;
+    if (reader_open(arg, fd, &reader) <= 0) {
+        reader_close(reader);
+        return NULL;
+    }
+    *size = reader->size;
+    return reader;
+}
+
+static int tar_content_next(void *handle, int *fd, uint64_t *size) {
+    return reader_next(handle, fd, size);
+}
+
+static void tar_content_close(void *handle) {
+    reader_close(handle);
+}
+
+// Function to get the content source that archives manifests as their files
+void chunk_store_tar_content(struct chunk_store *store, struct tar_content *content) {
+    memset(content, 0, sizeof(*content));
+    if (store != NULL) {
+        content->open = tar_content_open;
+        content->next = tar_content_next;
+        content->close = tar_content_close;
+        content->arg = store;
+    }
+}
+
+// helper to mark the chunks of the manifest in fd, as many entries as the file holds: one being
+// written may not be complete yet. Returns -1 if memory ran out.
+static int mark_manifest(struct chunk_store *store, int fd) {
+    struct manifest_header header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) != 0 || fstat(fd, &st) < 0) {
+        return 0;
+    }
+    uint64_t present = ((uint64_t)st.st_size - sizeof(header)) / sizeof(struct manifest_entry);
+    uint64_t count = present < header.count ? present : header.count;
+
+    struct manifest_entry batch[256];
+    for (uint64_t done = 0; done < count;) {
+        size_t want = count - done < 256 ? (size_t)(count - done) : 256;
+        ssize_t n = pread(fd, batch, want * sizeof(*batch), sizeof(header) + done * sizeof(*batch));
+        if (n <= 0) {
+            break;
+        }
+        size_t got = (size_t)n / sizeof(*batch);
+        pthread_mutex_lock(&store->lock);
+        for (size_t i = 0; i < got; i++) {
+            if (set_add(&store->marked, batch[i].digest) < 0) {
+                pthread_mutex_unlock(&store->lock);
+                return -1;
+            }
+        }
+        pthread_mutex_unlock(&store->lock);
+        done += got;
+    }
+    return 0;
+}
+
+// helper to mark the chunks of every manifest below a directory. path is a PATH_MAX buffer holding
+// its path of length len. Returns -1 if a part of the tree could not be read.
+static int mark_tree(struct chunk_store *store, char *path, size_t len) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        // A directory removed meanwhile holds no manifests
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+    }
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_REG) {
+            int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                result = errno == ENOENT ? 0 : -1;
+                continue;
+            }
+            result = mark_manifest(store, fd);
+            close(fd);
+        } else if (type == DT_DIR) {
+            size_t name_len = strlen(entry->d_name);
+            if (len + 1 + name_len >= PATH_MAX) {
+                result = -1;
+                break;
+            }
+            path[len] = '/';
+            memcpy(path + len + 1, entry->d_name, name_len + 1);
+            result = mark_tree(store, path, len + 1 + name_len);
+            path[len] = '\0';
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+// helper to turn a hex name into a digest, returns -1 if it is not one
+static int parse_digest(const char *name, unsigned char *digest) {
+    if (strlen(name) != SHA256_HEX_SIZE) {
+        return -1;
+    }
+    return sha256_from_hex(name, digest);
+}
+
+// helper to remove the chunks of one subdirectory that no manifest uses
+static void sweep_dir(struct chunk_store *store, const char *sub, uint64_t *removed, uint64_t *freed, uint64_t *kept) {
+    DIR *dir = opendir(sub);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    unsigned char digest[SHA256_SIZE];
+    while ((entry = readdir(dir)) != NULL) {
+        if (parse_digest(entry->d_name, digest) < 0) {
+            continue;
+        }
+        struct stat st;
+        pthread_mutex_lock(&store->lock);
+        if (set_find(&store->marked, digest) >= 0 || set_find(&store->pins, digest) >= 0 || store->mark_failed) {
+            (*kept)++;
+        } else if (fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 && unlinkat(dirfd(dir), entry->d_name, 0) == 0) {
+            set_remove(&store->cache, digest);
+            (*removed)++;
+            *freed += (uint64_t)st.st_size;
+        }
+        pthread_mutex_unlock(&store->lock);
+    }
+    closedir(dir);
+}
+
+// helper to remove the temporary files of chunks whose writer is gone
+static void sweep_temps(struct chunk_store *store) {
+    DIR *dir = opendir(store->dir);
+    if (dir == NULL) {
+        return;
+    }
+    time_t now = time(NULL);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strncmp(entry->d_name, "tmp.", 4) == 0 && fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 &&
+            now - st.st_mtime > CHUNK_TEMP_AGE) {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+// helper to remove the chunks no manifest and no transfer in progress uses: every manifest is read
+// to mark the chunks it lists, then the unmarked ones are removed. Chunks pinned while this runs are
+// marked too, so an upload that finishes behind the walk keeps its chunks.
+static void collect(struct chunk_store *store) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&store->lock);
+    store->collecting = 1;
+    store->mark_failed = 0;
+    for (size_t i = 0; i < store->pins.cap; i++) {
+        if (store->pins.counts[i] != 0 && set_add(&store->marked, store->pins.keys[i]) < 0) {
+            store->mark_failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", store->root);
+    if (mark_tree(store, path, strlen(path)) < 0) {
+        pthread_mutex_lock(&store->lock);
+        store->mark_failed = 1;
+        pthread_mutex_unlock(&store->lock);
+    }
+
+    uint64_t removed = 0, freed = 0, kept = 0;
+    pthread_mutex_lock(&store->lock);
+    int failed = store->mark_failed;
+    pthread_mutex_unlock(&store->lock);
+    if (!failed) {
+        for (int i = 0; i < 256; i++) {
+            char sub[PATH_MAX + 4];
+            snprintf(sub, sizeof(sub), "%s/%02x", store->dir, i);
+            sweep_dir(store, sub, &removed, &freed, &kept);
+        }
+        sweep_temps(store);
+    }
+
+    pthread_mutex_lock(&store->lock);
+    failed = store->mark_failed;
+    store->collecting = 0;
+    set_clear(&store->marked);
+    store->stats.collected += removed;
+    store->stats.bytes_freed += freed;
+    pthread_mutex_unlock(&store->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (failed) {
+        printf("Chunk store %s: the manifests could not all be read, nothing was collected\n", store->dir);
+    } else {
+        printf("Chunk store %s: collected %llu unused chunks (%llu bytes), %llu kept (%.1f ms)\n", store->dir,
+               (unsigned long long)removed, (unsigned long long)freed, (unsigned long long)kept, ms);
+    }
+}
+
+// helper to add milliseconds to a time
+static void add_ms(struct timespec *t, long ms) {
+    t->tv_sec += ms / 1000;
+    t->tv_nsec += (ms % 1000) * 1000000L;
+    if (t->tv_nsec >= 1000000000L) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+// The thread of the store: it collects unused chunks a moment after files were removed
+static void *collect_thread(void *arg) {
+    struct chunk_store *store = arg;
+    struct timespec next_allowed = {0, 0};
+
+    pthread_mutex_lock(&store->lock);
+    while (!store->stop) {
+        if (!store->released) {
+            pthread_cond_wait(&store->wake, &store->lock);
+            continue;
+        }
+        // Wait for more removals to come, and keep collections apart
+        struct timespec due;
+        clock_gettime(CLOCK_MONOTONIC, &due);
+        add_ms(&due, CHUNK_COLLECT_DELAY_MS);
+        if (due.tv_sec < next_allowed.tv_sec || (due.tv_sec == next_allowed.tv_sec && due.tv_nsec < next_allowed.tv_nsec)) {
+            due = next_allowed;
+        }
+        while (!store->stop && pthread_cond_timedwait(&store->wake, &store->lock, &due) != ETIMEDOUT) {
+        }
+        if (store->stop) {
+            break;
+        }
+        store->released = 0;
+        pthread_mutex_unlock(&store->lock);
+
+        collect(store);
+        clock_gettime(CLOCK_MONOTONIC, &next_allowed);
+        add_ms(&next_allowed, CHUNK_COLLECT_INTERVAL_MS);
+        pthread_mutex_lock(&store->lock);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+// Function to open the chunk store of a tree
+struct chunk_store *chunk_store_open(const char *root, const char *dir) {
+    struct chunk_store *store = calloc(1, sizeof(*store));
+    if (store == NULL) {
+        perror("Chunk store allocation failed");
+        return NULL;
+    }
+    snprintf(store->root, sizeof(store->root), "%s", root);
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    const char *env = getenv("DFS_CHUNK_STORE");
+    store->enabled = env != NULL && strcmp(env, "1") == 0;
+    pthread_once(&gear_once, gear_init);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Chunks go into 256 subdirectories so none of them grows too large
+    if (store->enabled) {
+        int made = mkdir(dir, 0755) == 0 || errno == EEXIST;
+        for (int i = 0; i < 256 && made; i++) {
+            char sub[PATH_MAX + 4];
+            snprintf(sub, sizeof(sub), "%s/%02x", dir, i);
+            made = mkdir(sub, 0755) == 0 || errno == EEXIST;
+        }
+        if (!made) {
+            perror("Chunk store creation failed, uploads are stored as they are");
+            store->enabled = 0;
+        } else {
+            printf("Chunk store %s: uploads are stored as chunks\n", dir);
+        }
+    }
+
+    store->present = store->enabled || access(dir, F_OK) == 0;
+    store->has_thread = pthread_create(&store->thread, NULL, collect_thread, store) == 0;
+    if (!store->has_thread) {
+        printf("Chunk store %s: no collection thread, unused chunks are kept\n", dir);
+    }
+    return store;
+}
+
+// Function to stop the store and free it
+void chunk_store_close(struct chunk_store *store) {
+    if (store == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&store->lock);
+    store->stop = 1;
+    pthread_cond_signal(&store->wake);
+    pthread_mutex_unlock(&store->lock);
+    if (store->has_thread) {
+        pthread_join(store->thread, NULL);
+    }
+    set_clear(&store->pins);
+    set_clear(&store->cache);
+    set_clear(&store->marked);
+    pthread_cond_destroy(&store->wake);
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+}
+
+// Function to tell if uploads are stored as chunks
+int chunk_store_enabled(const struct chunk_store *store) {
+    return store != NULL && store->enabled;
+}
+
+// Function to have the chunks of removed files collected
+void chunk_store_released(struct chunk_store *store) {
+    // Without chunks there is nothing to collect
+    if (store == NULL || !store->present) {
+        return;
+    }
+    pthread_mutex_lock(&store->lock);
+    store->released = 1;
+    pthread_cond_signal(&store->wake);
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Function to copy the counters of the store
+void chunk_store_get_stats(struct chunk_store *store, struct chunk_store_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (store == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&store->lock);
+    *stats = store->stats;
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Function to print the counters of the store as one line
+void chunk_store_print_stats(struct chunk_store *store) {
+    struct chunk_store_stats stats;
+    chunk_store_get_stats(store, &stats);
+    // The dedup ratio is the bytes uploaded per byte written, "-" while nothing was written
+    char ratio[32] = "-";
+    if (stats.bytes_written > 0) {
+        snprintf(ratio, sizeof(ratio), "%.2f", (double)stats.bytes_in / (double)stats.bytes_written);
+    }
+    printf("Chunk store: %llu files, %llu bytes in %llu new and %llu duplicate chunks, %llu bytes written, "
+           "dedup ratio %s, cache %llu hits, %llu misses, %llu chunks collected\n",
+           (unsigned long long)stats.files, (unsigned long long)stats.bytes_in, (unsigned long long)stats.chunks_new,
+           (unsigned long long)stats.chunks_dup, (unsigned long long)stats.bytes_written, ratio,
+           (unsigned long long)stats.cache_hits, (unsigned long long)stats.cache_misses,
+           (unsigned long long)stats.collected);
+}
@@ -0,0 +1,106 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stdint.h>
+
+#include "../common/sha256.h"
+#include "../common/dfs_delta.h"
+#include "../common/tar_stream.h"
+
+// Content addressed storage of the uploads of Spdf and Stext, with deduplication.
+//
+// It is used when the environment variable DFS_CHUNK_STORE is set to 1. An upload is then split into
+// content defined chunks (FastCDC: a gear hash over the bytes picks the cut points, so an edit only
+// changes the chunks around it) and every chunk is stored once, under its SHA-256, in a directory
+// next to the tree (~/.spdf.chunks/ab/ab12...). The file in the tree becomes a manifest that lists
+// its chunks, so 'display', the file index and the removal of files work as before, while an upload
+// whose chunks are all known writes nothing but its manifest.
+//
+// Manifests are read whether or not the mode is on: 'dfile' and 'dtar' send the chunks of a
+// manifest in order (with sendfile(), like plain files) and files written without the mode are sent
+// as they are. After files were removed or replaced, a thread of the store collects the chunks no
+// manifest refers to any more; chunks in use by an upload or a download are never collected.
+//
+// Every function accepts a NULL store, uploads are then written as they are.
+
+// Sizes of the chunks cut by FastCDC: at least CHUNK_MIN and at most CHUNK_MAX bytes, about
+// CHUNK_AVG on average (the last chunk of a file may be shorter)
+#define CHUNK_MIN (8 * 1024)
+#define CHUNK_AVG (32 * 1024)
+#define CHUNK_MAX (128 * 1024)
+
+struct chunk_store;
+struct chunk_writer;
+struct chunk_content;
+
+// Counters of the store since the server started
+struct chunk_store_stats {
+    uint64_t files;           // uploads stored as chunks
+    uint64_t bytes_in;        // bytes of those uploads
+    uint64_t bytes_written;   // bytes of the chunks that were new
+    uint64_t chunks_new;
+    uint64_t chunks_dup;      // chunks that were stored already
+    uint64_t cache_hits;      // chunks known to be stored without looking on disk
+    uint64_t cache_misses;
+    uint64_t collected;       // chunks removed because no manifest used them
+    uint64_t bytes_freed;
+};
+
+// Open the store of the tree root, keeping its chunks in dir. Returns NULL if it can not be started.
+struct chunk_store *chunk_store_open(const char *root, const char *dir);
+
+// Stop the collecting thread and free the store
+void chunk_store_close(struct chunk_store *store);
+
+// 1 if uploads are stored as chunks
+int chunk_store_enabled(const struct chunk_store *store);
+
+// Receive a DATA stream like dfs_recv_stream(): its bytes are written to fd, or with the store
+// enabled the manifest of its chunks. When delta is not NULL the stream is a delta that it rebuilds
+// the content from, and when hash is not NULL the content is also added to it.
+// *writer keeps the chunks from being collected until the file is in place; pass it to
+// chunk_writer_free() then (it is NULL when the upload was written as it is).
+int chunk_store_recv_file(struct chunk_store *store, int sock, int fd, struct sha256 *hash, struct dfs_delta_apply *delta,
+                          struct chunk_writer **writer);
+
+// Keep the chunks of the file in fd from being collected, like an upload of it would, while it
+// gets another name. Returns 0 with *writer for chunk_writer_free() (NULL for a file stored as it
+// is), or -1 if the file is a manifest whose chunks are not all stored.
+int chunk_store_hold_file(struct chunk_store *store, int fd, struct chunk_writer **writer);
+
+// Release what chunk_store_recv_file() kept
+void chunk_writer_free(struct chunk_writer *writer);
+
+// Size of the content of the stored file in fd: of the file a manifest stands for, or of fd itself.
+// Returns -1 if it can not be told.
+int chunk_store_file_size(struct chunk_store *store, int fd, uint64_t *size);
+
+// Send len bytes of the content of a file from offset like dfs_send_file_part(), from the chunks of
+// a manifest or the bytes of any other file; the range must lie within the content.
+// Returns 0 on success, -1 if the connection is no longer usable and -2 if the file could not be read
+// before anything was sent (an ERROR frame was sent instead).
+int chunk_store_send_file(struct chunk_store *store, int sock, uint32_t request_id, int fd, uint64_t offset, uint64_t len);
+
+// Open the content of the stored file in fd for reading at any offset: the chunks of a manifest,
+// which stay pinned until it is closed, or the bytes of any other file. fd must stay open as long.
+// *size gets the size of the content. Returns NULL if a manifest is damaged or memory ran out.
+struct chunk_content *chunk_store_content_open(struct chunk_store *store, int fd, uint64_t *size);
+
+// Read exactly len bytes of the content at offset, returns -1 if they can not be read.
+// Its signature is that of a dfs_delta_read_fn, content is the struct chunk_content.
+int chunk_store_content_read(void *content, void *buf, size_t len, uint64_t offset);
+
+void chunk_store_content_close(struct chunk_content *content);
+
+// Content source for tar_stream_set_content() that archives the content of manifests
+void chunk_store_tar_content(struct chunk_store *store, struct tar_content *content);
+
+// Tell the store that files were removed or replaced, their chunks are collected soon if nothing
+// else uses them
+void chunk_store_released(struct chunk_store *store);
+
+// Copy the counters, or print them as one log line
+void chunk_store_get_stats(struct chunk_store *store, struct chunk_store_stats *stats);
+void chunk_store_print_stats(struct chunk_store *store);
+
+#endif
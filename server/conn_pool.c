@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "conn_pool.h"
+
+// One idle connection and the time it was given back
+struct idle_conn {
+    int sock;
+    time_t since;
+};
+
+struct conn_pool {
+    char name[32];
+    struct sockaddr_in addr;
+    pthread_mutex_t lock;
+    // Idle connections used as a stack, the most recently returned one is handed out first
+    struct idle_conn *idle;
+    int idle_count;
+    int max_idle;
+    struct conn_pool_stats stats;
+};
+
+// Function to create a pool for one backend server
+struct conn_pool *conn_pool_create(const char *name, const char *host, int port, int max_idle) {
+    struct conn_pool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        perror("Connection pool allocation failed");
+        return NULL;
+    }
+    if (max_idle < 0) {
+        max_idle = 0;
+    }
+    pool->idle = calloc(max_idle > 0 ? max_idle : 1, sizeof(*pool->idle));
+    if (pool->idle == NULL) {
+        perror("Connection pool allocation failed");
+        free(pool);
+        return NULL;
+    }
+    snprintf(pool->name, sizeof(pool->name), "%s", name);
+    pool->addr.sin_family = AF_INET;
+    pool->addr.sin_port = htons(port);
+    pool->addr.sin_addr.s_addr = inet_addr(host);
+    pool->max_idle = max_idle;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+// helper to open a new connection to the pool's server. With nonblock the socket is non-blocking and
+// *connecting is set if the handshake is still going on
+static int dial(struct conn_pool *pool, int nonblock, int *connecting) {
+    int sock = socket(AF_INET, SOCK_STREAM | (nonblock ? SOCK_NONBLOCK : 0), 0);
+    if (sock < 0) {
+        fprintf(stderr, "%s socket creation failed: %s\n", pool->name, strerror(errno));
+        return -1;
+    }
+    // A server that does not answer is given up after a few seconds, not the system's two minutes
+    int syns = CONN_POOL_SYN_RETRIES;
+    setsockopt(sock, IPPROTO_TCP, TCP_SYNCNT, &syns, sizeof(syns));
+    if (connect(sock, (struct sockaddr*)&pool->addr, sizeof(pool->addr)) < 0) {
+        if (nonblock && errno == EINPROGRESS) {
+            *connecting = 1;
+        } else {
+            fprintf(stderr, "Connect to %s failed: %s\n", pool->name, strerror(errno));
+            close(sock);
+            return -1;
+        }
+    }
+    // Requests are small frames answered right away, do not let Nagle delay them
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+// helper to check that an idle connection is still usable: the server must not have
+// closed it, and since it owes us nothing there must be no data waiting on it either
+static int is_healthy(int sock) {
+    char probe;
+    ssize_t n = recv(sock, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// helper to take a healthy idle connection, -1 if there is none
+static int take_idle(struct conn_pool *pool) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->idle_count > 0) {
+        struct idle_conn conn = pool->idle[--pool->idle_count];
+        if (now - conn.since <= CONN_POOL_IDLE_SECS && is_healthy(conn.sock)) {
+            pool->stats.hits++;
+            pthread_mutex_unlock(&pool->lock);
+            return conn.sock;
+        }
+        // Closed by the server or idle for too long, throw it away and try the next one
+        pool->stats.stale++;
+        close(conn.sock);
+    }
+    pool->stats.misses++;
+    pthread_mutex_unlock(&pool->lock);
+    return -1;
+}
+
+// Function to get a connection to the pool's server, reusing an idle one when possible
+int conn_pool_get(struct conn_pool *pool) {
+    int sock = take_idle(pool);
+    if (sock >= 0) {
+        return sock;
+    }
+    // Connect outside the lock so other requests are not held up by a slow handshake
+    int connecting = 0;
+    sock = dial(pool, 0, &connecting);
+    if (sock < 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.connect_failed++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return sock;
+}
+
+// Function to get a non-blocking connection to the pool's server without waiting for a new one's handshake
+int conn_pool_get_nonblock(struct conn_pool *pool, int *connecting) {
+    *connecting = 0;
+    int sock = take_idle(pool);
+    if (sock >= 0) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        return sock;
+    }
+    sock = dial(pool, 1, connecting);
+    if (sock < 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.connect_failed++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return sock;
+}
+
+// Function to check on the handshake of a connection from conn_pool_get_nonblock()
+int conn_pool_connected(struct conn_pool *pool, int sock) {
+    // Writable once the handshake is over, either way
+    struct pollfd fds = {sock, POLLOUT, 0};
+    if (poll(&fds, 1, 0) == 0) {
+        return 0;
+    }
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+        error = errno;
+    }
+    if (error == 0) {
+        return 1;
+    }
+    fprintf(stderr, "Connect to %s failed: %s\n", pool->name, strerror(error));
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.connect_failed++;
+    pthread_mutex_unlock(&pool->lock);
+    return -1;
+}
+
+// Function to give a connection back to the pool
+void conn_pool_put(struct conn_pool *pool, int sock, int reusable) {
+    if (sock < 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (reusable && pool->idle_count < pool->max_idle) {
+        pool->idle[pool->idle_count].sock = sock;
+        pool->idle[pool->idle_count].since = time(NULL);
+        pool->idle_count++;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    pool->stats.discarded++;
+    pthread_mutex_unlock(&pool->lock);
+    close(sock);
+}
+
+// Function to copy the pool counters
+void conn_pool_get_stats(struct conn_pool *pool, struct conn_pool_stats *stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->idle = pool->idle_count;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to print the pool counters as one log line
+void conn_pool_print_stats(struct conn_pool *pool) {
+    struct conn_pool_stats stats;
+    conn_pool_get_stats(pool, &stats);
+    printf("%s pool: %llu hits, %llu misses, %llu stale, %llu connect failures, %llu discarded, %d idle\n",
+           pool->name, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+           (unsigned long long)stats.stale, (unsigned long long)stats.connect_failed,
+           (unsigned long long)stats.discarded, stats.idle);
+}
+
+// Function to close every idle connection and free the pool
+void conn_pool_destroy(struct conn_pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    for (int i = 0; i < pool->idle_count; i++) {
+        close(pool->idle[i].sock);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->idle);
+    free(pool);
+}
@@ -0,0 +1,61 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include <stdint.h>
+
+// A bounded pool of warm TCP connections from smain to one backend server (Spdf or Stext).
+//
+// conn_pool_get() hands out an idle connection when one is available and still healthy,
+// otherwise it opens a new one. conn_pool_put() gives the connection back; only connections
+// whose last request/reply exchange completed cleanly may be reused, everything else is closed.
+// At most max_idle connections are kept open while unused, and idle ones older than
+// CONN_POOL_IDLE_SECS are closed instead of being handed out. The pool is safe to share between threads.
+
+// Number of idle connections kept per backend unless configured otherwise
+#define CONN_POOL_MAX_IDLE 8
+
+// Idle connections older than this are not reused (seconds)
+#define CONN_POOL_IDLE_SECS 60
+
+// SYNs resent before a new connection is given up: 1 + 2 + 4 seconds with the usual timeouts
+#define CONN_POOL_SYN_RETRIES 2
+
+struct conn_pool;
+
+// Counters describing how well the pool is working
+struct conn_pool_stats {
+    uint64_t hits;            // requests served by an idle connection
+    uint64_t misses;          // requests that had to open a new connection
+    uint64_t stale;           // idle connections found closed or expired and thrown away
+    uint64_t connect_failed;  // new connections that could not be opened
+    uint64_t discarded;       // connections closed on release (broken exchange or pool full)
+    int idle;                 // connections currently waiting in the pool
+};
+
+// Create a pool for the server at host:port, name is only used in log messages. Returns NULL on failure.
+struct conn_pool *conn_pool_create(const char *name, const char *host, int port, int max_idle);
+
+// Get a connected socket, return -1 if the server can not be reached
+int conn_pool_get(struct conn_pool *pool);
+
+// The same for an event loop: the socket is non-blocking and a new connection's handshake is not
+// waited for, *connecting is then set until conn_pool_connected() returned 1 (once the socket is
+// writable). Return -1 if the server can not be reached
+int conn_pool_get_nonblock(struct conn_pool *pool, int *connecting);
+
+// 1 once the handshake of a connecting socket succeeded, 0 while it goes on, -1 if it failed
+int conn_pool_connected(struct conn_pool *pool, int sock);
+
+// Return a socket obtained from conn_pool_get(), reusable is 0 when the connection may be out of sync
+void conn_pool_put(struct conn_pool *pool, int sock, int reusable);
+
+// Copy the current counters
+void conn_pool_get_stats(struct conn_pool *pool, struct conn_pool_stats *stats);
+
+// Print the counters as one log line
+void conn_pool_print_stats(struct conn_pool *pool);
+
+// Close all idle connections and free the pool
+void conn_pool_destroy(struct conn_pool *pool);
+
+#endif
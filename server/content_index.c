@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "content_index.h"
+
+struct content_index {
+    char dir[PATH_MAX];             // entries, in subdirectories named by the first digest byte
+    unsigned long temp_counter;     // keeps the temporary names of concurrent additions apart
+};
+
+// helper to build the path of the entry of a content
+static void entry_path(const struct content_index *index, const unsigned char *digest, uint64_t size, char *path, size_t path_size) {
+    char hex[SHA256_HEX_SIZE + 1];
+    sha256_hex(digest, hex);
+    snprintf(path, path_size, "%s/%.2s/%s-%llu", index->dir, hex, hex, (unsigned long long)size);
+}
+
+// Function to open the index in dir
+struct content_index *content_index_open(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("Content index creation failed, every upload is transferred");
+        return NULL;
+    }
+    struct content_index *index = calloc(1, sizeof(*index));
+    if (index == NULL) {
+        perror("Content index allocation failed");
+        return NULL;
+    }
+    snprintf(index->dir, sizeof(index->dir), "%s", dir);
+    return index;
+}
+
+// Function to free the index, its entries stay on disk
+void content_index_close(struct content_index *index) {
+    free(index);
+}
+
+// Function to link the stored file with a content to a new name
+int content_index_link(struct content_index *index, const unsigned char digest[SHA256_SIZE], uint64_t size, const char *path) {
+    if (index == NULL) {
+        return -1;
+    }
+    char entry[PATH_MAX + SHA256_HEX_SIZE + 32];
+    entry_path(index, digest, size, entry, sizeof(entry));
+
+    // The target of the entry is "<inode> <mtime seconds>.<nanoseconds> <path>"
+    char target[PATH_MAX + 64];
+    ssize_t len = readlink(entry, target, sizeof(target) - 1);
+    if (len < 0) {
+        return -1;
+    }
+    target[len] = '\0';
+    unsigned long long ino;
+    long long sec;
+    long nsec;
+    int offset = 0;
+    if (sscanf(target, "%llu %lld.%ld %n", &ino, &sec, &nsec, &offset) != 3 || offset == 0) {
+        unlink(entry);
+        return -1;
+    }
+
+    // Link first and check the file behind the new name, so a file replaced in between is noticed
+    if (link(target + offset, path) < 0) {
+        if (errno == ENOENT) {
+            unlink(entry);
+        }
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode) || (unsigned long long)st.st_ino != ino ||
+        (long long)st.st_mtim.tv_sec != sec || st.st_mtim.tv_nsec != nsec) {
+        // The file was removed or replaced since it was added
+        unlink(path);
+        unlink(entry);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to add the entry of a file, replacing an older one of the same content
+void content_index_add(struct content_index *index, const unsigned char digest[SHA256_SIZE], uint64_t size, int fd, const char *path) {
+    if (index == NULL) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return;
+    }
+    char target[PATH_MAX + 64];
+    int len = snprintf(target, sizeof(target), "%llu %lld.%09ld %s", (unsigned long long)st.st_ino,
+                       (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, path);
+    if (len < 0 || (size_t)len >= sizeof(target)) {
+        return;
+    }
+
+    // Created under a temporary name and renamed over the entry, so a lookup never sees half of it
+    char entry[PATH_MAX + SHA256_HEX_SIZE + 32];
+    char temp[PATH_MAX + 64];
+    entry_path(index, digest, size, entry, sizeof(entry));
+    snprintf(temp, sizeof(temp), "%s/%.2s/tmp.%d.%lu", index->dir, strrchr(entry, '/') + 1, (int)getpid(),
+             __sync_fetch_and_add(&index->temp_counter, 1));
+    if (symlink(target, temp) < 0) {
+        // The subdirectory is made with the first entry it gets
+        char sub[PATH_MAX + 4];
+        snprintf(sub, sizeof(sub), "%s/%.2s", index->dir, strrchr(entry, '/') + 1);
+        if ((mkdir(sub, 0755) < 0 && errno != EEXIST) || symlink(target, temp) < 0) {
+            perror("Content index entry creation failed");
+            return;
+        }
+    }
+    if (rename(temp, entry) < 0) {
+        perror("Content index entry creation failed");
+        unlink(temp);
+    }
+}
+
+// Function to parse the size and hash of an announced upload
+int content_index_parse(const char *text, uint64_t *size, unsigned char digest[SHA256_SIZE]) {
+    unsigned long long value;
+    char hex[SHA256_HEX_SIZE + 2];
+    int end = 0;
+    if (sscanf(text, "%llu %65s%n", &value, hex, &end) != 2 || strlen(hex) != SHA256_HEX_SIZE ||
+        sha256_from_hex(hex, digest) < 0) {
+        return -1;
+    }
+    // Nothing may follow the hash
+    while (text[end] == ' ' || text[end] == '\n') {
+        end++;
+    }
+    if (text[end] != '\0') {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
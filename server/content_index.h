@@ -0,0 +1,41 @@
+#ifndef CONTENT_INDEX_H
+#define CONTENT_INDEX_H
+
+#include <stdint.h>
+
+#include "../common/sha256.h"
+
+// The files a server stores, found by their content, so an upload of content that is stored
+// already becomes a hard link instead of a transfer.
+//
+// 'ufile' first announces the size and SHA-256 of the file. When the index knows a file with that
+// content, the server links it to the destination and the upload is complete without any data;
+// otherwise the server answers CONTINUE, and the content that follows is hashed on its way to disk
+// and added here once the file is in place. The announced hash is never trusted on its own.
+//
+// An entry is a symbolic link in a directory next to the tree (~/.spdf.content/ab/ab12...-<size>)
+// whose target records the path, inode and mtime of a file. Uploads never change a file in place,
+// they rename a new one over it, so a file that still has the recorded inode and mtime still has
+// the content. An entry of a file that was removed or replaced is dropped when it is looked up.
+//
+// Every function accepts a NULL index, nothing is found in it then.
+
+struct content_index;
+
+// Open the index kept in dir, creating it if needed. Returns NULL if it can not be used.
+struct content_index *content_index_open(const char *dir);
+
+void content_index_close(struct content_index *index);
+
+// Hard link a stored file with this content to path, which must not exist yet.
+// Returns 0 on success and -1 if no stored file has the content.
+int content_index_link(struct content_index *index, const unsigned char digest[SHA256_SIZE], uint64_t size, const char *path);
+
+// Record that the file open as fd, which was just renamed to path, has this content. The inode
+// comes from fd, so a file renamed over path meanwhile is not taken for it.
+void content_index_add(struct content_index *index, const unsigned char digest[SHA256_SIZE], uint64_t size, int fd, const char *path);
+
+// Read the "<size> <hash>" a 'ufile' command announces, returns -1 if text is not that
+int content_index_parse(const char *text, uint64_t *size, unsigned char digest[SHA256_SIZE]);
+
+#endif
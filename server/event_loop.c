@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+
+// Events handled per epoll_wait() call, and connections accepted per wake up before other events get a turn
+#define EVENT_BATCH 64
+#define ACCEPT_BATCH 64
+
+struct event_loop {
+    int id;
+    int epoll_fd;
+    int listen_sock;
+    // Descriptor kept in reserve so connections can still be accepted and closed when the process runs out of fds
+    int spare_fd;
+    ev_accept_fn on_accept;
+    pthread_t thread;
+    // Pointers released by event_loop_defer_free(), freed after each batch
+    void **garbage;
+    int garbage_count;
+    int garbage_cap;
+};
+
+// Function to prepare a watch for a descriptor
+void ev_watch_init(struct ev_watch *watch, struct event_loop *loop, int fd, void (*callback)(struct ev_watch *, uint32_t)) {
+    watch->fd = fd;
+    watch->events = 0;
+    watch->callback = callback;
+    watch->loop = loop;
+}
+
+// Function to change the events a descriptor is watched for
+int ev_watch_set(struct ev_watch *watch, uint32_t events) {
+    if (watch->fd < 0 || events == watch->events) {
+        return 0;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = watch;
+
+    int op = watch->events == 0 ? EPOLL_CTL_ADD : (events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+    if (epoll_ctl(watch->loop->epoll_fd, op, watch->fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return -1;
+    }
+    watch->events = events;
+    return 0;
+}
+
+// Function to queue memory to be freed after the current batch of events
+void event_loop_defer_free(struct event_loop *loop, void *ptr) {
+    if (loop->garbage_count == loop->garbage_cap) {
+        int cap = loop->garbage_cap ? loop->garbage_cap * 2 : 16;
+        void **grown = realloc(loop->garbage, cap * sizeof(*grown));
+        if (grown == NULL) {
+            // Leaking is better than freeing memory a pending event may still point to
+            perror("Deferred free failed");
+            return;
+        }
+        loop->garbage = grown;
+        loop->garbage_cap = cap;
+    }
+    loop->garbage[loop->garbage_count++] = ptr;
+}
+
+// Function to get the number of a loop
+int event_loop_id(struct event_loop *loop) {
+    return loop->id;
+}
+
+// helper to accept the pending connections on the listening socket
+static void accept_clients(struct event_loop *loop) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        int client_sock = accept4(loop->listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock >= 0) {
+            loop->on_accept(loop, client_sock);
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno == EMFILE || errno == ENFILE) && loop->spare_fd >= 0) {
+            // Out of descriptors: accept and close the connection with the reserve fd, otherwise
+            // the listening socket stays readable and the loop would spin on it
+            fprintf(stderr, "Accept failed: too many open files, dropping a connection\n");
+            close(loop->spare_fd);
+            client_sock = accept(loop->listen_sock, NULL, NULL);
+            if (client_sock >= 0) {
+                close(client_sock);
+            }
+            loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+            perror("Accept failed");
+        }
+        return;
+    }
+}
+
+// helper running one event loop until the process exits
+static void *loop_main(void *arg) {
+    struct event_loop *loop = arg;
+    struct epoll_event events[EVENT_BATCH];
+
+    while (1) {
+        int n = epoll_wait(loop->epoll_fd, events, EVENT_BATCH, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            // The listening socket is registered without a watch
+            if (events[i].data.ptr == NULL) {
+                accept_clients(loop);
+                continue;
+            }
+            struct ev_watch *watch = events[i].data.ptr;
+            watch->callback(watch, events[i].events);
+        }
+
+        // Nothing from this batch can refer to the released memory any more
+        for (int i = 0; i < loop->garbage_count; i++) {
+            free(loop->garbage[i]);
+        }
+        loop->garbage_count = 0;
+    }
+    return NULL;
+}
+
+// Function to start the event loops and run the first one on the calling thread
+int event_loop_run(int listen_sock, int threads, ev_accept_fn on_accept) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    struct event_loop *loops = calloc(threads, sizeof(*loops));
+    if (loops == NULL) {
+        perror("Event loop allocation failed");
+        return -1;
+    }
+
+    // The loops accept from the same socket, it must never block any of them
+    fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL) | O_NONBLOCK);
+
+    for (int i = 0; i < threads; i++) {
+        struct event_loop *loop = &loops[i];
+        loop->id = i;
+        loop->listen_sock = listen_sock;
+        loop->on_accept = on_accept;
+        loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            return -1;
+        }
+
+        // EPOLLEXCLUSIVE wakes only one of the loops for a new connection
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+            perror("epoll_ctl on listening socket failed");
+            return -1;
+        }
+    }
+
+    // Loop 0 runs on this thread, the others get their own
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&loops[i].thread, NULL, loop_main, &loops[i]) != 0) {
+            perror("Event loop thread creation failed");
+            return -1;
+        }
+    }
+    loop_main(&loops[0]);
+    return -1;
+}
@@ -0,0 +1,41 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+
+// Event loops for Smain: one epoll instance per thread. Every loop watches the shared listening
+// socket (EPOLLEXCLUSIVE, so one loop wakes up per new connection) and owns the connections it
+// accepted for their whole life, so connection state is never shared between threads.
+
+struct event_loop;
+
+// A file descriptor watched by an event loop, embedded in the owner's own structure.
+// The callback runs on the loop's thread with the epoll events that are ready.
+struct ev_watch {
+    int fd;
+    uint32_t events;  // events currently registered, 0 when the fd is not in the epoll set
+    void (*callback)(struct ev_watch *watch, uint32_t ready);
+    struct event_loop *loop;
+};
+
+// Called on a loop's thread for every accepted client socket (already non-blocking)
+typedef void (*ev_accept_fn)(struct event_loop *loop, int client_sock);
+
+// Run the given number of event loops on listen_sock, the calling thread runs the first one.
+// Only returns if the loops could not be started.
+int event_loop_run(int listen_sock, int threads, ev_accept_fn on_accept);
+
+// Prepare a watch for fd on a loop, it is registered by the first ev_watch_set() with events
+void ev_watch_init(struct ev_watch *watch, struct event_loop *loop, int fd, void (*callback)(struct ev_watch *, uint32_t));
+
+// Wait for the given epoll events on the watch, 0 removes the fd from the epoll set
+int ev_watch_set(struct ev_watch *watch, uint32_t events);
+
+// Free ptr once the loop finished handling the current batch of events, so a callback
+// can close a connection whose other watch still has an event pending in the same batch
+void event_loop_defer_free(struct event_loop *loop, void *ptr);
+
+// Number of the loop (0 .. threads-1), used in log messages
+int event_loop_id(struct event_loop *loop);
+
+#endif
@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "../common/dfs_proto.h"
+#include "../common/dfs_range.h"
+#include "file_cache.h"
+#include "worker_pool.h"
+
+// Hash table of the entries by path
+#define CACHE_BUCKETS 16384
+
+// Count-min sketch: rows of saturating 4-bit counters (kept in bytes), halved after SKETCH_RESET additions
+#define SKETCH_ROWS 4
+#define SKETCH_WIDTH 65536
+#define SKETCH_MAX 15
+#define SKETCH_RESET (10 * SKETCH_WIDTH)
+
+// Shares of the capacity: the window takes 1%, the protected segment 80% of the rest
+#define WINDOW_PERCENT 1
+#define PROTECTED_PERCENT 80
+// Files larger than this part of the capacity are never fetched
+#define MAX_ENTRY_SHARE 4
+
+// Fetches running at once, and the workers that run them
+#define MAX_FILLS 8
+#define FILL_WORKERS 2
+
+enum cache_region {
+    REGION_NONE = -1,   // being admitted or dropped
+    REGION_WINDOW,
+    REGION_PROBATION,
+    REGION_PROTECTED
+};
+
+struct cache_entry {
+    char *path;
+    uint64_t hash;
+    char version[DFS_VERSION_MAX + 1];
+    uint64_t size;
+    int fd;
+    enum cache_region region;
+    struct cache_entry *prev;        // LRU list of its region, the head was used last
+    struct cache_entry *next;
+    struct cache_entry *bucket_next;
+};
+
+struct cache_list {
+    struct cache_entry *head;
+    struct cache_entry *tail;
+    uint64_t bytes;
+    uint64_t count;
+};
+
+struct file_cache {
+    pthread_mutex_t lock;
+    uint64_t capacity;
+    uint64_t window_capacity;
+    uint64_t protected_capacity;
+    char dir[PATH_MAX];              // "" keeps the content in memfds
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_list lists[3];      // by enum cache_region
+    unsigned char sketch[SKETCH_ROWS][SKETCH_WIDTH];
+    uint64_t additions;
+    uint64_t epoch;                  // advanced by every invalidation
+    char *filling[MAX_FILLS];        // paths being fetched
+    struct worker_pool *fillers;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t hit_bytes;
+    uint64_t miss_bytes;
+    uint64_t fetched;
+    uint64_t admitted;
+    uint64_t rejected;
+    uint64_t evicted;
+    uint64_t invalidated;
+};
+
+// A path fetched into the cache by a worker
+struct cache_fill {
+    struct file_cache *cache;
+    struct conn_pool *pool;
+    char *path;
+    uint64_t epoch;
+    int slot;
+};
+
+// helper to hash a path (FNV-1a)
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// helper returning the counter of a hash in one row of the sketch
+static unsigned char *sketch_counter(struct file_cache *cache, int row, uint64_t hash) {
+    uint64_t x = hash + (uint64_t)(row + 1) * 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return &cache->sketch[row][x & (SKETCH_WIDTH - 1)];
+}
+
+// helper to count one request of a path, halving all counters once enough were counted
+static void sketch_add(struct file_cache *cache, uint64_t hash) {
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        unsigned char *counter = sketch_counter(cache, row, hash);
+        if (*counter < SKETCH_MAX) {
+            (*counter)++;
+        }
+    }
+    if (++cache->additions >= SKETCH_RESET) {
+        for (int row = 0; row < SKETCH_ROWS; row++) {
+            for (int i = 0; i < SKETCH_WIDTH; i++) {
+                cache->sketch[row][i] >>= 1;
+            }
+        }
+        cache->additions /= 2;
+    }
+}
+
+// helper to estimate how often a path was asked for lately
+static int sketch_estimate(struct file_cache *cache, uint64_t hash) {
+    int estimate = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        unsigned char counter = *sketch_counter(cache, row, hash);
+        if (counter < estimate) {
+            estimate = counter;
+        }
+    }
+    return estimate;
+}
+
+// helper to put an entry at the head of the list of a region
+static void list_push(struct file_cache *cache, struct cache_entry *entry, enum cache_region region) {
+    struct cache_list *list = &cache->lists[region];
+    entry->region = region;
+    entry->prev = NULL;
+    entry->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = entry;
+    } else {
+        list->tail = entry;
+    }
+    list->head = entry;
+    list->bytes += entry->size;
+    list->count++;
+}
+
+// helper to take an entry out of the list of its region
+static void list_remove(struct file_cache *cache, struct cache_entry *entry) {
+    if (entry->region == REGION_NONE) {
+        return;
+    }
+    struct cache_list *list = &cache->lists[entry->region];
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+    list->bytes -= entry->size;
+    list->count--;
+    entry->region = REGION_NONE;
+}
+
+// helper to find the entry of a path
+static struct cache_entry *find_entry(struct file_cache *cache, uint64_t hash, const char *path) {
+    struct cache_entry *entry = cache->buckets[hash % CACHE_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0)) {
+        entry = entry->bucket_next;
+    }
+    return entry;
+}
+
+// helper to remove an entry from the cache and free it
+static void drop_entry(struct file_cache *cache, struct cache_entry *entry) {
+    struct cache_entry **link = &cache->buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    list_remove(cache, entry);
+    close(entry->fd);
+    free(entry->path);
+    free(entry);
+}
+
+// helper to move an entry the window pushed out into the main segments, if it is asked for more
+// often than each entry it would push out there. Returns 1 if it was admitted.
+static int admit_entry(struct file_cache *cache, struct cache_entry *candidate) {
+    uint64_t main_capacity = cache->capacity - cache->window_capacity;
+    int frequency = sketch_estimate(cache, candidate->hash);
+    if (candidate->size > main_capacity) {
+        drop_entry(cache, candidate);
+        return 0;
+    }
+    while (cache->lists[REGION_PROBATION].bytes + cache->lists[REGION_PROTECTED].bytes + candidate->size > main_capacity) {
+        struct cache_entry *victim = cache->lists[REGION_PROBATION].tail;
+        if (victim == NULL) {
+            victim = cache->lists[REGION_PROTECTED].tail;
+        }
+        if (frequency <= sketch_estimate(cache, victim->hash)) {
+            drop_entry(cache, candidate);
+            return 0;
+        }
+        drop_entry(cache, victim);
+        cache->evicted++;
+    }
+    list_push(cache, candidate, REGION_PROBATION);
+    return 1;
+}
+
+// helper to move an entry that was hit to the head of its segment, an entry of the probation
+// segment is promoted to the protected one, whose least recent entries fall back to probation
+static void touch_entry(struct file_cache *cache, struct cache_entry *entry) {
+    enum cache_region region = entry->region == REGION_WINDOW ? REGION_WINDOW : REGION_PROTECTED;
+    list_remove(cache, entry);
+    list_push(cache, entry, region);
+    while (cache->lists[REGION_PROTECTED].bytes > cache->protected_capacity &&
+           cache->lists[REGION_PROTECTED].tail != entry) {
+        struct cache_entry *demoted = cache->lists[REGION_PROTECTED].tail;
+        list_remove(cache, demoted);
+        list_push(cache, demoted, REGION_PROBATION);
+    }
+}
+
+// helper to add a fetched file, unless its path was invalidated since the fetch started
+static void insert_entry(struct file_cache *cache, const char *path, const char *version, uint64_t size, int fd, uint64_t epoch) {
+    struct cache_entry *entry = calloc(1, sizeof(*entry));
+    char *path_copy = strdup(path);
+    if (entry == NULL || path_copy == NULL || epoch != cache->epoch) {
+        free(entry);
+        free(path_copy);
+        close(fd);
+        return;
+    }
+    entry->path = path_copy;
+    entry->hash = hash_path(path);
+    snprintf(entry->version, sizeof(entry->version), "%s", version);
+    entry->size = size;
+    entry->fd = fd;
+    entry->region = REGION_NONE;
+    struct cache_entry *old = find_entry(cache, entry->hash, path);
+    if (old != NULL) {
+        drop_entry(cache, old);
+    }
+    entry->bucket_next = cache->buckets[entry->hash % CACHE_BUCKETS];
+    cache->buckets[entry->hash % CACHE_BUCKETS] = entry;
+    cache->fetched++;
+
+    // The window keeps the newest entries, what it can not hold competes for the main segments
+    list_push(cache, entry, REGION_WINDOW);
+    while (cache->lists[REGION_WINDOW].bytes > cache->window_capacity) {
+        struct cache_entry *candidate = cache->lists[REGION_WINDOW].tail;
+        list_remove(cache, candidate);
+        if (admit_entry(cache, candidate)) {
+            cache->admitted++;
+        } else {
+            cache->rejected++;
+        }
+    }
+}
+
+// helper to create the descriptor that holds the content of an entry
+static int create_content(struct file_cache *cache) {
+    if (cache->dir[0] != '\0') {
+        return open(cache->dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    return memfd_create("dfs-cache", MFD_CLOEXEC);
+}
+
+// helper to fetch a whole file from its server into a new descriptor. Returns 0 with it, the size
+// and version, or -1; *reusable tells whether the connection is still in sync.
+static int fetch_file(struct file_cache *cache, int sock, const char *path, int *fd, uint64_t *size, char *version, int *reusable) {
+    char request[PATH_MAX + 32];
+    snprintf(request, sizeof(request), "%s 0 0", path);
+    *reusable = 0;
+    if (dfs_send_text(sock, DFS_OP_DFILE, 0, request) < 0) {
+        return -1;
+    }
+    struct dfs_hdr hdr;
+    char name[PATH_MAX];
+    if (dfs_recv_hdr(sock, &hdr) < 0 || dfs_recv_text(sock, &hdr, name, sizeof(name)) < 0) {
+        return -1;
+    }
+    uint64_t offset;
+    if (hdr.opcode != DFS_OP_NAME) {
+        // The file is gone, the reply was the whole error frame
+        *reusable = 1;
+        return -1;
+    }
+    if (dfs_range_parse_name(name, size, version, &offset) < 0 || offset != 0 ||
+        *size > cache->capacity / MAX_ENTRY_SHARE || (*fd = create_content(cache)) < 0) {
+        *reusable = dfs_recv_stream(sock, -1, NULL, NULL, 0) != -1;
+        return -1;
+    }
+    uint64_t received = 0;
+    int result = dfs_recv_stream(sock, *fd, &received, NULL, 0);
+    *reusable = result != -1;
+    if (result != 0 || received != *size) {
+        close(*fd);
+        return -1;
+    }
+    return 0;
+}
+
+// helper run on a worker: fetch a path and add it to the cache
+static void run_fill(void *arg) {
+    struct cache_fill *fill = arg;
+    struct file_cache *cache = fill->cache;
+    char version[DFS_VERSION_MAX + 1];
+    uint64_t size = 0;
+    int fd = -1;
+    int fetched = -1;
+
+    int sock = conn_pool_get(fill->pool);
+    if (sock >= 0) {
+        int reusable = 0;
+        fetched = fetch_file(cache, sock, fill->path, &fd, &size, version, &reusable);
+        conn_pool_put(fill->pool, sock, reusable);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (fetched == 0) {
+        insert_entry(cache, fill->path, version, size, fd, fill->epoch);
+    }
+    free(cache->filling[fill->slot]);
+    cache->filling[fill->slot] = NULL;
+    pthread_mutex_unlock(&cache->lock);
+    free(fill);
+}
+
+// Function to open the cache configured by DFS_CACHE_MB and DFS_CACHE_DIR
+struct file_cache *file_cache_open(void) {
+    const char *env = getenv("DFS_CACHE_MB");
+    long long megabytes = env != NULL ? atoll(env) : FILE_CACHE_DEFAULT_MB;
+    if (megabytes <= 0) {
+        return NULL;
+    }
+    struct file_cache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        perror("File cache allocation failed");
+        return NULL;
+    }
+    cache->capacity = (uint64_t)megabytes * 1024 * 1024;
+    cache->window_capacity = cache->capacity * WINDOW_PERCENT / 100;
+    cache->protected_capacity = (cache->capacity - cache->window_capacity) * PROTECTED_PERCENT / 100;
+    env = getenv("DFS_CACHE_DIR");
+    snprintf(cache->dir, sizeof(cache->dir), "%s", env != NULL ? env : "");
+
+    // Check once that content can be stored where it was asked for
+    int probe = create_content(cache);
+    if (probe < 0) {
+        perror("File cache can not store content, it is turned off");
+        free(cache);
+        return NULL;
+    }
+    close(probe);
+    cache->fillers = worker_pool_create("Smain cache", FILL_WORKERS);
+    if (cache->fillers == NULL) {
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    printf("File cache of %lld MB in %s\n", megabytes, cache->dir[0] != '\0' ? cache->dir : "memory");
+    return cache;
+}
+
+// Function to free the cache once its fetches are done
+void file_cache_close(struct file_cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    worker_pool_destroy(cache->fillers);
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        while (cache->buckets[i] != NULL) {
+            drop_entry(cache, cache->buckets[i]);
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+// Function to look a path up, starting to fetch it when it is missing but popular
+int file_cache_get(struct file_cache *cache, struct conn_pool *pool, const char *path, int *fd, uint64_t *size, char *version) {
+    if (cache == NULL) {
+        return -1;
+    }
+    uint64_t hash = hash_path(path);
+    pthread_mutex_lock(&cache->lock);
+    sketch_add(cache, hash);
+    struct cache_entry *entry = find_entry(cache, hash, path);
+    if (entry != NULL && (*fd = dup(entry->fd)) >= 0) {
+        cache->hits++;
+        *size = entry->size;
+        snprintf(version, DFS_VERSION_MAX + 1, "%s", entry->version);
+        touch_entry(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    cache->misses++;
+
+    // Fetch a path that is asked for again, unless that is being done already
+    struct cache_fill *fill = NULL;
+    int slot = -1;
+    if (sketch_estimate(cache, hash) >= FILE_CACHE_FILL_MIN) {
+        for (int i = 0; i < MAX_FILLS; i++) {
+            if (cache->filling[i] == NULL) {
+                slot = slot < 0 ? i : slot;
+            } else if (strcmp(cache->filling[i], path) == 0) {
+                slot = -1;
+                break;
+            }
+        }
+    }
+    if (slot >= 0 && (fill = calloc(1, sizeof(*fill))) != NULL && (cache->filling[slot] = strdup(path)) != NULL) {
+        *fill = (struct cache_fill){cache, pool, cache->filling[slot], cache->epoch, slot};
+    } else {
+        free(fill);
+        fill = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (fill != NULL && worker_pool_submit(cache->fillers, run_fill, fill) < 0) {
+        pthread_mutex_lock(&cache->lock);
+        free(cache->filling[slot]);
+        cache->filling[slot] = NULL;
+        pthread_mutex_unlock(&cache->lock);
+        free(fill);
+    }
+    return -1;
+}
+
+// Function to count the bytes of a download for the byte hit ratio
+void file_cache_add_bytes(struct file_cache *cache, int hit, uint64_t bytes) {
+    if (cache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    if (hit) {
+        cache->hit_bytes += bytes;
+    } else {
+        cache->miss_bytes += bytes;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Function to drop the entry of a path that changes
+void file_cache_invalidate(struct file_cache *cache, const char *path) {
+    if (cache == NULL) {
+        return;
+    }
+    uint64_t hash = hash_path(path);
+    pthread_mutex_lock(&cache->lock);
+    // A fetch that is still running may have read the old file, it is not added
+    cache->epoch++;
+    struct cache_entry *entry = find_entry(cache, hash, path);
+    if (entry != NULL) {
+        drop_entry(cache, entry);
+        cache->invalidated++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Function to print the counters of the cache
+void file_cache_print_stats(struct file_cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    uint64_t requests = cache->hits + cache->misses;
+    uint64_t bytes = cache->hit_bytes + cache->miss_bytes;
+    uint64_t stored = 0, entries = 0;
+    for (int region = REGION_WINDOW; region <= REGION_PROTECTED; region++) {
+        stored += cache->lists[region].bytes;
+        entries += cache->lists[region].count;
+    }
+    printf("File cache: %llu hits, %llu misses, hit ratio %.1f%%, byte hit ratio %.1f%%, %llu entries with %llu of %llu bytes, "
+           "%llu fetched, %llu admitted, %llu rejected, %llu evicted, %llu invalidated\n",
+           (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+           requests > 0 ? 100.0 * (double)cache->hits / (double)requests : 0.0,
+           bytes > 0 ? 100.0 * (double)cache->hit_bytes / (double)bytes : 0.0,
+           (unsigned long long)entries, (unsigned long long)stored, (unsigned long long)cache->capacity,
+           (unsigned long long)cache->fetched, (unsigned long long)cache->admitted, (unsigned long long)cache->rejected,
+           (unsigned long long)cache->evicted, (unsigned long long)cache->invalidated);
+    pthread_mutex_unlock(&cache->lock);
+}
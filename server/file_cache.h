@@ -0,0 +1,51 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdint.h>
+
+#include "conn_pool.h"
+
+// Popular .pdf and .txt files kept by smain, so their downloads are served without asking Spdf/Stext.
+//
+// An entry holds the whole content of a file, in a memfd (or an unlinked file in DFS_CACHE_DIR,
+// e.g. on a local SSD), with the size and version its server reported. Hits are sent with sendfile()
+// from a dup() of that descriptor, so an entry evicted meanwhile does not disturb them. The cache
+// holds at most DFS_CACHE_MB megabytes (default FILE_CACHE_DEFAULT_MB, 0 turns it off).
+//
+// Admission and eviction follow W-TinyLFU: a count-min sketch estimates how often every path was
+// asked for lately (its counters are halved now and then, so old popularity fades). A path is only
+// fetched into the cache once it was asked for FILE_CACHE_FILL_MIN times, in the background on a
+// worker of the cache. New entries go into a small LRU window; what falls out of it only enters the
+// main SLRU (probation and protected segments) if it is asked for more often than the entries it
+// would push out, so a scan over many cold files can not flush the hot ones.
+//
+// Every 'ufile' and 'rmfile' of a path through smain drops its entry, once when it starts and again
+// when the server answered, and a fetch that overlapped one is thrown away.
+//
+// Every function accepts a NULL cache, which never has anything.
+
+#define FILE_CACHE_DEFAULT_MB 256
+#define FILE_CACHE_FILL_MIN 2
+
+struct file_cache;
+
+// Open the cache configured by the environment. Returns NULL if it is turned off or can not be used.
+struct file_cache *file_cache_open(void);
+
+void file_cache_close(struct file_cache *cache);
+
+// Look path up: 0 with a dup()ed descriptor of its content, the size and version, or -1 on a miss.
+// Either way the request is counted; a miss of a path asked for often enough starts fetching it
+// from the server of pool.
+int file_cache_get(struct file_cache *cache, struct conn_pool *pool, const char *path, int *fd, uint64_t *size, char *version);
+
+// Count bytes sent to a client for a dfile that was a hit (hit = 1) or a miss, for the byte hit ratio
+void file_cache_add_bytes(struct file_cache *cache, int hit, uint64_t bytes);
+
+// Drop the entry of path, the file is being replaced or removed
+void file_cache_invalidate(struct file_cache *cache, const char *path);
+
+// Print the counters as one log line
+void file_cache_print_stats(struct file_cache *cache);
+
+#endif
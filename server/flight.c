@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "flight.h"
+#include "frame_io.h"
+
+// Memory is given back in steps of this many bytes
+#define PUNCH_STEP (1024 * 1024)
+
+struct flight {
+    struct ev_watch backend;         // first, so the event callback finds the rest
+    struct ev_watch wake;            // eventfd: a waiter moved on or left
+    struct conn_pool *pool;
+    char *path;
+    int fd;                          // memfd with the file
+    struct out_buf request;          // the dfile request, sent once the connection is up
+    int connecting;                  // the handshake of a new connection is not over yet
+    struct frame_reader reader;      // the NAME (or ERROR) reply
+    struct frame_relay relay;        // DATA into fd
+    int fetching;                    // backend still holds the server connection
+    int paused;                      // the fetch is FLIGHT_WINDOW ahead of the slowest waiter
+    uint64_t punched;                // bytes given back from the start of fd
+    struct flight_state state;
+    struct flight_waiter *waiters;
+    int waiter_count;
+    int freed;                       // released, an event of this batch may still name it
+    struct flight *next;             // flights running, by path
+};
+
+// Flights that can be joined, and everything a waiter reads of a flight, under one lock
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct flight *flights;
+static uint64_t fetches_started;
+static uint64_t requests_joined;
+
+static void on_flight_backend(struct ev_watch *watch, uint32_t ready);
+static void on_flight_wake(struct ev_watch *watch, uint32_t ready);
+
+// helper to write an eventfd, the caller holds the lock
+static void poke(int fd) {
+    uint64_t one = 1;
+    ssize_t n = write(fd, &one, sizeof(one));
+    (void)n;
+}
+
+// helper to wake the waiters waiting for a change, the caller holds the lock
+static void wake_waiters(struct flight *flight) {
+    for (struct flight_waiter *waiter = flight->waiters; waiter != NULL; waiter = waiter->next) {
+        if (waiter->waiting) {
+            waiter->waiting = 0;
+            poke(waiter->notify_fd);
+        }
+    }
+}
+
+// helper returning the offset no waiter needs anything before, the caller holds the lock
+static uint64_t low_water(struct flight *flight) {
+    uint64_t low = flight->state.filled;
+    for (struct flight_waiter *waiter = flight->waiters; waiter != NULL; waiter = waiter->next) {
+        if (waiter->offset < low) {
+            low = waiter->offset;
+        }
+    }
+    return low;
+}
+
+// helper to take a flight out of the list of joinable ones, the caller holds the lock
+static void unlist(struct flight *flight) {
+    struct flight **link = &flights;
+    while (*link != NULL && *link != flight) {
+        link = &(*link)->next;
+    }
+    if (*link == flight) {
+        *link = flight->next;
+    }
+}
+
+// helper to free a flight on its loop, once no waiter and no fetch uses it anymore
+static void free_flight(struct flight *flight) {
+    flight->freed = 1;
+    ev_watch_set(&flight->wake, 0);
+    close(flight->wake.fd);
+    close(flight->fd);
+    frame_reader_reset(&flight->reader);
+    free(flight->path);
+    event_loop_defer_free(flight->wake.loop, flight);
+}
+
+// helper to end the fetch of a flight with its final phase and tell the waiters
+static void finish_fetch(struct flight *flight, enum flight_phase phase, int reusable) {
+    pthread_mutex_lock(&flights_lock);
+    flight->state.phase = phase;
+    unlist(flight);
+    wake_waiters(flight);
+    int unused = flight->waiter_count == 0;
+    pthread_mutex_unlock(&flights_lock);
+
+    frame_relay_release(&flight->relay);
+    out_buf_free(&flight->request);
+    flight->connecting = 0;
+    int server_sock = flight->backend.fd;
+    ev_watch_set(&flight->backend, 0);
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) & ~O_NONBLOCK);
+    conn_pool_put(flight->pool, server_sock, reusable);
+    flight->backend.fd = -1;
+    flight->fetching = 0;
+    if (unused) {
+        free_flight(flight);
+    }
+}
+
+// helper to move the fetch on as far as the server and the window allow
+static void run_fetch(struct flight *flight) {
+    // The request goes out once the connection is up
+    if (flight->connecting || flight->request.len > 0) {
+        int result = IO_WAIT_WRITE;
+        int connected = flight->connecting ? conn_pool_connected(flight->pool, flight->backend.fd) : 1;
+        if (connected > 0) {
+            flight->connecting = 0;
+            result = out_buf_flush(&flight->request, flight->backend.fd);
+        } else if (connected < 0) {
+            result = IO_FAIL_WRITE;
+        }
+        if (result == IO_WAIT_WRITE) {
+            ev_watch_set(&flight->backend, EPOLLOUT);
+            return;
+        }
+        if (result != IO_DONE) {
+            printf("Failed to connect to server\n");
+            finish_fetch(flight, FLIGHT_FAILED, 0);
+            return;
+        }
+    }
+    if (flight->state.phase == FLIGHT_NAME) {
+        int result = frame_reader_step(&flight->reader, flight->backend.fd, DFS_MAX_TEXT);
+        if (result == IO_WAIT_READ) {
+            ev_watch_set(&flight->backend, EPOLLIN);
+            return;
+        }
+        if (result != IO_DONE || (flight->reader.hdr.opcode != DFS_OP_NAME && flight->reader.hdr.opcode != DFS_OP_ERROR)) {
+            printf("Connection closed by server.\n");
+            finish_fetch(flight, FLIGHT_FAILED, 0);
+            return;
+        }
+        if (flight->reader.hdr.opcode == DFS_OP_ERROR) {
+            // The reply is complete, the connection is still in sync
+            pthread_mutex_lock(&flights_lock);
+            snprintf(flight->state.message, sizeof(flight->state.message), "%s", flight->reader.payload);
+            pthread_mutex_unlock(&flights_lock);
+            finish_fetch(flight, FLIGHT_REFUSED, 1);
+            return;
+        }
+        uint64_t size, offset;
+        char version[DFS_VERSION_MAX + 1];
+        if (dfs_range_parse_name(flight->reader.payload, &size, version, &offset) < 0 || offset != 0) {
+            printf("Unexpected reply from the server\n");
+            finish_fetch(flight, FLIGHT_FAILED, 0);
+            return;
+        }
+        pthread_mutex_lock(&flights_lock);
+        flight->state.size = size;
+        snprintf(flight->state.version, sizeof(flight->state.version), "%s", version);
+        flight->state.phase = FLIGHT_DATA;
+        wake_waiters(flight);
+        pthread_mutex_unlock(&flights_lock);
+        frame_reader_reset(&flight->reader);
+        frame_relay_init(&flight->relay, flight->backend.fd, flight->fd, 1, RELAY_UPLOAD, 0);
+    }
+
+    // Stay within the window of the slowest waiter, the bytes all of them sent are given back
+    pthread_mutex_lock(&flights_lock);
+    uint64_t low = low_water(flight);
+    if (low / PUNCH_STEP * PUNCH_STEP > flight->punched) {
+        uint64_t upto = low / PUNCH_STEP * PUNCH_STEP;
+        if (fallocate(flight->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)flight->punched, (off_t)(upto - flight->punched)) == 0) {
+            flight->punched = upto;
+        }
+    }
+    flight->paused = flight->state.filled - low > FLIGHT_WINDOW;
+    pthread_mutex_unlock(&flights_lock);
+    if (flight->paused) {
+        ev_watch_set(&flight->backend, 0);
+        return;
+    }
+
+    int result = frame_relay_step(&flight->relay);
+    pthread_mutex_lock(&flights_lock);
+    flight->state.filled = flight->relay.bytes;
+    wake_waiters(flight);
+    pthread_mutex_unlock(&flights_lock);
+    if (result == IO_WAIT_READ || result == IO_WAIT_WRITE) {
+        ev_watch_set(&flight->backend, EPOLLIN);
+        return;
+    }
+    if (result == IO_DONE && flight->relay.opcode == DFS_OP_END && flight->relay.bytes == flight->state.size) {
+        finish_fetch(flight, FLIGHT_DONE, 1);
+        return;
+    }
+    printf("Download from server failed\n");
+    finish_fetch(flight, FLIGHT_FAILED, result == IO_DONE);
+}
+
+// helper called by the event loop when the server connection of a flight is readable
+static void on_flight_backend(struct ev_watch *watch, uint32_t ready) {
+    struct flight *flight = (struct flight *)watch;
+    (void)ready;
+    if (!flight->freed && flight->fetching) {
+        run_fetch(flight);
+    }
+}
+
+// helper called by the event loop when a waiter moved on or left
+static void on_flight_wake(struct ev_watch *watch, uint32_t ready) {
+    struct flight *flight = (struct flight *)((char *)watch - offsetof(struct flight, wake));
+    if (flight->freed) {
+        return;
+    }
+    uint64_t count;
+    ssize_t n = read(watch->fd, &count, sizeof(count));
+    (void)n;
+    (void)ready;
+
+    pthread_mutex_lock(&flights_lock);
+    int unused = flight->waiter_count == 0;
+    if (unused) {
+        // Nobody can join it anymore
+        unlist(flight);
+    }
+    pthread_mutex_unlock(&flights_lock);
+    if (unused) {
+        if (flight->fetching) {
+            // Every requester left, the rest of the file is not needed
+            finish_fetch(flight, FLIGHT_FAILED, 0);
+        } else {
+            free_flight(flight);
+        }
+        return;
+    }
+    if (flight->fetching && flight->paused) {
+        run_fetch(flight);
+    }
+}
+
+// helper to add a waiter to a flight, the caller holds the lock
+static void add_waiter(struct flight *flight, struct flight_waiter *waiter) {
+    waiter->offset = 0;
+    waiter->waiting = 0;
+    waiter->next = flight->waiters;
+    flight->waiters = waiter;
+    flight->waiter_count++;
+}
+
+// helper to find the joinable flight of a path, the caller holds the lock
+static struct flight *find_flight(const char *path) {
+    struct flight *flight = flights;
+    while (flight != NULL && strcmp(flight->path, path) != 0) {
+        flight = flight->next;
+    }
+    return flight;
+}
+
+// Function to join the flight of a path, or start it
+struct flight *flight_join(struct event_loop *loop, struct conn_pool *pool, const char *path, struct flight_waiter *waiter) {
+    pthread_mutex_lock(&flights_lock);
+    struct flight *flight = find_flight(path);
+    // Bytes a new waiter needs may have been given back already, it then starts a flight for later requests
+    if (flight != NULL && flight->punched == 0) {
+        add_waiter(flight, waiter);
+        requests_joined++;
+        pthread_mutex_unlock(&flights_lock);
+        return flight;
+    }
+    pthread_mutex_unlock(&flights_lock);
+
+    // Start a new one: the whole file into a memfd
+    flight = calloc(1, sizeof(*flight));
+    if (flight == NULL || (flight->path = strdup(path)) == NULL) {
+        free(flight);
+        return NULL;
+    }
+    flight->pool = pool;
+    flight->fd = memfd_create("dfs-flight", MFD_CLOEXEC);
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    char request[DFS_MAX_TEXT + 1];
+    snprintf(request, sizeof(request), "%s 0 0", path);
+    // The request waits for the handshake of a new connection on the loop, like the reply
+    int server_sock = -1;
+    if (flight->fd >= 0 && wake_fd >= 0 && (server_sock = conn_pool_get_nonblock(pool, &flight->connecting)) >= 0 &&
+        out_buf_text(&flight->request, DFS_OP_DFILE, 0, request) < 0) {
+        out_buf_free(&flight->request);
+        conn_pool_put(pool, server_sock, 0);
+        server_sock = -1;
+    }
+    if (server_sock < 0) {
+        if (flight->fd >= 0) {
+            close(flight->fd);
+        }
+        if (wake_fd >= 0) {
+            close(wake_fd);
+        }
+        free(flight->path);
+        free(flight);
+        return NULL;
+    }
+    flight->fetching = 1;
+    flight->state.phase = FLIGHT_NAME;
+    frame_relay_init(&flight->relay, -1, -1, 0, RELAY_UPLOAD, 0);
+    ev_watch_init(&flight->backend, loop, server_sock, on_flight_backend);
+    ev_watch_init(&flight->wake, loop, wake_fd, on_flight_wake);
+
+    pthread_mutex_lock(&flights_lock);
+    add_waiter(flight, waiter);
+    flight->next = flights;
+    flights = flight;
+    fetches_started++;
+    pthread_mutex_unlock(&flights_lock);
+    if (ev_watch_set(&flight->backend, EPOLLOUT) < 0 || ev_watch_set(&flight->wake, EPOLLIN) < 0) {
+        // Nothing arrives without the watches, the waiter sees the failure
+        finish_fetch(flight, FLIGHT_FAILED, 0);
+    }
+    return flight;
+}
+
+// Function to copy the state of a flight
+void flight_get(struct flight *flight, struct flight_state *state) {
+    pthread_mutex_lock(&flights_lock);
+    *state = flight->state;
+    pthread_mutex_unlock(&flights_lock);
+}
+
+// Function to hand out a descriptor of the memfd of a flight
+int flight_fd(struct flight *flight) {
+    return dup(flight->fd);
+}
+
+// Function to record how far a waiter got, waking a fetch that waits for it
+void flight_progress(struct flight *flight, struct flight_waiter *waiter, uint64_t offset) {
+    pthread_mutex_lock(&flights_lock);
+    waiter->offset = offset;
+    if (flight->paused && flight->state.filled - low_water(flight) <= FLIGHT_WINDOW / 2) {
+        poke(flight->wake.fd);
+    }
+    pthread_mutex_unlock(&flights_lock);
+}
+
+// Function to wait for the next change of a flight
+int flight_wait(struct flight *flight, struct flight_waiter *waiter, const struct flight_state *state) {
+    pthread_mutex_lock(&flights_lock);
+    int changed = flight->state.phase != state->phase || flight->state.filled != state->filled;
+    if (!changed) {
+        waiter->waiting = 1;
+    }
+    pthread_mutex_unlock(&flights_lock);
+    return !changed;
+}
+
+// Function to remove a waiter from a flight, its loop frees the flight once nobody uses it
+void flight_leave(struct flight *flight, struct flight_waiter *waiter) {
+    pthread_mutex_lock(&flights_lock);
+    struct flight_waiter **link = &flight->waiters;
+    while (*link != NULL && *link != waiter) {
+        link = &(*link)->next;
+    }
+    if (*link == waiter) {
+        *link = waiter->next;
+        flight->waiter_count--;
+    }
+    poke(flight->wake.fd);
+    pthread_mutex_unlock(&flights_lock);
+}
+
+// Function to keep later requests of a path out of its running flights
+void flight_forget(const char *path) {
+    pthread_mutex_lock(&flights_lock);
+    struct flight *flight;
+    while ((flight = find_flight(path)) != NULL) {
+        unlist(flight);
+    }
+    pthread_mutex_unlock(&flights_lock);
+}
+
+// Function to print the counters of all flights
+void flight_print_stats(void) {
+    pthread_mutex_lock(&flights_lock);
+    printf("Coalesced downloads: %llu fetches, %llu requests joined a running one\n",
+           (unsigned long long)fetches_started, (unsigned long long)requests_joined);
+    pthread_mutex_unlock(&flights_lock);
+}
@@ -0,0 +1,82 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+
+#include "../common/dfs_range.h"
+#include "../common/dfs_proto.h"
+#include "conn_pool.h"
+#include "event_loop.h"
+
+// Single-flight downloads for smain: concurrent dfile requests of the same .pdf/.txt file share one
+// fetch from its server instead of each reading the file again.
+//
+// The first request of a path starts a flight: the whole file is asked for ("<path> 0 0") on a pooled
+// connection, watched by that request's event loop, and its DATA is spliced into a memfd. Requests of
+// the same path that arrive meanwhile join the flight. Every requester is a waiter that sends its own
+// reply (its range, or the whole file) from the memfd as the bytes arrive, and is woken through its
+// eventfd when more are there.
+//
+// The fetch runs at most FLIGHT_WINDOW bytes ahead of the slowest waiter, and what every waiter sent
+// already is punched out of the memfd, so a flight holds little memory however large the file is. A
+// request that would need bytes punched out already starts a new flight, which the requests after it
+// join. A flight all waiters left is cancelled, and a finished one is forgotten: later requests start
+// a new one. So are the running ones of a path that a 'ufile' or 'rmfile' changes.
+
+#define FLIGHT_WINDOW (16 * 1024 * 1024)
+
+enum flight_phase {
+    FLIGHT_NAME,     // waiting for the NAME reply
+    FLIGHT_DATA,     // size and version known, DATA arriving
+    FLIGHT_DONE,     // all of the file arrived
+    FLIGHT_REFUSED,  // the server answered with an error, see message
+    FLIGHT_FAILED    // the fetch broke off
+};
+
+// A requester of a flight, embedded in its connection
+struct flight_waiter {
+    struct flight_waiter *next;
+    int notify_fd;        // eventfd written when the flight moved on
+    uint64_t offset;      // bytes before this one are not needed by the waiter anymore
+    int waiting;          // notify_fd is written on the next change
+};
+
+// What a waiter may use of a flight
+struct flight_state {
+    enum flight_phase phase;
+    uint64_t size;
+    char version[DFS_VERSION_MAX + 1];
+    uint64_t filled;      // bytes of the file in the memfd
+    char message[DFS_MAX_TEXT + 1];
+};
+
+struct flight;
+
+// Join the flight of path, starting it on loop with a connection of pool if there is none. waiter
+// has its notify_fd set. Returns NULL if the flight can not be joined or started, the request is then
+// relayed on its own.
+struct flight *flight_join(struct event_loop *loop, struct conn_pool *pool, const char *path, struct flight_waiter *waiter);
+
+// Copy the state of the flight
+void flight_get(struct flight *flight, struct flight_state *state);
+
+// A descriptor of the memfd for sendfile() (dup()ed, the caller closes it), -1 if it failed
+int flight_fd(struct flight *flight);
+
+// The waiter does not need the bytes before offset anymore
+void flight_progress(struct flight *flight, struct flight_waiter *waiter, uint64_t offset);
+
+// Ask to be woken on the next change. Returns 0 if the flight changed since state was read (look
+// again), 1 once the waiter is waiting.
+int flight_wait(struct flight *flight, struct flight_waiter *waiter, const struct flight_state *state);
+
+// The waiter is done with the flight (from any thread)
+void flight_leave(struct flight *flight, struct flight_waiter *waiter);
+
+// The file at path is being replaced or removed: later requests do not join its running flight
+void flight_forget(const char *path);
+
+// Print how many fetches served how many requests as one log line
+void flight_print_stats(void);
+
+#endif
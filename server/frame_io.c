@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "frame_io.h"
+
+// Phases of a frame relay
+#define RELAY_HDR_IN 0
+#define RELAY_HDR_OUT 1
+#define RELAY_PAYLOAD 2
+
+// Pipes kept per thread for relays that finished cleanly
+#define PIPE_CACHE_SIZE 16
+
+// Largest piece handed to sendfile() at once, so one big file does not starve other connections
+#define SENDFILE_CHUNK (1024 * 1024)
+
+// Payload bytes a relay moves per call before it lets the event loop serve other connections.
+// It then reports a wait on a descriptor that is still ready, so it is called again right away.
+#define RELAY_BUDGET (4 * DFS_CHUNK_SIZE)
+
+static __thread int pipe_cache[PIPE_CACHE_SIZE][2];
+static __thread int pipe_cache_count;
+
+// helper to make room for n more bytes in an output buffer
+static int out_buf_reserve(struct out_buf *out, size_t n) {
+    // Everything queued earlier was sent, start from the beginning again
+    if (out->sent == out->len) {
+        out->sent = out->len = 0;
+    }
+    if (out->len + n <= out->cap) {
+        return 0;
+    }
+    size_t cap = out->cap ? out->cap : 256;
+    while (cap < out->len + n) {
+        cap *= 2;
+    }
+    char *grown = realloc(out->data, cap);
+    if (grown == NULL) {
+        perror("Output buffer allocation failed");
+        return -1;
+    }
+    out->data = grown;
+    out->cap = cap;
+    return 0;
+}
+
+// Function to queue a frame header whose payload is sent separately
+int out_buf_hdr(struct out_buf *out, int opcode, uint32_t request_id, uint64_t length) {
+    if (out_buf_reserve(out, DFS_HDR_SIZE) < 0) {
+        return -1;
+    }
+    dfs_pack_hdr((unsigned char *)out->data + out->len, opcode, request_id, length);
+    out->len += DFS_HDR_SIZE;
+    return 0;
+}
+
+// Function to queue a complete frame
+int out_buf_frame(struct out_buf *out, int opcode, uint32_t request_id, const void *payload, size_t length) {
+    if (out_buf_reserve(out, DFS_HDR_SIZE + length) < 0) {
+        return -1;
+    }
+    dfs_pack_hdr((unsigned char *)out->data + out->len, opcode, request_id, length);
+    if (length > 0) {
+        memcpy(out->data + out->len + DFS_HDR_SIZE, payload, length);
+    }
+    out->len += DFS_HDR_SIZE + length;
+    return 0;
+}
+
+// Function to queue a frame whose payload is a string
+int out_buf_text(struct out_buf *out, int opcode, uint32_t request_id, const char *text) {
+    return out_buf_frame(out, opcode, request_id, text, strlen(text));
+}
+
+// Function to send as much of the queued bytes as the socket accepts
+int out_buf_flush(struct out_buf *out, int sock) {
+    while (out->sent < out->len) {
+        ssize_t n = send(sock, out->data + out->sent, out->len - out->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_WAIT_WRITE;
+            }
+            return IO_FAIL_WRITE;
+        }
+        out->sent += (size_t)n;
+    }
+    // Idle connections should not keep buffers around
+    out_buf_free(out);
+    return IO_DONE;
+}
+
+// Function to release an output buffer
+void out_buf_free(struct out_buf *out) {
+    free(out->data);
+    out->data = NULL;
+    out->len = out->sent = out->cap = 0;
+}
+
+// Function to read the next frame from a socket as far as data is available
+int frame_reader_step(struct frame_reader *reader, int sock, size_t max_payload) {
+    // The header first
+    while (reader->raw_len < DFS_HDR_SIZE) {
+        ssize_t n = recv(sock, reader->raw + reader->raw_len, DFS_HDR_SIZE - reader->raw_len, 0);
+        if (n > 0) {
+            reader->raw_len += (size_t)n;
+            continue;
+        }
+        if (n == 0) {
+            return reader->raw_len == 0 ? IO_EOF : IO_FAIL_READ;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK ? IO_WAIT_READ : IO_FAIL_READ;
+    }
+
+    // Decode it once and allocate room for the payload
+    if (reader->payload == NULL) {
+        if (dfs_unpack_hdr(reader->raw, &reader->hdr) < 0) {
+            return IO_FAIL_READ;
+        }
+        if (reader->hdr.length > max_payload) {
+            fprintf(stderr, "Text frame too long (%llu bytes)\n", (unsigned long long)reader->hdr.length);
+            return IO_FAIL_READ;
+        }
+        reader->payload = malloc((size_t)reader->hdr.length + 1);
+        if (reader->payload == NULL) {
+            perror("Frame buffer allocation failed");
+            return IO_FAIL_READ;
+        }
+        reader->payload_len = 0;
+    }
+
+    // Then the payload
+    while (reader->payload_len < reader->hdr.length) {
+        ssize_t n = recv(sock, reader->payload + reader->payload_len, (size_t)reader->hdr.length - reader->payload_len, 0);
+        if (n > 0) {
+            reader->payload_len += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return IO_WAIT_READ;
+        }
+        return IO_FAIL_READ;
+    }
+    reader->payload[reader->payload_len] = '\0';
+    return IO_DONE;
+}
+
+// Function to release a reader's payload and start over with a new frame
+void frame_reader_reset(struct frame_reader *reader) {
+    free(reader->payload);
+    reader->payload = NULL;
+    reader->payload_len = 0;
+    reader->raw_len = 0;
+}
+
+// helper to check whether an opcode may appear in a relayed sequence
+static int relay_allows(enum relay_mode mode, int opcode) {
+    if (opcode == DFS_OP_DATA || opcode == DFS_OP_END || opcode == DFS_OP_ERROR) {
+        return 1;
+    }
+    return mode == RELAY_REPLY && (opcode == DFS_OP_OK || opcode == DFS_OP_NAME || opcode == DFS_OP_CONTINUE ||
+                                   opcode == DFS_OP_DELTA);
+}
+
+// helper to check whether an opcode ends a relayed sequence
+static int relay_is_last(enum relay_mode mode, int opcode) {
+    if (opcode == DFS_OP_END || opcode == DFS_OP_ERROR) {
+        return 1;
+    }
+    return mode == RELAY_REPLY && (opcode == DFS_OP_OK || opcode == DFS_OP_CONTINUE || opcode == DFS_OP_DELTA);
+}
+
+// helper to get a pipe for splicing, reusing one from this thread's cache when possible
+static int relay_get_pipe(struct frame_relay *relay) {
+    if (relay->pipe_fds[0] >= 0) {
+        return 0;
+    }
+    if (pipe_cache_count > 0) {
+        pipe_cache_count--;
+        relay->pipe_fds[0] = pipe_cache[pipe_cache_count][0];
+        relay->pipe_fds[1] = pipe_cache[pipe_cache_count][1];
+        return 0;
+    }
+    if (pipe2(relay->pipe_fds, O_CLOEXEC) < 0) {
+        perror("Relay pipe creation failed");
+        relay->pipe_fds[0] = relay->pipe_fds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// helper to close a relay's pipe, it may still hold bytes that belong to nobody
+static void relay_close_pipe(struct frame_relay *relay) {
+    if (relay->pipe_fds[0] >= 0) {
+        close(relay->pipe_fds[0]);
+        close(relay->pipe_fds[1]);
+        relay->pipe_fds[0] = relay->pipe_fds[1] = -1;
+    }
+    relay->in_pipe = 0;
+}
+
+// Function to set up a relay, the pipe is taken when the first payload needs it
+void frame_relay_init(struct frame_relay *relay, int from, int to, int to_is_file, enum relay_mode mode, uint32_t request_id) {
+    memset(relay, 0, sizeof(*relay));
+    relay->from = from;
+    relay->to = to;
+    relay->to_is_file = to_is_file;
+    relay->mode = mode;
+    relay->request_id = request_id;
+    relay->pipe_fds[0] = relay->pipe_fds[1] = -1;
+    relay->phase = RELAY_HDR_IN;
+}
+
+// Function to move frames from the source to the destination until the sequence is complete
+int frame_relay_step(struct frame_relay *relay) {
+    uint64_t budget = RELAY_BUDGET;
+
+    while (1) {
+        if (relay->phase == RELAY_HDR_IN) {
+            // Read the next header
+            while (relay->hdr_len < DFS_HDR_SIZE) {
+                ssize_t n = recv(relay->from, relay->hdr + relay->hdr_len, DFS_HDR_SIZE - relay->hdr_len, 0);
+                if (n > 0) {
+                    relay->hdr_len += (size_t)n;
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return IO_WAIT_READ;
+                }
+                return IO_FAIL_READ;
+            }
+            struct dfs_hdr hdr;
+            if (dfs_unpack_hdr(relay->hdr, &hdr) < 0) {
+                return IO_FAIL_READ;
+            }
+            if (!relay_allows(relay->mode, hdr.opcode)) {
+                fprintf(stderr, "Unexpected %s frame in stream\n", dfs_opcode_name(hdr.opcode));
+                return IO_FAIL_READ;
+            }
+            relay->opcode = hdr.opcode;
+            relay->remaining = hdr.length;
+            // Only the content of DATA frames goes into a file, headers never do
+            relay->discard = relay->to < 0 || (relay->to_is_file && hdr.opcode != DFS_OP_DATA);
+            relay->hdr_len = 0;
+            if (relay->to >= 0 && !relay->to_is_file) {
+                dfs_pack_hdr(relay->hdr, hdr.opcode, relay->request_id, hdr.length);
+                relay->phase = RELAY_HDR_OUT;
+            } else {
+                relay->phase = RELAY_PAYLOAD;
+            }
+        }
+
+        if (relay->phase == RELAY_HDR_OUT) {
+            // Forward the rewritten header, corked when a payload follows
+            int flags = MSG_NOSIGNAL | (relay->remaining > 0 ? MSG_MORE : 0);
+            while (relay->hdr_len < DFS_HDR_SIZE) {
+                ssize_t n = send(relay->to, relay->hdr + relay->hdr_len, DFS_HDR_SIZE - relay->hdr_len, flags);
+                if (n > 0) {
+                    relay->hdr_len += (size_t)n;
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return IO_WAIT_WRITE;
+                }
+                return IO_FAIL_WRITE;
+            }
+            relay->phase = RELAY_PAYLOAD;
+        }
+
+        // Move the payload: source -> pipe -> destination
+        while (relay->remaining > 0 || relay->in_pipe > 0) {
+            // A file can not be waited for, the pipe is always emptied into it before yielding
+            if (budget == 0 && !(relay->to_is_file && relay->in_pipe > 0)) {
+                return relay->in_pipe > 0 ? IO_WAIT_WRITE : IO_WAIT_READ;
+            }
+            if (relay->discard) {
+                char scratch[16384];
+                size_t want = relay->remaining < sizeof(scratch) ? (size_t)relay->remaining : sizeof(scratch);
+                ssize_t n = recv(relay->from, scratch, want, 0);
+                if (n > 0) {
+                    relay->remaining -= (uint64_t)n;
+                    budget = budget > (uint64_t)n ? budget - (uint64_t)n : 0;
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return IO_WAIT_READ;
+                }
+                return IO_FAIL_READ;
+            }
+            if (relay->in_pipe > 0) {
+                // SPLICE_F_MORE corks the socket, so it is only set while more payload is to come
+                unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (relay->remaining > 0 ? SPLICE_F_MORE : 0);
+                ssize_t n = splice(relay->pipe_fds[0], NULL, relay->to, NULL, relay->in_pipe, flags);
+                if (n > 0) {
+                    relay->in_pipe -= (size_t)n;
+                    relay->bytes += (uint64_t)n;
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return IO_WAIT_WRITE;
+                }
+                return IO_FAIL_WRITE;
+            }
+            if (relay_get_pipe(relay) < 0) {
+                return IO_FAIL_WRITE;
+            }
+            // The pipe is empty here, so EAGAIN can only mean the source has nothing yet
+            size_t want = relay->remaining < DFS_CHUNK_SIZE ? (size_t)relay->remaining : DFS_CHUNK_SIZE;
+            ssize_t n = splice(relay->from, NULL, relay->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                relay->in_pipe += (size_t)n;
+                relay->remaining -= (uint64_t)n;
+                budget = budget > (uint64_t)n ? budget - (uint64_t)n : 0;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return IO_WAIT_READ;
+            }
+            return IO_FAIL_READ;
+        }
+
+        // The frame is complete, go on with the next one unless it closed the sequence
+        relay->phase = RELAY_HDR_IN;
+        relay->hdr_len = 0;
+        if (relay_is_last(relay->mode, relay->opcode)) {
+            return IO_DONE;
+        }
+    }
+}
+
+// Function to turn a relay into a drain after its destination failed
+void frame_relay_discard(struct frame_relay *relay) {
+    relay_close_pipe(relay);
+    relay->to = -1;
+    relay->discard = 1;
+    if (relay->phase == RELAY_HDR_OUT) {
+        relay->phase = RELAY_PAYLOAD;
+    }
+}
+
+// Function to check whether the destination is between two frames
+int frame_relay_at_boundary(const struct frame_relay *relay) {
+    return relay->phase == RELAY_HDR_IN || (relay->phase == RELAY_HDR_OUT && relay->hdr_len == 0);
+}
+
+// Function to give back a relay's pipe
+void frame_relay_release(struct frame_relay *relay) {
+    if (relay->pipe_fds[0] < 0) {
+        return;
+    }
+    if (relay->in_pipe == 0 && pipe_cache_count < PIPE_CACHE_SIZE) {
+        pipe_cache[pipe_cache_count][0] = relay->pipe_fds[0];
+        pipe_cache[pipe_cache_count][1] = relay->pipe_fds[1];
+        pipe_cache_count++;
+        relay->pipe_fds[0] = relay->pipe_fds[1] = -1;
+        return;
+    }
+    relay_close_pipe(relay);
+}
+
+// Function to send the rest of a file, falling back to pread()/send() where sendfile() is not supported.
+// At most SENDFILE_CHUNK bytes are sent per call, then IO_WAIT_WRITE gives other connections a turn.
+int file_sender_step(struct file_sender *sender, int sock) {
+    uint64_t budget = SENDFILE_CHUNK;
+
+    while (sender->left > 0) {
+        if (budget == 0) {
+            return IO_WAIT_WRITE;
+        }
+        if (sender->padding) {
+            static const char zeros[16384];
+            size_t chunk = sender->left < sizeof(zeros) ? (size_t)sender->left : sizeof(zeros);
+            ssize_t sent = send(sock, zeros, chunk, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK ? IO_WAIT_WRITE : IO_FAIL_WRITE;
+            }
+            sender->left -= (uint64_t)sent;
+            budget = budget > (uint64_t)sent ? budget - (uint64_t)sent : 0;
+            continue;
+        }
+        size_t want = sender->left < SENDFILE_CHUNK ? (size_t)sender->left : SENDFILE_CHUNK;
+        want = want < budget ? want : (size_t)budget;
+        ssize_t n = sendfile(sock, sender->fd, &sender->offset, want);
+        if (n > 0) {
+            sender->left -= (uint64_t)n;
+            budget -= (uint64_t)n;
+            continue;
+        }
+        if (n == 0 && sender->pad_short) {
+            printf("File shrank while it was archived, padding it with zeros\n");
+            sender->padding = 1;
+            continue;
+        }
+        if (n == 0) {
+            fprintf(stderr, "File ended before its announced size\n");
+            return IO_FAIL_READ;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return IO_WAIT_WRITE;
+        }
+        if (errno == EIO) {
+            return IO_FAIL_READ;
+        }
+        if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            return IO_FAIL_WRITE;
+        }
+
+        // No sendfile() for this file, copy one buffer through user space
+        char buffer[16384];
+        size_t chunk = sender->left < sizeof(buffer) ? (size_t)sender->left : sizeof(buffer);
+        ssize_t got = pread(sender->fd, buffer, chunk, sender->offset);
+        if (got <= 0 && sender->pad_short) {
+            printf("File shrank while it was archived, padding it with zeros\n");
+            sender->padding = 1;
+            continue;
+        }
+        if (got <= 0) {
+            return IO_FAIL_READ;
+        }
+        ssize_t sent = send(sock, buffer, (size_t)got, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? IO_WAIT_WRITE : IO_FAIL_WRITE;
+        }
+        sender->offset += sent;
+        sender->left -= (uint64_t)sent;
+        budget = budget > (uint64_t)sent ? budget - (uint64_t)sent : 0;
+    }
+    return IO_DONE;
+}
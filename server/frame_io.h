@@ -0,0 +1,108 @@
+#ifndef FRAME_IO_H
+#define FRAME_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "../common/dfs_proto.h"
+
+// Non-blocking building blocks for frame based state machines (see common/dfs_proto.h for the
+// frame format). Every step function does as much work as the descriptors allow and then
+// reports what it is waiting for, so a caller never blocks on a slow peer.
+
+// Results of the step functions
+enum io_result {
+    IO_DONE = 0,      // the operation completed
+    IO_WAIT_READ,     // waiting for the source to become readable
+    IO_WAIT_WRITE,    // waiting for the destination to become writable
+    IO_EOF,           // the peer closed the connection cleanly before a new frame started
+    IO_FAIL_READ,     // reading the source failed, or it sent something that is not a valid frame
+    IO_FAIL_WRITE     // writing the destination failed
+};
+
+// Bytes queued for a non-blocking socket
+struct out_buf {
+    char *data;
+    size_t len;   // bytes queued
+    size_t sent;  // bytes of data already sent
+    size_t cap;
+};
+
+// Queue a frame header alone (the payload follows separately), a whole frame, or a text frame
+int out_buf_hdr(struct out_buf *out, int opcode, uint32_t request_id, uint64_t length);
+int out_buf_frame(struct out_buf *out, int opcode, uint32_t request_id, const void *payload, size_t length);
+int out_buf_text(struct out_buf *out, int opcode, uint32_t request_id, const char *text);
+
+// Send queued bytes: IO_DONE once the buffer is empty (its memory is released), IO_WAIT_WRITE or IO_FAIL_WRITE
+int out_buf_flush(struct out_buf *out, int sock);
+void out_buf_free(struct out_buf *out);
+
+// Reads one frame with a text payload of at most max_payload bytes
+struct frame_reader {
+    unsigned char raw[DFS_HDR_SIZE];
+    size_t raw_len;
+    struct dfs_hdr hdr;
+    char *payload;       // NUL-terminated payload once IO_DONE is returned
+    size_t payload_len;  // payload bytes received so far
+};
+
+// Read as much of the frame as available: IO_DONE, IO_WAIT_READ, IO_EOF or IO_FAIL_READ (also for too long payloads)
+int frame_reader_step(struct frame_reader *reader, int sock, size_t max_payload);
+
+// Release the payload and get ready for the next frame
+void frame_reader_reset(struct frame_reader *reader);
+
+enum relay_mode {
+    RELAY_UPLOAD,  // DATA frames closed by END (or ERROR when the sender gives up)
+    RELAY_REPLY    // a reply: OK, ERROR, CONTINUE, DELTA, or NAME followed by DATA frames closed by END
+};
+
+// Moves a sequence of frames from one descriptor to another. Headers are rewritten with
+// request_id, payloads are spliced through a pipe so they never enter user space.
+// The destination may be a socket, a regular file (payloads of DATA frames only) or -1 to discard.
+struct frame_relay {
+    int from;
+    int to;
+    int to_is_file;
+    enum relay_mode mode;
+    uint32_t request_id;
+    int pipe_fds[2];
+    int phase;            // reading the header, writing the header or moving the payload
+    unsigned char hdr[DFS_HDR_SIZE];
+    size_t hdr_len;       // header bytes read or written in the current phase
+    int opcode;           // opcode of the current (after IO_DONE: the last) frame
+    int discard;          // payload of the current frame is dropped
+    uint64_t remaining;   // payload bytes still to read from the source
+    size_t in_pipe;       // payload bytes in the pipe, not yet written
+    uint64_t bytes;       // payload bytes moved so far
+};
+
+void frame_relay_init(struct frame_relay *relay, int from, int to, int to_is_file, enum relay_mode mode, uint32_t request_id);
+
+// Move frames until the last one is complete: IO_DONE, IO_WAIT_READ (source), IO_WAIT_WRITE (destination),
+// IO_FAIL_READ or IO_FAIL_WRITE
+int frame_relay_step(struct frame_relay *relay);
+
+// After the destination failed: consume the rest of the frames from the source and drop them
+void frame_relay_discard(struct frame_relay *relay);
+
+// 1 if the destination did not get part of a frame, so another frame can still be sent to it
+int frame_relay_at_boundary(const struct frame_relay *relay);
+
+// Give the pipe back to this thread's cache (or close it if it may hold stale bytes)
+void frame_relay_release(struct frame_relay *relay);
+
+// Sends length bytes of a file to a socket with sendfile()
+struct file_sender {
+    int fd;
+    off_t offset;
+    uint64_t left;
+    int pad_short;  // if the file ends early send zeros for the rest (tar members), instead of failing
+    int padding;    // set once that happened
+};
+
+// IO_DONE, IO_WAIT_WRITE, IO_FAIL_WRITE, or IO_FAIL_READ if the file ended early or could not be read
+int file_sender_step(struct file_sender *sender, int sock);
+
+#endif
@@ -0,0 +1,1313 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "name_index.h"
+#include "../common/dfs_proto.h"
+
+// Changes every indexed directory is watched for, and the ones of the directory holding the root
+#define DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+// Initial bucket count of the hash tables, they double when they fill up
+#define INDEX_BUCKETS 1024
+
+// Bytes of inotify events read at once
+#define EVENT_BUFFER (64 * 1024)
+
+// Bytes of paths the journal keeps for a server that does not take them, more are dropped
+#define JOURNAL_MAX (1024 * 1024)
+
+// A changed index is written to its snapshot at most this often (milliseconds)
+#define SNAPSHOT_INTERVAL_MS (60 * 1000)
+
+// Directories modified this shortly before a snapshot is written are read again on the next start:
+// a change in the same timestamp tick as the one recorded would not change their mtime (ns)
+#define SNAPSHOT_RACY_NS 2000000000LL
+
+// Snapshot file, in native byte order: the header, the root path, then the records of the tree in
+// pre-order. A record is a uint8 type, a uint16 name length and the name; a directory adds its
+// uint64 inode, int64 mtime (ns) and uint32 entry count, and the records of its entries follow.
+#define SNAPSHOT_MAGIC "DFSIDX1\n"
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t root_len;
+    uint32_t crc;                   // CRC-32 of the records
+    uint64_t records_len;
+};
+
+// A record of the snapshot while it is loaded
+struct snapshot_record {
+    int type;
+    char name[NAME_MAX + 1];
+    uint64_t ino;
+    int64_t mtime_ns;
+    uint32_t entries;
+};
+
+// Records of a mapped snapshot not read yet
+struct snapshot_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+};
+
+// Records of a snapshot being written
+struct snapshot_writer {
+    FILE *out;
+    uLong crc;
+    uint64_t len;
+    int64_t now_ns;
+    int failed;
+};
+
+// A path component, stored once however many directories use it
+struct index_name {
+    struct index_name *next;        // chain of the name table
+    uint32_t hash;
+    uint32_t refs;                  // nodes using the name
+    char text[];
+};
+
+// A file, directory or other entry of the tree
+struct index_node {
+    struct index_name *name;
+    struct index_node *parent;      // NULL for the root
+    struct index_node **children;   // directory: its entries sorted by name
+    uint32_t child_count;
+    uint32_t child_cap;
+    int type;                       // enum index_answer
+    int wd;                         // directory: its inotify watch, -1 if it has none
+    struct index_node *wd_next;     // chain of the watch table
+    uint64_t ino;                   // directory: its inode and mtime when its entries were read
+    int64_t mtime_ns;
+};
+
+struct name_index {
+    char root[PATH_MAX];
+    size_t root_len;
+    const char *root_name;          // last component of root, watched for in its parent directory
+    pthread_rwlock_t lock;          // lookups read, the thread and name_index_update() change the tree
+    int ready;                      // the tree was read and every directory is watched
+    int broken;                     // a directory could not be watched or indexed
+    int overflow;                   // inotify dropped events, the tree must be read again
+    struct index_node *top;         // node of root, NULL while root is not a directory
+    int inotify_fd;
+    int parent_wd;                  // watch of the directory holding root
+    int stop_fd;                    // eventfd that ends the thread
+    pthread_t thread;
+    struct index_name **names;      // interned names
+    size_t name_buckets;
+    size_t name_count;
+    struct index_node **watches;    // watched directories by watch descriptor
+    size_t watch_buckets;
+    size_t watch_count;
+    size_t files;
+    size_t dirs;
+    char snapshot[PATH_MAX + 16];   // file the tree is saved in between runs
+    int dirty;                      // the tree changed since it was saved
+    size_t reread;                  // directories that changed since the snapshot that was loaded
+    pthread_mutex_t journal_lock;   // the journal: paths the thread added, see name_index_journal_fd()
+    int journal_fd;                 // eventfd readable while it holds paths, -1 until a server asks for it
+    char *journal;                  // paths relative to root, each ended by a '\0'
+    size_t journal_len;
+    size_t journal_cap;
+    int journal_lost;               // paths were dropped since it was last taken
+};
+
+// helper for the FNV-1a hash of a name
+static uint32_t hash_text(const char *text) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+// helper to map a file mode to what the index calls it
+static int mode_type(mode_t mode) {
+    if (S_ISREG(mode)) {
+        return INDEX_FILE;
+    }
+    return S_ISDIR(mode) ? INDEX_DIR : INDEX_OTHER;
+}
+
+// helper to get the stored copy of a name, it is added to the table if it is new
+static struct index_name *name_intern(struct name_index *index, const char *text) {
+    uint32_t hash = hash_text(text);
+    for (struct index_name *name = index->names[hash & (index->name_buckets - 1)]; name != NULL; name = name->next) {
+        if (name->hash == hash && strcmp(name->text, text) == 0) {
+            name->refs++;
+            return name;
+        }
+    }
+
+    // Double the table when it is full, if that fails the chains just get longer
+    if (index->name_count >= index->name_buckets) {
+        size_t buckets = index->name_buckets * 2;
+        struct index_name **grown = calloc(buckets, sizeof(*grown));
+        if (grown != NULL) {
+            for (size_t i = 0; i < index->name_buckets; i++) {
+                while (index->names[i] != NULL) {
+                    struct index_name *name = index->names[i];
+                    index->names[i] = name->next;
+                    name->next = grown[name->hash & (buckets - 1)];
+                    grown[name->hash & (buckets - 1)] = name;
+                }
+            }
+            free(index->names);
+            index->names = grown;
+            index->name_buckets = buckets;
+        }
+    }
+
+    size_t len = strlen(text);
+    struct index_name *name = malloc(sizeof(*name) + len + 1);
+    if (name == NULL) {
+        return NULL;
+    }
+    name->hash = hash;
+    name->refs = 1;
+    memcpy(name->text, text, len + 1);
+    name->next = index->names[hash & (index->name_buckets - 1)];
+    index->names[hash & (index->name_buckets - 1)] = name;
+    index->name_count++;
+    return name;
+}
+
+// helper to drop a node's use of a name, the name is freed with its last user
+static void name_release(struct name_index *index, struct index_name *name) {
+    if (--name->refs > 0) {
+        return;
+    }
+    struct index_name **link = &index->names[name->hash & (index->name_buckets - 1)];
+    while (*link != name) {
+        link = &(*link)->next;
+    }
+    *link = name->next;
+    index->name_count--;
+    free(name);
+}
+
+// helper to find the directory a watch descriptor belongs to
+static struct index_node *watch_find(struct name_index *index, int wd) {
+    for (struct index_node *node = index->watches[(size_t)wd & (index->watch_buckets - 1)]; node != NULL; node = node->wd_next) {
+        if (node->wd == wd) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// helper to add a directory to the watch table under its watch descriptor
+static void watch_insert(struct name_index *index, struct index_node *node) {
+    if (index->watch_count >= index->watch_buckets) {
+        size_t buckets = index->watch_buckets * 2;
+        struct index_node **grown = calloc(buckets, sizeof(*grown));
+        if (grown != NULL) {
+            for (size_t i = 0; i < index->watch_buckets; i++) {
+                while (index->watches[i] != NULL) {
+                    struct index_node *moved = index->watches[i];
+                    index->watches[i] = moved->wd_next;
+                    moved->wd_next = grown[(size_t)moved->wd & (buckets - 1)];
+                    grown[(size_t)moved->wd & (buckets - 1)] = moved;
+                }
+            }
+            free(index->watches);
+            index->watches = grown;
+            index->watch_buckets = buckets;
+        }
+    }
+    size_t bucket = (size_t)node->wd & (index->watch_buckets - 1);
+    node->wd_next = index->watches[bucket];
+    index->watches[bucket] = node;
+    index->watch_count++;
+}
+
+// helper to take a directory out of the watch table, its watch descriptor becomes -1
+static void watch_remove(struct name_index *index, struct index_node *node) {
+    struct index_node **link = &index->watches[(size_t)node->wd & (index->watch_buckets - 1)];
+    while (*link != NULL && *link != node) {
+        link = &(*link)->wd_next;
+    }
+    if (*link != NULL) {
+        *link = node->wd_next;
+        index->watch_count--;
+    }
+    node->wd = -1;
+    node->wd_next = NULL;
+}
+
+// helper to binary search the entries of a directory. Returns the entry called name or NULL,
+// *pos is where name is or would be inserted
+static struct index_node *child_find(const struct index_node *dir, const char *name, uint32_t *pos) {
+    uint32_t low = 0;
+    uint32_t high = dir->child_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        int order = strcmp(dir->children[mid]->name->text, name);
+        if (order == 0) {
+            *pos = mid;
+            return dir->children[mid];
+        }
+        if (order < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *pos = low;
+    return NULL;
+}
+
+static int node_path(const struct name_index *index, const struct index_node *node, char *path, size_t size);
+
+// helper to wake the server taking the journal, the caller holds the journal lock
+static void journal_signal(struct name_index *index) {
+    uint64_t one = 1;
+    if (write(index->journal_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Index journal signal failed");
+    }
+}
+
+// helper to drop the paths of the journal, the server can no longer learn the additions from it.
+// The caller holds the journal lock.
+static void journal_lose(struct name_index *index) {
+    if (index->journal_fd >= 0 && !index->journal_lost) {
+        index->journal_lost = 1;
+        index->journal_len = 0;
+        journal_signal(index);
+    }
+}
+
+// helper to record an entry the thread adds to a trusted tree (it was created by other means than
+// the server, which reports its own changes with name_index_update()), if a server asked for that
+static void journal_add(struct name_index *index, const struct index_node *parent, const char *name, int type) {
+    if (parent == NULL || !index->ready || !pthread_equal(pthread_self(), index->thread)) {
+        return;
+    }
+    char path[PATH_MAX];
+    int len = node_path(index, parent, path, sizeof(path));
+    int fits = len >= 0 && snprintf(path + len, sizeof(path) - len, "/%s", name) < (int)(sizeof(path) - len);
+    const char *key = path + index->root_len + 1;
+    size_t key_len = fits ? strlen(key) + 1 : 0;
+
+    pthread_mutex_lock(&index->journal_lock);
+    if (index->journal_fd < 0 || index->journal_lost) {
+        pthread_mutex_unlock(&index->journal_lock);
+        return;
+    }
+    // The server can not vouch for what lies behind a symbolic link
+    if (!fits || type == INDEX_OTHER || index->journal_len + key_len > JOURNAL_MAX) {
+        journal_lose(index);
+        pthread_mutex_unlock(&index->journal_lock);
+        return;
+    }
+    if (index->journal_len + key_len > index->journal_cap) {
+        size_t cap = index->journal_cap ? index->journal_cap * 2 : 4096;
+        while (cap < index->journal_len + key_len) {
+            cap *= 2;
+        }
+        char *grown = realloc(index->journal, cap);
+        if (grown == NULL) {
+            journal_lose(index);
+            pthread_mutex_unlock(&index->journal_lock);
+            return;
+        }
+        index->journal = grown;
+        index->journal_cap = cap;
+    }
+    memcpy(index->journal + index->journal_len, key, key_len);
+    index->journal_len += key_len;
+    journal_signal(index);
+    pthread_mutex_unlock(&index->journal_lock);
+}
+
+// helper to create a node that is not linked into the tree yet
+static struct index_node *node_new(struct name_index *index, struct index_node *parent, const char *name, int type) {
+    struct index_node *node = calloc(1, sizeof(*node));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->name = name_intern(index, name);
+    if (node->name == NULL) {
+        free(node);
+        return NULL;
+    }
+    node->parent = parent;
+    node->type = type;
+    node->wd = -1;
+    index->dirty = 1;
+    journal_add(index, parent, name, type);
+    if (type == INDEX_DIR) {
+        index->dirs++;
+    } else {
+        index->files++;
+    }
+    return node;
+}
+
+// helper to add an entry to a directory, in sort order. Returns the new node, or NULL if memory ran out
+static struct index_node *node_add(struct name_index *index, struct index_node *dir, const char *name, int type) {
+    uint32_t pos;
+    struct index_node *node = child_find(dir, name, &pos);
+    if (node != NULL) {
+        return node;
+    }
+    if (dir->child_count == dir->child_cap) {
+        uint32_t cap = dir->child_cap ? dir->child_cap * 2 : 4;
+        struct index_node **grown = realloc(dir->children, cap * sizeof(*grown));
+        if (grown == NULL) {
+            return NULL;
+        }
+        dir->children = grown;
+        dir->child_cap = cap;
+    }
+    if ((node = node_new(index, dir, name, type)) == NULL) {
+        return NULL;
+    }
+    memmove(dir->children + pos + 1, dir->children + pos, (dir->child_count - pos) * sizeof(*dir->children));
+    dir->children[pos] = node;
+    dir->child_count++;
+    return node;
+}
+
+// helper to free a node with everything below it and stop watching its directories
+static void node_free(struct name_index *index, struct index_node *node) {
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        node_free(index, node->children[i]);
+    }
+    if (node->wd >= 0) {
+        if (index->inotify_fd >= 0) {
+            inotify_rm_watch(index->inotify_fd, node->wd);
+        }
+        watch_remove(index, node);
+    }
+    if (node->type == INDEX_DIR) {
+        index->dirs--;
+    } else {
+        index->files--;
+    }
+    index->dirty = 1;
+    name_release(index, node->name);
+    free(node->children);
+    free(node);
+}
+
+// helper to unlink a node from its directory and free it
+static void node_remove(struct name_index *index, struct index_node *node) {
+    if (node->parent == NULL) {
+        index->top = NULL;
+    } else {
+        struct index_node *dir = node->parent;
+        uint32_t pos;
+        child_find(dir, node->name->text, &pos);
+        memmove(dir->children + pos, dir->children + pos + 1, (dir->child_count - pos - 1) * sizeof(*dir->children));
+        dir->child_count--;
+    }
+    node_free(index, node);
+}
+
+// helper to write the absolute path of a node. Returns its length, or -1 if it does not fit
+static int node_path(const struct name_index *index, const struct index_node *node, char *path, size_t size) {
+    if (node->parent == NULL) {
+        if (index->root_len >= size) {
+            return -1;
+        }
+        memcpy(path, index->root, index->root_len + 1);
+        return (int)index->root_len;
+    }
+    int len = node_path(index, node->parent, path, size);
+    if (len < 0) {
+        return -1;
+    }
+    int written = snprintf(path + len, size - len, "/%s", node->name->text);
+    return written < 0 || (size_t)written >= size - len ? -1 : len + written;
+}
+
+// helper to stop trusting the index, every answer comes from the filesystem from now on
+static void index_broken(struct name_index *index, const char *path, const char *reason) {
+    if (!index->broken) {
+        fprintf(stderr, "Index of %s can not follow %s: %s, answering from the filesystem\n", index->root, path, reason);
+    }
+    index->broken = 1;
+    index->ready = 0;
+    pthread_mutex_lock(&index->journal_lock);
+    journal_lose(index);
+    pthread_mutex_unlock(&index->journal_lock);
+}
+
+// helper to watch a directory for changes before its entries are read, and note its inode and
+// mtime: a change made after that arrives as an event, and makes the directory look changed to the
+// next start that loads the snapshot. Returns -1 if it is gone or can not be watched.
+static int watch_dir(struct name_index *index, struct index_node *node, const char *path) {
+    int wd = inotify_add_watch(index->inotify_fd, path, DIR_EVENTS);
+    struct stat st;
+    if (wd < 0 || stat(path, &st) != 0) {
+        // A directory removed while it was read is taken out by its removal event
+        if (errno != ENOENT && errno != ENOTDIR) {
+            index_broken(index, path, strerror(errno));
+        }
+        return -1;
+    }
+    // The same directory reached a second time (a bind mount) keeps its first node
+    if (watch_find(index, wd) == NULL) {
+        node->wd = wd;
+        watch_insert(index, node);
+    }
+    node->ino = st.st_ino;
+    node->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+// helper to add the entries of a directory to its node, without reading its subdirectories
+static void read_entries(struct name_index *index, struct index_node *node, const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        int type = INDEX_OTHER;
+        if (entry->d_type == DT_REG) {
+            type = INDEX_FILE;
+        } else if (entry->d_type == DT_DIR) {
+            type = INDEX_DIR;
+        } else if (entry->d_type == DT_UNKNOWN) {
+            // Some filesystems do not report the type while listing
+            struct stat st;
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = mode_type(st.st_mode);
+        }
+        if (node_add(index, node, entry->d_name, type) == NULL) {
+            index_broken(index, path, "out of memory");
+            break;
+        }
+    }
+    closedir(dir);
+}
+
+static void scan_dir(struct name_index *index, struct index_node *node, char *path, size_t len);
+
+// helper to read the subdirectories of a directory that were added without their entries.
+// Subdirectories are read once their parent is closed, so only one directory is open at a time.
+static void scan_subdirs(struct name_index *index, struct index_node *node, char *path, size_t len) {
+    for (uint32_t i = 0; i < node->child_count && !index->broken; i++) {
+        struct index_node *child = node->children[i];
+        if (child->type != INDEX_DIR || child->wd >= 0) {
+            continue;
+        }
+        size_t name_len = strlen(child->name->text);
+        if (len + 1 + name_len >= PATH_MAX) {
+            index_broken(index, path, "path too long");
+            break;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, child->name->text, name_len + 1);
+        scan_dir(index, child, path, len + 1 + name_len);
+        path[len] = '\0';
+    }
+}
+
+// helper to read a directory that was just added to the tree with everything below it.
+// path is a PATH_MAX buffer holding its path of length len.
+static void scan_dir(struct name_index *index, struct index_node *node, char *path, size_t len) {
+    if (watch_dir(index, node, path) < 0) {
+        return;
+    }
+    read_entries(index, node, path);
+    scan_subdirs(index, node, path, len);
+}
+
+// helper to bring the root in line with the filesystem. replaced tells that root was created or
+// moved into place, so an indexed tree there is an old one.
+static void sync_top(struct name_index *index, int replaced) {
+    // The root may be a symbolic link to the real tree
+    struct stat st;
+    int is_dir = stat(index->root, &st) == 0 && S_ISDIR(st.st_mode);
+    if (index->top != NULL && (!is_dir || replaced)) {
+        node_remove(index, index->top);
+    }
+    if (index->top == NULL && is_dir) {
+        if ((index->top = node_new(index, NULL, index->root_name, INDEX_DIR)) == NULL) {
+            index_broken(index, index->root, "out of memory");
+            return;
+        }
+        char path[PATH_MAX];
+        memcpy(path, index->root, index->root_len + 1);
+        scan_dir(index, index->top, path, index->root_len);
+    }
+}
+
+// helper to bring the entry name of the directory dir in line with the filesystem, see sync_top()
+static void sync_child(struct name_index *index, struct index_node *dir, const char *name, int replaced) {
+    char path[PATH_MAX];
+    int len = node_path(index, dir, path, sizeof(path));
+    if (len < 0 || len + 1 + strlen(name) >= sizeof(path)) {
+        index_broken(index, index->root, "path too long");
+        return;
+    }
+    path[len] = '/';
+    strcpy(path + len + 1, name);
+
+    struct stat st;
+    int type = lstat(path, &st) == 0 ? mode_type(st.st_mode) : INDEX_MISSING;
+    uint32_t pos;
+    struct index_node *node = child_find(dir, name, &pos);
+    if (node != NULL && (node->type != type || (replaced && type == INDEX_DIR))) {
+        node_remove(index, node);
+        node = NULL;
+    }
+    if (node == NULL && type != INDEX_MISSING) {
+        node = node_add(index, dir, name, type);
+        if (node == NULL) {
+            index_broken(index, path, "out of memory");
+        } else if (type == INDEX_DIR) {
+            scan_dir(index, node, path, strlen(path));
+        }
+    }
+}
+
+// helper to apply one inotify event to the tree
+static void handle_event(struct name_index *index, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        index->overflow = 1;
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        // The directory is gone, its node follows with the event of its parent
+        struct index_node *node = watch_find(index, event->wd);
+        if (node != NULL) {
+            watch_remove(index, node);
+        }
+        return;
+    }
+    if (event->len == 0) {
+        return;
+    }
+    int replaced = (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0;
+    if (event->wd == index->parent_wd) {
+        if (strcmp(event->name, index->root_name) == 0) {
+            sync_top(index, replaced);
+        }
+        return;
+    }
+    struct index_node *dir = watch_find(index, event->wd);
+    if (dir != NULL) {
+        sync_child(index, dir, event->name, replaced);
+    }
+}
+
+// helper to add bytes to the snapshot being written
+static void snapshot_put(struct snapshot_writer *writer, const void *data, size_t len) {
+    if (fwrite(data, 1, len, writer->out) != len) {
+        writer->failed = 1;
+    }
+    writer->crc = crc32(writer->crc, data, len);
+    writer->len += len;
+}
+
+// helper to write the records of a node and everything below it
+static void snapshot_node(struct snapshot_writer *writer, const struct index_node *node) {
+    uint8_t type = (uint8_t)node->type;
+    uint16_t name_len = (uint16_t)strlen(node->name->text);
+    snapshot_put(writer, &type, sizeof(type));
+    snapshot_put(writer, &name_len, sizeof(name_len));
+    snapshot_put(writer, node->name->text, name_len);
+    if (node->type != INDEX_DIR) {
+        return;
+    }
+    // A directory that may change again within its mtime tick is marked to be read again
+    int64_t mtime_ns = writer->now_ns - node->mtime_ns < SNAPSHOT_RACY_NS ? 0 : node->mtime_ns;
+    snapshot_put(writer, &node->ino, sizeof(node->ino));
+    snapshot_put(writer, &mtime_ns, sizeof(mtime_ns));
+    snapshot_put(writer, &node->child_count, sizeof(node->child_count));
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        snapshot_node(writer, node->children[i]);
+    }
+}
+
+// helper to save the tree, it goes to a temporary file that replaces the snapshot once complete
+static void write_snapshot(struct name_index *index) {
+    char temp[sizeof(index->snapshot) + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", index->snapshot);
+    struct snapshot_writer writer = {fopen(temp, "wb"), crc32(0, NULL, 0), 0, 0, 0};
+    if (writer.out == NULL) {
+        perror("Index snapshot failed");
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    writer.now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+    // The header is written again once the length and CRC of the records are known
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.root_len = (uint32_t)index->root_len;
+    fwrite(&header, sizeof(header), 1, writer.out);
+    fwrite(index->root, 1, index->root_len, writer.out);
+
+    pthread_rwlock_rdlock(&index->lock);
+    if (index->top != NULL) {
+        snapshot_node(&writer, index->top);
+    }
+    index->dirty = 0;
+    size_t entries = index->files + index->dirs;
+    pthread_rwlock_unlock(&index->lock);
+
+    header.crc = (uint32_t)writer.crc;
+    header.records_len = writer.len;
+    if (fseek(writer.out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, writer.out) != 1) {
+        writer.failed = 1;
+    }
+    if (fclose(writer.out) != 0 || writer.failed || rename(temp, index->snapshot) != 0) {
+        perror("Index snapshot failed");
+        unlink(temp);
+        pthread_rwlock_wrlock(&index->lock);
+        index->dirty = 1;
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+    printf("Index of %s saved: %zu entries in %llu bytes\n", index->root, entries, (unsigned long long)writer.len);
+}
+
+// helper to take bytes from the snapshot being loaded. Returns -1 if it ends too early
+static int snapshot_get(struct snapshot_reader *reader, void *data, size_t len) {
+    if ((size_t)(reader->end - reader->p) < len) {
+        return -1;
+    }
+    memcpy(data, reader->p, len);
+    reader->p += len;
+    return 0;
+}
+
+// helper to read the next record of the snapshot being loaded
+static int snapshot_record(struct snapshot_reader *reader, struct snapshot_record *record) {
+    uint8_t type;
+    uint16_t name_len;
+    if (snapshot_get(reader, &type, sizeof(type)) < 0 || snapshot_get(reader, &name_len, sizeof(name_len)) < 0 ||
+        name_len > NAME_MAX || snapshot_get(reader, record->name, name_len) < 0) {
+        return -1;
+    }
+    record->name[name_len] = '\0';
+    record->type = type;
+    if (type != INDEX_DIR) {
+        return 0;
+    }
+    if (snapshot_get(reader, &record->ino, sizeof(record->ino)) < 0 ||
+        snapshot_get(reader, &record->mtime_ns, sizeof(record->mtime_ns)) < 0 ||
+        snapshot_get(reader, &record->entries, sizeof(record->entries)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// helper to pass over the records of entries that are not in the tree any more
+static int snapshot_skip(struct snapshot_reader *reader, uint32_t entries) {
+    struct snapshot_record record;
+    for (uint32_t i = 0; i < entries; i++) {
+        if (snapshot_record(reader, &record) < 0 ||
+            (record.type == INDEX_DIR && snapshot_skip(reader, record.entries) < 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// helper to fill a directory node from its snapshot record and the records after it. Only a
+// directory whose inode or mtime differs from the record is read again; its subdirectories are
+// still checked one by one. Returns -1 if the snapshot is damaged or the index broke.
+static int load_dir(struct name_index *index, struct snapshot_reader *reader, struct index_node *node,
+                    char *path, size_t len, const struct snapshot_record *record) {
+    if (watch_dir(index, node, path) < 0) {
+        return index->broken ? -1 : snapshot_skip(reader, record->entries);
+    }
+    int unchanged = node->ino == record->ino && node->mtime_ns == record->mtime_ns;
+    if (!unchanged) {
+        read_entries(index, node, path);
+        index->reread++;
+    }
+
+    struct snapshot_record entry;
+    for (uint32_t i = 0; i < record->entries; i++) {
+        if (snapshot_record(reader, &entry) < 0) {
+            return -1;
+        }
+        uint32_t pos;
+        struct index_node *child = unchanged ? node_add(index, node, entry.name, entry.type) : child_find(node, entry.name, &pos);
+        if (unchanged && child == NULL) {
+            index_broken(index, path, "out of memory");
+            return -1;
+        }
+        if (entry.type != INDEX_DIR) {
+            continue;
+        }
+        // The records of a directory that is gone, or no directory any more, are passed over
+        if (child == NULL || child->type != INDEX_DIR || child->wd >= 0) {
+            if (snapshot_skip(reader, entry.entries) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        size_t name_len = strlen(entry.name);
+        if (len + 1 + name_len >= PATH_MAX) {
+            index_broken(index, path, "path too long");
+            return -1;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, entry.name, name_len + 1);
+        int result = load_dir(index, reader, child, path, len + 1 + name_len, &entry);
+        path[len] = '\0';
+        if (result < 0) {
+            return -1;
+        }
+    }
+    // Directories created since the snapshot are read completely
+    if (!unchanged) {
+        scan_subdirs(index, node, path, len);
+    }
+    return 0;
+}
+
+// helper to build the tree from the snapshot of the last run. Returns -1 if there is none that
+// can be used, the tree must be read then.
+static int load_snapshot(struct name_index *index) {
+    int fd = open(index->snapshot, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    const unsigned char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct snapshot_header) + index->root_len) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Index snapshot %s can not be used, reading the tree\n", index->snapshot);
+        return -1;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    // Only a complete snapshot of the same root is used
+    struct snapshot_header header;
+    memcpy(&header, map, sizeof(header));
+    const unsigned char *records = map + sizeof(header) + index->root_len;
+    int result = -1;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 && header.root_len == index->root_len &&
+        memcmp(map + sizeof(header), index->root, index->root_len) == 0 &&
+        header.records_len == (uint64_t)st.st_size - sizeof(header) - index->root_len &&
+        header.crc == crc32(crc32(0, NULL, 0), records, header.records_len)) {
+        struct snapshot_reader reader = {records, records + header.records_len};
+        struct snapshot_record record;
+        struct stat root_st;
+        if (header.records_len == 0 || stat(index->root, &root_st) != 0 || !S_ISDIR(root_st.st_mode)) {
+            // The root did not exist or does not any more, a saved tree is out of date then
+            index->reread += header.records_len != 0;
+            sync_top(index, 0);
+            result = 0;
+        } else if (snapshot_record(&reader, &record) == 0 && record.type == INDEX_DIR &&
+                   (index->top = node_new(index, NULL, index->root_name, INDEX_DIR)) != NULL) {
+            char path[PATH_MAX];
+            memcpy(path, index->root, index->root_len + 1);
+            result = load_dir(index, &reader, index->top, path, index->root_len, &record);
+        }
+    }
+    munmap((void *)map, st.st_size);
+    if (result < 0 && !index->broken) {
+        printf("Index snapshot %s can not be used, reading the tree\n", index->snapshot);
+    }
+    return result;
+}
+
+// helper to (re)build the whole tree from the snapshot or the disk, any tree indexed before is
+// dropped with the events queued for it
+static void read_tree(struct name_index *index) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_rwlock_wrlock(&index->lock);
+    index->ready = 0;
+    pthread_mutex_lock(&index->journal_lock);
+    journal_lose(index);
+    pthread_mutex_unlock(&index->journal_lock);
+    if (index->inotify_fd >= 0) {
+        close(index->inotify_fd);
+        index->inotify_fd = -1;
+    }
+    if (index->top != NULL) {
+        node_remove(index, index->top);
+    }
+    index->parent_wd = -1;
+    index->broken = 0;
+    index->overflow = 0;
+    index->reread = 0;
+    pthread_rwlock_unlock(&index->lock);
+
+    // Nobody else touches the tree until it is ready, it is read without holding the lock
+    index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (index->inotify_fd < 0) {
+        index_broken(index, index->root, strerror(errno));
+        return;
+    }
+    // The directory holding the root tells when the root itself is created or removed
+    char parent[PATH_MAX];
+    memcpy(parent, index->root, index->root_len + 1);
+    parent[index->root_name - index->root - 1] = '\0';
+    index->parent_wd = inotify_add_watch(index->inotify_fd, parent[0] ? parent : "/", DIR_EVENTS);
+
+    // The snapshot of the last run saves reading the directories that did not change since
+    int loaded = load_snapshot(index) == 0;
+    if (!loaded && !index->broken) {
+        if (index->top != NULL) {
+            node_remove(index, index->top);
+        }
+        sync_top(index, 0);
+    }
+    // A tree that only came from the snapshot needs no new one
+    index->dirty = !loaded || index->reread > 0;
+
+    pthread_rwlock_wrlock(&index->lock);
+    index->ready = !index->broken;
+    pthread_rwlock_unlock(&index->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (index->ready && loaded) {
+        printf("Index of %s ready: %zu files in %zu directories, %zu distinct names (%.1f ms, from the snapshot, %zu directories changed)\n",
+               index->root, index->files, index->dirs, index->name_count, ms, index->reread);
+    } else if (index->ready) {
+        printf("Index of %s ready: %zu files in %zu directories, %zu distinct names (%.1f ms)\n",
+               index->root, index->files, index->dirs, index->name_count, ms);
+    }
+    // Save a tree that had to be read right away, so the next start does not read it again
+    if (index->ready && index->dirty) {
+        write_snapshot(index);
+    }
+}
+
+// helper to tell if the tree changed since it was saved, name_index_update() changes it too
+static int index_dirty(struct name_index *index) {
+    pthread_rwlock_rdlock(&index->lock);
+    int dirty = index->ready && index->dirty;
+    pthread_rwlock_unlock(&index->lock);
+    return dirty;
+}
+
+// The thread of the index: it reads the tree, then applies inotify events until it is stopped,
+// saving the tree to the snapshot every SNAPSHOT_INTERVAL_MS while it changes
+static void *index_thread(void *arg) {
+    struct name_index *index = arg;
+    char events[EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct timespec saved;
+
+    read_tree(index);
+    clock_gettime(CLOCK_MONOTONIC, &saved);
+    while (1) {
+        struct pollfd fds[2] = {{index->stop_fd, POLLIN, 0}, {index->inotify_fd, POLLIN, 0}};
+        int timeout = -1;
+        if (index_dirty(index)) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed = (now.tv_sec - saved.tv_sec) * 1000 + (now.tv_nsec - saved.tv_nsec) / 1000000;
+            timeout = elapsed >= SNAPSHOT_INTERVAL_MS ? 0 : (int)(SNAPSHOT_INTERVAL_MS - elapsed);
+        }
+        int ready = poll(fds, 2, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Index poll failed");
+            break;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        if (ready == 0) {
+            write_snapshot(index);
+            clock_gettime(CLOCK_MONOTONIC, &saved);
+            continue;
+        }
+        ssize_t n = read(index->inotify_fd, events, sizeof(events));
+        if (n <= 0) {
+            continue;
+        }
+
+        // A batch of events is applied at once, lookups wait for it instead of seeing half of it
+        pthread_rwlock_wrlock(&index->lock);
+        for (char *p = events; p < events + n; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            handle_event(index, event);
+            p += sizeof(*event) + event->len;
+        }
+        int overflow = index->overflow;
+        pthread_rwlock_unlock(&index->lock);
+
+        if (overflow) {
+            printf("Index of %s missed changes, reading it again\n", index->root);
+            read_tree(index);
+            clock_gettime(CLOCK_MONOTONIC, &saved);
+        }
+    }
+    // Save the last changes for the next start
+    if (index_dirty(index)) {
+        write_snapshot(index);
+    }
+    return NULL;
+}
+
+// Function to start the index of the tree under root
+struct name_index *name_index_open(const char *root) {
+    size_t len = strlen(root);
+    // Trailing slashes are dropped, the filesystem root itself can not be indexed
+    while (len > 1 && root[len - 1] == '/') {
+        len--;
+    }
+    if (root[0] != '/' || len < 2 || len >= PATH_MAX) {
+        fprintf(stderr, "Can not index %s\n", root);
+        return NULL;
+    }
+
+    struct name_index *index = calloc(1, sizeof(*index));
+    if (index == NULL) {
+        perror("Index allocation failed");
+        return NULL;
+    }
+    memcpy(index->root, root, len);
+    index->root[len] = '\0';
+    index->root_len = len;
+    index->root_name = strrchr(index->root, '/') + 1;
+    // The snapshot is kept next to the root, hidden: ~/.smain.index
+    snprintf(index->snapshot, sizeof(index->snapshot), "%.*s.%s.index",
+             (int)(index->root_name - index->root), index->root, index->root_name);
+    index->inotify_fd = -1;
+    index->parent_wd = -1;
+    index->journal_fd = -1;
+    pthread_mutex_init(&index->journal_lock, NULL);
+    index->name_buckets = INDEX_BUCKETS;
+    index->watch_buckets = INDEX_BUCKETS;
+    index->names = calloc(index->name_buckets, sizeof(*index->names));
+    index->watches = calloc(index->watch_buckets, sizeof(*index->watches));
+    index->stop_fd = eventfd(0, EFD_CLOEXEC);
+
+    // Lookups come from many threads, a steady stream of them must not hold off the updates
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&index->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    if (index->names == NULL || index->watches == NULL || index->stop_fd < 0 ||
+        pthread_create(&index->thread, NULL, index_thread, index) != 0) {
+        perror("Index startup failed");
+        if (index->stop_fd >= 0) {
+            close(index->stop_fd);
+        }
+        pthread_rwlock_destroy(&index->lock);
+        pthread_mutex_destroy(&index->journal_lock);
+        free(index->names);
+        free(index->watches);
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+// Function to stop and free an index
+void name_index_close(struct name_index *index) {
+    if (index == NULL) {
+        return;
+    }
+    uint64_t stop = 1;
+    if (write(index->stop_fd, &stop, sizeof(stop)) != sizeof(stop)) {
+        perror("Index stop failed");
+    }
+    pthread_join(index->thread, NULL);
+    if (index->top != NULL) {
+        node_remove(index, index->top);
+    }
+    if (index->inotify_fd >= 0) {
+        close(index->inotify_fd);
+    }
+    close(index->stop_fd);
+    if (index->journal_fd >= 0) {
+        close(index->journal_fd);
+    }
+    free(index->journal);
+    pthread_rwlock_destroy(&index->lock);
+    pthread_mutex_destroy(&index->journal_lock);
+    free(index->names);
+    free(index->watches);
+    free(index);
+}
+
+// helper to find the node of an absolute path in the tree. Returns 0 and the node, NULL if nothing
+// is there, or -1 if the index can not answer for the path. Called with the lock held.
+static int resolve(const struct name_index *index, const char *path, struct index_node **found) {
+    if (strncmp(path, index->root, index->root_len) != 0 || (path[index->root_len] != '\0' && path[index->root_len] != '/')) {
+        return -1;
+    }
+    struct index_node *node = index->top;
+    const char *p = path + index->root_len;
+    while (node != NULL && *p != '\0') {
+        if (*p == '/') {
+            p++;
+            continue;
+        }
+        size_t len = strcspn(p, "/");
+        char name[NAME_MAX + 1];
+        if (len > NAME_MAX) {
+            node = NULL;
+            break;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+        if (strcmp(name, ".") == 0) {
+            continue;
+        }
+        // stat() would follow links and go up, the filesystem answers for those paths
+        if (strcmp(name, "..") == 0 || node->type == INDEX_OTHER) {
+            return -1;
+        }
+        uint32_t pos;
+        node = node->type == INDEX_DIR ? child_find(node, name, &pos) : NULL;
+    }
+    if (node != NULL && node->type == INDEX_OTHER) {
+        return -1;
+    }
+    *found = node;
+    return 0;
+}
+
+// Function to tell what is at a path
+int name_index_lookup(struct name_index *index, const char *path) {
+    if (index != NULL) {
+        struct index_node *node;
+        pthread_rwlock_rdlock(&index->lock);
+        if (index->ready && resolve(index, path, &node) == 0) {
+            int answer = node != NULL ? node->type : INDEX_MISSING;
+            pthread_rwlock_unlock(&index->lock);
+            return answer;
+        }
+        pthread_rwlock_unlock(&index->lock);
+    }
+
+    struct stat st;
+    return stat(path, &st) == 0 ? mode_type(st.st_mode) : INDEX_MISSING;
+}
+
+// Function to list the names of a directory that end with one of the suffixes into a page
+int name_index_list(struct name_index *index, const char *dir, const char *suffixes, struct name_page *page) {
+    if (index != NULL) {
+        struct index_node *node;
+        pthread_rwlock_rdlock(&index->lock);
+        if (index->ready && resolve(index, dir, &node) == 0) {
+            int answer = node != NULL ? node->type : INDEX_MISSING;
+            if (answer == INDEX_DIR) {
+                // The entries are sorted: start after the cursor and stop once the page is full and one more matched
+                uint32_t pos;
+                if (child_find(node, page->cursor, &pos) != NULL) {
+                    pos++;
+                }
+                for (; pos < node->child_count && !page->more; pos++) {
+                    const char *name = node->children[pos]->name->text;
+                    if (dfs_has_suffix(name, strlen(name), suffixes) && name_page_offer(page, name) < 0) {
+                        perror("Listing allocation failed");
+                        break;
+                    }
+                }
+            }
+            pthread_rwlock_unlock(&index->lock);
+            return answer;
+        }
+        pthread_rwlock_unlock(&index->lock);
+    }
+
+    // Read the directory itself
+    struct stat st;
+    if (stat(dir, &st) != 0) {
+        return INDEX_MISSING;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return mode_type(st.st_mode);
+    }
+    DIR *handle = opendir(dir);
+    if (handle != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(handle)) != NULL) {
+            if (dfs_has_suffix(entry->d_name, strlen(entry->d_name), suffixes) && name_page_offer(page, entry->d_name) < 0) {
+                perror("Listing allocation failed");
+                break;
+            }
+        }
+        closedir(handle);
+    }
+    return INDEX_DIR;
+}
+
+// helper to find a symbolic link or other entry the index does not follow below node
+static int has_other(const struct index_node *node) {
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        if (node->children[i]->type == INDEX_OTHER || has_other(node->children[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// helper to report the entries below node, whose relative path (len bytes) is in path
+static void walk_node(const struct index_node *node, char *path, size_t len, void (*fn)(void *, const char *, size_t), void *ctx) {
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        const struct index_node *child = node->children[i];
+        size_t name_len = strlen(child->name->text);
+        if (len + name_len + 2 > PATH_MAX) {
+            continue;
+        }
+        size_t child_len = len;
+        if (len > 0) {
+            path[child_len++] = '/';
+        }
+        memcpy(path + child_len, child->name->text, name_len + 1);
+        child_len += name_len;
+        fn(ctx, path, child_len);
+        walk_node(child, path, child_len, fn, ctx);
+        path[len] = '\0';
+    }
+}
+
+// Function to report every entry of the tree
+int name_index_walk(struct name_index *index, void (*fn)(void *ctx, const char *path, size_t len), void *ctx) {
+    if (index == NULL) {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&index->lock);
+    if (!index->ready || (index->top != NULL && has_other(index->top))) {
+        pthread_rwlock_unlock(&index->lock);
+        return -1;
+    }
+    char path[PATH_MAX] = "";
+    if (index->top != NULL) {
+        walk_node(index->top, path, 0, fn, ctx);
+    }
+    pthread_rwlock_unlock(&index->lock);
+    return 0;
+}
+
+// Function to bring the entry at path in line with the filesystem after this server changed it
+void name_index_update(struct name_index *index, const char *path) {
+    if (index == NULL) {
+        return;
+    }
+    pthread_rwlock_wrlock(&index->lock);
+    // Paths outside the tree are never answered from the index
+    if (!index->ready || strncmp(path, index->root, index->root_len) != 0 ||
+        (path[index->root_len] != '\0' && path[index->root_len] != '/')) {
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+    if (index->top == NULL) {
+        // The root was just created, reading it picks up the new entry too
+        sync_top(index, 0);
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+
+    // Walk down the directories that are indexed already. The first component that is not one
+    // is synced, a directory with everything below it.
+    struct index_node *dir = index->top;
+    const char *p = path + index->root_len;
+    while (*p != '\0') {
+        if (*p == '/') {
+            p++;
+            continue;
+        }
+        size_t len = strcspn(p, "/");
+        char name[NAME_MAX + 1];
+        if (len > NAME_MAX) {
+            break;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+        if (strcmp(name, ".") == 0) {
+            continue;
+        }
+        if (strcmp(name, "..") == 0) {
+            break;
+        }
+        uint32_t pos;
+        struct index_node *node = child_find(dir, name, &pos);
+        if (node != NULL && node->type == INDEX_DIR && p[strspn(p, "/")] != '\0') {
+            dir = node;
+            continue;
+        }
+        sync_child(index, dir, name, 0);
+        break;
+    }
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Function to start recording the entries created by other means than the server
+int name_index_journal_fd(struct name_index *index) {
+    if (index == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&index->journal_lock);
+    if (index->journal_fd < 0) {
+        index->journal_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (index->journal_fd < 0) {
+            perror("Index journal could not be started");
+        }
+    }
+    int fd = index->journal_fd;
+    pthread_mutex_unlock(&index->journal_lock);
+    return fd;
+}
+
+// Function to take the paths the journal recorded
+int name_index_journal_take(struct name_index *index, void (*fn)(void *ctx, const char *path, size_t len), void *ctx) {
+    if (index == NULL || index->journal_fd < 0) {
+        return -1;
+    }
+    uint64_t count;
+    pthread_mutex_lock(&index->journal_lock);
+    if (read(index->journal_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Index journal read failed");
+    }
+    char *journal = index->journal;
+    size_t len = index->journal_len;
+    int lost = index->journal_lost;
+    index->journal = NULL;
+    index->journal_len = 0;
+    index->journal_cap = 0;
+    index->journal_lost = 0;
+    pthread_mutex_unlock(&index->journal_lock);
+
+    for (size_t pos = 0; pos < len; ) {
+        size_t key_len = strlen(journal + pos);
+        fn(ctx, journal + pos, key_len);
+        pos += key_len + 1;
+    }
+    free(journal);
+    return lost ? -1 : 0;
+}
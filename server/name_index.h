@@ -0,0 +1,74 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include <stddef.h>
+
+#include "../common/name_page.h"
+
+// An in-memory index of the tree a server stores its files in (~/smain, ~/spdf or ~/stext), so
+// 'display' and the "File not found" answers of dfile/rmfile do not touch the filesystem.
+//
+// The tree is a trie of path components: every directory keeps its entries in a sorted array,
+// so a page of a listing is a binary search for the cursor followed by a walk over the next
+// entries, and every component string is interned, so a name used in many directories is stored
+// once. A thread of the index reads the tree at startup and then follows inotify events on every
+// directory; the server also reports its own uploads and removals with name_index_update(), which
+// makes them visible at once instead of when their event arrives. Events are only hints: every
+// entry they name is looked up again before the index changes, so a late event can not undo a
+// newer change.
+//
+// The tree is saved to a snapshot next to the root (~/.smain.index) after it was read and every
+// SNAPSHOT_INTERVAL_MS while it changes. A start that finds a snapshot of the same root maps it and
+// only reads the directories again whose inode or mtime is not the saved one; a directory saved
+// within two seconds of its mtime is always read again, as a change in the same tick would not
+// show. Only names and types are kept, the index never needed file sizes or contents.
+//
+// Until the tree has been read, after an inotify queue overflow (the tree is read again) and when
+// a directory can not be watched, the index is not trusted and every answer comes from the
+// filesystem, as do paths outside the tree and paths that pass through a symbolic link.
+
+// What a path is
+enum index_answer {
+    INDEX_MISSING = 0,  // nothing there
+    INDEX_FILE,
+    INDEX_DIR,
+    INDEX_OTHER         // symbolic link, socket, device, ...
+};
+
+struct name_index;
+
+// Start indexing the tree under root (an absolute path, it need not exist yet) on a thread of its
+// own. Returns NULL if the index can not be started; every function below accepts NULL and then
+// answers from the filesystem.
+struct name_index *name_index_open(const char *root);
+
+// Stop the thread and free the index
+void name_index_close(struct name_index *index);
+
+// What is at the absolute path, symbolic links are followed like stat() does
+int name_index_lookup(struct name_index *index, const char *path);
+
+// Offer the names in the directory dir that end with one of the space separated suffixes to page
+// (in ascending order, it stops once the page is full and knows there is more). Returns INDEX_DIR
+// when dir was listed, otherwise what dir is.
+int name_index_list(struct name_index *index, const char *dir, const char *suffixes, struct name_page *page);
+
+// Tell the index that this server just created, replaced or removed the entry at path
+void name_index_update(struct name_index *index, const char *path);
+
+// Call fn with the path of every file and directory of the tree relative to root ("a/b.pdf"),
+// under the lock of the index, so fn must not use it. Returns -1 without calling fn if the index
+// is not trusted or the tree holds a symbolic link (what lies behind it is not indexed).
+int name_index_walk(struct name_index *index, void (*fn)(void *ctx, const char *path, size_t len), void *ctx);
+
+// Start a journal of the entries the thread adds to the trusted tree, the ones created by other
+// means than the server. Returns an eventfd that is readable while the journal holds something to
+// take, or -1 if it can not be had.
+int name_index_journal_fd(struct name_index *index);
+
+// Call fn with the paths (relative to root) the journal recorded since it was last taken, and
+// empty it. Returns -1 if additions were dropped since then: the tree was read again or is not
+// trusted, it holds a new symbolic link, or the journal grew too long.
+int name_index_journal_take(struct name_index *index, void (*fn)(void *ctx, const char *path, size_t len), void *ctx);
+
+#endif
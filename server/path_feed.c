@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "../common/dfs_proto.h"
+#include "../common/dfs_bloom.h"
+#include "path_feed.h"
+
+// Connections the feed pushes to at most, one per running Smain is expected
+#define FEED_MAX_FOLLOWERS 16
+
+// A connection the paths are pushed to
+struct feed_follower {
+    int sock;
+    uint32_t request_id;
+};
+
+struct path_feed {
+    struct name_index *index;
+    pthread_mutex_t lock;            // the followers, and the journal while it is taken
+    struct feed_follower followers[FEED_MAX_FOLLOWERS];
+    int follower_count;
+    int journal_fd;
+    int wake_fd;                     // eventfd that tells the thread the followers changed
+    int stop_fd;                     // eventfd that ends the thread
+    pthread_t thread;
+};
+
+// Paths taken from the journal, sent in frames of at most DFS_BLOOM_PUSH_MAX bytes
+struct feed_batch {
+    struct path_feed *feed;
+    char frame[DFS_BLOOM_PUSH_MAX];
+    size_t len;
+};
+
+// helper to count the entries of the tree
+static void count_path(void *ctx, const char *path, size_t len) {
+    (void)path;
+    (void)len;
+    (*(uint64_t *)ctx)++;
+}
+
+// helper to add an entry of the tree to the filter
+static void filter_path(void *ctx, const char *path, size_t len) {
+    dfs_bloom_add((struct dfs_bloom *)ctx, path, len);
+}
+
+// helper to close a follower, the caller holds the lock
+static void drop_follower(struct path_feed *feed, int i) {
+    close(feed->followers[i].sock);
+    feed->followers[i] = feed->followers[--feed->follower_count];
+}
+
+// helper to send the paths of a batch to every follower, dropping the ones that fail
+static void send_batch(struct feed_batch *batch) {
+    struct path_feed *feed = batch->feed;
+    for (int i = feed->follower_count - 1; i >= 0; i--) {
+        if (dfs_send_frame(feed->followers[i].sock, DFS_OP_DATA, feed->followers[i].request_id, batch->frame, batch->len) < 0) {
+            printf("Path feed connection lost\n");
+            drop_follower(feed, i);
+        }
+    }
+    batch->len = 0;
+}
+
+// helper adding a path of the journal to the batch
+static void batch_path(void *ctx, const char *path, size_t len) {
+    struct feed_batch *batch = ctx;
+    if (batch->len + len + 1 > sizeof(batch->frame)) {
+        send_batch(batch);
+    }
+    memcpy(batch->frame + batch->len, path, len + 1);
+    batch->len += len + 1;
+}
+
+// helper to push what the journal holds, the caller holds the lock
+static void push_journal(struct path_feed *feed) {
+    struct feed_batch *batch = malloc(sizeof(*batch));
+    if (batch == NULL) {
+        return;
+    }
+    batch->feed = feed;
+    batch->len = 0;
+    int result = name_index_journal_take(feed->index, batch_path, batch);
+    if (batch->len > 0) {
+        send_batch(batch);
+    }
+    free(batch);
+    // The followers can not tell what they missed, they start over with a new filter
+    if (result < 0 && feed->follower_count > 0) {
+        printf("Path feed missed changes, closing %d connection(s)\n", feed->follower_count);
+        while (feed->follower_count > 0) {
+            drop_follower(feed, feed->follower_count - 1);
+        }
+    }
+}
+
+// helper running on the thread of the feed: push the journal as it fills, and notice the
+// followers that went away (Smain sends nothing on them)
+static void *feed_thread(void *arg) {
+    struct path_feed *feed = arg;
+    while (1) {
+        struct pollfd fds[3 + FEED_MAX_FOLLOWERS] = {{feed->stop_fd, POLLIN, 0}, {feed->wake_fd, POLLIN, 0}, {feed->journal_fd, POLLIN, 0}};
+        pthread_mutex_lock(&feed->lock);
+        int count = feed->follower_count;
+        for (int i = 0; i < count; i++) {
+            fds[3 + i].fd = feed->followers[i].sock;
+            fds[3 + i].events = POLLIN;
+            fds[3 + i].revents = 0;
+        }
+        pthread_mutex_unlock(&feed->lock);
+
+        int ready = poll(fds, (nfds_t)(3 + count), -1);
+        if (ready < 0 && errno != EINTR) {
+            perror("Path feed poll failed");
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        if (fds[1].revents) {
+            uint64_t wake;
+            if (read(feed->wake_fd, &wake, sizeof(wake)) < 0 && errno != EAGAIN) {
+                perror("Path feed wake failed");
+            }
+        }
+        pthread_mutex_lock(&feed->lock);
+        if (fds[2].revents) {
+            push_journal(feed);
+        }
+        for (int i = 0; i < count; i++) {
+            if (fds[3 + i].revents == 0) {
+                continue;
+            }
+            for (int j = 0; j < feed->follower_count; j++) {
+                if (feed->followers[j].sock == fds[3 + i].fd) {
+                    printf("Path feed connection closed by peer\n");
+                    drop_follower(feed, j);
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&feed->lock);
+    }
+    return NULL;
+}
+
+// Function to start the feed of an index
+struct path_feed *path_feed_open(struct name_index *index) {
+    struct path_feed *feed = calloc(1, sizeof(*feed));
+    if (feed == NULL) {
+        return NULL;
+    }
+    feed->index = index;
+    pthread_mutex_init(&feed->lock, NULL);
+    feed->journal_fd = name_index_journal_fd(index);
+    feed->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    feed->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (feed->journal_fd < 0 || feed->wake_fd < 0 || feed->stop_fd < 0 ||
+        pthread_create(&feed->thread, NULL, feed_thread, feed) != 0) {
+        perror("Path feed could not be started");
+        if (feed->wake_fd >= 0) {
+            close(feed->wake_fd);
+        }
+        if (feed->stop_fd >= 0) {
+            close(feed->stop_fd);
+        }
+        pthread_mutex_destroy(&feed->lock);
+        free(feed);
+        return NULL;
+    }
+    return feed;
+}
+
+// Function to stop a feed and free it
+void path_feed_close(struct path_feed *feed) {
+    if (feed == NULL) {
+        return;
+    }
+    uint64_t stop = 1;
+    if (write(feed->stop_fd, &stop, sizeof(stop)) != sizeof(stop)) {
+        perror("Path feed stop failed");
+    }
+    pthread_join(feed->thread, NULL);
+    while (feed->follower_count > 0) {
+        drop_follower(feed, feed->follower_count - 1);
+    }
+    close(feed->wake_fd);
+    close(feed->stop_fd);
+    pthread_mutex_destroy(&feed->lock);
+    free(feed);
+}
+
+// Function to answer a 'filter' request: the Bloom filter of the tree as a NAME frame describing
+// it and the bit array as a DATA stream, then the paths added later as DATA frames
+int path_feed_follow(struct path_feed *feed, int sock, uint32_t request_id) {
+    if (feed == NULL) {
+        printf("Path filter not available\n");
+        dfs_send_text(sock, DFS_OP_ERROR, request_id, "ERROR: Path filter not available!");
+        return 0;
+    }
+    pthread_mutex_lock(&feed->lock);
+    // Paths recorded before the tree is walked are part of it, the ones after are pushed
+    push_journal(feed);
+
+    // Sized for the entries of the tree, a filter can only be built from a complete index
+    uint64_t entries = 0;
+    struct dfs_bloom bloom;
+    if (feed->follower_count == FEED_MAX_FOLLOWERS || name_index_walk(feed->index, count_path, &entries) < 0 ||
+        dfs_bloom_init(&bloom, entries) < 0) {
+        pthread_mutex_unlock(&feed->lock);
+        printf("Path filter not available\n");
+        dfs_send_text(sock, DFS_OP_ERROR, request_id, "ERROR: Path filter not available!");
+        return 0;
+    }
+    if (name_index_walk(feed->index, filter_path, &bloom) < 0) {
+        pthread_mutex_unlock(&feed->lock);
+        dfs_bloom_free(&bloom);
+        printf("Path filter not available\n");
+        dfs_send_text(sock, DFS_OP_ERROR, request_id, "ERROR: Path filter not available!");
+        return 0;
+    }
+
+    char name[96];
+    snprintf(name, sizeof(name), "%llu %d %llu", (unsigned long long)bloom.bit_count, bloom.hashes, (unsigned long long)bloom.keys);
+    if (dfs_send_text(sock, DFS_OP_NAME, request_id, name) < 0 ||
+        dfs_send_frame(sock, DFS_OP_DATA, request_id, bloom.bits, bloom.bit_count / 8) < 0 ||
+        dfs_send_frame(sock, DFS_OP_END, request_id, NULL, 0) < 0) {
+        pthread_mutex_unlock(&feed->lock);
+        dfs_bloom_free(&bloom);
+        close(sock);
+        return 1;
+    }
+    printf("Path filter sent: %llu paths in %llu bytes\n", (unsigned long long)bloom.keys, (unsigned long long)(bloom.bit_count / 8));
+    dfs_bloom_free(&bloom);
+
+    feed->followers[feed->follower_count].sock = sock;
+    feed->followers[feed->follower_count].request_id = request_id;
+    feed->follower_count++;
+    uint64_t wake = 1;
+    if (write(feed->wake_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+        perror("Path feed wake failed");
+    }
+    pthread_mutex_unlock(&feed->lock);
+    return 1;
+}
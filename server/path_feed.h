@@ -0,0 +1,34 @@
+#ifndef PATH_FEED_H
+#define PATH_FEED_H
+
+#include <stdint.h>
+
+#include "name_index.h"
+
+// The paths a Spdf/Stext server stores, for the path filters of Smain (see smain's path_filter.h).
+//
+// A DFS_OP_FILTER request is answered with the Bloom filter of the indexed tree (see
+// common/dfs_bloom.h), and the connection then belongs to the feed: it carries no more requests.
+// The thread of the feed takes the journal of the index (name_index_journal_fd()), the entries
+// created by other means than the server, and pushes those paths to every such connection as
+// DATA frames. When the journal dropped paths, the connections are closed and Smain asks for a
+// new filter. The server's own uploads are not pushed, Smain added their paths before it passed
+// them on.
+//
+// The filter of a new connection is built and sent while the feed pushes nothing, so every path is
+// either part of it or pushed after it.
+
+struct path_feed;
+
+// Start the feed of the tree of index. Returns NULL if it can not be started, path_feed_follow()
+// then refuses every request.
+struct path_feed *path_feed_open(struct name_index *index);
+
+// Stop the thread and close the connections of the feed
+void path_feed_close(struct path_feed *feed);
+
+// Answer a DFS_OP_FILTER request. Returns 1 if the connection now belongs to the feed, 0 if the
+// filter was refused (the index is not trusted yet) and the connection carries requests as before.
+int path_feed_follow(struct path_feed *feed, int sock, uint32_t request_id);
+
+#endif
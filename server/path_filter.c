@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "../common/dfs_proto.h"
+#include "../common/dfs_bloom.h"
+#include "path_filter.h"
+
+// An upload through Smain, kept while it runs and while a filter that may have missed it loads
+struct filter_upload {
+    struct filter_upload *next;
+    int running;
+    size_t len;
+    char key[];
+};
+
+struct path_filter {
+    char name[16];
+    struct conn_pool *pool;
+    char root[PATH_MAX];             // ~/smain, the paths of requests start with it
+    size_t root_len;
+    pthread_mutex_t lock;            // everything below
+    struct dfs_bloom bloom;
+    int loaded;                      // bloom holds a filter of the server
+    int loading;                     // the thread is asking for a new one
+    uint64_t changes;                // paths added and removed since the filter was loaded
+    struct filter_upload *uploads;
+    uint64_t lookups;
+    uint64_t ruled_out;              // lookups answered without the server
+    uint64_t loads;
+    uint64_t load_failures;
+    uint64_t pushed;                 // paths the server pushed after its filter
+    int stop_fd;                     // eventfd that ends the thread
+    pthread_t thread;
+};
+
+// Bytes of the bit array received so far
+struct filter_sink {
+    struct dfs_bloom *bloom;
+    uint64_t received;
+};
+
+// helper to turn an absolute path under ~/smain into the key of the filter ("a/b.pdf"), with empty
+// and "." components left out. Returns its length, or -1 if the filter can not answer for the path.
+static int path_key(const struct path_filter *filter, const char *path, char *key, size_t size) {
+    if (strncmp(path, filter->root, filter->root_len) != 0 || path[filter->root_len] != '/') {
+        return -1;
+    }
+    size_t len = 0;
+    const char *p = path + filter->root_len;
+    while (*p != '\0') {
+        if (*p == '/') {
+            p++;
+            continue;
+        }
+        size_t n = strcspn(p, "/");
+        if (n == 1 && p[0] == '.') {
+            p += n;
+            continue;
+        }
+        // The server resolves ".." on its disk, the filter only knows the tree
+        if ((n == 2 && p[0] == '.' && p[1] == '.') || len + n + 2 > size) {
+            return -1;
+        }
+        if (len > 0) {
+            key[len++] = '/';
+        }
+        memcpy(key + len, p, n);
+        len += n;
+        p += n;
+    }
+    key[len] = '\0';
+    return len > 0 ? (int)len : -1;
+}
+
+// helper to add a key and the directories above it to a filter
+static void add_key(struct dfs_bloom *bloom, const char *key, size_t len) {
+    dfs_bloom_add(bloom, key, len);
+    for (size_t i = len; i > 0; i--) {
+        if (key[i - 1] == '/') {
+            dfs_bloom_add(bloom, key, i - 1);
+        }
+    }
+}
+
+// helper to free the uploads that ended, the caller holds the lock
+static void drop_ended(struct path_filter *filter) {
+    struct filter_upload **link = &filter->uploads;
+    while (*link != NULL) {
+        struct filter_upload *upload = *link;
+        if (upload->running) {
+            link = &upload->next;
+        } else {
+            *link = upload->next;
+            free(upload);
+        }
+    }
+}
+
+// helper storing the bit array of a filter as it arrives
+static int sink_bits(void *ctx, const void *data, size_t len) {
+    struct filter_sink *sink = ctx;
+    if (len > sink->bloom->bit_count / 8 - sink->received) {
+        return -1;
+    }
+    memcpy(sink->bloom->bits + sink->received, data, len);
+    sink->received += len;
+    return 0;
+}
+
+// helper asking the server for its filter. Returns the connection it pushes later paths on, with
+// bloom filled, or -1.
+static int fetch_filter(struct path_filter *filter, struct dfs_bloom *bloom) {
+    int server_sock = conn_pool_get(filter->pool);
+    if (server_sock < 0) {
+        return -1;
+    }
+    struct dfs_hdr hdr;
+    char text[DFS_MAX_TEXT + 1];
+    if (dfs_send_text(server_sock, DFS_OP_FILTER, 0, "") < 0 || dfs_recv_hdr(server_sock, &hdr) < 0 ||
+        (hdr.opcode != DFS_OP_NAME && hdr.opcode != DFS_OP_ERROR) || dfs_recv_text(server_sock, &hdr, text, sizeof(text)) < 0) {
+        conn_pool_put(filter->pool, server_sock, 0);
+        return -1;
+    }
+    if (hdr.opcode == DFS_OP_ERROR) {
+        // Its index is not ready yet, or it can not vouch for every path
+        conn_pool_put(filter->pool, server_sock, 1);
+        return -1;
+    }
+
+    unsigned long long bit_count, keys;
+    int hashes;
+    if (sscanf(text, "%llu %d %llu", &bit_count, &hashes, &keys) != 3 || dfs_bloom_init_bits(bloom, bit_count, hashes) < 0) {
+        printf("%s sent an unusable path filter\n", filter->name);
+        conn_pool_put(filter->pool, server_sock, 0);
+        return -1;
+    }
+    bloom->keys = keys;
+    struct filter_sink sink = {bloom, 0};
+    uint64_t total;
+    if (dfs_recv_stream_to(server_sock, sink_bits, &sink, &total, NULL, 0) != 0 || sink.received != bit_count / 8) {
+        conn_pool_put(filter->pool, server_sock, 0);
+        dfs_bloom_free(bloom);
+        return -1;
+    }
+    // The connection is the server's from now on, it never goes back to the pool
+    return server_sock;
+}
+
+// helper to replace the filter by the server's current one. Returns the connection of its pushes,
+// or -1 if it could not be had.
+static int load_filter(struct path_filter *filter) {
+    // Uploads that end from now on are kept, the server may have answered them after building the filter
+    pthread_mutex_lock(&filter->lock);
+    filter->loading = 1;
+    pthread_mutex_unlock(&filter->lock);
+
+    struct dfs_bloom bloom;
+    int server_sock = fetch_filter(filter, &bloom);
+
+    pthread_mutex_lock(&filter->lock);
+    if (server_sock >= 0) {
+        for (struct filter_upload *upload = filter->uploads; upload != NULL; upload = upload->next) {
+            add_key(&bloom, upload->key, upload->len);
+        }
+        dfs_bloom_free(&filter->bloom);
+        filter->bloom = bloom;
+        if (!filter->loaded) {
+            printf("%s path filter loaded: %llu paths in %llu bytes\n", filter->name,
+                   (unsigned long long)bloom.keys, (unsigned long long)(bloom.bit_count / 8));
+        }
+        filter->loaded = 1;
+        filter->changes = 0;
+        filter->loads++;
+    } else {
+        filter->load_failures++;
+    }
+    filter->loading = 0;
+    drop_ended(filter);
+    pthread_mutex_unlock(&filter->lock);
+    return server_sock;
+}
+
+// helper to read a frame the server pushed: the paths it gained. Returns -1 if the connection is
+// of no more use, the filter then misses what the server gains.
+static int read_push(struct path_filter *filter, int server_sock) {
+    struct dfs_hdr hdr;
+    char keys[DFS_BLOOM_PUSH_MAX];
+    if (dfs_recv_hdr(server_sock, &hdr) < 0 || hdr.opcode != DFS_OP_DATA || hdr.length > sizeof(keys) ||
+        dfs_recv_all(server_sock, keys, (size_t)hdr.length) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&filter->lock);
+    for (size_t pos = 0; pos < hdr.length; ) {
+        size_t len = strnlen(keys + pos, (size_t)hdr.length - pos);
+        dfs_bloom_add(&filter->bloom, keys + pos, len);
+        filter->pushed++;
+        filter->changes++;
+        pos += len + 1;
+    }
+    pthread_mutex_unlock(&filter->lock);
+    return 0;
+}
+
+// helper to tell if a new filter should be loaded, the caller holds the lock
+static int filter_stale(struct path_filter *filter) {
+    if (!filter->loaded) {
+        return 1;
+    }
+    uint64_t room = filter->bloom.bit_count / DFS_BLOOM_BITS_PER_KEY;
+    return filter->changes >= room / 4;
+}
+
+// helper running on the thread of a filter: load it, apply what the server pushes, and load a new
+// one when it is stale or the server's connection was lost
+static void *filter_thread(void *arg) {
+    struct path_filter *filter = arg;
+    int server_sock = -1;
+    int retry_ms = PATH_FILTER_RETRY_MS;
+    while (1) {
+        pthread_mutex_lock(&filter->lock);
+        int stale = filter_stale(filter);
+        pthread_mutex_unlock(&filter->lock);
+        // A server that is down is asked less and less often
+        int timeout = PATH_FILTER_RETRY_MS;
+        if (stale) {
+            int loaded_sock = load_filter(filter);
+            if (loaded_sock < 0) {
+                timeout = retry_ms;
+                retry_ms = retry_ms * 2 < PATH_FILTER_MAX_RETRY_MS ? retry_ms * 2 : PATH_FILTER_MAX_RETRY_MS;
+            } else {
+                // The new filter holds what was pushed on the old connection
+                if (server_sock >= 0) {
+                    conn_pool_put(filter->pool, server_sock, 0);
+                }
+                server_sock = loaded_sock;
+                retry_ms = PATH_FILTER_RETRY_MS;
+            }
+        }
+
+        struct pollfd fds[2] = {{filter->stop_fd, POLLIN, 0}, {server_sock, POLLIN, 0}};
+        int ready = poll(fds, server_sock >= 0 ? 2 : 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            perror("Path filter poll failed");
+            break;
+        }
+        if (ready > 0 && fds[0].revents) {
+            break;
+        }
+        if (ready > 0 && fds[1].revents && read_push(filter, server_sock) < 0) {
+            // Until the next filter arrives every path is passed on
+            printf("%s path filter lost its server, passing every path on until it is loaded again\n", filter->name);
+            conn_pool_put(filter->pool, server_sock, 0);
+            server_sock = -1;
+            pthread_mutex_lock(&filter->lock);
+            filter->loaded = 0;
+            pthread_mutex_unlock(&filter->lock);
+        }
+    }
+    if (server_sock >= 0) {
+        conn_pool_put(filter->pool, server_sock, 0);
+    }
+    return NULL;
+}
+
+// Function to start the filter of a server
+struct path_filter *path_filter_open(const char *name, struct conn_pool *pool, const char *smain_root) {
+    struct path_filter *filter = calloc(1, sizeof(*filter));
+    if (filter == NULL) {
+        return NULL;
+    }
+    snprintf(filter->name, sizeof(filter->name), "%s", name);
+    snprintf(filter->root, sizeof(filter->root), "%s", smain_root);
+    filter->root_len = strlen(filter->root);
+    filter->pool = pool;
+    pthread_mutex_init(&filter->lock, NULL);
+    filter->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (filter->stop_fd < 0 || pthread_create(&filter->thread, NULL, filter_thread, filter) != 0) {
+        perror("Path filter could not be started");
+        if (filter->stop_fd >= 0) {
+            close(filter->stop_fd);
+        }
+        pthread_mutex_destroy(&filter->lock);
+        free(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+// Function to stop the thread of a filter and free it
+void path_filter_close(struct path_filter *filter) {
+    if (filter == NULL) {
+        return;
+    }
+    uint64_t stop = 1;
+    if (write(filter->stop_fd, &stop, sizeof(stop)) != sizeof(stop)) {
+        perror("Path filter stop failed");
+    }
+    pthread_join(filter->thread, NULL);
+    close(filter->stop_fd);
+    filter->loading = 0;
+    for (struct filter_upload *upload = filter->uploads; upload != NULL; upload = upload->next) {
+        upload->running = 0;
+    }
+    drop_ended(filter);
+    dfs_bloom_free(&filter->bloom);
+    pthread_mutex_destroy(&filter->lock);
+    free(filter);
+}
+
+// Function to tell if the server may store a path
+int path_filter_may_exist(struct path_filter *filter, const char *path) {
+    char key[PATH_MAX];
+    int len;
+    if (filter == NULL || (len = path_key(filter, path, key, sizeof(key))) < 0) {
+        return 1;
+    }
+    pthread_mutex_lock(&filter->lock);
+    int may_exist = !filter->loaded || dfs_bloom_test(&filter->bloom, key, (size_t)len);
+    filter->lookups++;
+    if (!may_exist) {
+        filter->ruled_out++;
+    }
+    pthread_mutex_unlock(&filter->lock);
+    return may_exist;
+}
+
+// Function to add the path of an upload before it reaches the server
+void path_filter_add(struct path_filter *filter, const char *path) {
+    char key[PATH_MAX];
+    int len;
+    if (filter == NULL || (len = path_key(filter, path, key, sizeof(key))) < 0) {
+        return;
+    }
+    struct filter_upload *upload = malloc(sizeof(*upload) + (size_t)len + 1);
+    pthread_mutex_lock(&filter->lock);
+    if (filter->loaded) {
+        add_key(&filter->bloom, key, (size_t)len);
+    }
+    if (upload != NULL) {
+        upload->running = 1;
+        upload->len = (size_t)len;
+        memcpy(upload->key, key, (size_t)len + 1);
+        upload->next = filter->uploads;
+        filter->uploads = upload;
+    }
+    filter->changes++;
+    pthread_mutex_unlock(&filter->lock);
+}
+
+// Function to note that the server answered an upload
+void path_filter_added(struct path_filter *filter, const char *path) {
+    char key[PATH_MAX];
+    int len;
+    if (filter == NULL || (len = path_key(filter, path, key, sizeof(key))) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&filter->lock);
+    for (struct filter_upload *upload = filter->uploads; upload != NULL; upload = upload->next) {
+        if (upload->running && upload->len == (size_t)len && memcmp(upload->key, key, (size_t)len) == 0) {
+            upload->running = 0;
+            break;
+        }
+    }
+    if (!filter->loading) {
+        drop_ended(filter);
+    }
+    pthread_mutex_unlock(&filter->lock);
+}
+
+// Function to count a removal, the filter keeps the path until the next one is loaded
+void path_filter_removed(struct path_filter *filter, const char *path) {
+    (void)path;
+    if (filter == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&filter->lock);
+    filter->changes++;
+    pthread_mutex_unlock(&filter->lock);
+}
+
+// Function to print the counters of a filter
+void path_filter_print_stats(struct path_filter *filter) {
+    if (filter == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&filter->lock);
+    if (filter->loaded) {
+        printf("%s path filter: %llu paths in %llu bytes, estimated false positive rate %.4f%%, "
+               "%llu lookups, %llu answered without the server, %llu loads (%llu failed), %llu paths pushed\n",
+               filter->name, (unsigned long long)filter->bloom.keys, (unsigned long long)(filter->bloom.bit_count / 8),
+               dfs_bloom_false_positive_rate(&filter->bloom) * 100.0, (unsigned long long)filter->lookups,
+               (unsigned long long)filter->ruled_out, (unsigned long long)filter->loads,
+               (unsigned long long)filter->load_failures, (unsigned long long)filter->pushed);
+    } else {
+        printf("%s path filter: not loaded yet, %llu lookups passed on\n", filter->name, (unsigned long long)filter->lookups);
+    }
+    pthread_mutex_unlock(&filter->lock);
+}
@@ -0,0 +1,51 @@
+#ifndef PATH_FILTER_H
+#define PATH_FILTER_H
+
+#include "conn_pool.h"
+
+// What Smain knows of the paths a Spdf/Stext server stores, so a dfile or rmfile of a path the
+// server does not have is answered "File not found" without a round trip to it.
+//
+// The filter is the Bloom filter of the server's tree (see common/dfs_bloom.h). A thread of the
+// filter asks the server for it at startup, and again while the server can not be reached or its
+// index is not ready (after PATH_FILTER_RETRY_MS, doubled on every failure up to
+// PATH_FILTER_MAX_RETRY_MS). The connection it came on stays with the thread: the server pushes the
+// paths created in its tree by other means on it (see server/path_feed.h), which are added as they
+// arrive. Once the paths added and removed since the filter was loaded reach a quarter of its room
+// a new one is loaded (a Bloom filter can not forget a removed path, it only tests positive for
+// longer). When the connection is lost, or the server closes it because it missed changes, every
+// path may exist again until a new filter arrived.
+//
+// Every 'ufile' through Smain adds its path (and the directories above it) before it is passed on,
+// so the filter never misses a file the server stores. An upload still running while a filter is
+// loaded may or may not be part of it, so the paths of those, and of the ones that ended while it
+// was loaded, are added to it again before it is used.
+//
+// Until the first filter arrived every path may exist. Every function accepts a NULL filter, which
+// never rules a path out.
+
+#define PATH_FILTER_RETRY_MS 1000
+#define PATH_FILTER_MAX_RETRY_MS 32000
+
+struct path_filter;
+
+// Start the filter of the server reached through pool, whose tree corresponds to smain_root (the
+// absolute path of ~/smain) in the paths of the requests. name is used in log messages.
+struct path_filter *path_filter_open(const char *name, struct conn_pool *pool, const char *smain_root);
+
+void path_filter_close(struct path_filter *filter);
+
+// 0 if the server certainly does not store the absolute path, 1 if it may
+int path_filter_may_exist(struct path_filter *filter, const char *path);
+
+// An upload to path starts, path_filter_added() follows once the server answered (or did not)
+void path_filter_add(struct path_filter *filter, const char *path);
+void path_filter_added(struct path_filter *filter, const char *path);
+
+// A removal of path was passed to the server
+void path_filter_removed(struct path_filter *filter, const char *path);
+
+// Print the counters as one log line
+void path_filter_print_stats(struct path_filter *filter);
+
+#endif
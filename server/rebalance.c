@@ -0,0 +1,943 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "../common/dfs_proto.h"
+#include "rebalance.h"
+
+enum entry_state {
+    ENTRY_LISTED,      // found by the listing, not placed yet
+    ENTRY_PENDING,     // to be copied from 'from' to 'to'
+    ENTRY_COPYING,
+    ENTRY_DONE,        // on its owner, the copies the other holders have are removed
+    ENTRY_FAILED       // could not be moved, stays on 'from'
+};
+
+// A file of a backend of the run, known by its path below ~/smain
+struct entry {
+    struct entry *next;          // in its bucket
+    char *key;
+    int backend;
+    int from;                    // the server that has the current content
+    int to;                      // its owner
+    uint32_t holders;            // the servers that have a copy, bit i for server i of the table
+    uint64_t size;
+    enum entry_state state;
+    int dirty;                   // written since its copy started
+    int writing;                 // writes routed by the entry that their server did not answer yet
+    long long done_ms;           // when it became DONE, the other copies are removed REBALANCE_GRACE_MS later
+};
+
+// Entries by key, in the order they were added
+struct entry_map {
+    struct entry **buckets;
+    size_t bucket_count;
+    struct entry **entries;
+    size_t count;
+    size_t cap;
+};
+
+struct rebalance {
+    struct route_table *table;
+    struct path_filter **filters;
+    char root[PATH_MAX];
+    char *routes_path;
+    int signal_fd;               // SIGHUP
+    int stop_fd;                 // eventfd that ends the thread, never read
+    pthread_t thread;
+    double rate;                 // bytes per second, 0 for no limit
+
+    pthread_mutex_t lock;        // the run: everything below but the thread's own counters
+    int active[ROUTE_MAX_BACKENDS];
+    struct route_layout *staged[ROUTE_MAX_BACKENDS];
+    struct entry_map run;        // the files of the run, the moves follow their order
+    struct entry_map strays;     // files earlier runs could not move, FAILED entries that route to 'from'
+
+    // The thread's own
+    uint32_t request_id;
+    struct entry **removals;     // DONE entries whose other copies are removed, oldest first
+    size_t removal_count;
+    size_t removal_next;
+    size_t removal_cap;
+    double budget;               // bytes that may be sent now
+    long long budget_ms;
+    char names[128];             // the backends of the run, for log messages
+    long long started_ms;
+    long long progress_ms;
+    uint64_t files_to_move;
+    uint64_t bytes_to_move;
+    uint64_t copies_to_remove;
+    uint64_t files_moved;
+    uint64_t bytes_sent;
+    uint64_t copies_removed;
+    uint64_t failed;
+};
+
+// Streams a file from one server to another
+struct copy {
+    struct rebalance *rb;
+    int sock;
+    uint32_t request_id;
+};
+
+// Records of a DFS_OP_LIST reply, cut anywhere by the frames
+struct listing {
+    struct rebalance *rb;
+    int server;
+    uint64_t files;
+    size_t rest_len;
+    int skipping;                // the record in rest is too long, dropped up to its end
+    char rest[PATH_MAX + 32];
+};
+
+// helper returning a monotonic clock in milliseconds
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// helper to wait ms milliseconds, returns 1 if the rebalancer is stopped meanwhile
+static int wait_stop(struct rebalance *rb, int ms) {
+    struct pollfd fds = {rb->stop_fd, POLLIN, 0};
+    return poll(&fds, 1, ms) > 0;
+}
+
+// helper hashing a key (FNV-1a)
+static size_t hash_key(const char *key) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (; *key != '\0'; key++) {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+// helper finding the entry of a key, the caller holds the lock
+static struct entry *find_entry(const struct entry_map *map, const char *key) {
+    if (map->bucket_count == 0) {
+        return NULL;
+    }
+    struct entry *entry = map->buckets[hash_key(key) & (map->bucket_count - 1)];
+    while (entry != NULL && strcmp(entry->key, key) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+// helper adding the entry of a key, the caller holds the lock. Returns NULL if out of memory
+static struct entry *add_entry(struct entry_map *map, const char *key, int backend) {
+    // Twice the buckets once there are as many entries
+    if (map->count >= map->bucket_count) {
+        size_t count = map->bucket_count > 0 ? map->bucket_count * 2 : 1024;
+        struct entry **buckets = calloc(count, sizeof(*buckets));
+        if (buckets == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < map->count; i++) {
+            struct entry *entry = map->entries[i];
+            size_t bucket = hash_key(entry->key) & (count - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+        }
+        free(map->buckets);
+        map->buckets = buckets;
+        map->bucket_count = count;
+    }
+    if (map->count == map->cap) {
+        size_t cap = map->cap > 0 ? map->cap * 2 : 1024;
+        struct entry **entries = realloc(map->entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+            return NULL;
+        }
+        map->entries = entries;
+        map->cap = cap;
+    }
+    struct entry *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL || (entry->key = strdup(key)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->backend = backend;
+    entry->from = -1;
+    entry->to = -1;
+    entry->state = ENTRY_LISTED;
+    size_t bucket = hash_key(key) & (map->bucket_count - 1);
+    entry->next = map->buckets[bucket];
+    map->buckets[bucket] = entry;
+    map->entries[map->count++] = entry;
+    return entry;
+}
+
+// helper to forget the entries of a map, the caller holds the lock
+static void free_entries(struct entry_map *map) {
+    for (size_t i = 0; i < map->count; i++) {
+        free(map->entries[i]->key);
+        free(map->entries[i]);
+    }
+    free(map->entries);
+    free(map->buckets);
+    memset(map, 0, sizeof(*map));
+}
+
+// helper returning the server that has the file at key now: the one an earlier run could not move it
+// from, else its owner. The caller holds the lock
+static int current_server(struct rebalance *rb, struct route_table *table, int backend, const char *key) {
+    struct entry *stray = rb->strays.count > 0 ? find_entry(&rb->strays, key) : NULL;
+    if (stray != NULL && stray->backend == backend && !table->servers[stray->from].drained) {
+        return stray->from;
+    }
+    return route_find_server(table, backend, key);
+}
+
+// helper keeping the files of a run that could not be moved as strays, until a later run lists
+// their servers again. The caller holds the lock
+static void keep_strays(struct rebalance *rb, const int active[ROUTE_MAX_BACKENDS], const int unlisted[ROUTE_MAX_SERVERS]) {
+    struct entry_map strays = {0};
+    for (size_t i = 0; i < rb->strays.count; i++) {
+        struct entry *stray = rb->strays.entries[i];
+        // A stray of a server the run listed was moved, failed again or is gone
+        if ((active[stray->backend] && !unlisted[stray->from]) || find_entry(&rb->run, stray->key) != NULL) {
+            continue;
+        }
+        struct entry *kept = add_entry(&strays, stray->key, stray->backend);
+        if (kept != NULL) {
+            kept->from = stray->from;
+            kept->state = ENTRY_FAILED;
+        }
+    }
+    for (size_t i = 0; i < rb->run.count; i++) {
+        struct entry *entry = rb->run.entries[i];
+        if (entry->state != ENTRY_FAILED) {
+            continue;
+        }
+        struct entry *kept = add_entry(&strays, entry->key, entry->backend);
+        if (kept != NULL) {
+            kept->from = entry->from;
+            kept->state = ENTRY_FAILED;
+        }
+    }
+    free_entries(&rb->strays);
+    rb->strays = strays;
+}
+
+// helper counting the copies of an entry that are not on its owner
+static int stale_copies(const struct entry *entry) {
+    return __builtin_popcount(entry->holders & ~(1u << entry->to));
+}
+
+// helper queueing the removal of the copies of a DONE entry that are not on its owner
+static void queue_removal(struct rebalance *rb, struct entry *entry) {
+    if (stale_copies(entry) == 0) {
+        return;
+    }
+    if (rb->removal_count == rb->removal_cap) {
+        size_t cap = rb->removal_cap > 0 ? rb->removal_cap * 2 : 1024;
+        struct entry **removals = realloc(rb->removals, cap * sizeof(*removals));
+        if (removals == NULL) {
+            return;
+        }
+        rb->removals = removals;
+        rb->removal_cap = cap;
+    }
+    rb->removals[rb->removal_count++] = entry;
+}
+
+// helper printing how far the run is
+static void print_progress(struct rebalance *rb) {
+    double seconds = (double)(now_ms() - rb->started_ms) / 1000;
+    printf("Rebalancing %s: %llu of %llu files moved, %.1f of %.1f MB sent (%.1f MB/s), %llu of %llu old copies removed, %llu failed\n",
+           rb->names, (unsigned long long)rb->files_moved, (unsigned long long)rb->files_to_move,
+           (double)rb->bytes_sent / (1024 * 1024), (double)rb->bytes_to_move / (1024 * 1024),
+           seconds > 0 ? (double)rb->bytes_sent / (1024 * 1024) / seconds : 0.0,
+           (unsigned long long)rb->copies_removed, (unsigned long long)rb->copies_to_remove, (unsigned long long)rb->failed);
+    rb->progress_ms = now_ms();
+}
+
+// helper printing the progress every REBALANCE_PROGRESS_MS
+static void check_progress(struct rebalance *rb) {
+    if (now_ms() - rb->progress_ms >= REBALANCE_PROGRESS_MS) {
+        print_progress(rb);
+    }
+}
+
+// helper waiting until len more bytes may be sent. The budget refills at the rate, up to one second
+// of it. Returns -1 if the rebalancer is stopped meanwhile
+static int throttle(struct rebalance *rb, size_t len) {
+    if (rb->rate <= 0) {
+        return 0;
+    }
+    long long now = now_ms();
+    rb->budget += (double)(now - rb->budget_ms) * rb->rate / 1000;
+    if (rb->budget > rb->rate) {
+        rb->budget = rb->rate;
+    }
+    rb->budget_ms = now;
+    rb->budget -= (double)len;
+    if (rb->budget < 0 && wait_stop(rb, (int)(-rb->budget * 1000 / rb->rate) + 1)) {
+        return -1;
+    }
+    return 0;
+}
+
+// helper sending a request to a server of the table. Returns the connection, or -1 if the server
+// can not be reached
+static int server_begin(struct rebalance *rb, int server, int opcode, const char *text, uint32_t *request_id) {
+    struct conn_pool *pool = rb->table->servers[server].pool;
+    int sock = conn_pool_get(pool);
+    if (sock < 0) {
+        return -1;
+    }
+    *request_id = ++rb->request_id;
+    if (dfs_send_text(sock, opcode, *request_id, text) < 0) {
+        conn_pool_put(pool, sock, 0);
+        return -1;
+    }
+    return sock;
+}
+
+// helper reading an OK or ERROR reply. Returns 0 for OK, 1 for ERROR (its text in message) and -1
+// if the connection failed
+static int server_reply(int sock, char *message, size_t message_size) {
+    struct dfs_hdr hdr;
+    if (dfs_recv_hdr(sock, &hdr) < 0 || (hdr.opcode != DFS_OP_OK && hdr.opcode != DFS_OP_ERROR) ||
+        dfs_recv_text(sock, &hdr, message, message_size) < 0) {
+        return -1;
+    }
+    return hdr.opcode == DFS_OP_ERROR;
+}
+
+// helper passing a chunk of the file on to the server that gets it
+static int copy_sink(void *ctx, const void *data, size_t len) {
+    struct copy *copy = ctx;
+    if (throttle(copy->rb, len) < 0 || dfs_send_frame(copy->sock, DFS_OP_DATA, copy->request_id, data, len) < 0) {
+        return -1;
+    }
+    copy->rb->bytes_sent += len;
+    check_progress(copy->rb);
+    return 0;
+}
+
+// helper copying the file at key from one server to another: a 'dfile' to the one whose DATA is
+// passed on as a 'ufile' to the other. Returns 0 when it is copied, 1 if from does not have the
+// file and -1 if the copy failed
+static int copy_file(struct rebalance *rb, const char *key, int from, int to) {
+    const struct route_server *source = &rb->table->servers[from];
+    const struct route_server *target = &rb->table->servers[to];
+    char path[2 * PATH_MAX];
+    char message[DFS_MAX_TEXT + 1];
+    snprintf(path, sizeof(path), "%s/%s", rb->root, key);
+
+    uint32_t get_id;
+    struct dfs_hdr hdr;
+    int get_sock = server_begin(rb, from, DFS_OP_DFILE, path, &get_id);
+    if (get_sock < 0) {
+        printf("Rebalancing: %s can not be reached\n", source->name);
+        return -1;
+    }
+    if (dfs_recv_hdr(get_sock, &hdr) < 0 || (hdr.opcode != DFS_OP_NAME && hdr.opcode != DFS_OP_ERROR) ||
+        dfs_recv_text(get_sock, &hdr, message, sizeof(message)) < 0) {
+        conn_pool_put(source->pool, get_sock, 0);
+        printf("Rebalancing: %s could not be read from %s\n", key, source->name);
+        return -1;
+    }
+    if (hdr.opcode == DFS_OP_ERROR) {
+        conn_pool_put(source->pool, get_sock, 1);
+        if (strstr(message, "not found") != NULL) {
+            return 1;
+        }
+        printf("Rebalancing: %s could not be read from %s: %s\n", key, source->name, message);
+        return -1;
+    }
+
+    uint32_t put_id;
+    int put_sock = server_begin(rb, to, DFS_OP_UFILE, path, &put_id);
+    if (put_sock < 0) {
+        conn_pool_put(source->pool, get_sock, 0);
+        printf("Rebalancing: %s can not be reached\n", target->name);
+        return -1;
+    }
+    // The upload is ended like the download: END, or ERROR so the server drops what it got
+    struct copy copy = {rb, put_sock, put_id};
+    int got = dfs_recv_stream_to(get_sock, copy_sink, &copy, NULL, message, sizeof(message));
+    conn_pool_put(source->pool, get_sock, got == 0 || got == -2 || got == -3);
+    int result = -1;
+    if (got != -2 && (got == 0 ? dfs_send_frame(put_sock, DFS_OP_END, put_id, NULL, 0)
+                               : dfs_send_text(put_sock, DFS_OP_ERROR, put_id, "ERROR: Copy failed!")) == 0) {
+        result = server_reply(put_sock, message, sizeof(message));
+    }
+    conn_pool_put(target->pool, put_sock, result >= 0);
+    if (got != 0 || result != 0) {
+        printf("Rebalancing: %s could not be copied from %s to %s\n", key, source->name, target->name);
+        return -1;
+    }
+    return 0;
+}
+
+// helper removing the file at key from a server. Returns 0 if the server does not have it any more
+static int remove_file(struct rebalance *rb, const char *key, int server) {
+    char path[2 * PATH_MAX];
+    char message[DFS_MAX_TEXT + 1];
+    snprintf(path, sizeof(path), "%s/%s", rb->root, key);
+    uint32_t request_id;
+    int sock = server_begin(rb, server, DFS_OP_RMFILE, path, &request_id);
+    if (sock < 0) {
+        return -1;
+    }
+    int result = server_reply(sock, message, sizeof(message));
+    conn_pool_put(rb->table->servers[server].pool, sock, result >= 0);
+    if (result < 0 || (result == 1 && strstr(message, "not found") == NULL)) {
+        printf("Rebalancing: %s could not be removed from %s\n", key, rb->table->servers[server].name);
+        return -1;
+    }
+    path_filter_removed(rb->filters[server], path);
+    return 0;
+}
+
+// helper handling a record "<size> <path>" of a listing
+static void list_record(struct listing *listing, const char *record) {
+    struct rebalance *rb = listing->rb;
+    char *end;
+    unsigned long long size = strtoull(record, &end, 10);
+    if (end == record || *end != ' ' || end[1] == '\0') {
+        return;
+    }
+    const char *key = end + 1;
+    const char *name = strrchr(key, '/');
+    name = name != NULL ? name + 1 : key;
+    // The files of other types, and the temporary files of uploads, are no business of the backend
+    int backend = rb->table->servers[listing->server].backend;
+    if (route_find(rb->table, name) != backend) {
+        return;
+    }
+    pthread_mutex_lock(&rb->lock);
+    struct entry *entry = find_entry(&rb->run, key);
+    if (entry == NULL) {
+        entry = add_entry(&rb->run, key, backend);
+    }
+    if (entry != NULL) {
+        entry->holders |= 1u << listing->server;
+        if (size > entry->size) {
+            entry->size = size;
+        }
+    }
+    pthread_mutex_unlock(&rb->lock);
+    listing->files++;
+}
+
+// helper taking the records out of a chunk of a listing
+static int list_sink(void *ctx, const void *data, size_t len) {
+    struct listing *listing = ctx;
+    const char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        if (bytes[i] == '\0') {
+            listing->rest[listing->rest_len] = '\0';
+            if (!listing->skipping) {
+                list_record(listing, listing->rest);
+            }
+            listing->rest_len = 0;
+            listing->skipping = 0;
+        } else if (listing->rest_len + 1 < sizeof(listing->rest)) {
+            listing->rest[listing->rest_len++] = bytes[i];
+        } else {
+            listing->skipping = 1;
+        }
+    }
+    return 0;
+}
+
+// helper asking a server which files it stores. Returns -1 if it could not be listed
+static int list_server(struct rebalance *rb, int server) {
+    const struct route_server *listed = &rb->table->servers[server];
+    struct listing *listing = malloc(sizeof(*listing));
+    if (listing == NULL) {
+        return -1;
+    }
+    for (int attempt = 1; attempt <= REBALANCE_LIST_TRIES; attempt++) {
+        if (attempt > 1 && wait_stop(rb, 1000)) {
+            break;
+        }
+        uint32_t request_id;
+        int sock = server_begin(rb, server, DFS_OP_LIST, "", &request_id);
+        if (sock < 0) {
+            continue;
+        }
+        listing->rb = rb;
+        listing->server = server;
+        listing->files = 0;
+        listing->rest_len = 0;
+        listing->skipping = 0;
+        char message[DFS_MAX_TEXT + 1] = "";
+        int got = dfs_recv_stream_to(sock, list_sink, listing, NULL, message, sizeof(message));
+        conn_pool_put(listed->pool, sock, got == 0 || got == -3);
+        if (got == 0) {
+            printf("Rebalancing %s: %s stores %llu files\n", rb->names, listed->name, (unsigned long long)listing->files);
+            free(listing);
+            return 0;
+        }
+    }
+    printf("Rebalancing %s: %s could not be listed, its files stay where they are\n", rb->names, listed->name);
+    free(listing);
+    return -1;
+}
+
+// helper moving the file of an entry to its owner. Gives up after REBALANCE_TRIES copies that
+// failed or were written meanwhile, the file then stays where it is
+static void move_entry(struct rebalance *rb, struct entry *entry) {
+    char path[2 * PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", rb->root, entry->key);
+    int tries = 0;
+    while (1) {
+        pthread_mutex_lock(&rb->lock);
+        // A write its server did not answer yet would change the file under the copy
+        if (entry->writing > 0) {
+            pthread_mutex_unlock(&rb->lock);
+            if (wait_stop(rb, 100)) {
+                break;
+            }
+            continue;
+        }
+        entry->state = ENTRY_COPYING;
+        entry->dirty = 0;
+        int from = entry->from;
+        int to = entry->to;
+        pthread_mutex_unlock(&rb->lock);
+
+        int copied = copy_file(rb, entry->key, from, to);
+        if (copied == 1) {
+            // Removed meanwhile, so is what an earlier try copied
+            if (remove_file(rb, entry->key, to) < 0) {
+                copied = -1;
+            }
+        }
+        tries++;
+
+        pthread_mutex_lock(&rb->lock);
+        if (copied >= 0 && !entry->dirty && entry->writing == 0) {
+            entry->state = ENTRY_DONE;
+            entry->done_ms = now_ms();
+            // The old copy is removed once the grace is over, a file removed meanwhile is gone already.
+            // Only a complete copy goes into the owner's path filter, which can not forget one that failed
+            if (copied == 0) {
+                path_filter_add(rb->filters[to], path);
+                path_filter_added(rb->filters[to], path);
+                entry->holders |= 1u << to;
+            } else {
+                entry->holders &= ~(1u << from);
+            }
+            entry->from = to;
+            queue_removal(rb, entry);
+            pthread_mutex_unlock(&rb->lock);
+            rb->files_moved++;
+            return;
+        }
+        if (tries < REBALANCE_TRIES) {
+            // Written meanwhile, the copy starts over
+            entry->state = ENTRY_PENDING;
+            pthread_mutex_unlock(&rb->lock);
+            if (copied < 0 && wait_stop(rb, 1000)) {
+                break;
+            }
+            continue;
+        }
+        entry->state = ENTRY_FAILED;
+        pthread_mutex_unlock(&rb->lock);
+        break;
+    }
+
+    // The file stays where it is, the owner must not keep a copy it would serve instead
+    pthread_mutex_lock(&rb->lock);
+    entry->state = ENTRY_FAILED;
+    pthread_mutex_unlock(&rb->lock);
+    if (remove_file(rb, entry->key, entry->to) < 0) {
+        printf("Rebalancing: %s may be stale on %s\n", entry->key, rb->table->servers[entry->to].name);
+    }
+    printf("Rebalancing: %s stays on %s\n", entry->key, rb->table->servers[entry->from].name);
+    rb->failed++;
+}
+
+// helper removing the copies of DONE entries that are not on their owner, once the requests that
+// may still be on their way to them are over. With wait, all of them, else the ones that are due
+static void remove_copies(struct rebalance *rb, int wait) {
+    while (rb->removal_next < rb->removal_count) {
+        struct entry *entry = rb->removals[rb->removal_next];
+        long long due = entry->done_ms + REBALANCE_GRACE_MS - now_ms();
+        if (due > 0 && (!wait || wait_stop(rb, (int)due))) {
+            return;
+        }
+        rb->removal_next++;
+        pthread_mutex_lock(&rb->lock);
+        uint32_t holders = entry->holders & ~(1u << entry->to);
+        pthread_mutex_unlock(&rb->lock);
+        for (int server = 0; server < ROUTE_MAX_SERVERS; server++) {
+            if ((holders & (1u << server)) == 0) {
+                continue;
+            }
+            if (remove_file(rb, entry->key, server) < 0) {
+                rb->failed++;
+                continue;
+            }
+            pthread_mutex_lock(&rb->lock);
+            entry->holders &= ~(1u << server);
+            pthread_mutex_unlock(&rb->lock);
+            rb->copies_removed++;
+        }
+        check_progress(rb);
+    }
+}
+
+// helper running a rebalancing of the backends in active, with the layouts in staged to commit
+// (NULL for the backends whose layout is in use already)
+static void run(struct rebalance *rb, const int active[ROUTE_MAX_BACKENDS], struct route_layout *staged[ROUTE_MAX_BACKENDS]) {
+    struct route_table *table = rb->table;
+    rb->names[0] = '\0';
+    for (int b = 0; b < table->backend_count; b++) {
+        if (active[b]) {
+            size_t used = strlen(rb->names);
+            snprintf(rb->names + used, sizeof(rb->names) - used, "%s%s", used > 0 ? ", " : "", table->backends[b].name);
+        }
+    }
+    rb->started_ms = now_ms();
+    rb->progress_ms = rb->started_ms;
+    rb->budget = 0;
+    rb->budget_ms = rb->started_ms;
+    rb->files_to_move = rb->bytes_to_move = rb->copies_to_remove = 0;
+    rb->files_moved = rb->bytes_sent = rb->copies_removed = rb->failed = 0;
+    rb->removal_count = rb->removal_next = 0;
+
+    // From now on writes leave entries, so no listed copy is moved over a newer one
+    pthread_mutex_lock(&rb->lock);
+    for (int b = 0; b < ROUTE_MAX_BACKENDS; b++) {
+        rb->active[b] = active[b];
+        rb->staged[b] = staged[b];
+    }
+    pthread_mutex_unlock(&rb->lock);
+
+    int unlisted[ROUTE_MAX_SERVERS] = {0};
+    int server_count = table->server_count;
+    for (int i = 0; i < server_count; i++) {
+        const struct route_server *server = &table->servers[i];
+        if (active[server->backend] && !server->drained && list_server(rb, i) < 0) {
+            unlisted[i] = 1;
+        }
+    }
+
+    // A file goes to its owner from the current one if that has it, which got the writes, else from
+    // the first server that has it. The current one is where an earlier run left a file it could not
+    // move, its copy wins over the one the owner may have kept
+    int stopped = wait_stop(rb, 0);
+    pthread_mutex_lock(&rb->lock);
+    long long now = now_ms();
+    for (size_t i = 0; !stopped && i < rb->run.count; i++) {
+        struct entry *entry = rb->run.entries[i];
+        if (entry->state == ENTRY_LISTED) {
+            int current = current_server(rb, table, entry->backend, entry->key);
+            int has_current = (entry->holders & (1u << current)) != 0;
+            entry->to = staged[entry->backend] != NULL ? route_layout_find(staged[entry->backend], entry->key) : current;
+            if ((entry->holders & (1u << entry->to)) && (entry->to == current || !has_current)) {
+                entry->state = ENTRY_DONE;
+            } else {
+                entry->state = ENTRY_PENDING;
+                entry->from = has_current ? current : __builtin_ctz(entry->holders);
+            }
+        }
+        if (entry->state == ENTRY_PENDING) {
+            rb->files_to_move++;
+            rb->bytes_to_move += entry->size;
+        } else if (entry->state == ENTRY_DONE) {
+            entry->done_ms = now;
+            queue_removal(rb, entry);
+        }
+        rb->copies_to_remove += stale_copies(entry);
+    }
+    // New uploads go to the owners from now on
+    if (!stopped) {
+        route_table_commit(table, rb->staged);
+    }
+    for (int b = 0; b < ROUTE_MAX_BACKENDS; b++) {
+        route_layout_free(rb->staged[b]);
+        rb->staged[b] = NULL;
+    }
+    pthread_mutex_unlock(&rb->lock);
+    if (!stopped) {
+        char limit[48];
+        snprintf(limit, sizeof(limit), rb->rate > 0 ? "at most %.0f KB/s" : "without a limit", rb->rate / 1024);
+        printf("Rebalancing %s: %llu files to move (%.1f MB) %s, %llu old copies to remove\n", rb->names,
+               (unsigned long long)rb->files_to_move, (double)rb->bytes_to_move / (1024 * 1024), limit,
+               (unsigned long long)rb->copies_to_remove);
+    }
+
+    // Entries written meanwhile are added to the end, the loop reaches them too
+    for (size_t i = 0; !stopped; i++) {
+        pthread_mutex_lock(&rb->lock);
+        struct entry *entry = i < rb->run.count ? rb->run.entries[i] : NULL;
+        int pending = entry != NULL && entry->state == ENTRY_PENDING;
+        pthread_mutex_unlock(&rb->lock);
+        if (entry == NULL) {
+            break;
+        }
+        if (pending) {
+            move_entry(rb, entry);
+        }
+        remove_copies(rb, 0);
+        check_progress(rb);
+        stopped = wait_stop(rb, 0);
+    }
+    if (!stopped) {
+        remove_copies(rb, 1);
+        stopped = wait_stop(rb, 0);
+    }
+
+    // A retired server that held no files it is now the only one to have can be stopped
+    pthread_mutex_lock(&rb->lock);
+    for (int i = 0; !stopped && i < server_count; i++) {
+        struct route_server *server = &table->servers[i];
+        if (!active[server->backend] || !server->retired || server->drained || unlisted[i]) {
+            continue;
+        }
+        int holds = 0;
+        for (size_t j = 0; j < rb->run.count; j++) {
+            holds = holds || (rb->run.entries[j]->holders & (1u << i)) != 0;
+        }
+        if (!holds) {
+            pthread_rwlock_wrlock(&table->lock);
+            server->drained = 1;
+            pthread_rwlock_unlock(&table->lock);
+            printf("%s server at %s:%d holds no files any more, it can be stopped\n", server->name, server->host, server->port);
+        }
+    }
+    for (int b = 0; b < ROUTE_MAX_BACKENDS; b++) {
+        rb->active[b] = 0;
+    }
+    keep_strays(rb, active, unlisted);
+    free_entries(&rb->run);
+    pthread_mutex_unlock(&rb->lock);
+
+    if (stopped) {
+        printf("Rebalancing %s stopped\n", rb->names);
+        return;
+    }
+    print_progress(rb);
+    printf("Rebalancing %s done in %.1f s\n", rb->names, (double)(now_ms() - rb->started_ms) / 1000);
+}
+
+// helper reading the routing table again and rebalancing the backends whose servers changed
+static void reload(struct rebalance *rb) {
+    struct route_table *table = rb->table;
+    struct route_layout *staged[ROUTE_MAX_BACKENDS];
+    int old_count = table->server_count;
+    printf("Reading routing table %s again\n", rb->routes_path != NULL ? rb->routes_path : "(classic)");
+    int changed = route_table_reload(table, rb->routes_path, staged);
+    if (changed < 0) {
+        return;
+    }
+    // The new servers are asked for their paths before any file is sent to them
+    for (int i = old_count; i < table->server_count; i++) {
+        if (rb->root[0] != '\0') {
+            rb->filters[i] = path_filter_open(table->servers[i].name, table->servers[i].pool, rb->root);
+        }
+    }
+    if (changed == 0) {
+        printf("Routing table read again, no backend changed\n");
+        return;
+    }
+    int active[ROUTE_MAX_BACKENDS] = {0};
+    for (int b = 0; b < ROUTE_MAX_BACKENDS; b++) {
+        active[b] = staged[b] != NULL;
+    }
+    run(rb, active, staged);
+}
+
+// helper running on the thread of the rebalancer
+static void *rebalance_thread(void *arg) {
+    struct rebalance *rb = arg;
+    struct route_table *table = rb->table;
+
+    // The files of the sharded backends may have been stored by another layout before the start
+    int active[ROUTE_MAX_BACKENDS] = {0};
+    struct route_layout *staged[ROUTE_MAX_BACKENDS] = {NULL};
+    int sharded = 0;
+    for (int b = 0; b < table->backend_count; b++) {
+        active[b] = table->backends[b].layout->server_count > 1;
+        sharded = sharded || active[b];
+    }
+    if (sharded) {
+        run(rb, active, staged);
+    }
+
+    // A SIGHUP that arrived during a run is read when it is over
+    while (1) {
+        struct pollfd fds[2] = {{rb->stop_fd, POLLIN, 0}, {rb->signal_fd, POLLIN, 0}};
+        int ready = poll(fds, 2, -1);
+        if (ready < 0 && errno != EINTR) {
+            perror("Rebalancer poll failed");
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        struct signalfd_siginfo info;
+        if (read(rb->signal_fd, &info, sizeof(info)) != sizeof(info)) {
+            continue;
+        }
+        reload(rb);
+    }
+    return NULL;
+}
+
+// Function to start the rebalancer of a routing table
+struct rebalance *rebalance_open(struct route_table *table, struct path_filter **filters, const char *smain_root, const char *routes_path) {
+    struct rebalance *rb = calloc(1, sizeof(*rb));
+    if (rb == NULL) {
+        perror("Rebalancer allocation failed");
+        return NULL;
+    }
+    rb->table = table;
+    rb->filters = filters;
+    snprintf(rb->root, sizeof(rb->root), "%s", smain_root);
+    rb->routes_path = routes_path != NULL ? strdup(routes_path) : NULL;
+    const char *env = getenv("DFS_REBALANCE_KBPS");
+    long long kbps = env != NULL ? atoll(env) : REBALANCE_DEFAULT_KBPS;
+    rb->rate = kbps > 0 ? (double)kbps * 1024 : 0;
+    pthread_mutex_init(&rb->lock, NULL);
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    rb->signal_fd = signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK);
+    rb->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (rb->signal_fd < 0 || rb->stop_fd < 0 || (routes_path != NULL && rb->routes_path == NULL) ||
+        pthread_create(&rb->thread, NULL, rebalance_thread, rb) != 0) {
+        perror("Rebalancer could not be started");
+        if (rb->signal_fd >= 0) {
+            close(rb->signal_fd);
+        }
+        if (rb->stop_fd >= 0) {
+            close(rb->stop_fd);
+        }
+        pthread_mutex_destroy(&rb->lock);
+        free(rb->routes_path);
+        free(rb);
+        return NULL;
+    }
+    return rb;
+}
+
+// Function to stop the rebalancer and free it
+void rebalance_close(struct rebalance *rb) {
+    if (rb == NULL) {
+        return;
+    }
+    uint64_t stop = 1;
+    if (write(rb->stop_fd, &stop, sizeof(stop)) != sizeof(stop)) {
+        perror("Rebalancer stop failed");
+    }
+    pthread_join(rb->thread, NULL);
+    close(rb->signal_fd);
+    close(rb->stop_fd);
+    pthread_mutex_destroy(&rb->lock);
+    free_entries(&rb->strays);
+    free(rb->removals);
+    free(rb->routes_path);
+    free(rb);
+}
+
+// helper passing a read its owner does not have to another server of the backend that may have it,
+// one whose file could not be moved
+static int find_copy(struct rebalance *rb, struct route_table *table, int backend, const char *key, int owner) {
+    int others = 0;
+    int server_count = table->server_count;
+    for (int i = 0; i < server_count; i++) {
+        others += i != owner && table->servers[i].backend == backend && !table->servers[i].drained;
+    }
+    if (others == 0) {
+        return owner;
+    }
+    char path[2 * PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", rb->root, key);
+    if (path_filter_may_exist(rb->filters[owner], path)) {
+        return owner;
+    }
+    for (int i = 0; i < server_count; i++) {
+        if (i != owner && table->servers[i].backend == backend && !table->servers[i].drained &&
+            path_filter_may_exist(rb->filters[i], path)) {
+            return i;
+        }
+    }
+    return owner;
+}
+
+// Function to find the server a request for the file at key goes to
+int rebalance_route(struct rebalance *rb, struct route_table *table, int backend, const char *key, int *writing) {
+    if (writing != NULL) {
+        *writing = 0;
+    }
+    if (rb == NULL) {
+        return route_find_server(table, backend, key);
+    }
+    pthread_mutex_lock(&rb->lock);
+    int owner = route_find_server(table, backend, key);
+    int current = current_server(rb, table, backend, key);
+    struct entry *entry = rb->active[backend] ? find_entry(&rb->run, key) : NULL;
+    if (entry != NULL && entry->state != ENTRY_LISTED) {
+        // Until it is on its owner the file is where it was
+        int done = entry->state == ENTRY_DONE;
+        int server = done ? entry->to : entry->from;
+        if (writing != NULL) {
+            entry->dirty = 1;
+            entry->writing++;
+            *writing = 1;
+        }
+        pthread_mutex_unlock(&rb->lock);
+        return server;
+    }
+    if (writing != NULL && rb->active[backend]) {
+        // A write the run has not placed the file of yet goes to its current server now. The entry
+        // keeps a listed copy from being moved over it, and the file moves too if it is not on its owner
+        if (entry == NULL) {
+            entry = add_entry(&rb->run, key, backend);
+        }
+        if (entry != NULL) {
+            entry->to = rb->staged[backend] != NULL ? route_layout_find(rb->staged[backend], key) : owner;
+            entry->from = current;
+            entry->holders |= 1u << current;
+            entry->state = entry->to == current ? ENTRY_DONE : ENTRY_PENDING;
+            entry->dirty = 1;
+            entry->writing++;
+            *writing = 1;
+        }
+        pthread_mutex_unlock(&rb->lock);
+        return current;
+    }
+    pthread_mutex_unlock(&rb->lock);
+    // A file an earlier run could not move is where it stayed, for writes too
+    if (writing != NULL || current != owner) {
+        return current;
+    }
+    return find_copy(rb, table, backend, key, owner);
+}
+
+// Function to tell the rebalancer a write rebalance_route() counted was answered
+void rebalance_write_done(struct rebalance *rb, const char *key) {
+    if (rb == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&rb->lock);
+    struct entry *entry = find_entry(&rb->run, key);
+    if (entry != NULL && entry->writing > 0) {
+        entry->writing--;
+    }
+    pthread_mutex_unlock(&rb->lock);
+}
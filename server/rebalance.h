@@ -0,0 +1,59 @@
+#ifndef REBALANCE_H
+#define REBALANCE_H
+
+#include "path_filter.h"
+#include "route_table.h"
+
+// Moves the files of a sharded backend to the servers that own them while Smain keeps serving.
+//
+// A run starts when Smain starts, for the backends with several servers, and on SIGHUP: the
+// routing table is read again (route_table_reload()), and the backends whose servers or weights
+// changed are the ones of the run. A SIGHUP that arrives during a run starts the next one when it
+// ended. The thread of the rebalancer runs them one at a time:
+//
+//  1. Every server of the backends is asked which files it stores (DFS_OP_LIST), new servers get
+//     their path filter first. A server that can not be listed after REBALANCE_LIST_TRIES tries is
+//     left out of the run.
+//  2. The new layouts are committed, new uploads go to the servers that own the files from now on.
+//  3. Every file that is not on its owner is copied there from the server that has it: a 'dfile' to
+//     the one and a 'ufile' to the other, one file at a time, at most DFS_REBALANCE_KBPS kilobytes
+//     per second (REBALANCE_DEFAULT_KBPS when unset, 0 for no limit). Once the owner has it, the old
+//     copy is removed after REBALANCE_GRACE_MS, as are the copies of files that were on their owner
+//     and some other server already.
+//
+// Until its copy is complete the file is read, replaced and removed on the server that has it: a
+// write meanwhile makes the copy start over once it is done (up to REBALANCE_TRIES times), and a
+// file removed meanwhile is removed from its new owner too. A file that could not be moved stays
+// where it is: its reads and writes go there until a later run lists that server again and moves it
+// (its owner's path filter only gets a file once the copy is complete). A read its owner does not
+// have by its path filter is passed to another server of the backend whose path filter may have it.
+//
+// Progress is logged every REBALANCE_PROGRESS_MS. A retired server (left out of the table) holds
+// no files once a run moved all of them, it is then left out of 'display' and 'dtar' and can be
+// stopped.
+
+#define REBALANCE_DEFAULT_KBPS 51200
+#define REBALANCE_LIST_TRIES 5
+#define REBALANCE_TRIES 3
+#define REBALANCE_GRACE_MS 1000
+#define REBALANCE_PROGRESS_MS 2000
+
+struct rebalance;
+
+// Start the thread of the rebalancer of table, reading routes_path again on SIGHUP (which the
+// caller blocks in every thread before any is created). filters is the array of path filters of the
+// servers of the table, the filters of servers added later are opened into it with smain_root.
+// Returns NULL if the thread can not be started, the layouts then never change.
+struct rebalance *rebalance_open(struct route_table *table, struct path_filter **filters, const char *smain_root, const char *routes_path);
+
+// Stop the thread, a move that is running is given up
+void rebalance_close(struct rebalance *rb);
+
+// The server of a backend a request for the file at key (its path below ~/smain) goes to. writing
+// is NULL for a read; for a 'ufile' or 'rmfile' it is set to 1 if rebalance_write_done() must
+// follow once the server answered.
+int rebalance_route(struct rebalance *rb, struct route_table *table, int backend, const char *key, int *writing);
+
+void rebalance_write_done(struct rebalance *rb, const char *key);
+
+#endif
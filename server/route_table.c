@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "route_table.h"
+
+// The table used when DFS_ROUTES is not set
+static const char *const classic_routes =
+    "backend Spdf 127.0.0.1:8081\n"
+    "backend Stext 127.0.0.1:8082\n"
+    "route .pdf Spdf\n"
+    "route .txt Stext\n"
+    "route .c local\n";
+
+// helper to find a backend by name. Returns its index, or -1.
+static int find_backend(const struct route_table *table, const char *name) {
+    for (int i = 0; i < table->backend_count; i++) {
+        if (strcmp(table->backends[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// helper to add a node to the trie. Returns its index, or 0 if out of memory.
+static int32_t new_node(struct route_table *table) {
+    struct route_node *grown = realloc(table->nodes, (size_t)(table->node_count + 1) * sizeof(*grown));
+    if (grown == NULL) {
+        return 0;
+    }
+    table->nodes = grown;
+    memset(&table->nodes[table->node_count], 0, sizeof(*table->nodes));
+    table->nodes[table->node_count].target = ROUTE_NONE;
+    return table->node_count++;
+}
+
+// helper for the 64-bit FNV-1a hash of a key, its bits mixed so keys that differ in one character spread
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// helper to parse a 'backend <name> <host>:<port> [idle=<n>] [weight=<n>]' directive, a name listed
+// before adds a server to its backend. Returns NULL or what is wrong.
+static const char *parse_backend(struct route_table *table, char **save) {
+    char *name = strtok_r(NULL, " \t", save);
+    char *address = strtok_r(NULL, " \t", save);
+    if (name == NULL || address == NULL) {
+        return "backend needs a name and an address";
+    }
+    if (strlen(name) >= sizeof(table->backends[0].name) || strcmp(name, "local") == 0) {
+        return "invalid backend name";
+    }
+    int index = find_backend(table, name);
+    if (index < 0 && table->backend_count == ROUTE_MAX_BACKENDS) {
+        return "too many backends";
+    }
+    if (table->server_count == ROUTE_MAX_SERVERS) {
+        return "too many servers";
+    }
+    struct route_server *server = &table->servers[table->server_count];
+    memset(server, 0, sizeof(*server));
+    char *colon = strrchr(address, ':');
+    struct in_addr addr;
+    if (colon == NULL || (size_t)(colon - address) >= sizeof(server->host)) {
+        return "address is not <host>:<port>";
+    }
+    memcpy(server->host, address, (size_t)(colon - address));
+    server->host[colon - address] = '\0';
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    if (inet_pton(AF_INET, server->host, &addr) != 1 || *end != '\0' || port < 1 || port > 65535) {
+        return "address is not <host>:<port>";
+    }
+    server->port = (int)port;
+    for (int i = 0; i < table->server_count; i++) {
+        if (table->servers[i].port == server->port && strcmp(table->servers[i].host, server->host) == 0) {
+            return "server listed twice";
+        }
+    }
+    server->max_idle = CONN_POOL_MAX_IDLE;
+    server->weight = 1;
+
+    char *option;
+    while ((option = strtok_r(NULL, " \t", save)) != NULL) {
+        long value = -1;
+        end = option;
+        if (strncmp(option, "idle=", 5) == 0) {
+            value = strtol(option + 5, &end, 10);
+            if (value >= 0 && value <= 1024 && *end == '\0') {
+                server->max_idle = (int)value;
+                continue;
+            }
+        } else if (strncmp(option, "weight=", 7) == 0) {
+            value = strtol(option + 7, &end, 10);
+            if (value >= 1 && value <= ROUTE_MAX_WEIGHT && *end == '\0') {
+                server->weight = (int)value;
+                continue;
+            }
+        }
+        return "unknown backend option";
+    }
+
+    if (index < 0) {
+        index = table->backend_count++;
+        struct route_backend *backend = &table->backends[index];
+        memset(backend, 0, sizeof(*backend));
+        snprintf(backend->name, sizeof(backend->name), "%s", name);
+        snprintf(backend->unavailable, sizeof(backend->unavailable), "ERROR: %s server unavailable!", name);
+    }
+    server->backend = index;
+    table->server_count++;
+    return NULL;
+}
+
+// helper to parse a 'route <suffix> <backend>|local' directive. Returns NULL or what is wrong.
+static const char *parse_route(struct route_table *table, char **save) {
+    char *suffix = strtok_r(NULL, " \t", save);
+    char *name = strtok_r(NULL, " \t", save);
+    if (suffix == NULL || name == NULL || strtok_r(NULL, " \t", save) != NULL) {
+        return "route needs a suffix and a backend";
+    }
+    size_t len = strlen(suffix);
+    if (len == 0 || len > ROUTE_MAX_SUFFIX || strchr(suffix, '/') != NULL) {
+        return "invalid suffix";
+    }
+    int target = strcmp(name, "local") == 0 ? ROUTE_LOCAL : find_backend(table, name);
+    if (target == ROUTE_NONE) {
+        return "route to a backend that is not listed before it";
+    }
+    // The suffixes of a backend are sent with its dtar and display requests, Smain's are the files it lists
+    char *list = target >= 0 ? table->backends[target].suffixes : table->local_suffixes;
+    size_t used = strlen(list);
+    if (used + len + 1 >= ROUTE_MAX_SUFFIXES) {
+        return "too many suffixes for one backend";
+    }
+
+    // The suffix is inserted from its last character back
+    int32_t node = 0;
+    for (size_t i = len; i > 0; i--) {
+        unsigned char c = (unsigned char)suffix[i - 1];
+        if (table->nodes[node].next[c] == 0) {
+            int32_t child = new_node(table);
+            if (child == 0) {
+                return "out of memory";
+            }
+            table->nodes[node].next[c] = child;
+        }
+        node = table->nodes[node].next[c];
+    }
+    if (table->nodes[node].target != ROUTE_NONE) {
+        return "suffix routed twice";
+    }
+    table->nodes[node].target = target;
+    snprintf(list + used, ROUTE_MAX_SUFFIXES - used, "%s%s", used > 0 ? " " : "", suffix);
+    return NULL;
+}
+
+// helper to parse one line of the table. Returns NULL or what is wrong.
+static const char *parse_line(struct route_table *table, char *line) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    char *save;
+    char *directive = strtok_r(line, " \t", &save);
+    if (directive == NULL) {
+        return NULL;
+    }
+    if (strcmp(directive, "backend") == 0) {
+        return parse_backend(table, &save);
+    }
+    if (strcmp(directive, "route") == 0) {
+        return parse_route(table, &save);
+    }
+    return "unknown directive";
+}
+
+// helper to order the points of a ring
+static int compare_points(const void *a, const void *b) {
+    const struct route_point *pa = a, *pb = b;
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return pa->server - pb->server;
+}
+
+// helper to read the file of a table (NULL for the classic one) into table. Returns -1, after
+// printing what is wrong, if it can not be used.
+static int parse_table(struct route_table *table, const char *path) {
+    char line[512];
+    int line_no = 0;
+    const char *error = NULL;
+    if (path == NULL) {
+        for (const char *p = classic_routes; *p != '\0' && error == NULL; ) {
+            size_t len = strcspn(p, "\n");
+            snprintf(line, sizeof(line), "%.*s", (int)len, p);
+            line_no++;
+            error = parse_line(table, line);
+            p += len + (p[len] == '\n');
+        }
+    } else {
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            perror(path);
+            return -1;
+        }
+        while (error == NULL && fgets(line, sizeof(line), file) != NULL) {
+            line_no++;
+            error = parse_line(table, line);
+        }
+        fclose(file);
+    }
+    if (error != NULL) {
+        printf("Routing table %s, line %d: %s\n", path != NULL ? path : "(classic)", line_no, error);
+        return -1;
+    }
+    return 0;
+}
+
+// helper to place the servers of a layout on its ring. Returns -1 if out of memory.
+static int build_ring(const struct route_table *table, struct route_layout *layout) {
+    size_t len = 0;
+    for (int i = 0; i < layout->server_count; i++) {
+        len += (size_t)layout->weights[i] * ROUTE_VNODES;
+    }
+    layout->ring = malloc((len > 0 ? len : 1) * sizeof(*layout->ring));
+    if (layout->ring == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < layout->server_count; i++) {
+        const struct route_server *server = &table->servers[layout->servers[i]];
+        // The points depend on the address alone, not on where the server is listed
+        for (int v = 0; v < layout->weights[i] * ROUTE_VNODES; v++) {
+            char point[96];
+            int point_len = snprintf(point, sizeof(point), "%s:%d#%d", server->host, server->port, v);
+            layout->ring[layout->ring_len].hash = hash_key(point, (size_t)point_len);
+            layout->ring[layout->ring_len].server = layout->servers[i];
+            layout->ring_len++;
+        }
+    }
+    qsort(layout->ring, layout->ring_len, sizeof(*layout->ring), compare_points);
+    return 0;
+}
+
+// helper to print where the files of a backend go
+static void print_layout(const struct route_table *table, const struct route_backend *backend, const struct route_layout *layout) {
+    for (int i = 0; i < layout->server_count; i++) {
+        const struct route_server *server = &table->servers[layout->servers[i]];
+        if (layout->server_count > 1) {
+            printf("%s server at %s:%d stores about %zu%% of the %s files\n", server->name, server->host, server->port,
+                   (size_t)layout->weights[i] * ROUTE_VNODES * 100 / layout->ring_len, backend->suffixes[0] ? backend->suffixes : "routed");
+        } else {
+            printf("%s server at %s:%d stores %s\n", server->name, server->host, server->port,
+                   backend->suffixes[0] ? backend->suffixes : "nothing");
+        }
+    }
+}
+
+// Function to load the routing table
+struct route_table *route_table_load(const char *path) {
+    struct route_table *table = calloc(1, sizeof(*table));
+    if (table == NULL || new_node(table) != 0) {
+        perror("Routing table allocation failed");
+        free(table);
+        return NULL;
+    }
+    pthread_rwlock_init(&table->lock, NULL);
+    if (parse_table(table, path) < 0) {
+        route_table_free(table);
+        return NULL;
+    }
+
+    // Every server listed is in the layout of its backend, named after it with its number when there are several
+    for (int i = 0; i < table->backend_count; i++) {
+        struct route_layout *layout = calloc(1, sizeof(*layout));
+        table->backends[i].layout = layout;
+        if (layout == NULL) {
+            perror("Routing table allocation failed");
+            route_table_free(table);
+            return NULL;
+        }
+        for (int j = 0; j < table->server_count; j++) {
+            if (table->servers[j].backend == i) {
+                layout->servers[layout->server_count] = j;
+                layout->weights[layout->server_count] = table->servers[j].weight;
+                layout->server_count++;
+            }
+        }
+        for (int j = 0; j < layout->server_count; j++) {
+            struct route_server *server = &table->servers[layout->servers[j]];
+            if (layout->server_count > 1) {
+                snprintf(server->name, sizeof(server->name), "%s#%d", table->backends[i].name, j + 1);
+            } else {
+                snprintf(server->name, sizeof(server->name), "%s", table->backends[i].name);
+            }
+        }
+        if (build_ring(table, layout) < 0) {
+            perror("Routing table allocation failed");
+            route_table_free(table);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < table->server_count; i++) {
+        struct route_server *server = &table->servers[i];
+        server->pool = conn_pool_create(server->name, server->host, server->port, server->max_idle);
+        if (server->pool == NULL) {
+            route_table_free(table);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < table->backend_count; i++) {
+        print_layout(table, &table->backends[i], table->backends[i].layout);
+    }
+    return table;
+}
+
+// Function to free a routing table
+void route_table_free(struct route_table *table) {
+    if (table == NULL) {
+        return;
+    }
+    for (int i = 0; i < table->server_count; i++) {
+        if (table->servers[i].pool != NULL) {
+            conn_pool_destroy(table->servers[i].pool);
+        }
+    }
+    for (int i = 0; i < table->backend_count; i++) {
+        route_layout_free(table->backends[i].layout);
+    }
+    pthread_rwlock_destroy(&table->lock);
+    free(table->nodes);
+    free(table);
+}
+
+// Function to read the file of a table again. Servers may be added, removed or weighted anew, the
+// backends and routes must stay as they are.
+int route_table_reload(struct route_table *table, const char *path, struct route_layout *staged[ROUTE_MAX_BACKENDS]) {
+    for (int i = 0; i < ROUTE_MAX_BACKENDS; i++) {
+        staged[i] = NULL;
+    }
+    struct route_table *listed = calloc(1, sizeof(*listed));
+    if (listed == NULL || new_node(listed) != 0) {
+        perror("Routing table allocation failed");
+        free(listed);
+        return -1;
+    }
+    pthread_rwlock_init(&listed->lock, NULL);
+    if (parse_table(listed, path) < 0) {
+        route_table_free(listed);
+        return -1;
+    }
+    const char *error = NULL;
+    int same = listed->backend_count == table->backend_count && listed->node_count == table->node_count &&
+               memcmp(listed->nodes, table->nodes, (size_t)table->node_count * sizeof(*table->nodes)) == 0;
+    for (int i = 0; same && i < table->backend_count; i++) {
+        same = strcmp(listed->backends[i].name, table->backends[i].name) == 0;
+    }
+    if (!same) {
+        error = "only the servers of the backends can change without a restart";
+    }
+
+    // The servers are known by their address, a new one is added to the table now but gets no
+    // files until the layouts are committed
+    int found[ROUTE_MAX_SERVERS];
+    for (int i = 0; error == NULL && i < listed->server_count; i++) {
+        const struct route_server *server = &listed->servers[i];
+        found[i] = -1;
+        for (int j = 0; j < table->server_count; j++) {
+            if (table->servers[j].port == server->port && strcmp(table->servers[j].host, server->host) == 0) {
+                found[i] = j;
+            }
+        }
+        if (found[i] >= 0 && table->servers[found[i]].backend != server->backend) {
+            error = "a server can not move to another backend";
+        } else if (found[i] < 0 && table->server_count == ROUTE_MAX_SERVERS) {
+            error = "too many servers";
+        } else if (found[i] < 0) {
+            struct route_server *added = &table->servers[table->server_count];
+            *added = *server;
+            int number = 1;
+            for (int j = 0; j < table->server_count; j++) {
+                number += table->servers[j].backend == server->backend;
+            }
+            // Named from the table just read, the same backend name
+            if (snprintf(added->name, sizeof(added->name), "%s#%d", listed->backends[server->backend].name, number) >=
+                (int)sizeof(added->name)) {
+                error = "invalid backend name";
+                break;
+            }
+            added->pool = conn_pool_create(added->name, added->host, added->port, added->max_idle);
+            if (added->pool == NULL) {
+                error = "out of memory";
+                break;
+            }
+            // Complete before the other threads see it
+            found[i] = __sync_fetch_and_add(&table->server_count, 1);
+            printf("%s server at %s:%d added to %s\n", added->name, added->host, added->port, table->backends[server->backend].name);
+        }
+    }
+
+    int changed = 0;
+    for (int b = 0; error == NULL && b < table->backend_count; b++) {
+        struct route_layout *layout = calloc(1, sizeof(*layout));
+        if (layout == NULL) {
+            error = "out of memory";
+            break;
+        }
+        for (int i = 0; i < listed->server_count; i++) {
+            if (listed->servers[i].backend == b) {
+                layout->servers[layout->server_count] = found[i];
+                layout->weights[layout->server_count] = listed->servers[i].weight;
+                layout->server_count++;
+            }
+        }
+        // The servers and weights stay as they are, so does the ring
+        const struct route_layout *current = table->backends[b].layout;
+        if (layout->server_count == current->server_count &&
+            memcmp(layout->servers, current->servers, (size_t)layout->server_count * sizeof(int)) == 0 &&
+            memcmp(layout->weights, current->weights, (size_t)layout->server_count * sizeof(int)) == 0) {
+            free(layout);
+            continue;
+        }
+        if (build_ring(table, layout) < 0) {
+            route_layout_free(layout);
+            error = "out of memory";
+            break;
+        }
+        staged[b] = layout;
+        changed++;
+    }
+    route_table_free(listed);
+    if (error != NULL) {
+        printf("Routing table %s: %s\n", path != NULL ? path : "(classic)", error);
+        for (int i = 0; i < ROUTE_MAX_BACKENDS; i++) {
+            route_layout_free(staged[i]);
+            staged[i] = NULL;
+        }
+        return -1;
+    }
+    return changed;
+}
+
+// Function to put the layouts route_table_reload() staged in use
+void route_table_commit(struct route_table *table, struct route_layout *staged[ROUTE_MAX_BACKENDS]) {
+    struct route_layout *old[ROUTE_MAX_BACKENDS];
+    pthread_rwlock_wrlock(&table->lock);
+    for (int b = 0; b < table->backend_count; b++) {
+        old[b] = NULL;
+        if (staged[b] == NULL) {
+            continue;
+        }
+        old[b] = table->backends[b].layout;
+        table->backends[b].layout = staged[b];
+        // A server left out keeps its files until they are moved
+        for (int i = 0; i < table->server_count; i++) {
+            struct route_server *server = &table->servers[i];
+            if (server->backend != b) {
+                continue;
+            }
+            int kept = 0;
+            for (int j = 0; j < staged[b]->server_count; j++) {
+                kept = kept || staged[b]->servers[j] == i;
+            }
+            if (!kept && !server->retired) {
+                printf("%s server at %s:%d leaves %s\n", server->name, server->host, server->port, table->backends[b].name);
+            }
+            server->retired = !kept;
+            server->drained = server->drained && !kept;
+        }
+    }
+    pthread_rwlock_unlock(&table->lock);
+    for (int b = 0; b < table->backend_count; b++) {
+        if (staged[b] != NULL) {
+            print_layout(table, &table->backends[b], staged[b]);
+        }
+        route_layout_free(old[b]);
+        staged[b] = NULL;
+    }
+}
+
+// Function to free a layout
+void route_layout_free(struct route_layout *layout) {
+    if (layout == NULL) {
+        return;
+    }
+    free(layout->ring);
+    free(layout);
+}
+
+// Function to find where a file goes by the longest suffix of its name
+int route_find(const struct route_table *table, const char *name) {
+    int target = ROUTE_NONE;
+    int32_t node = 0;
+    for (size_t i = strlen(name); i > 0; i--) {
+        node = table->nodes[node].next[(unsigned char)name[i - 1]];
+        if (node == 0) {
+            break;
+        }
+        if (table->nodes[node].target != ROUTE_NONE) {
+            target = table->nodes[node].target;
+        }
+    }
+    return target;
+}
+
+// Function to find where the files of a suffix go
+int route_find_rule(const struct route_table *table, const char *suffix) {
+    int32_t node = 0;
+    for (size_t i = strlen(suffix); i > 0; i--) {
+        node = table->nodes[node].next[(unsigned char)suffix[i - 1]];
+        if (node == 0) {
+            return ROUTE_NONE;
+        }
+    }
+    return node == 0 ? ROUTE_NONE : table->nodes[node].target;
+}
+
+// Function to find the server of a layout that stores the file at key
+int route_layout_find(const struct route_layout *layout, const char *key) {
+    if (layout->server_count == 1) {
+        return layout->servers[0];
+    }
+    // The first point at or after the hash of the key, past the last one the ring starts over
+    uint64_t hash = hash_key(key, strlen(key));
+    size_t low = 0, high = layout->ring_len;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (layout->ring[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return layout->ring[low == layout->ring_len ? 0 : low].server;
+}
+
+// Function to find the server of a backend that stores the file at key
+int route_find_server(struct route_table *table, int backend, const char *key) {
+    pthread_rwlock_rdlock(&table->lock);
+    int server = route_layout_find(table->backends[backend].layout, key);
+    pthread_rwlock_unlock(&table->lock);
+    return server;
+}
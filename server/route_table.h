@@ -0,0 +1,135 @@
+#ifndef ROUTE_TABLE_H
+#define ROUTE_TABLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "conn_pool.h"
+
+// Where Smain keeps the files of each type: the backend servers and the file name suffixes routed
+// to them, loaded at startup from the file named by DFS_ROUTES. Without it the table is the classic
+// one: .pdf files go to Spdf at 127.0.0.1:8081, .txt files to Stext at 127.0.0.1:8082 and .c files
+// stay with Smain.
+//
+// The file holds one directive per line, '#' starts a comment:
+//
+//   backend <name> <host>:<port> [idle=<n>] [weight=<n>]   a server, idle is how many connections
+//                                                           its pool keeps
+//   route <suffix> <backend>|local                          files whose name ends in suffix are
+//                                                           stored there
+//
+// A name goes where its longest matching suffix says, so "notes.c.txt" is a .txt file, and a name
+// no suffix matches is refused. The suffixes are compiled into a trie of their characters from the
+// last one back, every node a table of 256 children: a lookup follows the name from its end, one
+// step per character however many rules there are.
+//
+// A backend listed on several lines is sharded over those servers by consistent hashing: each
+// server is weight * ROUTE_VNODES points on a ring of 64-bit hashes, placed by the hash of its
+// address, and a file belongs to the first point at or after the hash of its path below ~/smain.
+// Adding a server to N others takes over about 1/(N+1) of the files, all of them from the others;
+// no file moves between the servers that were there. A server is known by its address, listing
+// the same servers in another order places every file the same way.
+//
+// A backend archives ('dtar') and lists ('display') the files it stores with the suffixes Smain
+// sends in the request: those routed to it, or the one asked for by 'dtar <suffix>'. Every server
+// of a sharded one does so for the files it holds; Smain archives and lists its files of the
+// suffixes routed to local.
+//
+// The servers of a backend can change while Smain runs (SIGHUP, see rebalance.h): servers are
+// added to the table and never leave it, the ones left out of a new layout are retired and keep
+// being asked for what they hold until the rebalancer moved it to the others.
+
+#define ROUTE_MAX_BACKENDS 8
+#define ROUTE_MAX_SERVERS 16             // servers of all backends together
+#define ROUTE_MAX_SUFFIX 32
+#define ROUTE_MAX_SUFFIXES 256           // the space separated suffixes of one backend, or of Smain
+#define ROUTE_MAX_WEIGHT 64
+#define ROUTE_VNODES 64                  // points on the ring per unit of weight
+
+// Targets of a lookup besides the index of a backend
+#define ROUTE_NONE -1   // no rule matches
+#define ROUTE_LOCAL -2  // Smain stores the file itself
+
+struct route_server {
+    char name[24];                       // the backend's name, "Spdf#2" when it has several servers
+    char host[64];
+    int port;
+    int max_idle;
+    int weight;                          // as listed, the layout of the backend has the one in use
+    int backend;
+    int retired;                         // left out of the layout of its backend, may still hold files
+    int drained;                         // retired and holds no files, requests leave it out
+    struct conn_pool *pool;
+};
+
+// A point of a ring
+struct route_point {
+    uint64_t hash;
+    int server;
+};
+
+// The servers of a backend and their ring, replaced as a whole when the table is read again
+struct route_layout {
+    int servers[ROUTE_MAX_SERVERS];      // indexes in the table
+    int weights[ROUTE_MAX_SERVERS];
+    int server_count;
+    struct route_point *ring;            // sorted by hash
+    size_t ring_len;
+};
+
+struct route_backend {
+    char name[16];
+    char suffixes[ROUTE_MAX_SUFFIXES];   // the suffixes routed to it (".pdf .md"), sent with its dtar and display requests
+    char unavailable[64];                // reply when it can not be reached
+    struct route_layout *layout;         // under the lock of the table
+};
+
+// A node of the suffix trie
+struct route_node {
+    int32_t next[256];                   // child for the character before, 0 if none (the root is no child)
+    int target;                          // where a name ending here goes, ROUTE_NONE if no rule ends here
+};
+
+struct route_table {
+    struct route_backend backends[ROUTE_MAX_BACKENDS];
+    int backend_count;
+    struct route_server servers[ROUTE_MAX_SERVERS];
+    int server_count;                    // only grows, a server is complete before it is counted
+    char local_suffixes[ROUTE_MAX_SUFFIXES]; // the suffixes routed to local, the files Smain archives and lists
+    struct route_node *nodes;            // nodes[0] is the root
+    int node_count;
+    pthread_rwlock_t lock;               // the layouts of the backends
+};
+
+// Load the table from the file at path (NULL for the classic table) and create the pools of its
+// servers. Returns NULL, after printing what is wrong, if the file can not be used.
+struct route_table *route_table_load(const char *path);
+
+// Destroy the pools and free the table
+void route_table_free(struct route_table *table);
+
+// Read the file of a loaded table again (see rebalance.h). New servers are added to the table with
+// their pools, the backends whose servers or weights changed get their new layout in staged (the
+// others NULL) to be committed later. Returns how many changed, or -1 after printing why the file
+// is refused: only the servers of the backends can change without a restart.
+int route_table_reload(struct route_table *table, const char *path, struct route_layout *staged[ROUTE_MAX_BACKENDS]);
+
+// Put the staged layouts in use and mark the servers they leave out retired
+void route_table_commit(struct route_table *table, struct route_layout *staged[ROUTE_MAX_BACKENDS]);
+
+void route_layout_free(struct route_layout *layout);
+
+// Where the file name goes: the index of a backend, ROUTE_LOCAL or ROUTE_NONE
+int route_find(const struct route_table *table, const char *name);
+
+// Where the files of the rule for exactly suffix go ('dtar .pdf')
+int route_find_rule(const struct route_table *table, const char *suffix);
+
+// The server of a backend that stores the file at key, its path below ~/smain ("docs/a.pdf").
+// Returns the index of the server in the table.
+int route_find_server(struct route_table *table, int backend, const char *key);
+
+// The server of a layout that stores the file at key
+int route_layout_find(const struct route_layout *layout, const char *key);
+
+#endif
@@ -1,47 +1,299 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <sys/wait.h>
 #include <dirent.h>
-
+#include <signal.h>
+
+#include "../common/dfs_proto.h"
+#include "../common/tar_stream.h"
+#include "../common/dfs_codec.h"
+#include "../common/name_page.h"
+#include "../common/dfs_delta.h"
+#include "../common/dfs_range.h"
+#include "../common/dfs_dirs.h"
+#include "conn_pool.h"
+#include "event_loop.h"
+#include "frame_io.h"
+#include "worker_pool.h"
+#include "tar_compress.h"
+#include "tar_merge.h"
+#include "name_index.h"
+#include "content_index.h"
+#include "file_cache.h"
+#include "flight.h"
+#include "path_filter.h"
+#include "route_table.h"
+#include "rebalance.h"
 
 #define PORT 8080
 #define BUFSIZE 102400
-#define CMD_END_MARKER "END_CMD"
-#define TAR_FILE_PATH "c_files.tar"
+// Archive of the files of one type Smain stores, "c_files.tar"
+#define TAR_FILE_PATH "%s_files.tar"
+#define ALL_TAR_FILE_PATH "all_files.tar"
+
+// Archive pieces produced per turn of a CONN_SEND_TAR connection before other connections get theirs
+#define TAR_PIECES_PER_STEP 16
+
+// Largest page of names accepted from the Spdf or Stext server for 'display'
+#define MAX_LISTING (1024 * 1024)
+
+// Time the Spdf and Stext servers get to answer 'display', a slower one is left out of the list
+#define DISPLAY_DEADLINE_MS 2000
+
+// Smain serves every client from a few event loop threads instead of a process per client.
+// Each connection is a small state machine: it reads a request frame, starts the command and
+// then moves between the states below until the reply is complete, never blocking on a socket.
+enum conn_state {
+    CONN_REQUEST,        // flush earlier replies, then read the next request frame
+    CONN_UPLOAD,         // ufile: DATA stream from the client into a local file, to a server, or drained
+    CONN_BACKEND_REPLY,  // relay the reply of the Spdf/Stext server (dfile, dtar, rmfile, ufile)
+    CONN_SEND_FILE,      // dfile of a .c file: local file sent with sendfile()
+    CONN_SEND_TAR,       // dtar of .c files: archive built while it is sent, members sent with sendfile() or compressed
+    CONN_SEND_ALL,       // dtar all: the archives of Smain, Spdf and Stext merged member by member
+    CONN_DISPLAY,        // display: collect the file lists of the Spdf and Stext servers, asked at once
+    CONN_FLIGHT,         // dfile of a .pdf/.txt file: sent from a fetch shared with other requests of the file
+    CONN_LOCAL_JOB       // ufile of a .c file: waiting for the compressors to sign the file it replaces, or rebuild and hash what arrived
+};
+
+// What a state function wants the event loop to do next
+#define STEP_AGAIN 0  // state changed, run the state machine again
+#define STEP_WAIT 1   // wait for the events stored in want_client/want_backend
+#define STEP_CLOSE 2  // drop the connection
+
+// Outcome of the 'display' request to one server
+enum display_status {
+    DISPLAY_PENDING,
+    DISPLAY_LISTED,                  // its page is in records
+    DISPLAY_EMPTY,                   // it has no such files
+    DISPLAY_TIMED_OUT,               // no answer before the deadline
+    DISPLAY_UNAVAILABLE              // connecting or reading failed
+};
+
+// File-sized work of a local upload, run on the compressors so the event loop never reads a whole file
+enum local_task {
+    LOCAL_SIGN,          // sign the file an upload replaces, for a delta against it
+    LOCAL_APPLY,         // rebuild the upload from the delta that arrived, then hash it
+    LOCAL_HASH           // hash the upload that arrived
+};
+
+// The connection and the worker both hold the job, the last one to let go frees it
+struct local_job {
+    enum local_task task;
+    int refs;
+    int fd;                          // its own descriptor of the file (LOCAL_SIGN: the one replaced)
+    int base_fd;                     // LOCAL_APPLY: the file replaced and the delta, -1 otherwise
+    int delta_fd;
+    int notify_fd;                   // eventfd, written once done is set
+    int done;
+    int failed;
+    uint64_t size;                   // the size of the file replaced, LOCAL_APPLY/LOCAL_HASH: then of the upload
+    unsigned char digest[SHA256_SIZE]; // LOCAL_APPLY/LOCAL_HASH: the hash of the upload
+    struct dfs_delta_stats stats;    // LOCAL_APPLY
+    unsigned char *signatures;       // LOCAL_SIGN
+    size_t signatures_len;
+};
+
+// Spdf/Stext connection of a request that talks to both servers at once ('dtar all', 'display')
+struct fanout_server {
+    struct ev_watch watch;           // first, so the event callback finds the rest
+    struct client_conn *conn;
+    struct conn_pool *pool;
+    const char *name;
+    struct out_buf request;          // the request frame, sent once the connection is up
+    int connecting;                  // the handshake of a new connection is not over yet
+    int source;                      // dtar all: index in the merge
+    struct frame_reader reader;      // display: the current frame of the reply
+    enum display_status status;
+    char *records;                   // display: "name\n" records of the page, in sort order
+    size_t records_len;
+    char cursor[DFS_CURSOR_MAX + 1]; // display: where the server's next page starts, "" after its last
+};
+
+struct client_conn {
+    struct ev_watch client;          // client socket
+    struct ev_watch backend;         // Spdf/Stext connection of the current request, fd -1 when none
+    struct conn_pool *backend_pool;  // pool the backend connection belongs to
+    struct out_buf backend_request;  // request frame for the backend, sent once the connection is up
+    int backend_connecting;          // the handshake of a new backend connection is not over yet
+    enum conn_state state;
+    int closed;
+    uint32_t request_id;
+    struct frame_reader reader;      // request frame of the client
+    struct out_buf out;              // reply frames waiting for the client socket
+    struct frame_relay relay;        // CONN_UPLOAD and CONN_BACKEND_REPLY
+    const char *fail_message;        // sent to the client when the relay can not complete
+    const char *unavailable_message; // sent to the client when the backend can not be reached
+    struct file_sender file;         // CONN_SEND_FILE, and the current member in CONN_SEND_TAR
+    struct tar_stream *tar;          // CONN_SEND_TAR
+    struct tar_compress *tarz;       // CONN_SEND_TAR with a codec: blocks compressed on the pool
+    struct ev_watch notify;          // readable when tarz finished a block, the flight moved on or the job is done
+    struct local_job *job;           // CONN_LOCAL_JOB
+    struct fanout_server servers[ROUTE_MAX_SERVERS]; // every backend server, for CONN_SEND_ALL and CONN_DISPLAY
+    struct tar_merge *merge;         // CONN_SEND_ALL
+    char merge_name[64];             // archive name, sent with the first bytes of the merge
+    int merge_named;
+    int merge_closed;                // all of the merged archive was handed to tarz
+    int upload_fd;                   // local .c upload, written to upload_temp and renamed to upload_path
+    int upload_failed;
+    int upload_hashed;               // the local upload was announced: its hash goes into the content index
+    int upload_delta_fd;             // the local upload is a delta against upload_base_fd, received into this unlinked file
+    int upload_base_fd;              // the file it replaces
+    uint64_t upload_base_size;
+    uint64_t upload_size;            // announced size and hash, a rebuilt file must have them
+    unsigned char upload_digest[SHA256_SIZE];
+    char *upload_path;
+    char *upload_temp;
+    char *changed_path;              // ufile/rmfile of a .pdf/.txt: its cache entry and flight are dropped again when the server answered
+    struct path_filter *adding;      // ufile of a .pdf/.txt: the path filter its path was added to
+    int rebalanced;                  // the rebalancer counted the ufile/rmfile of changed_path, it is told when the server answered
+    int cache_miss;                  // dfile relayed from a server because the cache did not have the file
+    struct flight *flight;           // CONN_FLIGHT: the shared fetch of the file
+    struct flight_waiter waiter;
+    int flight_started;              // the NAME and DATA header are queued, file is sent up to what arrived
+    char flight_name[256];           // file name and range of the reply
+    struct dfs_range flight_range;
+    int flight_ranged;
+    struct ev_watch deadline;        // CONN_DISPLAY: timerfd that ends the wait for the servers
+    int deadline_passed;
+    struct name_page local_page;     // CONN_DISPLAY: the .c files of Smain on this page
+    size_t display_limit;
+    char display_cursor[DFS_CURSOR_MAX + 1];
+};
+
+// The backend servers with their pools of warm connections, shared by all event loops, and the
+// file name suffixes routed to them
+static struct route_table *routes;
+
+// Threads compressing dtar archives and hashing local uploads, shared by all event loops
+static struct worker_pool *compressors;
+
+// What is stored under ~/smain, kept in memory for display and the "File not found" answers
+static struct name_index *file_index;
+// Stored .c files by content, an upload that announces content found here is linked instead of sent
+static struct content_index *contents;
+// Popular .pdf and .txt files, served without asking their server
+static struct file_cache *file_cache;
+// The paths each backend server stores, requests for others are answered without asking it
+static struct path_filter *filters[ROUTE_MAX_SERVERS];
+// ~/smain, the paths of requests start with it
+static char root_path[BUFSIZE];
+// Moves the files of sharded backends to the servers that own them, on SIGHUP the table is read again
+static struct rebalance *rebalancer;
+
+// Counter that keeps temporary file names of concurrent requests apart
+static unsigned long temp_counter;
 
 // Function prototypes
-void prcclient(int client_sock);
-void handle_ufile(int client_sock, char *command, char *file_data);
-void handle_dfile(int client_sock, char *command);
-void handle_rmfile(int client_sock, char *command);
-void handle_dtar(int client_sock, char *command);
-void handle_display(int client_sock, char *command);
-int connect_to_spdf();
-int connect_to_stext();
-void send_file_to_server(int server_sock, int client_sock, char *command, char *filename, char *destination_path, char *file_data);
-int receive_and_save_file(int sock, char *destination_path, char *f_name, char *file_data);
-void remove_file_from_server(int sock, int client_sock, char *command, char *destination_path);
-void send_file_to_client(int client_sock, const char *file_path, const char *file_name);
+void accept_client(struct event_loop *loop, int client_sock);
+void on_client_event(struct ev_watch *watch, uint32_t ready);
+void on_backend_event(struct ev_watch *watch, uint32_t ready);
+void on_notify_event(struct ev_watch *watch, uint32_t ready);
+void on_fanout_event(struct ev_watch *watch, uint32_t ready);
+void on_deadline_event(struct ev_watch *watch, uint32_t ready);
+void conn_run(struct client_conn *conn);
+int conn_step(struct client_conn *conn, uint32_t *want_client, uint32_t *want_backend);
+void conn_close(struct client_conn *conn);
+void conn_reply(struct client_conn *conn, int opcode, const char *message);
+int conn_request(struct client_conn *conn, uint32_t *want_client);
+void conn_dispatch(struct client_conn *conn);
+int conn_upload(struct client_conn *conn, uint32_t *want_client, uint32_t *want_backend);
+void finish_upload(struct client_conn *conn);
+void finish_local_upload(struct client_conn *conn, int complete, const struct local_job *hash);
+int local_job_start(struct client_conn *conn, enum local_task task);
+void run_local_job(void *arg);
+int apply_local_delta(struct local_job *job);
+void local_job_release(struct local_job *job);
+void close_job_files(struct local_job *job);
+void end_local_job(struct client_conn *conn);
+int conn_local_job(struct client_conn *conn);
+int conn_backend_reply(struct client_conn *conn, uint32_t *want_client, uint32_t *want_backend);
+int conn_send_file(struct client_conn *conn, uint32_t *want_client);
+int conn_send_tar(struct client_conn *conn, uint32_t *want_client);
+int conn_send_tar_compressed(struct client_conn *conn, uint32_t *want_client);
+int conn_send_all(struct client_conn *conn, uint32_t *want_client);
+int merge_connect(struct client_conn *conn);
+int merge_wait(struct client_conn *conn);
+int merge_done(struct client_conn *conn);
+int merge_failed(struct client_conn *conn);
+void finish_merge(struct client_conn *conn);
+int conn_display(struct client_conn *conn);
+int conn_flight(struct client_conn *conn, uint32_t *want_client);
+void finish_display(struct client_conn *conn);
+int server_request(struct conn_pool *pool, int opcode, uint32_t request_id, const char *text, struct out_buf *request, int *connecting);
+int server_request_step(struct conn_pool *pool, int server_sock, struct out_buf *request, int *connecting);
+void server_release(struct conn_pool *pool, struct ev_watch *watch, int reusable);
+int backend_begin(struct client_conn *conn, struct conn_pool *pool, int opcode, const char *text);
+void backend_end(struct client_conn *conn, int reusable);
+void backend_unavailable(struct client_conn *conn);
+int fanout_begin(struct client_conn *conn, int index, struct conn_pool *pool, const char *name, int opcode, const char *text);
+void fanout_end(struct client_conn *conn, int index, int reusable);
+const char *shard_key(const char *full_path);
+int find_shard(int backend, const char *full_path, int *writing);
+int backend_servers(int backend);
+void start_backend_reply(struct client_conn *conn, struct conn_pool *pool, int opcode, const char *text, const char *unavailable_message, const char *fail_message);
+void start_upload_drain(struct client_conn *conn, const char *fail_message);
+void refuse_upload(struct client_conn *conn, int announced, const char *fail_message);
+void start_local_file(struct client_conn *conn, int file_fd, const char *file_name, struct dfs_range *range);
+void start_file_reply(struct client_conn *conn, int file_fd, const char *file_name, uint64_t size, const char *version, struct dfs_range *range);
+int serve_cached_file(struct client_conn *conn, struct conn_pool *pool, const char *full_path, const char *file_name, struct dfs_range *range);
+int start_flight(struct client_conn *conn, struct conn_pool *pool, const char *full_path, const char *file_name, struct dfs_range *range);
+void leave_flight(struct client_conn *conn);
+void file_changing(struct client_conn *conn, const char *full_path, struct path_filter *filter, int upload, int rebalanced);
+void handle_ufile(struct client_conn *conn, char *command);
+void handle_dfile(struct client_conn *conn, char *command);
+void handle_rmfile(struct client_conn *conn, char *command);
+void handle_dtar(struct client_conn *conn, char *command);
+void start_dtar_merge(struct client_conn *conn, const char *full_path, struct dfs_codec_spec *spec, int backend, const char *suffix, const char *name);
+void handle_display(struct client_conn *conn, char *command);
+int expand_path(const char *path, char *full_path, size_t size);
+int is_valid_path(const char *path);
+int local_upload_paths(char *destination_path, char *f_name, char *final_path, char *temp_path);
+int open_local_upload(struct client_conn *conn, char *destination_path, char *f_name);
+int link_local_upload(struct client_conn *conn, char *destination_path, char *f_name, uint64_t size, const unsigned char *digest);
+void ask_local_content(struct client_conn *conn, uint64_t size, const unsigned char *digest);
+void local_content_signed(struct client_conn *conn, const struct local_job *sign);
+void release_local_base(struct client_conn *conn);
+void close_local_file(int fd);
+void run_close_local_file(void *arg);
+int read_local_base(void *ctx, void *buf, size_t len, uint64_t offset);
+int write_local_upload(void *ctx, const void *data, size_t len);
 int delete_file(const char *file_path);
-void send_download_request(int server_sock, int client_sock, char *command, char *file_path);
-void get_file_names_from_server(int (*connect_func)(), const char *message, const char *error_prefix, char *response_buffer, size_t buffer_size);
-void c_tar_file(int client_sock, const char *path);
-void request_tar_file(int server_sock, int client_sock, char *path);
+int records_append(struct fanout_server *server, const char *text, size_t len);
+int display_read(struct fanout_server *server);
+
+int main(int argc, char *argv[]) {
+    int server_sock;
+    struct sockaddr_in server_addr;
 
-int main() {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_size;
-    pid_t child_pid;
+    // Number of event loop threads, one per core unless given on the command line
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) {
+        threads = atol(argv[1]);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    // Every client holds a descriptor for as long as it stays connected, allow as many as permitted
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
     // Create a socket for the server
     server_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -61,6 +313,10 @@ int main() {
     // Zero out the rest of the struct
     memset(server_addr.sin_zero, '\0', sizeof(server_addr.sin_zero));
 
+    // Allow a restarted server to bind while old connections are still in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Bind the socket to the specified port and address so it can listen for incoming connections
     if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         // If binding fails, print an error and close the socket
@@ -69,1085 +325,2209 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    // Set the server to listen for incoming connections, with a maximum of 10 queued connections
-    if (listen(server_sock, 10) < 0) {
+    // Set the server to listen for incoming connections, bursts of new clients wait in the kernel queue
+    if (listen(server_sock, SOMAXCONN) < 0) {
         // If listening fails, print an error and close the socket
         perror("Listen failed");
         close(server_sock);
         exit(EXIT_FAILURE);
     }
 
-    printf("Smain server is listening on port %d\n", PORT);
+    // A client that disconnects during splice()/sendfile() must not kill the server with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
 
-    while (1) {
-        // Accept a connection from a client, saving their address and port information
-        addr_size = sizeof(client_addr);
-        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_size);
-        if (client_sock < 0) {
-            // If accepting the connection fails, print an error and continue to the next iteration
-            perror("Accept failed");
-            continue;
-        }
+    // SIGHUP reads the routing table again, the rebalancer takes it from a signalfd. It is blocked
+    // before any thread is started so none of them gets it
+    sigset_t hangup;
+    sigemptyset(&hangup);
+    sigaddset(&hangup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hangup, NULL);
 
-        printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    // One process logs for every client now, write each line out as it is printed
+    setvbuf(stdout, NULL, _IOLBF, 0);
 
-        // Fork a child process to handle the client
-        child_pid = fork();
-        if (child_pid == 0) {
-            // If this is the child process, close the server socket and handle the client's requests
-            close(server_sock);  // Close the server socket in the child
-            prcclient(client_sock);  // Handle communication with the client
-            close(client_sock);  // Close the client socket
-            exit(0);  // Exit the child process
-        } else if (child_pid > 0) {
-            // In the parent process
-            close(client_sock);  // Close the client socket in the parent
-            waitpid(-1, NULL, WNOHANG);  // Wait for child processes to terminate
-        } else {
-            perror("Fork failed");
-        }
+    // Load the routing table (DFS_ROUTES names its file) with the connection pools of its backends
+    routes = route_table_load(getenv("DFS_ROUTES"));
+    compressors = worker_pool_create("Smain compression", (int)threads);
+    if (routes == NULL || compressors == NULL) {
+        close(server_sock);
+        exit(EXIT_FAILURE);
     }
 
-    close(server_sock);  // Close the server socket
-    return 0;
-}
-
-// Function to handle communication with a connected client
-void prcclient(int client_sock) {
-    char buffer[BUFSIZE];
-    int bytes_read;
-
-    // Read messages from the client
-    while ((bytes_read = recv(client_sock, buffer, BUFSIZE, 0)) > 0) {
-        // Null-terminate the received string to prevent buffer overflow
-        buffer[bytes_read] = '\0';
-
-
-        // Check if the received message contains file data after the command
-        char *file_data = strstr(buffer, "END_CMD");
-        if (file_data) {
-            // If found, separate the command part from the file data
-            *file_data = '\0';
-            // Move the pointer past the "END_CMD" marker to get to the file data
-            file_data += strlen("END_CMD");
-        }
-        
-        // Determine which command the client sent and call the appropriate function to handle it
-        if (strncmp(buffer, "ufile", 5) == 0) {
-            // Handle the 'ufile' command, which uploads a file
-            printf("File Upload request\n");
-            handle_ufile(client_sock, buffer, file_data);
-        } else if (strncmp(buffer, "dfile", 5) == 0) {
-            // Handle the 'dfile' command, which downloads a file
-            printf("File download request\n");
-            handle_dfile(client_sock, buffer);
-        } else if (strncmp(buffer, "rmfile", 6) == 0) {
-            // Handle the 'rmfile' command, which removes a file
-            printf("File remove request\n");
-            handle_rmfile(client_sock, buffer);
-        } else if (strncmp(buffer, "dtar", 4) == 0) {
-            // Handle the 'dtar' command, which download file of given extension to Tar
-            printf("TarFile download request\n");
-            handle_dtar(client_sock, buffer);
-        } else if (strncmp(buffer, "display", 7) == 0) {
-            // Handle the 'display' command, which shows files in a directory
-            printf("Display Files request\n");
-            handle_display(client_sock, buffer);
+    // Index ~/smain in the background, until it is ready requests are answered from the disk
+    if (expand_path("~/smain", root_path, sizeof(root_path)) == 0) {
+        file_index = name_index_open(root_path);
+        // Ask the servers which paths they store, in the background
+        for (int i = 0; i < routes->server_count; i++) {
+            filters[i] = path_filter_open(routes->servers[i].name, routes->servers[i].pool, root_path);
         }
     }
-}
-
-// helper Function to check if the path is valid
-int is_valid_path(const char *path) {
-    // Check if the path starts with "smain"
-    if (strncmp(path, "~/smain",7) != 0) {
-        return 0; // Invalid path
+    // Files not on the server that owns them are moved there, and again when the servers change
+    rebalancer = rebalance_open(routes, filters, root_path, getenv("DFS_ROUTES"));
+    // Uploads that announce content stored already are linked, found through ~/.smain.content
+    char content_dir[BUFSIZE];
+    if (expand_path("~/.smain.content", content_dir, sizeof(content_dir)) == 0) {
+        contents = content_index_open(content_dir);
     }
-    return 1; // Valid path
-}
+    file_cache = file_cache_open();
+    printf("Smain server is listening on port %d with %ld event loop threads\n", PORT, threads);
 
-// Function to handle 'ufile' command
-void handle_ufile(int client_sock, char *command, char *file_data) {
-    char filename[256], destination_path[256];
-    int server_sock;
-    char *f_name;
+    // Serve clients until the process is stopped
+    event_loop_run(server_sock, (int)threads, accept_client);
 
-    // Extract filename and destination path from the command
-    if (sscanf(command, "ufile %s %s", filename, destination_path) != 2) {
-        // Notify the client that the file upload failed
-        printf("Command parsing failed\n");
-        send(client_sock, "File upload failed", 18, 0);
-        return;
-    }
-    // extract file name if subdirectory is also given
-    if(strstr(filename,"/") != NULL){
-        // Extract the file name
-        f_name = strrchr(filename, '/') + 1;
-    }else{
-        f_name = filename;
+    name_index_close(file_index);
+    content_index_close(contents);
+    file_cache_close(file_cache);
+    rebalance_close(rebalancer);
+    for (int i = 0; i < routes->server_count; i++) {
+        path_filter_close(filters[i]);
     }
+    route_table_free(routes);
+    close(server_sock);  // Close the server socket
+    return EXIT_FAILURE;
+}
 
-    // Check if the file is a PDF
-    if (strstr(filename, ".pdf") != NULL) {
-        // Forward to Spdf server
-        server_sock = connect_to_spdf();
-        if (server_sock < 0) {
-            printf("Failed to connect to Spdf server\n");
-            // Notify the client that the file upload failed
-            send(client_sock, "File upload failed", 18, 0);
-            return;
-        }
-        // Send the file to the Spdf server
-        send_file_to_server(server_sock, client_sock, "ufile", f_name, destination_path, file_data);
-        close(server_sock);
+// Function to set up the state machine of a newly accepted client
+void accept_client(struct event_loop *loop, int client_sock) {
+    struct sockaddr_in client_addr;
+    socklen_t addr_size = sizeof(client_addr);
+    if (getpeername(client_sock, (struct sockaddr*)&client_addr, &addr_size) == 0) {
+        printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    }
 
-    // Check if the file is a text file
-    } else if (strstr(filename, ".txt") != NULL) {
-        // Connect to the Stext server
-        server_sock = connect_to_stext();
-        if (server_sock < 0) {
-            // Notify the client that the file upload failed
-            printf("Failed to connect to Stext server\n");
-            send(client_sock, "File upload failed", 18, 0);
-            return;
-        }
-        // Send the file to the Stext server
-        send_file_to_server(server_sock, client_sock, "ufile", f_name, destination_path, file_data);
-        close(server_sock);
+    // Replies are written as a header followed by a relayed payload, do not let Nagle hold them back
+    int one = 1;
+    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-    // Check if the file is a C file
-    } else if (strstr(filename, ".c") != NULL) {
-        // upload by Smain
-        if (receive_and_save_file(client_sock, destination_path, f_name, file_data) == 0) {
-            // Notify the client that the file upload was successful
-            const char *success_message = "File Uploaded successfully.";
-            printf("%s\n",success_message);
-            send(client_sock, success_message, strlen(success_message), 0);
-        } else {
-            // Notify the client that the file upload failed
-            const char *failed_message = "File uploading failed!";
-            printf("%s\n",failed_message);
-            send(client_sock, failed_message, strlen(failed_message), 0);
-        }
-    } else {
-        // If the file type is unsupported, notify the client
-        printf("Unsupported file type: %s\n", filename);
-        send(client_sock, "Unsupported file type", 21, 0);
+    struct client_conn *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        perror("Connection allocation failed");
+        close(client_sock);
+        return;
     }
+    ev_watch_init(&conn->client, loop, client_sock, on_client_event);
+    ev_watch_init(&conn->backend, loop, -1, on_backend_event);
+    ev_watch_init(&conn->notify, loop, -1, on_notify_event);
+    for (int i = 0; i < ROUTE_MAX_SERVERS; i++) {
+        ev_watch_init(&conn->servers[i].watch, loop, -1, on_fanout_event);
+        conn->servers[i].conn = conn;
+    }
+    ev_watch_init(&conn->deadline, loop, -1, on_deadline_event);
+    frame_relay_init(&conn->relay, -1, -1, 0, RELAY_REPLY, 0);
+    conn->state = CONN_REQUEST;
+    conn->upload_fd = -1;
+    conn->upload_delta_fd = -1;
+    conn->upload_base_fd = -1;
+    conn->file.fd = -1;
+    conn_run(conn);
 }
 
-// Function to handle 'dfile' command
-void handle_dfile(int client_sock, char *command) {
-    int server_sock;
-    char file_path[256];
-
-    // Extract the file path from the command
-    sscanf(command, "dfile %s", file_path);
-
-    // check if requested doenload file path is valid or not
-    if(!is_valid_path(file_path)){
-        printf("ERROR: Invalid path!\n");
-        // Send error message if the path is invalid
-        const char *error_message = "ERROR: Invalid path!";
-        send(client_sock, error_message, strlen(error_message), 0);
+// Function called by the event loop when the client socket is ready
+void on_client_event(struct ev_watch *watch, uint32_t ready) {
+    struct client_conn *conn = (struct client_conn *)((char *)watch - offsetof(struct client_conn, client));
+    if (conn->closed) {
         return;
     }
-    
-    // Extract the file name
-    char *file_name = strrchr(file_path, '/') + 1;
-    if (!file_name) {
-        // Handle case where the file name extraction fails
-        send(client_sock, "Invalid file path", 17, 0);
+    // Both directions are gone, nothing we send would arrive
+    if (ready & (EPOLLERR | EPOLLHUP)) {
+        conn_close(conn);
         return;
     }
+    conn_run(conn);
+}
 
-    // Determine the file type and process accordingly
-    if(strstr(file_name,".c") != NULL){
-        // Handle .c file - Send file directly to the client
-        send_file_to_client(client_sock, file_path, file_name);
-    }else if(strstr(file_name,".txt") != NULL){
-        // Handle .txt file - Forward request to Stext server
-        server_sock = connect_to_stext();
-        if (server_sock < 0) {
-            printf("Failed to connect to Stext server\n");
-            return;
-        }
-        send_download_request(server_sock, client_sock, "dfile", file_path);
-        close(server_sock);
-
-    }else if(strstr(file_name,".pdf") != NULL){
-        // Handle .pdf file - Forward request to Spdf server
-        server_sock = connect_to_spdf();
-        if (server_sock < 0) {
-            printf("Failed to connect to Stext server\n");
-            return;
-        }
-        send_download_request(server_sock, client_sock, "dfile", file_path);
-        close(server_sock);
-
-    }else{
-        printf("Invalid file type\n");
-        // Send an error message to the client with a specific prefix
-        const char *success_message = "ERROR: Invalid file type!";
-        send(client_sock, success_message, strlen(success_message), 0);
+// Function called by the event loop when the Spdf/Stext connection of a request is ready
+void on_backend_event(struct ev_watch *watch, uint32_t ready) {
+    struct client_conn *conn = (struct client_conn *)((char *)watch - offsetof(struct client_conn, backend));
+    (void)ready;
+    if (conn->closed) {
         return;
     }
+    // Errors show up in the next read or write of the state machine
+    conn_run(conn);
 }
 
-// Function to handle 'rmfile' command
-void handle_rmfile(int client_sock, char *command) {
-    // variable to store the file path
-    char file_path[256];
-    int server_sock;
-
-    // Extract the file path from the command
-    sscanf(command, "rmfile %s", file_path);
-    
-    // Create a copy of the file path to use for Tokenization
-    char file_path_copy[BUFSIZE];
-    strncpy(file_path_copy, file_path, BUFSIZE - 1);
-    file_path_copy[BUFSIZE - 1] = '\0';
-
-    // Tokenize the file path to get the file name
-    char *file_name = NULL;
-    char *token = strtok(file_path_copy, "/");
-    while (token != NULL) {
-        file_name = token;
-        token = strtok(NULL, "/");
-    }
-
-    // Check if the file has a .pdf extension
-    if (strstr(file_name, ".pdf") != NULL) {
-        // Connect to the server responsible for handling PDF files
-        server_sock = connect_to_spdf();
-        // If the connection fails, inform the client and exit the function
-        if (server_sock < 0) {
-            printf("Failed to connect to Spdf server\n");
-            send(client_sock, "File remove failed", 18, 0);
-            return;
-        }
-        // Remove the file from the server
-        remove_file_from_server(server_sock, client_sock, "rmfile", file_path);
-        // Close the server connection after the operation
-        close(server_sock);
-
-    // Check if the file has a .txt extension
-    } else if (strstr(file_name, ".txt") != NULL) {
-        // Connect to the server responsible for handling text files
-        server_sock = connect_to_stext();
-        // If the connection fails, inform the client and exit the function
-        if (server_sock < 0) {
-            printf("Failed to connect to Stext server\n");
-            send(client_sock, "File remove failed", 18, 0);
-            return;
-        }
-        // Remove the file from the server
-        remove_file_from_server(server_sock, client_sock, "rmfile", file_path);
-        // Close the server connection after the operation
-        close(server_sock);
-
-    // Check if the file has a .c extension
-    } else if (strstr(file_name, ".c") != NULL) {
-        // Delete the .c file by Smain
-        int result = delete_file(file_path);
-        if (result == 0) {
-            // Send confirmation to the client
-            const char *success_message = "File has been removed!";
-            printf("%s\n",success_message);
-            send(client_sock, success_message, strlen(success_message), 0);
-        }else if (result == 2){
-            // Send rejction to the client
-            const char *success_message = "File not found!";
-            printf("%s\n",success_message);
-            send(client_sock, success_message, strlen(success_message), 0);
-        }else{
-            // Send rejction to the client
-            const char *success_message = "File remove Failed!";
-            printf("%s\n",success_message);
-            send(client_sock, success_message, strlen(success_message), 0);
-        }
-
-    // Handle unsupported file types
-    } else {
-        printf("Unsupported file type: %s\n", file_name);
+// Function called by the event loop when the compression pool finished a block of a dtar archive
+void on_notify_event(struct ev_watch *watch, uint32_t ready) {
+    struct client_conn *conn = (struct client_conn *)((char *)watch - offsetof(struct client_conn, notify));
+    (void)ready;
+    if (conn->closed) {
+        return;
     }
+    conn_run(conn);
 }
 
-// Function to handle 'dtar' command from client
-void handle_dtar(int client_sock, char *command) {
-    // variable to store the file extension
-    char ext[10];
-    // store the server socket connection
-    int server_sock;
-    // Extract the file extension from the command 
-    sscanf(command, "dtar %s", ext);
-
-    // Define the path to be searched
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        // Print an error message if the home directory couldn't be found
-        fprintf(stderr, "Failed to get HOME environment variable\n");
+// Function called by the event loop when a server connection of 'dtar all' or 'display' is readable
+void on_fanout_event(struct ev_watch *watch, uint32_t ready) {
+    struct client_conn *conn = ((struct fanout_server *)watch)->conn;
+    (void)ready;
+    if (conn->closed) {
         return;
     }
-    // Define the full path to the directory that will be searched 
-    char full_path[512];
-    snprintf(full_path, sizeof(full_path), "%s/smain", home_dir);
-
-
-    // Check if the file has a .pdf extension
-    if (strcmp(ext, ".pdf") == 0) {
-        // Connect to the server responsible for handling PDF files
-        server_sock = connect_to_spdf();
-        // If the connection fails, inform the client and exit the function
-        if (server_sock < 0) {
-            printf("Failed to connect to Spdf server\n");
-            return;
-        }
-        // Send Request to the server to create a tarball and send it back and forward to client
-        request_tar_file(server_sock,client_sock,full_path);
-        close(server_sock);
-
-    // Check if the file has a .txt extension
-    }else if (strcmp(ext, ".txt") == 0) {
-        // Connect to the server responsible for handling PDF files
-        server_sock = connect_to_stext();
-        // If the connection fails, inform the client and exit the function
-        if (server_sock < 0) {
-            printf("Failed to connect to Stext server\n");
-            return;
-        }
-        // Send Request to the server to create a tarball and send it back and forward to client
-        request_tar_file(server_sock,client_sock,full_path);
-        close(server_sock);
-
-    // Check if the file has a .c extension
-    }else if (strcmp(ext, ".c") == 0) {
-        // Check if the full_path exists and is a directory
-        struct stat path_stat;
-        if (stat(full_path, &path_stat) != 0 || !S_ISDIR(path_stat.st_mode)) {
-            // Print an error message if the directory doesn't exist
-            printf("ERROR: Server directory does not exist, expected : %s\n", full_path);
-            // Send an error message to the client
-            const char *error_message = "ERROR: Server directory does not exist!";
-            send(client_sock, error_message, strlen(error_message), 0);
-            return;
-        }
-        // Create a tarball of the ".c" files and send it to the client
-        c_tar_file(client_sock, full_path);
+    conn_run(conn);
+}
 
-    } else {
-        // Print a message indicating that the file extension is not supported
-        const char *success_message = "ERROR: Invalid Extention Format!";
-        send(client_sock, success_message, strlen(success_message), 0);
+// Function called by the event loop when the servers took too long to answer 'display'
+void on_deadline_event(struct ev_watch *watch, uint32_t ready) {
+    struct client_conn *conn = (struct client_conn *)((char *)watch - offsetof(struct client_conn, deadline));
+    (void)ready;
+    if (conn->closed) {
         return;
     }
+    conn->deadline_passed = 1;
+    conn_run(conn);
 }
 
-// Function to handle 'display' command
-void handle_display(int client_sock, char *command) {
-    // variables to store the pathname and full path
-    char pathname[256];
-    char full_path[BUFSIZE];
-    // variables for server socket connections and file stats
-    int server_sock;
-    struct stat path_stat;
-    int server_sock_pdf,server_sock_txt;
-
-    // Extract the pathname from the command
-    sscanf(command, "display %s", pathname);
+// Function to advance a connection as far as its sockets allow, then wait for the next events
+void conn_run(struct client_conn *conn) {
+    uint32_t want_client, want_backend;
+    int result;
 
-    // Initialize file lists
-    char c_files[BUFSIZE] = "";  // List of .c files
-    char pdf_files[BUFSIZE] = ""; // List of .pdf files from server
-    char txt_files[BUFSIZE] = ""; // List of .txt files from server
+    do {
+        want_client = want_backend = 0;
+        result = conn_step(conn, &want_client, &want_backend);
+    } while (result == STEP_AGAIN);
 
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
+    if (result == STEP_CLOSE) {
+        conn_close(conn);
         return;
     }
-    // Construct the full path for the directory
-    if (pathname[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, pathname + 1);
-    } else {
-        snprintf(full_path, sizeof(full_path), "%s", pathname);
-    }
-
-    // Initialize a flag to check if the path exists
-    int path_exists = 0;
-    if (stat(full_path, &path_stat) == 0) {
-        if (S_ISDIR(path_stat.st_mode)) {
-            path_exists = 1;
-            // Step 1: Retrieve the list of .c files from the local directory
-            DIR *dir = opendir(full_path);
-            struct dirent *entry;
-            // If the directory is opened successfully, read its contents
-            if (dir != NULL) {
-                while ((entry = readdir(dir)) != NULL) {
-                    // Check if the file has a .c extension and add it to the list
-                    if (strstr(entry->d_name, ".c") != NULL) {
-                        strcat(c_files, entry->d_name);
-                        strcat(c_files, "\n");
-                    }
-                }
-                // Close the directory after reading its contents
-                closedir(dir);
-            }
-        } else {
-            // If the path exists but is not a directory, print an error
-            printf("ERROR: Not a directory in Smain!\n");
-        }
-    } else {
-        // If stat fails, it might be due to an invalid path
-        printf("ERROR: Invalid path or not a directory in Smain!\n");
+    if (ev_watch_set(&conn->client, want_client) < 0 || ev_watch_set(&conn->backend, want_backend) < 0) {
+        conn_close(conn);
     }
+}
 
-    // Prefix for error messages
-    const char *error_prefix = "ERROR:";
-
-    // Construct the message to send
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "display %s", full_path);
+// Function to run the handler of the current state once
+int conn_step(struct client_conn *conn, uint32_t *want_client, uint32_t *want_backend) {
+    // A backend connection gets its request before the state uses it, once its handshake is over
+    if (conn->backend.fd >= 0 && (conn->backend_connecting || conn->backend_request.len > 0)) {
+        int result = server_request_step(conn->backend_pool, conn->backend.fd, &conn->backend_request, &conn->backend_connecting);
+        if (result == IO_WAIT_WRITE) {
+            *want_backend = EPOLLOUT;
+            return STEP_WAIT;
+        }
+        if (result != IO_DONE) {
+            backend_unavailable(conn);
+            return STEP_AGAIN;
+        }
+    }
+    switch (conn->state) {
+        case CONN_REQUEST:
+            return conn_request(conn, want_client);
+        case CONN_UPLOAD:
+            return conn_upload(conn, want_client, want_backend);
+        case CONN_BACKEND_REPLY:
+            return conn_backend_reply(conn, want_client, want_backend);
+        case CONN_SEND_FILE:
+            return conn_send_file(conn, want_client);
+        case CONN_SEND_TAR:
+            return conn_send_tar(conn, want_client);
+        case CONN_SEND_ALL:
+            return conn_send_all(conn, want_client);
+        case CONN_DISPLAY:
+            return conn_display(conn);
+        case CONN_FLIGHT:
+            return conn_flight(conn, want_client);
+        case CONN_LOCAL_JOB:
+            return conn_local_job(conn);
+    }
+    return STEP_CLOSE;
+}
 
-    // Step 2: Retrieve .pdf files from Spdf server
-    get_file_names_from_server(connect_to_spdf, message, error_prefix, pdf_files, sizeof(pdf_files));
+// Function to release everything a connection holds
+void conn_close(struct client_conn *conn) {
+    conn->closed = 1;
+    printf("Client disconnected\n");
+
+    ev_watch_set(&conn->client, 0);
+    close(conn->client.fd);
+    // A request that was still running leaves its server connection out of sync
+    backend_end(conn, 0);
+    frame_relay_release(&conn->relay);
+    frame_reader_reset(&conn->reader);
+    out_buf_free(&conn->out);
+    if (conn->upload_fd >= 0) {
+        unlink(conn->upload_temp);
+        close_local_file(conn->upload_fd);
+    }
+    release_local_base(conn);
+    if (conn->file.fd >= 0) {
+        close(conn->file.fd);
+    }
+    if (conn->merge != NULL) {
+        finish_merge(conn);
+    }
+    finish_display(conn);
+    leave_flight(conn);
+    if (conn->job != NULL) {
+        end_local_job(conn);
+    }
+    ev_watch_set(&conn->notify, 0);
+    tar_compress_free(conn->tarz);
+    tar_stream_close(conn->tar);
+    free(conn->upload_path);
+    free(conn->upload_temp);
+
+    // Report how often the backend connections could be reused, how well the cache and path filters work and how many downloads were shared
+    for (int i = 0; i < routes->server_count; i++) {
+        conn_pool_print_stats(routes->servers[i].pool);
+    }
+    file_cache_print_stats(file_cache);
+    flight_print_stats();
+    for (int i = 0; i < routes->server_count; i++) {
+        path_filter_print_stats(filters[i]);
+    }
+
+    // Another event of this batch may still point to the connection
+    event_loop_defer_free(conn->client.loop, conn);
+}
 
-    // Step 3: Retrieve .txt files from Stext server
-    get_file_names_from_server(connect_to_stext, message, error_prefix, txt_files, sizeof(txt_files));
+// Function to queue a reply for the client and go back to reading requests
+void conn_reply(struct client_conn *conn, int opcode, const char *message) {
+    if (out_buf_text(&conn->out, opcode, conn->request_id, message) < 0) {
+        printf("Reply to client dropped\n");
+    }
+    conn->state = CONN_REQUEST;
+}
 
-    // Step 4: Combine the lists
-    char combined_list[3 * BUFSIZE] = "";
-    // If the path exists for c files, add .c files to the combined list
-    if (path_exists) {
-        strcat(combined_list, c_files);
+// State CONN_REQUEST: send what is queued, then read the next request frame
+int conn_request(struct client_conn *conn, uint32_t *want_client) {
+    int result = out_buf_flush(&conn->out, conn->client.fd);
+    if (result == IO_WAIT_WRITE) {
+        *want_client = EPOLLOUT;
+        return STEP_WAIT;
+    }
+    if (result != IO_DONE) {
+        return STEP_CLOSE;
     }
-    // Add .pdf and .txt files from the servers to the combined list
-    strcat(combined_list, pdf_files);
-    strcat(combined_list, txt_files);
 
-    // If no files were found, send an error message to the client
-    if(strlen(combined_list) == 0){
-        const char *error_message = "ERROR: No files found or given path doesnot exist!";
-        printf("%s\n",error_message);
-        send(client_sock, error_message, strlen(error_message), 0);
-    }else{
-        // print and send the list of files to the client
-        printf("List of files has been sent to Client\n");
-        send(client_sock,combined_list,strlen(combined_list),0);
+    // The payload of a request frame is its argument list
+    result = frame_reader_step(&conn->reader, conn->client.fd, DFS_MAX_TEXT);
+    if (result == IO_WAIT_READ) {
+        *want_client = EPOLLIN;
+        return STEP_WAIT;
+    }
+    if (result != IO_DONE) {
+        return STEP_CLOSE;
     }
-    
+    conn_dispatch(conn);
+    return STEP_AGAIN;
 }
 
-// Function to connect to the Spdf server
-int connect_to_spdf() {
-    // variable to store the socket descriptor
-    int server_sock;
-    // structure to store the server's address information
-    struct sockaddr_in server_addr;
-
-    // Create a socket
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    // Check if the socket creation was successful
-    if (server_sock < 0) {
-        perror("Spdf socket creation failed");
-        return -1;
+// Function to start the command of a complete request frame
+void conn_dispatch(struct client_conn *conn) {
+    char command[DFS_MAX_TEXT + 1];
+    int opcode = conn->reader.hdr.opcode;
+
+    // Take the request out of the reader, the reader is reused for server replies
+    conn->request_id = conn->reader.hdr.request_id;
+    conn->cache_miss = 0;
+    snprintf(command, sizeof(command), "%s", conn->reader.payload != NULL ? conn->reader.payload : "");
+    frame_reader_reset(&conn->reader);
+
+    // Determine which command the client sent and call the appropriate function to handle it
+    if (opcode == DFS_OP_UFILE) {
+        // Handle the 'ufile' command, which uploads a file
+        printf("File Upload request\n");
+        handle_ufile(conn, command);
+    } else if (opcode == DFS_OP_DFILE) {
+        // Handle the 'dfile' command, which downloads a file
+        printf("File download request\n");
+        handle_dfile(conn, command);
+    } else if (opcode == DFS_OP_RMFILE) {
+        // Handle the 'rmfile' command, which removes a file
+        printf("File remove request\n");
+        handle_rmfile(conn, command);
+    } else if (opcode == DFS_OP_DTAR) {
+        // Handle the 'dtar' command, which download file of given extension to Tar
+        printf("TarFile download request\n");
+        handle_dtar(conn, command);
+    } else if (opcode == DFS_OP_DISPLAY) {
+        // Handle the 'display' command, which shows files in a directory
+        printf("Display Files request\n");
+        handle_display(conn, command);
+    } else {
+        // Reply to anything else so the client does not wait forever
+        printf("Unknown request: %s\n", dfs_opcode_name(opcode));
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Unknown command!");
     }
+}
 
-    // Set up the server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(8081);  // Port for Spdf
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    // Connect to the Spdf server
-    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        // Print an error message if the connection fails
-        perror("Connect to Spdf failed");
-        close(server_sock);
-        return -1;
+// State CONN_UPLOAD: move the client's DATA stream to its destination
+int conn_upload(struct client_conn *conn, uint32_t *want_client, uint32_t *want_backend) {
+    // The CONTINUE reply that asked for an announced content must reach the client first
+    int result = out_buf_flush(&conn->out, conn->client.fd);
+    if (result == IO_WAIT_WRITE) {
+        *want_client = EPOLLOUT;
+        return STEP_WAIT;
+    }
+    if (result != IO_DONE) {
+        return STEP_CLOSE;
+    }
+
+    result = frame_relay_step(&conn->relay);
+    switch (result) {
+        case IO_WAIT_READ:
+            *want_client = EPOLLIN;
+            return STEP_WAIT;
+        case IO_WAIT_WRITE:
+            *want_backend = EPOLLOUT;
+            return STEP_WAIT;
+        case IO_FAIL_WRITE:
+            // Keep consuming the stream so the client connection stays in sync, then report the failure
+            perror(conn->upload_fd >= 0 ? "File write failed" : "Send to server failed");
+            conn->upload_failed = 1;
+            frame_relay_discard(&conn->relay);
+            return STEP_AGAIN;
+        case IO_DONE:
+            frame_relay_release(&conn->relay);
+            finish_upload(conn);
+            return STEP_AGAIN;
+        default:
+            // The client is gone, nobody is left to answer
+            printf("Upload stream interrupted\n");
+            return STEP_CLOSE;
     }
+}
 
-    return server_sock;
+// Function to complete an upload once the client's END (or ERROR) frame arrived
+void finish_upload(struct client_conn *conn) {
+    if (conn->upload_fd >= 0) {
+        // Local .c file: rename the temporary file into place only if the whole stream arrived
+        int complete = !conn->upload_failed && conn->relay.opcode == DFS_OP_END;
+        // The index gets the hash of what really arrived of an announced upload, a delta is applied first.
+        // The compressors read the files, the upload is finished once its hash is there
+        enum local_task task = conn->upload_delta_fd >= 0 ? LOCAL_APPLY : LOCAL_HASH;
+        if (complete && conn->upload_hashed && local_job_start(conn, task) == 0) {
+            return;
+        }
+        finish_local_upload(conn, complete, NULL);
+    } else if (conn->backend.fd >= 0 && !conn->upload_failed) {
+        // Forwarded to a server: its confirmation goes to the client next
+        frame_relay_init(&conn->relay, conn->backend.fd, conn->client.fd, 0, RELAY_REPLY, conn->request_id);
+        conn->fail_message = "File upload failed";
+        conn->state = CONN_BACKEND_REPLY;
+    } else {
+        // The stream was drained because it could not be stored
+        backend_end(conn, 0);
+        conn_reply(conn, DFS_OP_ERROR, conn->fail_message);
+    }
 }
 
-// Function to connect to the Stext server
-int connect_to_stext() {
-    // variable to store the socket descriptor
-    int server_sock;
-    // structure to store the server's address information
-    struct sockaddr_in server_addr;
+// Function to rename a local upload into place and answer the client, hash is the finished LOCAL_HASH
+// or LOCAL_APPLY job of an announced upload (NULL if it has none)
+void finish_local_upload(struct client_conn *conn, int complete, const struct local_job *hash) {
+    int hashed = hash != NULL && !hash->failed;
+    if (conn->upload_delta_fd >= 0) {
+        // A file rebuilt from a delta must be the one that was announced
+        complete = complete && hashed &&
+                   hash->size == conn->upload_size && memcmp(hash->digest, conn->upload_digest, SHA256_SIZE) == 0;
+        if (complete) {
+            printf("Delta upload: %llu bytes received, %llu bytes reused from the old file\n",
+                   (unsigned long long)hash->stats.encoded, (unsigned long long)hash->stats.copied);
+        } else if (hashed) {
+            printf("Rebuilt file does not match the announced hash\n");
+        } else if (hash != NULL) {
+            printf("Delta could not be applied\n");
+        }
+    } else if (complete) {
+        // Held across the rename, so the file replaced is freed by release_local_base()
+        conn->upload_base_fd = open(conn->upload_path, O_RDONLY);
+    }
+    if (complete && rename(conn->upload_temp, conn->upload_path) == 0) {
+        name_index_update(file_index, conn->upload_path);
+        if (hashed) {
+            content_index_add(contents, hash->digest, hash->size, conn->upload_fd, conn->upload_path);
+        }
+        // Notify the client that the file upload was successful
+        const char *success_message = "File Uploaded successfully.";
+        printf("%s\n",success_message);
+        conn_reply(conn, DFS_OP_OK, success_message);
+    } else {
+        // Notify the client that the file upload failed
+        unlink(conn->upload_temp);
+        const char *failed_message = "File uploading failed!";
+        printf("%s\n",failed_message);
+        conn_reply(conn, DFS_OP_ERROR, failed_message);
+    }
+    release_local_base(conn);
+    close_local_file(conn->upload_fd);
+    conn->upload_fd = -1;
+    free(conn->upload_path);
+    free(conn->upload_temp);
+    conn->upload_path = conn->upload_temp = NULL;
+}
 
-    // Create a socket
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    // Check if the socket creation was successful
-    if (server_sock < 0) {
-        perror("Stext socket creation failed");
+// Function to hand file-sized work of a local upload to the compressors, the connection waits in
+// CONN_LOCAL_JOB until it is done. The job reads its own descriptors of the upload's files.
+// Returns -1 if the job could not be started
+int local_job_start(struct client_conn *conn, enum local_task task) {
+    struct local_job *job = calloc(1, sizeof(*job));
+    if (job == NULL) {
         return -1;
     }
-
-    // Set up the server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(8082);  // Port for Stext
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    // Connect to the Stext server
-    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        // Print an error message if the connection fails
-        perror("Connect to Stext failed");
-        close(server_sock);
+    job->task = task;
+    job->size = conn->upload_base_size;
+    job->refs = 2;
+    job->fd = dup(task == LOCAL_SIGN ? conn->upload_base_fd : conn->upload_fd);
+    job->base_fd = task == LOCAL_APPLY ? dup(conn->upload_base_fd) : -1;
+    job->delta_fd = task == LOCAL_APPLY ? dup(conn->upload_delta_fd) : -1;
+    job->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (job->fd < 0 || job->notify_fd < 0 || (task == LOCAL_APPLY && (job->base_fd < 0 || job->delta_fd < 0)) ||
+        worker_pool_submit(compressors, run_local_job, job) < 0) {
+        perror("Local upload job failed");
+        job->refs = 1;
+        local_job_release(job);
         return -1;
     }
-
-    return server_sock;
+    conn->job = job;
+    conn->notify.fd = job->notify_fd;
+    ev_watch_set(&conn->notify, EPOLLIN | EPOLLET);
+    conn->state = CONN_LOCAL_JOB;
+    return 0;
 }
 
+// Function run on a compressor: the work of a local upload job, then wake its connection
+void run_local_job(void *arg) {
+    struct local_job *job = arg;
+    if (job->task == LOCAL_SIGN) {
+        job->failed = dfs_delta_sign(read_local_base, &job->fd, job->size, &job->signatures, &job->signatures_len) < 0;
+    } else {
+        // Synced before the rename, which would otherwise write the file out on the event loop
+        job->failed = (job->task == LOCAL_APPLY && apply_local_delta(job) < 0) ||
+                      sha256_file(job->fd, job->digest, &job->size) < 0 || fdatasync(job->fd) < 0;
+    }
+    // The last descriptor of a file can be file-sized work to close (see close_local_file()), the
+    // connection holds its own until it hands them to the compressors
+    close_job_files(job);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    ssize_t n = write(job->notify_fd, &one, sizeof(one));
+    (void)n;
+    local_job_release(job);
+}
 
-// helper Function to send a file to a specified server for uploading file
-void send_file_to_server(int server_sock, int client_sock, char *command, char *filename, char *destination_path, char *file_data) {
-    // buffer to hold data
-    char buffer[BUFSIZE];
-    // store the number of bytes sent
-    ssize_t bytes_sent;
-    // buffer to hold the response from the server
-    char recv_buffer[BUFSIZE];
-
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    // Check if the HOME environment variable is available
-    if (home_dir == NULL) {
-        // Print an error message if the HOME variable is not found
-        fprintf(stderr, "Failed to get HOME environment variable\n");
+// Function to let go of a local upload job, the last holder frees it
+void local_job_release(struct local_job *job) {
+    if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) > 0) {
         return;
     }
-    
-    // Construct the full path for the file (FilePath + file name)
-    char full_path[BUFSIZE];
-    if (destination_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s/%s/%s", home_dir, destination_path + 1, filename);
-    } else {
-        snprintf(full_path, sizeof(full_path), "%s/%s", destination_path, filename);
-    }
-    
-    // Construct the message with the command and the full path
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "%s %s\n", command, full_path);
-
-    // Calculate the total length of the message including file data
-    size_t total_length = strlen(message) + strlen(file_data) + 1; // +1 for null terminator
-    
-    // Allocate memory to hold the entire message (command + file path + file data)
-    char *complete_message = malloc(total_length);
-    if (complete_message == NULL) {
-        // Print an error message if memory allocation fails
-        perror("Memory allocation failed");
-        return;
+    close_job_files(job);
+    if (job->notify_fd >= 0) {
+        close(job->notify_fd);
     }
+    free(job->signatures);
+    free(job);
+}
 
-    // Copy the message and file data into the complete_message buffer
-    strcpy(complete_message, message);
-    // Append the file data to the complete_message buffer
-    strcat(complete_message, file_data);
-
-    // Send the complete message (command, full path, and file data in one go)
-    printf("Sending request to server...\n");
-    bytes_sent = send(server_sock, complete_message, total_length - 1, 0); // -1 to exclude the null terminator
-    if (bytes_sent < 0) {
-        // Print an error message if sending fails
-        perror("Send failed");
-    }
-
-    // Receive and display the confirmation message
-    ssize_t bytes_received = recv(server_sock, recv_buffer, sizeof(recv_buffer) - 1, 0);
-    // Check if data was received from the server
-    if (bytes_received > 0) {
-        // Null-terminate the received data to make it a valid string
-        recv_buffer[bytes_received] = '\0';
-        printf("Server Responce: %s\nforwarding responce to client\n",recv_buffer);
-        // Forward the server response to the client
-        if (send(client_sock, recv_buffer, bytes_received, 0) < 0) {
-            // Print an error message if forwarding to the client fails
-            perror("Send to client failed");
+// helper to close the descriptors a local upload job has of the upload's files
+void close_job_files(struct local_job *job) {
+    int *fds[] = {&job->fd, &job->base_fd, &job->delta_fd};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
         }
-    } else if (bytes_received == 0) {
-        // Print a message if the connection was closed by the server
-        printf("Connection closed by server.\n");
-        exit(EXIT_SUCCESS);
-    } else {
-        // Print an error message if there was an issue receiving data
-        perror("Error receiving data");
     }
+}
 
-    // Free allocated memory
-    free(complete_message);
+// helper run on a compressor: rebuild a local upload from the delta stream it received (LOCAL_APPLY),
+// returns -1 if the delta is malformed or a file could not be read or written
+int apply_local_delta(struct local_job *job) {
+    struct dfs_delta_apply *apply = dfs_delta_apply_new(job->size, read_local_base, &job->base_fd);
+    char *chunk = malloc(DFS_CHUNK_SIZE);
+    uint64_t offset = 0;
+    int result = apply != NULL && chunk != NULL ? 0 : -1;
+    if (result == 0) {
+        dfs_delta_apply_output(apply, write_local_upload, &job->fd);
+    }
+    while (result == 0) {
+        ssize_t n = pread(job->delta_fd, chunk, DFS_CHUNK_SIZE, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            result = n < 0 ? -1 : dfs_delta_apply_finish(apply, &job->stats);
+            break;
+        }
+        result = dfs_delta_apply_add(apply, chunk, (size_t)n);
+        offset += (uint64_t)n;
+    }
+    free(chunk);
+    dfs_delta_apply_free(apply);
+    return result;
 }
 
+// Function to stop waiting for the job of a connection
+void end_local_job(struct client_conn *conn) {
+    ev_watch_set(&conn->notify, 0);
+    conn->notify.fd = -1;
+    local_job_release(conn->job);
+    conn->job = NULL;
+}
 
-// Function to receive a file from a client and save it to the specified destination for uploading file
-int receive_and_save_file(int sock, char *destination_path, char *f_name, char *file_data) {
-    // a buffer to hold data temporarily
-    char buffer[BUFSIZE];
-    int file_fd;
-    // To store the number of bytes received
-    ssize_t bytes_received;
-    // buffer to hold the directory path
-    char dir_path[256];
- 
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
-        return -1;
+// State CONN_LOCAL_JOB: go on with the local upload once the compressors did their part
+int conn_local_job(struct client_conn *conn) {
+    if (!__atomic_load_n(&conn->job->done, __ATOMIC_ACQUIRE)) {
+        return STEP_WAIT;
     }
- 
-    // Create the full path for the file
-    char full_path[BUFSIZE];
-    if (destination_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, destination_path + 1);
+    if (conn->job->task == LOCAL_SIGN) {
+        local_content_signed(conn, conn->job);
     } else {
-        strncpy(full_path, destination_path, sizeof(full_path) - 1);
-        full_path[sizeof(full_path) - 1] = '\0';
-    }
- 
-    // Copy the destination path to dir_path
-    strncpy(dir_path, full_path, sizeof(dir_path) - 1);
-    dir_path[sizeof(dir_path) - 1] = '\0';
- 
-    // Ensure the destination directory exists by creating it if necessary
-    char command[BUFSIZE];
-    snprintf(command, sizeof(command), "mkdir -p %s", dir_path);
-    system(command);
- 
-    // Construct the full path for the file (path + file name)
-    char final_path[512];
-    snprintf(final_path, sizeof(final_path), "%s/%s", full_path, f_name);
- 
-    // Create the file at the specified path with read/write permissions
-    file_fd = open(final_path, O_CREAT | O_RDWR | O_TRUNC, 0777);
-    if (file_fd < 0) {
-        // Print an error message if file creation fails
-        perror("File creation failed");
-        return -1;
+        finish_local_upload(conn, 1, conn->job);
     }
- 
-    // Write the received file data into the newly created file
-    if (file_data) {
-        write(file_fd, file_data, strlen(file_data));
+    end_local_job(conn);
+    return STEP_AGAIN;
+}
+
+// State CONN_BACKEND_REPLY: forward the server's reply frames, payloads are spliced socket to socket
+int conn_backend_reply(struct client_conn *conn, uint32_t *want_client, uint32_t *want_backend) {
+    // Anything queued earlier must reach the client before the relayed frames
+    int result = out_buf_flush(&conn->out, conn->client.fd);
+    if (result == IO_WAIT_WRITE) {
+        *want_client = EPOLLOUT;
+        return STEP_WAIT;
+    }
+    if (result != IO_DONE) {
+        return STEP_CLOSE;
+    }
+
+    result = frame_relay_step(&conn->relay);
+    switch (result) {
+        case IO_WAIT_READ:
+            *want_backend = EPOLLIN;
+            return STEP_WAIT;
+        case IO_WAIT_WRITE:
+            *want_client = EPOLLOUT;
+            return STEP_WAIT;
+        case IO_DONE:
+            printf("Server reply forwarded to client (%s)\n", dfs_opcode_name(conn->relay.opcode));
+            frame_relay_release(&conn->relay);
+            if (conn->cache_miss) {
+                file_cache_add_bytes(file_cache, 0, conn->relay.bytes);
+            }
+            if (conn->relay.opcode == DFS_OP_CONTINUE || conn->relay.opcode == DFS_OP_DELTA) {
+                // The server does not have the content of an announced upload, the client sends it
+                // now (as a delta against the server's old version after DELTA)
+                frame_relay_init(&conn->relay, conn->client.fd, conn->backend.fd, 0, RELAY_UPLOAD, conn->request_id);
+                conn->upload_failed = 0;
+                conn->state = CONN_UPLOAD;
+                return STEP_AGAIN;
+            }
+            backend_end(conn, 1);
+            conn->state = CONN_REQUEST;
+            return STEP_AGAIN;
+        case IO_FAIL_READ:
+            printf("Connection closed by server.\n");
+            frame_relay_release(&conn->relay);
+            backend_end(conn, 0);
+            // The client already got a partial frame, so the connection can not be reused
+            if (!frame_relay_at_boundary(&conn->relay)) {
+                return STEP_CLOSE;
+            }
+            conn_reply(conn, DFS_OP_ERROR, conn->fail_message);
+            return STEP_AGAIN;
+        default:
+            perror("Send to client failed");
+            return STEP_CLOSE;
     }
-    
-    // Close the file after writing is complete
-    close(file_fd);
-    return 0;
 }
 
+// State CONN_SEND_FILE: send the queued NAME and DATA headers, then the file content and END
+int conn_send_file(struct client_conn *conn, uint32_t *want_client) {
+    int result = out_buf_flush(&conn->out, conn->client.fd);
+    if (result == IO_DONE) {
+        result = file_sender_step(&conn->file, conn->client.fd);
+    }
+    if (result == IO_WAIT_WRITE) {
+        *want_client = EPOLLOUT;
+        return STEP_WAIT;
+    }
+    if (result != IO_DONE) {
+        // A partly sent frame can not be recovered, drop the connection
+        perror("Error sending file");
+        return STEP_CLOSE;
+    }
+
+    close(conn->file.fd);
+    conn->file.fd = -1;
+    // Send an END frame to signal the end of the file content
+    out_buf_frame(&conn->out, DFS_OP_END, conn->request_id, NULL, 0);
+    printf("File sent to client.\n");
+    conn->state = CONN_REQUEST;
+    return STEP_AGAIN;
+}
 
-// Function to remove requested file by client from servers
-void remove_file_from_server(int sock, int client_sock, char *command, char *destination_path){
-    // Declare a buffer to hold the server's response
-    char recv_buffer[BUFSIZE];
+// State CONN_FLIGHT: wait for the NAME of the shared fetch, then send the file as far as it arrived
+int conn_flight(struct client_conn *conn, uint32_t *want_client) {
+    struct flight_state state;
+    flight_get(conn->flight, &state);
 
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
-        return;
+    if (!conn->flight_started) {
+        if (state.phase == FLIGHT_NAME) {
+            return flight_wait(conn->flight, &conn->waiter, &state) ? STEP_WAIT : STEP_AGAIN;
+        }
+        if (state.phase == FLIGHT_REFUSED || state.phase == FLIGHT_FAILED) {
+            leave_flight(conn);
+            conn_reply(conn, DFS_OP_ERROR, state.phase == FLIGHT_REFUSED ? state.message : "ERROR: Download Failed!");
+            return STEP_AGAIN;
+        }
+        int file_fd = flight_fd(conn->flight);
+        if (file_fd < 0) {
+            perror("dup");
+            leave_flight(conn);
+            conn_reply(conn, DFS_OP_ERROR, "ERROR: Download Failed!");
+            return STEP_AGAIN;
+        }
+        start_file_reply(conn, file_fd, conn->flight_name, state.size, state.version, conn->flight_ranged ? &conn->flight_range : NULL);
+        if (conn->state != CONN_SEND_FILE) {
+            // The range was refused
+            leave_flight(conn);
+            return STEP_AGAIN;
+        }
+        if (conn->cache_miss) {
+            file_cache_add_bytes(file_cache, 0, conn->file.left);
+        }
+        conn->state = CONN_FLIGHT;
+        conn->flight_started = 1;
+        flight_progress(conn->flight, &conn->waiter, (uint64_t)conn->file.offset);
+    }
+
+    // Only the bytes that arrived can be sent, the rest follows when the flight moved on
+    int result = out_buf_flush(&conn->out, conn->client.fd);
+    if (result == IO_DONE && conn->file.left > 0 && state.filled > (uint64_t)conn->file.offset) {
+        struct file_sender part = conn->file;
+        uint64_t available = state.filled - (uint64_t)conn->file.offset;
+        part.left = available < conn->file.left ? available : conn->file.left;
+        uint64_t before = part.left;
+        result = file_sender_step(&part, conn->client.fd);
+        conn->file.offset = part.offset;
+        conn->file.left -= before - part.left;
+        flight_progress(conn->flight, &conn->waiter, (uint64_t)conn->file.offset);
+    }
+    if (result == IO_WAIT_WRITE) {
+        *want_client = EPOLLOUT;
+        return STEP_WAIT;
+    }
+    if (result != IO_DONE) {
+        perror("Error sending file");
+        return STEP_CLOSE;
+    }
+    if (conn->file.left > 0) {
+        if (state.phase != FLIGHT_DATA) {
+            // The client got part of the DATA frame already, drop the connection
+            printf("Download from server failed\n");
+            return STEP_CLOSE;
+        }
+        return flight_wait(conn->flight, &conn->waiter, &state) ? STEP_WAIT : STEP_AGAIN;
     }
-    
-    // Construct the full path for the file (FilePath + file name)
-    char full_path[BUFSIZE];
-    if (destination_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, destination_path+1);
+
+    close(conn->file.fd);
+    conn->file.fd = -1;
+    leave_flight(conn);
+    out_buf_frame(&conn->out, DFS_OP_END, conn->request_id, NULL, 0);
+    printf("File sent to client.\n");
+    conn->state = CONN_REQUEST;
+    return STEP_AGAIN;
+}
+
+// State CONN_SEND_TAR: send the archive piece by piece, header blocks from memory and member contents with sendfile()
+int conn_send_tar(struct client_conn *conn, uint32_t *want_client) {
+    if (conn->tarz != NULL) {
+        return conn_send_tar_compressed(conn, want_client);
+    }
+    for (int pieces = 0; pieces < TAR_PIECES_PER_STEP; pieces++) {
+        int result = out_buf_flush(&conn->out, conn->client.fd);
+        if (result == IO_DONE && conn->file.fd >= 0) {
+            result = file_sender_step(&conn->file, conn->client.fd);
+            if (result == IO_DONE) {
+                close(conn->file.fd);
+                conn->file.fd = -1;
+            }
+        }
+        if (result == IO_WAIT_WRITE) {
+            *want_client = EPOLLOUT;
+            return STEP_WAIT;
+        }
+        if (result != IO_DONE) {
+            // A partly sent frame can not be recovered, drop the connection
+            perror("Error sending tarball");
+            return STEP_CLOSE;
+        }
+
+        struct tar_piece piece;
+        if (tar_stream_next(conn->tar, &piece) < 0) {
+            return STEP_CLOSE;
+        }
+        if (piece.kind == TAR_PIECE_BYTES) {
+            out_buf_frame(&conn->out, DFS_OP_DATA, conn->request_id, piece.data, piece.len);
+        } else if (piece.kind == TAR_PIECE_FILE) {
+            // Each member is a DATA frame of its own; a file that shrinks meanwhile is padded with zeros
+            out_buf_hdr(&conn->out, DFS_OP_DATA, conn->request_id, piece.size);
+            conn->file = (struct file_sender){piece.fd, 0, piece.size, 1, 0};
+        } else {
+            tar_stream_close(conn->tar);
+            conn->tar = NULL;
+            // Send an END frame to signal the end of the archive
+            out_buf_frame(&conn->out, DFS_OP_END, conn->request_id, NULL, 0);
+            printf("Tarball sent to client.\n");
+            conn->state = CONN_REQUEST;
+            return STEP_AGAIN;
+        }
     }
+    // Let the other connections of this loop have a turn before the next pieces
+    *want_client = EPOLLOUT;
+    return STEP_WAIT;
+}
 
-    // Construct the message to send to the server, including the command and full file path
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "%s %s", command, full_path);
-    
-    // Send the message to the server
-    printf("Sending request to server...\n");
-    if (send(sock, message, strlen(message), 0) == -1) {
-        // Print an error message if sending fails
-        perror("send");
-        return;
+// State CONN_SEND_TAR with a codec: queue blocks on the compression pool and send each one as it is done
+int conn_send_tar_compressed(struct client_conn *conn, uint32_t *want_client) {
+    for (int pieces = 0; pieces < TAR_PIECES_PER_STEP; pieces++) {
+        // Only read further ahead once the last block reached the socket
+        int result = out_buf_flush(&conn->out, conn->client.fd);
+        if (result == IO_WAIT_WRITE) {
+            *want_client = EPOLLOUT;
+            return STEP_WAIT;
+        }
+        if (result != IO_DONE || tar_compress_fill(conn->tarz) < 0) {
+            // A partly sent archive can not be recovered, drop the connection
+            perror("Error sending tarball");
+            return STEP_CLOSE;
+        }
+
+        const void *data;
+        size_t len;
+        int rc = tar_compress_next(conn->tarz, 0, &data, &len);
+        if (rc < 0) {
+            return STEP_CLOSE;
+        }
+        if (rc == 0) {
+            // The next block is still being compressed, its notification wakes us up
+            return STEP_WAIT;
+        }
+        if (rc == 1) {
+            out_buf_frame(&conn->out, DFS_OP_DATA, conn->request_id, data, len);
+            continue;
+        }
+
+        ev_watch_set(&conn->notify, 0);
+        conn->notify.fd = -1;
+        tar_compress_free(conn->tarz);
+        conn->tarz = NULL;
+        tar_stream_close(conn->tar);
+        conn->tar = NULL;
+        // Send an END frame to signal the end of the archive
+        out_buf_frame(&conn->out, DFS_OP_END, conn->request_id, NULL, 0);
+        printf("Tarball sent to client.\n");
+        conn->state = CONN_REQUEST;
+        return STEP_AGAIN;
+    }
+    // Let the other connections of this loop have a turn before the next blocks
+    *want_client = EPOLLOUT;
+    return STEP_WAIT;
+}
+
+// State CONN_SEND_ALL: copy whole members of the three archives into one as they arrive, through tarz with a codec
+int conn_send_all(struct client_conn *conn, uint32_t *want_client) {
+    // The archives only come once every server has the request
+    int connecting = merge_connect(conn);
+    if (connecting != 0) {
+        return connecting > 0 ? STEP_WAIT : STEP_AGAIN;
+    }
+    for (int pieces = 0; pieces < TAR_PIECES_PER_STEP; pieces++) {
+        int result = out_buf_flush(&conn->out, conn->client.fd);
+        if (result == IO_WAIT_WRITE) {
+            *want_client = EPOLLOUT;
+            return merge_wait(conn);
+        }
+        if (result != IO_DONE) {
+            // A partly sent archive can not be recovered, drop the connection
+            perror("Error sending tarball");
+            return STEP_CLOSE;
+        }
+
+        // Compressed blocks go out in order as soon as they are done
+        if (conn->tarz != NULL) {
+            const void *block;
+            size_t block_len;
+            int rc = tar_compress_next(conn->tarz, 0, &block, &block_len);
+            if (rc < 0) {
+                return STEP_CLOSE;
+            }
+            if (rc == 1) {
+                out_buf_frame(&conn->out, DFS_OP_DATA, conn->request_id, block, block_len);
+                continue;
+            }
+            if (rc == 2) {
+                return merge_done(conn);
+            }
+            if (conn->merge_closed) {
+                // Only the last blocks are still being compressed
+                return merge_wait(conn);
+            }
+        }
+
+        const void *data;
+        size_t len;
+        int rc = tar_merge_next(conn->merge, &data, &len);
+        if (rc == TAR_MERGE_WAIT) {
+            return merge_wait(conn);
+        }
+        if (rc == TAR_MERGE_FAIL) {
+            return merge_failed(conn);
+        }
+        if (rc == TAR_MERGE_END) {
+            if (conn->tarz == NULL) {
+                return merge_done(conn);
+            }
+            // The last partial block needs a free slot, the notification of a finished block brings one
+            if (tar_compress_close_input(conn->tarz) == 1) {
+                return merge_wait(conn);
+            }
+            conn->merge_closed = 1;
+            continue;
+        }
+
+        // The name goes out with the first member, an archive of nothing but the end marker is an error
+        if (!conn->merge_named) {
+            if (tar_merge_members(conn->merge) == 0) {
+                printf("No files found.\n");
+                finish_merge(conn);
+                conn_reply(conn, DFS_OP_ERROR, "ERROR: No files found!");
+                return STEP_AGAIN;
+            }
+            out_buf_text(&conn->out, DFS_OP_NAME, conn->request_id, conn->merge_name);
+            conn->merge_named = 1;
+        }
+        if (conn->tarz != NULL) {
+            size_t taken = tar_compress_write(conn->tarz, data, len);
+            tar_merge_consume(conn->merge, taken);
+            if (taken == 0) {
+                // Every slot is busy, wait for a block to finish
+                return merge_wait(conn);
+            }
+        } else {
+            out_buf_frame(&conn->out, DFS_OP_DATA, conn->request_id, data, len);
+            tar_merge_consume(conn->merge, len);
+        }
     }
+    // Let the other connections of this loop have a turn before the next members
+    *want_client = EPOLLOUT;
+    return merge_wait(conn);
+}
 
-    // Receive and display the confirmation message from the server
-    ssize_t bytes_received = recv(sock, recv_buffer, sizeof(recv_buffer) - 1, 0);
-    if (bytes_received > 0) {
-        //  Null-terminate the received data to make it a valid string
-        recv_buffer[bytes_received] = '\0';
-        printf("Server Responce: %s\nforwarding responce to client\n",recv_buffer);
-        // Forward the server's response to the client
-        if (send(client_sock, recv_buffer, bytes_received, 0) < 0) {
-            // Print an error message if forwarding to the client fails
-            perror("Send to client failed");
+// Function to close the merged archive once all of it is queued for the client
+int merge_done(struct client_conn *conn) {
+    finish_merge(conn);
+    // Send an END frame to signal the end of the archive
+    out_buf_frame(&conn->out, DFS_OP_END, conn->request_id, NULL, 0);
+    printf("Tarball sent to client.\n");
+    conn->state = CONN_REQUEST;
+    return STEP_AGAIN;
+}
+
+// Function to send the servers of a merge their requests as their connections come up. Returns 0 once
+// all of them have it, 1 while waiting for some, -1 if one can not be reached (the merge is ended)
+int merge_connect(struct client_conn *conn) {
+    int waiting = 0;
+    for (int i = 0; i < routes->server_count; i++) {
+        struct fanout_server *server = &conn->servers[i];
+        if (server->watch.fd < 0 || (!server->connecting && server->request.len == 0)) {
+            continue;
+        }
+        int result = server_request_step(server->pool, server->watch.fd, &server->request, &server->connecting);
+        if (result == IO_WAIT_WRITE) {
+            if (ev_watch_set(&server->watch, EPOLLOUT) < 0) {
+                merge_failed(conn);
+                return -1;
+            }
+            waiting = 1;
+        } else if (result != IO_DONE) {
+            printf("Failed to connect to server\n");
+            finish_merge(conn);
+            conn_reply(conn, DFS_OP_ERROR, routes->backends[routes->servers[i].backend].unavailable);
+            return -1;
         }
-    } else if (bytes_received == 0) {
-        // Print a message if the server closed the connection
-        printf("Connection closed by server.\n");
-        exit(EXIT_SUCCESS);
-    } else {
-        // Print an error message if there was an issue receiving data
-        perror("Error receiving data");
     }
+    return waiting;
 }
 
-// Function to delete a file and handle errors
-int delete_file(const char *file_path) {
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
+// Function to watch the server connections of a merge that still have data for it
+int merge_wait(struct client_conn *conn) {
+    // Drain them first, an unread socket would wake us up again right away
+    if (tar_merge_read(conn->merge) < 0) {
+        return merge_failed(conn);
+    }
+    for (int i = 0; i < routes->server_count; i++) {
+        struct fanout_server *server = &conn->servers[i];
+        if (server->watch.fd >= 0 &&
+            ev_watch_set(&server->watch, tar_merge_wants_read(conn->merge, server->source) ? EPOLLIN : 0) < 0) {
+            return STEP_CLOSE;
+        }
+    }
+    return STEP_WAIT;
+}
+
+// Function to end a merge whose sources failed
+int merge_failed(struct client_conn *conn) {
+    printf("ERROR: Merging the archives failed.\n");
+    finish_merge(conn);
+    // Frames are queued whole, so an ERROR frame in place of END tells the client the download failed
+    conn_reply(conn, DFS_OP_ERROR, "ERROR: Download Failed!");
+    return STEP_AGAIN;
+}
+
+// Function to release the sources and compression of a 'dtar all' merge
+void finish_merge(struct client_conn *conn) {
+    for (int i = 0; i < routes->server_count; i++) {
+        // A server that did not finish its reply leaves its connection out of sync
+        int source = conn->servers[i].source;
+        if (conn->servers[i].watch.fd >= 0) {
+            fanout_end(conn, i, source >= 0 && conn->merge->sources[source].clean);
+        }
+    }
+    tar_merge_free(conn->merge);
+    free(conn->merge);
+    conn->merge = NULL;
+    if (conn->tarz != NULL) {
+        ev_watch_set(&conn->notify, 0);
+        conn->notify.fd = -1;
+        tar_compress_free(conn->tarz);
+        conn->tarz = NULL;
+    }
+    conn->merge_named = conn->merge_closed = 0;
+}
+
+// State CONN_DISPLAY: collect the pages of the Spdf and Stext servers (both were asked at once) and
+// merge them with the .c files of Smain into one sorted page
+int conn_display(struct client_conn *conn) {
+    int waiting = 0;
+
+    for (int i = 0; i < routes->server_count; i++) {
+        struct fanout_server *server = &conn->servers[i];
+        if (server->watch.fd < 0) {
+            continue;
+        }
+        // The request goes out once the connection is up, the deadline counts from the start
+        int result = server_request_step(server->pool, server->watch.fd, &server->request, &server->connecting);
+        if (result == IO_DONE) {
+            result = display_read(server);
+        }
+        if ((result == IO_WAIT_READ || result == IO_WAIT_WRITE) && !conn->deadline_passed) {
+            if (ev_watch_set(&server->watch, result == IO_WAIT_READ ? EPOLLIN : EPOLLOUT) < 0) {
+                return STEP_CLOSE;
+            }
+            waiting++;
+            continue;
+        }
+        if (result == IO_WAIT_READ || result == IO_WAIT_WRITE) {
+            printf("%s server did not answer in time\n", server->name);
+            server->status = DISPLAY_TIMED_OUT;
+        } else if (result != IO_DONE) {
+            printf("Connection closed by server.\n");
+            server->status = DISPLAY_UNAVAILABLE;
+        }
+        // A reply that was not read completely leaves the connection out of sync
+        fanout_end(conn, i, result == IO_DONE);
+    }
+    if (waiting > 0) {
+        return STEP_WAIT;
+    }
+
+    // Every page is sorted, a k-way merge takes the smallest head until this page is full
+    char *heads[ROUTE_MAX_SERVERS], *ends[ROUTE_MAX_SERVERS];
+    for (int i = 0; i < routes->server_count; i++) {
+        struct fanout_server *server = &conn->servers[i];
+        heads[i] = ends[i] = NULL;
+        if (server->status == DISPLAY_LISTED && server->records_len > 0) {
+            heads[i] = server->records;
+            ends[i] = server->records + server->records_len;
+            // Each record becomes a string of its own
+            for (char *c = heads[i]; c < ends[i]; c++) {
+                if (*c == '\n') {
+                    *c = '\0';
+                }
+            }
+        }
+    }
+    struct name_page *local = &conn->local_page;
+    size_t local_next = 0;
+    char chunk[DFS_CHUNK_SIZE];
+    size_t used = 0;
+    size_t listed = 0;
+    const char *last = NULL;
+
+    while (listed < conn->display_limit) {
+        const char *best = local_next < local->count ? local->names[local_next] : NULL;
+        int from = -1;
+        for (int i = 0; i < routes->server_count; i++) {
+            if (heads[i] != NULL && heads[i] < ends[i] && (best == NULL || strcmp(heads[i], best) < 0)) {
+                best = heads[i];
+                from = i;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+        if (from < 0) {
+            local_next++;
+        } else {
+            heads[from] += strlen(heads[from]) + 1;
+        }
+        // A name found on two servers is listed once
+        if (last != NULL && strcmp(best, last) == 0) {
+            continue;
+        }
+        size_t len = strlen(best);
+        // Records never span two frames
+        if (used + len + 1 > sizeof(chunk)) {
+            out_buf_frame(&conn->out, DFS_OP_DATA, conn->request_id, chunk, used);
+            used = 0;
+        }
+        memcpy(chunk + used, best, len);
+        chunk[used + len] = '\n';
+        used += len + 1;
+        last = best;
+        listed++;
+    }
+
+    // There is a next page if any name is left over here or on a server
+    int more = local_next < local->count || local->more;
+    for (int i = 0; i < routes->server_count; i++) {
+        more = more || (heads[i] != NULL && heads[i] < ends[i]) || conn->servers[i].cursor[0] != '\0';
+    }
+    char next_cursor[DFS_CURSOR_MAX + 1];
+    snprintf(next_cursor, sizeof(next_cursor), "%s", more && last != NULL ? last : "");
+
+    // Tell the user which files may be missing
+    char notes[2048] = "";
+    for (int i = 0; i < routes->server_count; i++) {
+        struct fanout_server *server = &conn->servers[i];
+        // A server of a sharded backend only has part of its files
+        struct route_backend *backend = &routes->backends[routes->servers[i].backend];
+        const char *part = backend_servers(routes->servers[i].backend) > 1 ? "some " : "";
+        size_t note_len = strlen(notes);
+        if (server->status == DISPLAY_TIMED_OUT) {
+            snprintf(notes + note_len, sizeof(notes) - note_len, "NOTE: %s server did not answer within %d ms, %s%s files are not listed\n",
+                     server->name, DISPLAY_DEADLINE_MS, part, backend->suffixes);
+        } else if (server->status == DISPLAY_UNAVAILABLE) {
+            snprintf(notes + note_len, sizeof(notes) - note_len, "NOTE: %s server is unavailable, %s%s files are not listed\n",
+                     server->name, part, backend->suffixes);
+        }
+    }
+    int first_page = conn->display_cursor[0] == '\0';
+    finish_display(conn);
+
+    // If no files were found, send an error message to the client
+    if (listed == 0 && first_page) {
+        char error_message[sizeof(notes) + 64];
+        snprintf(error_message, sizeof(error_message), "ERROR: No files found or given path doesnot exist!%s%s",
+                 notes[0] ? "\n" : "", notes);
+        printf("%s\n",error_message);
+        conn_reply(conn, DFS_OP_ERROR, error_message);
+        return STEP_AGAIN;
+    }
+    // send the page to the client: its records, the notes, and END with the cursor of the next page
+    if (used > 0) {
+        out_buf_frame(&conn->out, DFS_OP_DATA, conn->request_id, chunk, used);
+    }
+    if (notes[0] != '\0') {
+        out_buf_text(&conn->out, DFS_OP_OK, conn->request_id, notes);
+    }
+    out_buf_text(&conn->out, DFS_OP_END, conn->request_id, next_cursor);
+    printf("List of %zu files has been sent to Client\n", listed);
+    conn->state = CONN_REQUEST;
+    return STEP_AGAIN;
+}
+
+// Function to read a server's 'display' reply: DATA records up to the END frame, or an ERROR
+int display_read(struct fanout_server *server) {
+    while (1) {
+        int result = frame_reader_step(&server->reader, server->watch.fd, DFS_CHUNK_SIZE);
+        if (result != IO_DONE) {
+            return result;
+        }
+        int opcode = server->reader.hdr.opcode;
+        if (opcode == DFS_OP_DATA) {
+            if (records_append(server, server->reader.payload, server->reader.payload_len) < 0) {
+                return IO_FAIL_READ;
+            }
+        } else if (opcode == DFS_OP_END) {
+            snprintf(server->cursor, sizeof(server->cursor), "%s", server->reader.payload);
+            server->status = DISPLAY_LISTED;
+        } else {
+            // Only a page carries names, an error adds nothing
+            server->status = DISPLAY_EMPTY;
+        }
+        frame_reader_reset(&server->reader);
+        if (opcode != DFS_OP_DATA) {
+            return IO_DONE;
+        }
+    }
+}
+
+// Function to release the server connections and deadline timer of 'display'
+void finish_display(struct client_conn *conn) {
+    for (int i = 0; i < routes->server_count; i++) {
+        if (conn->servers[i].watch.fd >= 0) {
+            fanout_end(conn, i, 0);
+        }
+        frame_reader_reset(&conn->servers[i].reader);
+        free(conn->servers[i].records);
+        conn->servers[i].records = NULL;
+        conn->servers[i].records_len = 0;
+        conn->servers[i].cursor[0] = '\0';
+        conn->servers[i].status = DISPLAY_PENDING;
+    }
+    name_page_free(&conn->local_page);
+    if (conn->deadline.fd >= 0) {
+        ev_watch_set(&conn->deadline, 0);
+        close(conn->deadline.fd);
+        conn->deadline.fd = -1;
+    }
+    conn->deadline_passed = 0;
+}
+
+// Function to take a server connection from its pool and queue a request frame for it in request.
+// A new connection is not waited for: server_request_step() sends the request once it is up, and
+// the reply is then read without blocking.
+int server_request(struct conn_pool *pool, int opcode, uint32_t request_id, const char *text, struct out_buf *request, int *connecting) {
+    int server_sock = conn_pool_get_nonblock(pool, connecting);
+    if (server_sock < 0) {
+        return -1;
+    }
+    if (out_buf_text(request, opcode, request_id, text) < 0) {
+        out_buf_free(request);
+        *connecting = 0;
+        conn_pool_put(pool, server_sock, 0);
         return -1;
     }
+    return server_sock;
+}
 
-    // new file path creation to replace ~
-    char full_path[BUFSIZE];
-    if (file_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path + 1);
-    } else {
-        strncpy(full_path, file_path, sizeof(full_path) - 1);
-        full_path[sizeof(full_path) - 1] = '\0';
+// Function to send the request frame of a server connection once its handshake is over:
+// IO_DONE once sent, IO_WAIT_WRITE, or IO_FAIL_WRITE if the server could not be reached
+int server_request_step(struct conn_pool *pool, int server_sock, struct out_buf *request, int *connecting) {
+    if (*connecting) {
+        int connected = conn_pool_connected(pool, server_sock);
+        if (connected <= 0) {
+            return connected == 0 ? IO_WAIT_WRITE : IO_FAIL_WRITE;
+        }
+        *connecting = 0;
+    }
+    int result = out_buf_flush(request, server_sock);
+    if (result == IO_FAIL_WRITE) {
+        perror("Send to server failed");
     }
+    return result;
+}
 
-    // check if file exist or not
-    if (access(full_path, F_OK) == -1) {
-        return 2;
+// Function to stop watching a server connection and give it back to its pool
+void server_release(struct conn_pool *pool, struct ev_watch *watch, int reusable) {
+    int server_sock = watch->fd;
+    ev_watch_set(watch, 0);
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) & ~O_NONBLOCK);
+    conn_pool_put(pool, server_sock, reusable);
+    watch->fd = -1;
+}
+
+// Function to start the request of a command on a server connection from its pool
+int backend_begin(struct client_conn *conn, struct conn_pool *pool, int opcode, const char *text) {
+    int server_sock = server_request(pool, opcode, conn->request_id, text, &conn->backend_request, &conn->backend_connecting);
+    if (server_sock < 0) {
+        return -1;
     }
+    conn->backend_pool = pool;
+    ev_watch_init(&conn->backend, conn->client.loop, server_sock, on_backend_event);
+    return 0;
+}
 
-    // delete the file at the specified path
-    if (unlink(full_path) == 0) {
-        return 0;
-    } else {
-        // Handle different errors that could occur during file deletion
-        switch (errno) {
-            case EACCES:
-                fprintf(stderr, "Permission denied: %s\n", full_path);
-                break;
-            case ENOENT:
-                fprintf(stderr, "File does not exist: %s\n", full_path);
-                break;
-            case EISDIR:
-                fprintf(stderr, "Path is a directory, not a file: %s\n", full_path);
-                break;
-            default:
-                fprintf(stderr, "Failed to delete file %s: %s\n", full_path, strerror(errno));
+// Function to give the server connection of a request back to its pool
+void backend_end(struct client_conn *conn, int reusable) {
+    // The file a ufile/rmfile changed may have been cached while the server worked on it
+    if (conn->changed_path != NULL) {
+        file_cache_invalidate(file_cache, conn->changed_path);
+        flight_forget(conn->changed_path);
+        path_filter_added(conn->adding, conn->changed_path);
+        if (conn->rebalanced) {
+            rebalance_write_done(rebalancer, shard_key(conn->changed_path));
         }
+        free(conn->changed_path);
+        conn->changed_path = NULL;
+        conn->adding = NULL;
+        conn->rebalanced = 0;
+    }
+    if (conn->backend.fd < 0) {
+        return;
+    }
+    out_buf_free(&conn->backend_request);
+    conn->backend_connecting = 0;
+    server_release(conn->backend_pool, &conn->backend, reusable);
+}
+
+// Function to give up a request whose server could not be reached, an upload to it is drained
+void backend_unavailable(struct client_conn *conn) {
+    printf("Failed to connect to server\n");
+    backend_end(conn, 0);
+    if (conn->state == CONN_UPLOAD) {
+        start_upload_drain(conn, conn->fail_message);
+    } else {
+        conn_reply(conn, DFS_OP_ERROR, conn->unavailable_message);
+    }
+}
+
+// Function to send a request to one of the servers of a fan-out, its reply is read without blocking
+int fanout_begin(struct client_conn *conn, int index, struct conn_pool *pool, const char *name, int opcode, const char *text) {
+    struct fanout_server *server = &conn->servers[index];
+    server->pool = pool;
+    server->name = name;
+    server->source = -1;
+    int server_sock = server_request(pool, opcode, conn->request_id, text, &server->request, &server->connecting);
+    if (server_sock < 0) {
         return -1;
     }
+    ev_watch_init(&server->watch, conn->client.loop, server_sock, on_fanout_event);
+    return 0;
 }
 
-// Function to send a file to the client for downloading
-void send_file_to_client(int client_sock, const char *file_path, const char *file_name) {
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
+// Function to give the connection of a fan-out server back to its pool
+void fanout_end(struct client_conn *conn, int index, int reusable) {
+    struct fanout_server *server = &conn->servers[index];
+    out_buf_free(&server->request);
+    server->connecting = 0;
+    server_release(server->pool, &server->watch, reusable);
+}
+
+// Function to find the key of a file on the rings of the routing table: its path below ~/smain, so
+// the home directory of Smain does not move files
+const char *shard_key(const char *full_path) {
+    size_t root_len = strlen(root_path);
+    if (root_len > 0 && strncmp(full_path, root_path, root_len) == 0 && full_path[root_len] == '/') {
+        return full_path + root_len + 1;
+    }
+    return full_path;
+}
+
+// Function to find the server of a backend that stores the file at full_path, an index in the routing
+// table. While a file is moved to another server it stays where it was (see rebalance.h); writing is
+// NULL for a read, else set when the rebalancer must be told the write is over
+int find_shard(int backend, const char *full_path, int *writing) {
+    return rebalance_route(rebalancer, routes, backend, shard_key(full_path), writing);
+}
+
+// Function to count the servers of a backend that requests go to, the retired ones that still hold files included
+int backend_servers(int backend) {
+    int count = 0;
+    for (int i = 0; i < routes->server_count; i++) {
+        count += routes->servers[i].backend == backend && !routes->servers[i].drained;
+    }
+    return count;
+}
+
+// Function to send a request to a server and relay its reply to the client
+void start_backend_reply(struct client_conn *conn, struct conn_pool *pool, int opcode, const char *text, const char *unavailable_message, const char *fail_message) {
+    printf("Sending request to server...\n");
+    if (backend_begin(conn, pool, opcode, text) < 0) {
+        printf("Failed to connect to server\n");
+        conn_reply(conn, DFS_OP_ERROR, unavailable_message);
         return;
     }
-    // Construct the full path for the file
-    char full_path[BUFSIZE];
-    if (file_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path + 1);
+    frame_relay_init(&conn->relay, conn->backend.fd, conn->client.fd, 0, RELAY_REPLY, conn->request_id);
+    conn->fail_message = fail_message;
+    conn->unavailable_message = unavailable_message;
+    conn->state = CONN_BACKEND_REPLY;
+}
+
+// Function to consume an upload that can not be stored, the client gets fail_message afterwards
+void start_upload_drain(struct client_conn *conn, const char *fail_message) {
+    frame_relay_init(&conn->relay, conn->client.fd, -1, 0, RELAY_UPLOAD, conn->request_id);
+    conn->upload_failed = 1;
+    conn->fail_message = fail_message;
+    conn->state = CONN_UPLOAD;
+}
+
+// Function to refuse an upload, its content is drained unless the command only announced it
+void refuse_upload(struct client_conn *conn, int announced, const char *fail_message) {
+    if (announced) {
+        conn_reply(conn, DFS_OP_ERROR, fail_message);
     } else {
-        snprintf(full_path, sizeof(full_path), "%s", file_path);
+        start_upload_drain(conn, fail_message);
     }
+}
 
-    // Open the file for reading
-    int file_fd = open(full_path, O_RDONLY);
-    if (file_fd < 0) {
-        perror("File open failed");
-        // Send rejction to the client
-        const char *success_message = "ERROR: File not found!";
-        printf("%s\n",success_message);
-        send(client_sock, success_message, strlen(success_message), 0);
+// Function to queue the NAME frame and DATA header for a local file and start sending it.
+// A ranged request gets the part of the file it names, after a NAME that describes the whole file
+void start_local_file(struct client_conn *conn, int file_fd, const char *file_name, struct dfs_range *range) {
+    struct stat st;
+    if (fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(file_fd);
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: File not found!");
         return;
     }
+    char version[DFS_VERSION_MAX + 1];
+    dfs_range_version(&st, version);
+    start_file_reply(conn, file_fd, file_name, (uint64_t)st.st_size, version, range);
+}
 
-    // Send the file name to the client
-    send(client_sock, file_name, strlen(file_name), 0);
+// Function to start sending a file of size bytes with version, from the disk or the cache
+void start_file_reply(struct client_conn *conn, int file_fd, const char *file_name, uint64_t size, const char *version, struct dfs_range *range) {
+    struct dfs_range whole = {0, 0, ""};
+    struct dfs_range *part = range != NULL ? range : &whole;
+    if (dfs_range_resolve(part, size, version) < 0) {
+        close(file_fd);
+        printf("Requested range is past the end of the file\n");
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Invalid range!");
+        return;
+    }
+    if (range != NULL) {
+        char name[BUFSIZE];
+        dfs_range_name(name, sizeof(name), file_name, size, range);
+        out_buf_text(&conn->out, DFS_OP_NAME, conn->request_id, name);
+    } else {
+        out_buf_text(&conn->out, DFS_OP_NAME, conn->request_id, file_name);
+    }
+    // The part is one DATA frame, the kernel copies it from the page cache with sendfile()
+    out_buf_hdr(&conn->out, DFS_OP_DATA, conn->request_id, part->length);
+    conn->file = (struct file_sender){file_fd, (off_t)part->offset, part->length, 0, 0};
+    conn->state = CONN_SEND_FILE;
+}
 
-    // Read the file and send its contents to the client
-    char buffer_content[BUFSIZE];
-    ssize_t bytes_read,bytes_sent;
-    while ((bytes_read = read(file_fd, buffer_content, sizeof(buffer_content))) > 0) {
-        bytes_sent = send(client_sock, buffer_content, bytes_read, 0);
-        if (bytes_sent < 0) {
-            perror("Error sending file");
-            break;
-        }
+// Function to answer a dfile of a .pdf/.txt file from the cache, returns -1 if it does not have it
+int serve_cached_file(struct client_conn *conn, struct conn_pool *pool, const char *full_path, const char *file_name, struct dfs_range *range) {
+    int file_fd;
+    uint64_t size;
+    char version[DFS_VERSION_MAX + 1];
+    if (file_cache_get(file_cache, pool, full_path, &file_fd, &size, version) < 0) {
+        conn->cache_miss = file_cache != NULL;
+        return -1;
     }
-    if (bytes_read < 0) {
-        perror("Error reading file");
+    printf("File served from the cache\n");
+    start_file_reply(conn, file_fd, file_name, size, version, range);
+    if (conn->state == CONN_SEND_FILE) {
+        file_cache_add_bytes(file_cache, 1, conn->file.left);
     }
-    close(file_fd);
+    return 0;
+}
 
-    // Send the end marker to indicate the end of the file transfer
-    if (send(client_sock, CMD_END_MARKER, strlen(CMD_END_MARKER), 0) == -1) {
-        perror("Failed to send end marker");
+// Function to answer a dfile of a .pdf/.txt file from a fetch shared with the other requests of it,
+// returns -1 if there is none to join and none could be started
+int start_flight(struct client_conn *conn, struct conn_pool *pool, const char *full_path, const char *file_name, struct dfs_range *range) {
+    int notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd < 0) {
+        return -1;
     }
+    conn->waiter.notify_fd = notify_fd;
+    conn->flight = flight_join(conn->client.loop, pool, full_path, &conn->waiter);
+    if (conn->flight == NULL) {
+        close(notify_fd);
+        return -1;
+    }
+    conn->notify.fd = notify_fd;
+    ev_watch_set(&conn->notify, EPOLLIN | EPOLLET);
+    snprintf(conn->flight_name, sizeof(conn->flight_name), "%s", file_name);
+    conn->flight_ranged = range != NULL;
+    if (range != NULL) {
+        conn->flight_range = *range;
+    }
+    conn->flight_started = 0;
+    conn->state = CONN_FLIGHT;
+    return 0;
+}
 
+// Function to stop using the shared fetch of a dfile
+void leave_flight(struct client_conn *conn) {
+    if (conn->flight == NULL) {
+        return;
+    }
+    // The flight writes the eventfd under its lock, so nothing is written to it after this
+    flight_leave(conn->flight, &conn->waiter);
+    conn->flight = NULL;
+    ev_watch_set(&conn->notify, 0);
+    close(conn->notify.fd);
+    conn->notify.fd = -1;
 }
 
+// Function to drop the cached copy of a .pdf/.txt file that a ufile/rmfile changes, now and when the
+// server answered, later downloads do not share a fetch of its old content either. The path of an
+// upload goes into the path filter of its server before the server gets it. rebalanced is set when
+// find_shard() counted the write.
+void file_changing(struct client_conn *conn, const char *full_path, struct path_filter *filter, int upload, int rebalanced) {
+    file_cache_invalidate(file_cache, full_path);
+    flight_forget(full_path);
+    if (conn->changed_path != NULL) {
+        path_filter_added(conn->adding, conn->changed_path);
+        if (conn->rebalanced) {
+            rebalance_write_done(rebalancer, shard_key(conn->changed_path));
+        }
+    }
+    free(conn->changed_path);
+    conn->changed_path = strdup(full_path);
+    conn->adding = NULL;
+    conn->rebalanced = conn->changed_path != NULL && rebalanced;
+    if (conn->changed_path == NULL && rebalanced) {
+        rebalance_write_done(rebalancer, shard_key(full_path));
+    }
+    if (upload) {
+        path_filter_add(filter, full_path);
+        conn->adding = conn->changed_path != NULL ? filter : NULL;
+    } else {
+        path_filter_removed(filter, full_path);
+    }
+}
 
-// Function to send a download request to the server and handle the file transfer
-void send_download_request(int server_sock, int client_sock, char *command, char *file_path){
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
+// Function to handle 'ufile' command
+// The file content follows the command as a DATA stream, every branch below either
+// stores, forwards or drains that stream before replying, so the connection stays in sync.
+// A command that announces the size and hash of the content ("<file> <path> <size> <hash>") gets
+// no stream unless the content is asked for with a CONTINUE reply, after which it is handled the same way.
+// An upload that replaces a large file may be asked for a delta against it with a DELTA reply instead
+void handle_ufile(struct client_conn *conn, char *command) {
+    char filename[256], destination_path[256];
+    char *f_name;
+    uint64_t size = 0;
+    unsigned char digest[SHA256_SIZE];
+
+    // Extract filename and destination path from the command, and the content it may announce
+    int end = 0;
+    int parsed = sscanf(command, "%255s %255s%n", filename, destination_path, &end);
+    while (parsed == 2 && command[end] == ' ') {
+        end++;
+    }
+    int announced = parsed == 2 && command[end] != '\0';
+    if (parsed != 2 || (announced && content_index_parse(command + end, &size, digest) < 0)) {
+        printf("Command parsing failed\n");
+        refuse_upload(conn, announced, "File upload failed");
         return;
     }
-    
-    // Construct the full path for the file (FilePath + file name)
+    // extract file name if subdirectory is also given
+    if(strstr(filename,"/") != NULL){
+        // Extract the file name
+        f_name = strrchr(filename, '/') + 1;
+    }else{
+        f_name = filename;
+    }
+
+    // The routing table tells who stores the file: a backend server (.pdf Spdf, .txt Stext) or Smain
+    int target = route_find(routes, f_name);
+    if (target >= 0) {
+        // Construct the full path for the file (FilePath + file name)
+        char dir_path[BUFSIZE];
+        char full_path[BUFSIZE];
+        if (expand_path(destination_path, dir_path, sizeof(dir_path)) < 0) {
+            refuse_upload(conn, announced, "File upload failed");
+            return;
+        }
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, f_name);
+        // The path picks the server of a sharded backend
+        int rebalanced;
+        int shard = find_shard(target, full_path, &rebalanced);
+        struct route_server *server = &routes->servers[shard];
+        file_changing(conn, full_path, filters[shard], 1, rebalanced);
+
+        if (announced) {
+            // Pass the announcement on, the server's answer decides whether the content follows
+            char request[BUFSIZE + 96];
+            char hex[SHA256_HEX_SIZE + 1];
+            sha256_hex(digest, hex);
+            snprintf(request, sizeof(request), "%s %llu %s", full_path, (unsigned long long)size, hex);
+            start_backend_reply(conn, server->pool, DFS_OP_UFILE, request, "File upload failed", "File upload failed");
+            return;
+        }
+
+        // Send the command frame, then pass the client's content through as it arrives
+        printf("Sending request to server...\n");
+        if (backend_begin(conn, server->pool, DFS_OP_UFILE, full_path) < 0) {
+            printf("Failed to connect to %s server\n", server->name);
+            start_upload_drain(conn, "File upload failed");
+            return;
+        }
+        frame_relay_init(&conn->relay, conn->client.fd, conn->backend.fd, 0, RELAY_UPLOAD, conn->request_id);
+        conn->upload_failed = 0;
+        conn->fail_message = "File upload failed";
+        conn->state = CONN_UPLOAD;
+
+    // Check if the file is one Smain stores (a C file)
+    } else if (target == ROUTE_LOCAL) {
+        // Content that is stored already is linked to the destination, nothing is transferred
+        if (announced && link_local_upload(conn, destination_path, f_name, size, digest) == 0) {
+            return;
+        }
+        // upload by Smain
+        if (open_local_upload(conn, destination_path, f_name) < 0) {
+            refuse_upload(conn, announced, "File uploading failed!");
+            return;
+        }
+        frame_relay_init(&conn->relay, conn->client.fd, conn->upload_fd, 1, RELAY_UPLOAD, conn->request_id);
+        conn->upload_failed = 0;
+        conn->upload_hashed = announced;
+        conn->state = CONN_UPLOAD;
+        if (announced) {
+            // The content is needed, ask for it
+            ask_local_content(conn, size, digest);
+        }
+    } else {
+        // If the file type is unsupported, notify the client
+        printf("Unsupported file type: %s\n", filename);
+        refuse_upload(conn, announced, "Unsupported file type");
+    }
+}
+
+// Function to handle 'dfile' command
+void handle_dfile(struct client_conn *conn, char *command) {
+    char file_path[256];
     char full_path[BUFSIZE];
-    if (file_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path+1);
-    }
-
-    // Construct the message to send to the server, including the command and full file path
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "%s %s", command, full_path);
-    
-    // Send the message to the server
-    printf("Sending download request to server..\n");
-    if (send(server_sock, message, strlen(message), 0) == -1) {
-        // Print an error message if sending fails
-        perror("send");
+    struct dfs_range range;
+    int ranged = 0;
+
+    // Extract the file path from the command, and the part of the file it may ask for
+    int end = 0;
+    if (sscanf(command, "%255s%n", file_path, &end) != 1) {
+        file_path[0] = '\0';
+    } else if ((ranged = dfs_range_parse(command + end, &range)) < 0) {
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Invalid range!");
         return;
     }
 
-    // Receive the file name from the server
-    char file_name[256];
-    ssize_t bytes_received = recv(server_sock, file_name, sizeof(file_name) - 1, 0);
-    if (bytes_received <= 0) {
-        // Print an error message if receiving the file name fails
-        perror("Error receiving file name");
+    // check if requested doenload file path is valid or not
+    if(!is_valid_path(file_path)){
+        printf("ERROR: Invalid path!\n");
+        // Send error message if the path is invalid
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Invalid path!");
         return;
     }
-    // Null-terminate the file name
-    file_name[bytes_received] = '\0'; 
 
-    //send the file name to the client
-    if (send(client_sock, file_name, strlen(file_name), 0) == -1) {
-        // Print an error message if sending the file name to the client fails
-        perror("send");
+    // Extract the file name
+    char *file_name = strrchr(file_path, '/');
+    if (!file_name) {
+        // Handle case where the file name extraction fails
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Invalid file path");
+        return;
     }
+    file_name++;
 
+    // Replace ~ with the value of the HOME environment variable
+    if (expand_path(file_path, full_path, sizeof(full_path)) < 0) {
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Server configuration error!");
+        return;
+    }
 
-    // Receive the file content from the server and forward it to the client
-    char buffer[BUFSIZE];
-    ssize_t content_received;
-    // Keep receiving content until there's no more left to receive
-    while ((content_received = recv(server_sock, buffer, sizeof(buffer), 0)) > 0) {
-        // Forward the received content to the client
-        ssize_t bytes_sent = send(client_sock, buffer, content_received, 0);
-        if (bytes_sent < 0) {
-            // Print an error message if forwarding fails
-            perror("send");
-            break;
+    // Determine the file type and process accordingly
+    int target = route_find(routes, file_name);
+    if (target == ROUTE_LOCAL) {
+        // Handle .c file - Send file directly to the client, one the index does not know is not looked for on disk
+        int file_fd = -1;
+        if (name_index_lookup(file_index, full_path) != INDEX_MISSING) {
+            file_fd = open(full_path, O_RDONLY);
+        }
+        if (file_fd < 0) {
+            printf("File open failed\n");
+            // Send rejction to the client
+            const char *success_message = "ERROR: File not found!";
+            printf("%s\n",success_message);
+            conn_reply(conn, DFS_OP_ERROR, success_message);
+            return;
         }
+        start_local_file(conn, file_fd, file_name, ranged ? &range : NULL);
+        return;
+    }
 
-        // Check for the end marker in the buffer to detect the end of the file content
-        if (content_received < BUFSIZE) {
-            if (memcmp(buffer + content_received - strlen(CMD_END_MARKER), CMD_END_MARKER, strlen(CMD_END_MARKER)) == 0) {
-                // Break the loop if the end of the content is reached
-                break;
-            }
+    // The servers get the range along with the path
+    char request[BUFSIZE + 96];
+    if (ranged) {
+        snprintf(request, sizeof(request), "%s %llu %llu %s", full_path, (unsigned long long)range.offset,
+                 (unsigned long long)range.length, range.version);
+    } else {
+        snprintf(request, sizeof(request), "%s", full_path);
+    }
+    if (target >= 0) {
+        // Forward the request to the server that stores the file, unless it does not have the file,
+        // the file is cached or already asked for
+        int shard = find_shard(target, full_path, NULL);
+        struct route_server *server = &routes->servers[shard];
+        if (!path_filter_may_exist(filters[shard], full_path)) {
+            printf("File not found!\n");
+            conn_reply(conn, DFS_OP_ERROR, "ERROR: File not found!");
+            return;
         }
+        if (serve_cached_file(conn, server->pool, full_path, file_name, ranged ? &range : NULL) == 0 ||
+            start_flight(conn, server->pool, full_path, file_name, ranged ? &range : NULL) == 0) {
+            return;
+        }
+        start_backend_reply(conn, server->pool, DFS_OP_DFILE, request, routes->backends[target].unavailable, "ERROR: Download Failed!");
+    }else{
+        printf("Invalid file type\n");
+        // Send an error message to the client with a specific prefix
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Invalid file type!");
+    }
+}
+
+// Function to handle 'rmfile' command
+void handle_rmfile(struct client_conn *conn, char *command) {
+    // variable to store the file path
+    char file_path[256];
+    char full_path[BUFSIZE];
+
+    // Extract the file path from the command
+    if (sscanf(command, "%255s", file_path) != 1) {
+        file_path[0] = '\0';
     }
-    if (content_received < 0) {
-        // Print an error message if there was an issue receiving the file content
-        perror("Error receiving file content");
+
+    // The file name is the last component of the path
+    char *file_name = strrchr(file_path, '/');
+    file_name = file_name != NULL ? file_name + 1 : file_path;
+
+    // Reject requests that do not name a file at all
+    if (file_name[0] == '\0') {
+        printf("Command parsing failed\n");
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Invalid path!");
+        return;
+    }
+
+    // Files a backend server stores (.pdf, .txt) are removed by it
+    int target = route_find(routes, file_name);
+    if (target >= 0) {
+        if (expand_path(file_path, full_path, sizeof(full_path)) < 0) {
+            conn_reply(conn, DFS_OP_ERROR, "File remove failed");
+            return;
+        }
+        // A path its server does not store is not asked for
+        int rebalanced;
+        int shard = find_shard(target, full_path, &rebalanced);
+        if (!path_filter_may_exist(filters[shard], full_path)) {
+            if (rebalanced) {
+                rebalance_write_done(rebalancer, shard_key(full_path));
+            }
+            printf("File not found!\n");
+            conn_reply(conn, DFS_OP_ERROR, "File not found!");
+            return;
+        }
+        file_changing(conn, full_path, filters[shard], 0, rebalanced);
+        start_backend_reply(conn, routes->servers[shard].pool, DFS_OP_RMFILE, full_path, "File remove failed", "File remove failed");
+
+    // Check if the file is one Smain stores (a .c file)
+    } else if (target == ROUTE_LOCAL) {
+        // Delete the .c file by Smain
+        int result = delete_file(file_path);
+        if (result == 0) {
+            // Send confirmation to the client
+            const char *success_message = "File has been removed!";
+            printf("%s\n",success_message);
+            conn_reply(conn, DFS_OP_OK, success_message);
+        }else if (result == 2){
+            // Send rejction to the client
+            const char *success_message = "File not found!";
+            printf("%s\n",success_message);
+            conn_reply(conn, DFS_OP_ERROR, success_message);
+        }else{
+            // Send rejction to the client
+            const char *success_message = "File remove Failed!";
+            printf("%s\n",success_message);
+            conn_reply(conn, DFS_OP_ERROR, success_message);
+        }
+
+    // Handle unsupported file types
+    } else {
+        printf("Unsupported file type: %s\n", file_name);
+        conn_reply(conn, DFS_OP_ERROR, "Unsupported file type");
     }
 }
 
+// Function to handle 'dtar' command from client
+void handle_dtar(struct client_conn *conn, char *command) {
+    // variables to store the file extension and the optional compression codec ("zstd:3")
+    char ext[ROUTE_MAX_SUFFIX + 1];
+    char codec[32];
+    // Extract the file extension and codec from the command
+    int parsed = sscanf(command, "%32s %31s", ext, codec);
+    if (parsed < 1) {
+        ext[0] = '\0';
+    }
+    struct dfs_codec_spec spec = {DFS_CODEC_NONE, 0};
+    if (parsed == 2 && dfs_codec_parse(codec, &spec) < 0) {
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Invalid compression codec!");
+        return;
+    }
 
-// Helper function to request server for file name for given path
-void get_file_names_from_server(int (*connect_func)(), const char *message, const char *error_prefix, char *response_buffer, size_t buffer_size) {
-    // Establish a connection to the server using the provided connect function
-    int server_sock = connect_func();
-    if (server_sock < 0) {
-        // Print an error message if the connection failed
-        printf("Failed to connect to server\n");
-        response_buffer[0] = '\0'; // Clear the buffer on connection failure
+    // Define the path to be searched
+    char full_path[512];
+    if (expand_path("~/smain", full_path, sizeof(full_path)) < 0) {
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Server configuration error!");
         return;
     }
+    // The Spdf and Stext servers get the codec after the path and compress the archive themselves,
+    // the suffix of the files follows on the next line
+    char backend_command[sizeof(full_path) + sizeof(codec) + sizeof(ext) + 2];
+    snprintf(backend_command, sizeof(backend_command), "%s%s%s\n%s", full_path, parsed == 2 ? " " : "", parsed == 2 ? codec : "", ext);
 
-    // Send the message to the server
-    send(server_sock, message, strlen(message), 0);
+    // The file type is routed like a file name of just its suffix
+    int target = strcmp(ext, "all") == 0 ? ROUTE_NONE : route_find_rule(routes, ext);
 
-    // Clear the response buffer to ensure it's empty before receiving data
-    memset(response_buffer, 0, buffer_size);
+    // 'all' merges the archives of Smain and every backend into one
+    if (strcmp(ext, "all") == 0) {
+        start_dtar_merge(conn, full_path, &spec, ROUTE_NONE, NULL, ALL_TAR_FILE_PATH);
 
-    // Receive the server's response into the response buffer
-    // Read response, leaving space for null terminator
-    recv(server_sock, response_buffer, buffer_size - 1, 0); 
+    // The archives of the servers of a sharded backend are merged into one
+    }else if (target >= 0 && backend_servers(target) > 1) {
+        char tar_name[64];
+        snprintf(tar_name, sizeof(tar_name), TAR_FILE_PATH, ext + (ext[0] == '.'));
+        start_dtar_merge(conn, full_path, &spec, target, ext, tar_name);
+
+    // Check if a backend stores the files (.pdf Spdf, .txt Stext)
+    }else if (target >= 0) {
+        // Send Request to the server to create a tarball and send it back and forward to client
+        // The backend has one server, every key leads to it
+        struct route_backend *backend = &routes->backends[target];
+        start_backend_reply(conn, routes->servers[route_find_server(routes, target, "")].pool, DFS_OP_DTAR, backend_command, backend->unavailable, "ERROR: Download Failed!");
+
+    // Check if Smain stores the files (.c)
+    }else if (target == ROUTE_LOCAL) {
+        // Check if the full_path exists and is a directory
+        if (name_index_lookup(file_index, full_path) != INDEX_DIR) {
+            // Print an error message if the directory doesn't exist
+            printf("ERROR: Server directory does not exist, expected : %s\n", full_path);
+            // Send an error message to the client
+            conn_reply(conn, DFS_OP_ERROR, "ERROR: Server directory does not exist!");
+            return;
+        }
+        // Archive the files of the type (".c") while they are sent, the first member is already looked up
+        struct tar_stream *tar = tar_stream_open(full_path, ext);
+        if (tar == NULL) {
+            printf("ERROR: Failed to create tarball for %s files.\n", ext);
+            conn_reply(conn, DFS_OP_ERROR, "ERROR: Tar file creation failed!");
+            return;
+        }
+        if (tar_stream_members(tar) == 0) {
+            // If no such files are found, inform the client
+            char message[64];
+            snprintf(message, sizeof(message), "ERROR: No %s files found!", ext);
+            printf("No %s files found.\n", ext);
+            tar_stream_close(tar);
+            conn_reply(conn, DFS_OP_ERROR, message);
+            return;
+        }
+        // A codec this build lacks falls back to an uncompressed archive, the name tells the client
+        if (!dfs_codec_supported(spec.codec)) {
+            printf("Codec %s is not supported, sending the archive uncompressed\n", dfs_codec_name(spec.codec));
+            spec.codec = DFS_CODEC_NONE;
+        }
+        if (spec.codec != DFS_CODEC_NONE) {
+            conn->tarz = tar_compress_create(tar, &spec, compressors, 1);
+            if (conn->tarz == NULL) {
+                tar_stream_close(tar);
+                conn_reply(conn, DFS_OP_ERROR, "ERROR: Tar file creation failed!");
+                return;
+            }
+            // Edge triggered: finished blocks are found by tar_compress_next(), one wake up per block is enough
+            conn->notify.fd = tar_compress_notify_fd(conn->tarz);
+            ev_watch_set(&conn->notify, EPOLLIN | EPOLLET);
+        }
+        char tar_name[64];
+        snprintf(tar_name, sizeof(tar_name), TAR_FILE_PATH "%s", ext + (ext[0] == '.'), dfs_codec_suffix(spec.codec));
+        out_buf_text(&conn->out, DFS_OP_NAME, conn->request_id, tar_name);
+        conn->tar = tar;
+        conn->state = CONN_SEND_TAR;
 
-    // Check if the response starts with the error prefix
-    if (strncmp(response_buffer, error_prefix, strlen(error_prefix)) != 0) {
-        // If the response doesn't start with the error prefix, close the connection
-        close(server_sock);
     } else {
-        // If the response starts with the error prefix, clear the buffer to indicate an error
-        response_buffer[0] = '\0';
-        close(server_sock);
+        // Print a message indicating that the file extension is not supported
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Invalid Extention Format!");
     }
 }
 
+// Function to start a merged dtar: for 'all' (backend ROUTE_NONE) the files Smain stores itself and
+// the archives of every backend server, else the archives of the files with suffix of the servers of
+// one sharded backend, sent as one archive called name
+void start_dtar_merge(struct client_conn *conn, const char *full_path, struct dfs_codec_spec *spec, int backend, const char *suffix, const char *name) {
+    conn->merge = malloc(sizeof(*conn->merge));
+    if (conn->merge == NULL) {
+        perror("Merge allocation failed");
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Tar file creation failed!");
+        return;
+    }
+    tar_merge_init(conn->merge);
 
-// Helper Function to create a tarball of .c files and send it to the client
-void c_tar_file(int client_sock, const char *path) {
-    // variables to hold the command for creating the tarball and the target path
-    char tar_cmd[BUFSIZE];
-    char target_path[BUFSIZE];
+    // Ask the servers first, they build their archives while Smain walks its own directory.
+    // They get no codec, the merged archive is compressed here as a whole; for 'all' they archive
+    // every suffix routed to them
+    char request[DFS_MAX_TEXT + 1];
+    for (int i = 0; i < routes->server_count; i++) {
+        struct route_server *server = &routes->servers[i];
+        // A retired server that holds no files any more is not asked
+        if ((backend != ROUTE_NONE && server->backend != backend) || server->drained) {
+            continue;
+        }
+        snprintf(request, sizeof(request), "%s\n%s", full_path, suffix != NULL ? suffix : routes->backends[server->backend].suffixes);
+        if (fanout_begin(conn, i, server->pool, server->name, DFS_OP_DTAR, request) < 0 ||
+            (conn->servers[i].source = tar_merge_add_server(conn->merge, server->name, conn->servers[i].watch.fd)) < 0) {
+            printf("Failed to connect to server\n");
+            finish_merge(conn);
+            conn_reply(conn, DFS_OP_ERROR, routes->backends[server->backend].unavailable);
+            return;
+        }
+    }
 
-    // Create the full path for the tarball file, which will be stored in the given path
-    snprintf(target_path,sizeof(target_path), "%s/%s",path,TAR_FILE_PATH);
+    // A missing ~/smain only means there are no local files
+    if (backend == ROUTE_NONE && routes->local_suffixes[0] != '\0' && name_index_lookup(file_index, full_path) == INDEX_DIR) {
+        struct tar_stream *tar = tar_stream_open(full_path, routes->local_suffixes);
+        if (tar == NULL || tar_merge_add_local(conn->merge, "Smain", tar) < 0) {
+            printf("ERROR: Failed to create tarball for %s files.\n", routes->local_suffixes);
+            finish_merge(conn);
+            conn_reply(conn, DFS_OP_ERROR, "ERROR: Tar file creation failed!");
+            return;
+        }
+    }
 
-    // Check for the presence of .c files first
-    snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*.c' -print -quit", path);
-    // Run the command to check for .c files and store the result
-    FILE *check = popen(tar_cmd, "r");
-    // If the check command fails, inform the client and exit the function
-    if (check == NULL) {
-        printf("ERROR: Failed to check for .c files.\n");
-        const char *error_message = "ERROR: Failed to check for .c files!";
-        send(client_sock, error_message, strlen(error_message), 0);
-        return;
+    // A codec this build lacks falls back to an uncompressed archive, the name tells the client
+    if (!dfs_codec_supported(spec->codec)) {
+        printf("Codec %s is not supported, sending the archive uncompressed\n", dfs_codec_name(spec->codec));
+        spec->codec = DFS_CODEC_NONE;
+    }
+    if (spec->codec != DFS_CODEC_NONE) {
+        conn->tarz = tar_compress_create(NULL, spec, compressors, 1);
+        if (conn->tarz == NULL) {
+            finish_merge(conn);
+            conn_reply(conn, DFS_OP_ERROR, "ERROR: Tar file creation failed!");
+            return;
+        }
+        conn->notify.fd = tar_compress_notify_fd(conn->tarz);
+        ev_watch_set(&conn->notify, EPOLLIN | EPOLLET);
     }
+    snprintf(conn->merge_name, sizeof(conn->merge_name), "%s%s", name, dfs_codec_suffix(spec->codec));
+    conn->state = CONN_SEND_ALL;
+}
 
-    // If no .c files are found, inform the client and exit the function
-    if (fgetc(check) == EOF) {
-        printf("No .c files found.\n");
-        const char *error_message = "ERROR: No .c files found!";
-        send(client_sock, error_message, strlen(error_message), 0);
-        pclose(check);
+// Function to handle 'display' command
+void handle_display(struct client_conn *conn, char *command) {
+    // variables to store the pathname, full path and the page that is asked for
+    char *pathname;
+    char *suffixes;  // a client names none, the servers are asked for the suffixes routed to them
+    char *cursor;
+    char full_path[BUFSIZE];
+
+    // Extract the pathname, page size and cursor from the command
+    if (dfs_parse_display(command, &pathname, &suffixes, &conn->display_limit, &cursor) < 0) {
+        pathname = "";
+    }
+    snprintf(conn->display_cursor, sizeof(conn->display_cursor), "%s", cursor);
+
+    // Replace ~ with the value of the HOME environment variable
+    if (expand_path(pathname, full_path, sizeof(full_path)) < 0) {
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Server configuration error!");
         return;
     }
-    // Close the check command as .c files were found
-    pclose(check);
-
-    // If .c files are found, create the tarball using the find command and tar command
-    snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*.c' -print0 | tar -cf %s --null -T - 2>/dev/null", path, target_path);
-    // Run the command to create the tarball
-    int result = system(tar_cmd);
-    // If the tarball creation fails, inform the client and exit the function
-    if (result != 0) {
-        printf("ERROR: Failed to create tarball for .c files.\n");
-        const char *error_message = "ERROR: Tar file creation failed!";
-        send(client_sock, error_message, strlen(error_message), 0);
+    // The servers get the same page: the first display_limit names after the cursor
+    if (name_page_init(&conn->local_page, conn->display_limit, conn->display_cursor) < 0) {
+        conn_reply(conn, DFS_OP_ERROR, "ERROR: Server configuration error!");
         return;
     }
+    char request[DFS_MAX_TEXT + 1];
 
-    // send tar filename to client
-    send(client_sock, TAR_FILE_PATH, strlen(TAR_FILE_PATH), 0);
+    // Step 1: Ask every backend for the files it stores with the suffixes routed to it (the Spdf server
+    // for the .pdf files, the Stext server for the .txt files), all at once
+    int asked = 0;
+    for (int i = 0; i < routes->server_count; i++) {
+        if (routes->servers[i].drained) {
+            continue;
+        }
+        snprintf(request, sizeof(request), "%s %s\n%zu\n%s", full_path, routes->backends[routes->servers[i].backend].suffixes,
+                 conn->display_limit, conn->display_cursor);
+        if (fanout_begin(conn, i, routes->servers[i].pool, routes->servers[i].name, DFS_OP_DISPLAY, request) < 0) {
+            // Print an error message if the connection failed, the list just lacks these files
+            printf("Failed to connect to server\n");
+            conn->servers[i].status = DISPLAY_UNAVAILABLE;
+        } else {
+            asked++;
+        }
+    }
+    // The servers get DISPLAY_DEADLINE_MS from now to answer
+    if (asked > 0) {
+        struct itimerspec deadline = {{0, 0}, {DISPLAY_DEADLINE_MS / 1000, (DISPLAY_DEADLINE_MS % 1000) * 1000000L}};
+        int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &deadline, NULL) < 0) {
+            perror("Display deadline timer failed");
+            if (timer_fd >= 0) {
+                close(timer_fd);
+            }
+            finish_display(conn);
+            conn_reply(conn, DFS_OP_ERROR, "ERROR: Server configuration error!");
+            return;
+        }
+        ev_watch_init(&conn->deadline, conn->client.loop, timer_fd, on_deadline_event);
+        ev_watch_set(&conn->deadline, EPOLLIN);
+    }
 
-    // Check if the tarball file was successfully created
-    if (access(target_path, F_OK) != 0) {
-        // Send rejction to the client
-        const char *success_message = "ERROR: Tar file creation failed!";
-        printf("%s\n",success_message);
-        send(client_sock, success_message, strlen(success_message), 0);
-        return;
+    // Step 2: Retrieve the list of the files routed to local (.c) from the local directory while the
+    // servers work on theirs, the index answers from memory
+    int found = name_index_list(file_index, full_path, routes->local_suffixes, &conn->local_page);
+    if (found == INDEX_MISSING) {
+        // If the path does not exist, it might still exist on the servers
+        printf("ERROR: Invalid path or not a directory in Smain!\n");
+    } else if (found != INDEX_DIR) {
+        // If the path exists but is not a directory, print an error
+        printf("ERROR: Not a directory in Smain!\n");
     }
+    name_page_sort(&conn->local_page);
 
-    // Open the tarball file to read its contents
-    FILE *tarball = fopen(target_path, "rb");
-    if (tarball == NULL) {
-        // If the tarball file cannot be opened
-        printf("ERROR: Failed to open tarball file.\n");
-        // Send rejction to the client
-        const char *success_message = "ERROR: Tar file creation failed!";
-        send(client_sock, success_message, strlen(success_message), 0);
-        return;
+    // Step 3: Merge the pages of the servers as they arrive
+    conn->state = CONN_DISPLAY;
+}
+
+// helper to replace a leading ~ with the value of the HOME environment variable
+int expand_path(const char *path, char *full_path, size_t size) {
+    if (path[0] != '~') {
+        snprintf(full_path, size, "%s", path);
+        return 0;
+    }
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return -1;
     }
+    snprintf(full_path, size, "%s%s", home_dir, path + 1);
+    return 0;
+}
 
-    // Declare a buffer to hold the file content as it is read
-    char file_buffer[1024];
-    size_t bytes_read;
-    // Read the tarball file and send its contents to the client
-    while ((bytes_read = fread(file_buffer, 1, sizeof(file_buffer), tarball)) > 0) {
-        // Send the read data to the client
-        ssize_t bytes_sent = send(client_sock, file_buffer, bytes_read, 0);
-        // If sending the data fails, inform the client and exit the function
-        if (bytes_sent < 0) {
-            perror("Failed to send tarball data");
-            // Send rejction to the client
-            const char *success_message = "ERROR: Tar file creation failed!";
-            send(client_sock, success_message, strlen(success_message), 0);
-            fclose(tarball);
+// helper Function to check if the path is valid
+int is_valid_path(const char *path) {
+    // Check if the path starts with "smain"
+    if (strncmp(path, "~/smain",7) != 0) {
+        return 0; // Invalid path
+    }
+    return 1; // Valid path
+}
+
+// Function to build the destination of an uploaded .c file and the temporary name it is written to,
+// creating its directory. Both buffers hold BUFSIZE bytes.
+int local_upload_paths(char *destination_path, char *f_name, char *final_path, char *temp_path) {
+    // Create the full path for the directory
+    char full_path[BUFSIZE];
+    if (expand_path(destination_path, full_path, sizeof(full_path)) < 0) {
+        return -1;
+    }
+
+    // Ensure the destination directory exists by creating it if necessary
+    if (dfs_make_dirs(full_path) < 0) {
+        perror("Directory creation failed");
+        return -1;
+    }
+
+    // Construct the full path for the file (path + file name) and its temporary name,
+    // unique per request now that one process serves every client
+    snprintf(final_path, BUFSIZE, "%s/%s", full_path, f_name);
+    snprintf(temp_path, BUFSIZE, "%s.part.%d.%lu", final_path, (int)getpid(), __sync_fetch_and_add(&temp_counter, 1));
+    return 0;
+}
+
+// Function to create the destination of an uploaded .c file.
+// Data is written to a temporary name and renamed once the END frame arrived,
+// so an interrupted upload never replaces an existing file with a truncated one
+int open_local_upload(struct client_conn *conn, char *destination_path, char *f_name) {
+    char final_path[BUFSIZE];
+    char temp_path[BUFSIZE];
+    if (local_upload_paths(destination_path, f_name, final_path, temp_path) < 0) {
+        return -1;
+    }
+
+    // Create the file at the specified path with read/write permissions, it is read back to hash it
+    conn->upload_fd = open(temp_path, O_CREAT | O_RDWR | O_TRUNC, 0777);
+    if (conn->upload_fd < 0) {
+        // Print an error message if file creation fails
+        perror("File creation failed");
+        return -1;
+    }
+    conn->upload_path = strdup(final_path);
+    conn->upload_temp = strdup(temp_path);
+    if (conn->upload_path == NULL || conn->upload_temp == NULL) {
+        close(conn->upload_fd);
+        unlink(temp_path);
+        conn->upload_fd = -1;
+        free(conn->upload_path);
+        free(conn->upload_temp);
+        conn->upload_path = conn->upload_temp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to put a stored .c file with the announced content at the destination without receiving it.
+// Returns 0 once the client has its reply, -1 if the content has to be sent.
+int link_local_upload(struct client_conn *conn, char *destination_path, char *f_name, uint64_t size, const unsigned char *digest) {
+    char final_path[BUFSIZE];
+    char temp_path[BUFSIZE];
+    if (local_upload_paths(destination_path, f_name, final_path, temp_path) < 0 ||
+        content_index_link(contents, digest, size, temp_path) < 0) {
+        return -1;
+    }
+    if (rename(temp_path, final_path) < 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    // rename() leaves both names when they are links of the same file, the file was uploaded over itself
+    unlink(temp_path);
+    name_index_update(file_index, final_path);
+
+    const char *success_message = "File Uploaded successfully.";
+    printf("Content already stored, linked to %s\n%s\n", final_path, success_message);
+    conn_reply(conn, DFS_OP_OK, success_message);
+    return 0;
+}
+
+// Function to ask for the content of an announced .c upload, the upload is in CONN_UPLOAD. When it
+// replaces a file large enough, the compressors sign that file and the upload is rebuilt from a
+// delta against it (see local_content_signed()), otherwise CONTINUE is queued
+void ask_local_content(struct client_conn *conn, uint64_t size, const unsigned char *digest) {
+    struct stat st;
+    conn->upload_size = size;
+    memcpy(conn->upload_digest, digest, SHA256_SIZE);
+    conn->upload_base_fd = open(conn->upload_path, O_RDONLY);
+    if (conn->upload_base_fd >= 0 && fstat(conn->upload_base_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (uint64_t)st.st_size >= DELTA_MIN_SIZE) {
+        conn->upload_base_size = (uint64_t)st.st_size;
+        if (local_job_start(conn, LOCAL_SIGN) == 0) {
             return;
         }
     }
+    release_local_base(conn);
+    out_buf_text(&conn->out, DFS_OP_CONTINUE, conn->request_id, "");
+}
 
-    // Send an end-of-file marker to signal the end of the file content
-    const char *end_marker = "END_CMD";
-    send(client_sock, end_marker, strlen(end_marker), 0);
-    // Close the tarball file after sending its contents
-    fclose(tarball);
-    printf("Tarball sent to client.\n");
+// Function to ask for a delta against the file an upload replaces once the compressors signed it
+// (DELTA with the signatures), or for the whole content if that failed (CONTINUE). The delta stream
+// is relayed into an unlinked file next to the upload, the compressors apply it once it is complete
+void local_content_signed(struct client_conn *conn, const struct local_job *sign) {
+    char delta_path[BUFSIZE];
+    snprintf(delta_path, sizeof(delta_path), "%s.delta", conn->upload_temp);
+    if (!sign->failed) {
+        conn->upload_delta_fd = open(delta_path, O_CREAT | O_RDWR | O_TRUNC, 0600);
+        if (conn->upload_delta_fd >= 0) {
+            unlink(delta_path);
+        }
+    }
+    if (conn->upload_delta_fd < 0 ||
+        out_buf_frame(&conn->out, DFS_OP_DELTA, conn->request_id, sign->signatures, sign->signatures_len) < 0) {
+        release_local_base(conn);
+        out_buf_text(&conn->out, DFS_OP_CONTINUE, conn->request_id, "");
+    } else {
+        printf("Asking for a delta against %s (%zu bytes of signatures)\n", conn->upload_path, sign->signatures_len);
+        frame_relay_init(&conn->relay, conn->client.fd, conn->upload_delta_fd, 1, RELAY_UPLOAD, conn->request_id);
+    }
+    conn->state = CONN_UPLOAD;
 }
 
-// Function to request a tarball file from a server and forward it to the client
-void request_tar_file(int server_sock, int client_sock, char *path){
-    // Construct the message to send to the server, including the command and server path
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "dtar %s", path);
+// Function to release the old version of a file once its upload is over, after the rename closing it
+// frees its blocks
+void release_local_base(struct client_conn *conn) {
+    if (conn->upload_delta_fd >= 0) {
+        close(conn->upload_delta_fd);
+        conn->upload_delta_fd = -1;
+    }
+    if (conn->upload_base_fd >= 0) {
+        close_local_file(conn->upload_base_fd);
+        conn->upload_base_fd = -1;
+    }
+}
 
-    // Send the message to the server
-    printf("Sending tar file download request to server\n");
-    if (send(server_sock, message, strlen(message), 0) == -1) {
-        // Print an error message if sending fails
-        perror("send");
-        return;
+// Function to close a file of a local upload on the compressors. The last descriptor of a file that
+// lost its name frees all of its blocks, and ext4 starts writing out a file renamed over another one
+// when its last descriptor is closed
+void close_local_file(int fd) {
+    if (worker_pool_submit(compressors, run_close_local_file, (void *)(intptr_t)fd) < 0) {
+        close(fd);
     }
+}
 
-    // Receive the file name from the server
-    char file_name[256];
-    ssize_t bytes_received = recv(server_sock, file_name, sizeof(file_name) - 1, 0);
-    // If receiving the file name fails, print an error message and exit
-    if (bytes_received <= 0) {
-        // Print an error message if receiving the file name fails
-        perror("Error receiving file name");
-        return;
+// Function run on a compressor: close_local_file(), arg is the descriptor
+void run_close_local_file(void *arg) {
+    close((int)(intptr_t)arg);
+}
+
+// helper to read a part of the old version of a file, ctx is its descriptor
+int read_local_base(void *ctx, void *buf, size_t len, uint64_t offset) {
+    int fd = *(int *)ctx;
+    char *out = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, out, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        out += n;
+        offset += (uint64_t)n;
+        len -= (size_t)n;
     }
-    // Null-terminate the received file name string
-    file_name[bytes_received] = '\0'; 
-
-    //send the file name to the client
-    if (send(client_sock, file_name, strlen(file_name), 0) == -1) {
-        // Print an error message if sending the file name to the client fails
-        perror("send");
-    }
-
-    // buffer to hold the file content received from the server
-    char buffer_data[BUFSIZE];
-    ssize_t content_received;
-    // Keep receiving file content from the server and forward it to the client
-    while ((content_received = recv(server_sock, buffer_data, sizeof(buffer_data), 0)) > 0) {
-        // Send the received content to the client
-        ssize_t bytes_sent = send(client_sock, buffer_data, content_received, 0);
-        // If sending the content fails, print an error message and exit
-        if (bytes_sent < 0) {
-            // Print an error message if forwarding fails
-            perror("send");
-            break;
+    return 0;
+}
+
+// helper to write rebuilt content to the temporary file of an upload, ctx is its descriptor
+int write_local_upload(void *ctx, const void *data, size_t len) {
+    int fd = *(int *)ctx;
+    const char *in = data;
+    while (len > 0) {
+        ssize_t n = write(fd, in, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("File write failed");
+            return -1;
         }
+        in += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Function to delete a file and handle errors
+int delete_file(const char *file_path) {
+    // new file path creation to replace ~
+    char full_path[BUFSIZE];
+    if (expand_path(file_path, full_path, sizeof(full_path)) < 0) {
+        return -1;
+    }
+
+    // check if file exist or not
+    if (name_index_lookup(file_index, full_path) == INDEX_MISSING) {
+        return 2;
+    }
 
-        // Check for the end marker in the buffer_data to detect the end of the file content
-        if (content_received < BUFSIZE) {
-            if (memcmp(buffer_data + content_received - strlen(CMD_END_MARKER), CMD_END_MARKER, strlen(CMD_END_MARKER)) == 0) {
-                // Break the loop if the end of the content is reached
+    // delete the file at the specified path
+    if (unlink(full_path) == 0) {
+        name_index_update(file_index, full_path);
+        return 0;
+    } else {
+        // Handle different errors that could occur during file deletion
+        switch (errno) {
+            case EACCES:
+                fprintf(stderr, "Permission denied: %s\n", full_path);
                 break;
-            }
+            case ENOENT:
+                fprintf(stderr, "File does not exist: %s\n", full_path);
+                break;
+            case EISDIR:
+                fprintf(stderr, "Path is a directory, not a file: %s\n", full_path);
+                break;
+            default:
+                fprintf(stderr, "Failed to delete file %s: %s\n", full_path, strerror(errno));
         }
+        return -1;
     }
-    // If receiving the content fails, print an error message
-    if (content_received < 0) {
-        // Print an error message if there was an issue receiving the file content
-        perror("Error receiving file content");
-    }else{
-        // Print a message indicating that the file was successfully received and forwarded to the client
-        printf("'%s' received and send to client.\n",file_name);
+}
+
+// helper to add records of a server's page for display, a page holds at most MAX_LISTING bytes
+int records_append(struct fanout_server *server, const char *text, size_t len) {
+    if (server->records_len + len > MAX_LISTING) {
+        printf("File list of %s server is too large\n", server->name);
+        return -1;
     }
-}
\ No newline at end of file
+    char *grown = realloc(server->records, server->records_len + len + 1);
+    if (grown == NULL) {
+        perror("File list allocation failed");
+        return -1;
+    }
+    memcpy(grown + server->records_len, text, len);
+    server->records = grown;
+    server->records_len += len;
+    server->records[server->records_len] = '\0';
+    return 0;
+}
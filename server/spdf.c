@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -10,103 +11,182 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <dirent.h>
-#include <sys/wait.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+#include "../common/dfs_proto.h"
+#include "../common/tar_stream.h"
+#include "../common/dfs_codec.h"
+#include "../common/name_page.h"
+#include "../common/dfs_delta.h"
+#include "../common/dfs_range.h"
+#include "../common/dfs_dirs.h"
+#include "worker_pool.h"
+#include "tar_compress.h"
+#include "name_index.h"
+#include "path_feed.h"
+#include "chunk_store.h"
+#include "content_index.h"
 
 // Define constants for the port number and buffer size
 #define PORT 8081
 #define BUFSIZE 102400
-#define CMD_END_MARKER "END_CMD"
 #define TAR_FILE_PATH "pdf_files.tar"
+// Suffixes of the files archived and listed when a request of Smain names none
+#define DEFAULT_SUFFIXES ".pdf"
+
+// Connections reported ready per epoll_wait() call of the dispatcher
+#define EVENT_BATCH 64
+
+// Connections waiting for their next request, and the workers that serve the requests
+static int epoll_fd = -1;
+static struct worker_pool *workers;
+// Threads compressing dtar archives, shared by all requests
+static struct worker_pool *compressors;
+
+// The tree the files are stored in: ~/spdf, or the one DFS_ROOT names for one server of a sharded Spdf
+static char root[BUFSIZE];
+// What is stored under ~/spdf, kept in memory for display and the "File not found" answers
+static struct name_index *file_index;
+// Smain's path filters of the tree: they get its Bloom filter, then the paths created by other means
+static struct path_feed *feed;
+// Chunks of the uploads when they are deduplicated (DFS_CHUNK_STORE=1), the files are their manifests then
+static struct chunk_store *chunks;
+// Stored files by content, an upload that announces content found here is linked instead of sent
+static struct content_index *contents;
+
+// Old version of a file an upload replaces, which the delta of the upload refers to
+struct delta_base {
+    int fd;
+    struct chunk_content *content;
+    struct dfs_delta_apply *apply;   // NULL when the content is sent whole
+};
+
+// Counter that keeps temporary file names of concurrent requests apart
+static unsigned long temp_counter;
 
 // Function prototypes
-void handle_client(int client_sock);
+void serve_request(void *arg);
+int watch_connection(int client_sock, int op);
 char* create_pdf_path(const char *destination_path);
 int delete_file(const char *file_path);
-void handle_ufile(int client_sock, char *command, char *file_data);
-void handle_dfile(int client_sock, char *command);
-void handle_rmfile(int client_sock, char *command);
-void handle_dtar(int client_sock, char *command);
-void handle_display(int client_sock, char *command);
-void send_file_back_to_smain(int smain_sock, const char *file_path, const char *file_name);
-void pdf_tar_file(int client_sock, const char *path);
-
-// This function handles communication with a connected client (Smain)
-void handle_client(int client_sock) {
-    // Buffer to store data received from the client
-    char buffer[BUFSIZE];
-    // Variable to hold the number of bytes received
-    ssize_t bytes_received;
-    // Pointer to store the command part of the message
-    char *command;
-    // Pointer to store the file data part of the message
-    char *file_data;
-
-    // Receive the combined message (command and possibly file data) from the client(Smain)
-    bytes_received = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0'; // Null-terminate the received data
-
+void handle_ufile(int client_sock, uint32_t request_id, char *command);
+void refuse_upload(int client_sock, uint32_t request_id, int announced, const char *message);
+int link_stored_content(const char *file_path, const char *temp_path, uint64_t size, const unsigned char *digest);
+int ask_for_content(int client_sock, uint32_t request_id, const char *file_path, struct delta_base *base);
+void release_delta_base(struct delta_base *base);
+void handle_dfile(int client_sock, uint32_t request_id, char *command);
+void handle_rmfile(int client_sock, uint32_t request_id, char *command);
+void handle_dtar(int client_sock, uint32_t request_id, char *command);
+void handle_display(int client_sock, uint32_t request_id, char *command);
+void handle_list(int client_sock, uint32_t request_id);
+void send_file_back_to_smain(int smain_sock, uint32_t request_id, const char *file_path, const char *file_name, struct dfs_range *range);
+void pdf_tar_file(int client_sock, uint32_t request_id, const char *path, const char *suffixes, const struct dfs_codec_spec *spec);
+
+// This function serves one request of a connected client (Smain), it runs as a task on a worker thread.
+// Smain keeps its connections open in a pool, so a connection carries one request after another;
+// in between it waits in the epoll set of main() instead of holding a worker.
+// Every handler leaves the connection at a frame boundary.
+void serve_request(void *arg) {
+    int client_sock = (int)(intptr_t)arg;
+    // Buffer to store the command part of the message
+    char buffer[DFS_MAX_TEXT + 1];
+    // Header of the request frame
+    struct dfs_hdr hdr;
+
+    // Receive the request frame (command and arguments) from the client(Smain)
+    if (dfs_recv_hdr(client_sock, &hdr) == 0 && dfs_recv_text(client_sock, &hdr, buffer, sizeof(buffer)) == 0) {
         // Determine which command was sent by the client and handle it accordingly
-        if (strncmp(buffer, "ufile", 5) == 0) {
-            // Locate the newline character that separates the command from the file data
-            char *delimiter = strstr(buffer, "\n");
-            if (delimiter == NULL) {
-                printf("Invalid message format\n");
-                return;
-            }
-            // Null-terminate the command
-            *delimiter = '\0';
-            // Extract the file data
-            file_data = delimiter + 1;
+        if (hdr.opcode == DFS_OP_UFILE) {
             // Handle the 'ufile' command, which uploads a file
             printf("File Upload request\n");
-            handle_ufile(client_sock, buffer, file_data);
+            handle_ufile(client_sock, hdr.request_id, buffer);
 
-        } else if (strncmp(buffer, "dfile", 5) == 0) {
+        } else if (hdr.opcode == DFS_OP_DFILE) {
             // Handle the 'dfile' command, which downloads a file
             printf("File download request\n");
-            handle_dfile(client_sock, buffer);
-        } else if (strncmp(buffer, "rmfile", 6) == 0) {
+            handle_dfile(client_sock, hdr.request_id, buffer);
+        } else if (hdr.opcode == DFS_OP_RMFILE) {
             // Handle the 'rmfile' command, which removes a file
             printf("File remove request\n");
-            handle_rmfile(client_sock, buffer);
-        } else if (strncmp(buffer, "dtar", 4) == 0) {
+            handle_rmfile(client_sock, hdr.request_id, buffer);
+        } else if (hdr.opcode == DFS_OP_DTAR) {
             // Handle the 'dtar' command, which download file of given extension to Tar
             printf("TarFile download request\n");
-            handle_dtar(client_sock, buffer);
-        } else if (strncmp(buffer, "display", 7) == 0) {
+            handle_dtar(client_sock, hdr.request_id, buffer);
+        } else if (hdr.opcode == DFS_OP_DISPLAY) {
             // Handle the 'display' command, which shows files in a directory
             printf("Display Files request\n");
-            handle_display(client_sock, buffer);
+            handle_display(client_sock, hdr.request_id, buffer);
+        } else if (hdr.opcode == DFS_OP_FILTER) {
+            // Smain asks which paths are stored, to answer requests for others itself
+            printf("Path filter request\n");
+            if (path_feed_follow(feed, client_sock, hdr.request_id) == 1) {
+                // The connection now carries the paths stored later, it takes no more requests
+                return;
+            }
+        } else if (hdr.opcode == DFS_OP_LIST) {
+            // Smain's rebalancer asks which files are stored, to move the ones another server owns
+            printf("File list request\n");
+            handle_list(client_sock, hdr.request_id);
         } else {
             // If the command is unknown, print an error message
-            printf("Unknown command: %s\n", buffer);
+            printf("Unknown command: %s\n", dfs_opcode_name(hdr.opcode));
+            dfs_send_text(client_sock, DFS_OP_ERROR, hdr.request_id, "ERROR: Unknown command!");
         }
-    } else {
-        // Handle the case where no data is received or an error occurred
-        if (bytes_received == 0) {
-            printf("Connection closed by peer\n");
-        } else {
-            perror("Receive command failed");
+        // Wait for the next request on this connection
+        if (watch_connection(client_sock, EPOLL_CTL_MOD) == 0) {
+            return;
         }
+    } else {
+        // Smain closed the connection or an error occurred
+        printf("Connection closed by peer\n");
+        worker_pool_print_stats(workers);
     }
 
-    // Close the connection with the client after handling the command
+    // Close the connection with the client after its last command
     close(client_sock);
 }
 
+// helper to (re)arm a connection in the epoll set, it is reported once when its next request arrives
+int watch_connection(int client_sock, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    // One shot: the connection is handed to a single worker and ignored until that worker re-arms it
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = client_sock;
+    if (epoll_ctl(epoll_fd, op, client_sock, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return -1;
+    }
+    return 0;
+}
+
 // This function handles the 'ufile' command to upload a file to the server
-void handle_ufile(int client_sock, char *command, char *file_data) {
+// The file content follows the command as a DATA stream which is written to disk as it arrives.
+// A command that announces the size and hash of the content ("<path> <size> <hash>") only gets
+// the stream after a CONTINUE reply, when no stored file has that content; a stored file with it
+// is linked to the destination instead. When the upload replaces a large file, the reply is DELTA
+// with the signatures of that file, and the stream is a delta against it
+void handle_ufile(int client_sock, uint32_t request_id, char *command) {
     // Buffer to store the destination file path
     char destination_path[1024];
     // File descriptor for the file being created
     int file_fd;
+    // Size and hash of the content when the command announces them
+    uint64_t size = 0;
+    unsigned char digest[SHA256_SIZE];
 
     // Extract the destination path from the 'ufile' command and check for error and send that error to Smain(client)
-    int parsed = sscanf(command, "ufile %s", destination_path);
-    if (parsed < 1) {
+    int end = 0;
+    int parsed = sscanf(command, "%1023s%n", destination_path, &end);
+    while (parsed == 1 && command[end] == ' ') {
+        end++;
+    }
+    int announced = parsed == 1 && command[end] != '\0';
+    if (parsed < 1 || (announced && content_index_parse(command + end, &size, digest) < 0)) {
         printf("Command parsing failed\n");
-        send(client_sock, "File upload failed", 18, 0);
+        refuse_upload(client_sock, request_id, announced, "File upload failed");
         return;
     }
 
@@ -118,12 +198,10 @@ void handle_ufile(int client_sock, char *command, char *file_data) {
         if (last_slash != NULL) {   
             // Temporarily remove the last part of the path
             *last_slash = '\0';
-            char command_buf[BUFSIZE];
             // Create the directory if it does not exist, if fails print it and send error to client(Smain)
-            snprintf(command_buf, sizeof(command_buf), "mkdir -p %s", new_file_path);
-            if (system(command_buf) != 0) {
+            if (dfs_make_dirs(new_file_path) < 0) {
                 perror("Directory creation failed");
-                send(client_sock, "File upload failed", 18, 0);
+                refuse_upload(client_sock, request_id, announced, "File upload failed");
                 free(new_file_path);
                 return;
             }
@@ -131,32 +209,104 @@ void handle_ufile(int client_sock, char *command, char *file_data) {
             *last_slash = '/';  
         }
 
+        // An upload that replaces a file may leave chunks of the old one unused
+        int replaced = name_index_lookup(file_index, new_file_path) != INDEX_MISSING;
+
+        // Write to a temporary name first and rename it into place once the whole stream arrived
+        char temp_path[BUFSIZE];
+        snprintf(temp_path, sizeof(temp_path), "%s.part.%d.%lu", new_file_path, (int)getpid(), __sync_fetch_and_add(&temp_counter, 1));
+
+        // Content that is stored already is linked to the destination, nothing is transferred
+        if (announced && link_stored_content(new_file_path, temp_path, size, digest) == 0) {
+            name_index_update(file_index, new_file_path);
+            if (replaced) {
+                chunk_store_released(chunks);
+            }
+            const char *linked_message = "File Uploaded successfully.";
+            printf("Content already stored, linked to %s\n%s\n", new_file_path, linked_message);
+            dfs_send_text(client_sock, DFS_OP_OK, request_id, linked_message);
+            free(new_file_path);
+            return;
+        }
+
         // Create the file for writing, if error encounter print and send it to the Smain(Client)
-        file_fd = open(new_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        file_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
         if (file_fd < 0) {
             perror("File creation failed");
-            send(client_sock, "File upload failed", 18, 0);
+            refuse_upload(client_sock, request_id, announced, "File upload failed");
+            free(new_file_path);
+            return;
+        }
+        // The content is needed, ask for it
+        struct delta_base base = {-1, NULL, NULL};
+        if (announced && ask_for_content(client_sock, request_id, new_file_path, &base) < 0) {
+            release_delta_base(&base);
             close(file_fd);
+            unlink(temp_path);
             free(new_file_path);
             return;
         }
 
-        // Write the file data to the file, if error encounter print and send it to the Smain(Client)
-        ssize_t file_data_len = strlen(file_data);
-        if (write(file_fd, file_data, file_data_len) < 0) {
+        // Write the file data to the file chunk by chunk, if error encounter print and send it to the Smain(Client).
+        // With the chunk store only the chunks not stored yet are written, and the file gets their manifest
+        // An announced upload is hashed on its way, the index gets the hash of what really arrived.
+        // A delta is rebuilt into the same place, and must give the content that was announced
+        struct chunk_writer *writer;
+        struct sha256 hash;
+        unsigned char received_digest[SHA256_SIZE];
+        if (announced) {
+            sha256_init(&hash);
+        }
+        int received = chunk_store_recv_file(chunks, client_sock, file_fd, announced ? &hash : NULL, base.apply, &writer);
+        if (announced) {
+            sha256_final(&hash, received_digest);
+        }
+        if (base.apply != NULL && received == 0) {
+            struct dfs_delta_stats stats;
+            dfs_delta_apply_finish(base.apply, &stats);
+            printf("Delta upload: %llu bytes received, %llu bytes reused from the old file\n",
+                   (unsigned long long)stats.encoded, (unsigned long long)stats.copied);
+            if (hash.total != size || memcmp(received_digest, digest, SHA256_SIZE) != 0) {
+                printf("Rebuilt file does not match the announced hash\n");
+                received = -1;
+            }
+        }
+        release_delta_base(&base);
+        int chunked = writer != NULL;
+        if (received != 0 || rename(temp_path, new_file_path) != 0) {
             perror("File write failed");
-            send(client_sock, "File upload failed", 18, 0);
             close(file_fd);
+            unlink(temp_path);
+            // Chunks stored for it are not used by any file
+            chunk_writer_free(writer);
+            if (chunked) {
+                chunk_store_released(chunks);
+            }
+            dfs_send_text(client_sock, DFS_OP_ERROR, request_id, "File upload failed");
             free(new_file_path);
+            return;
         }
 
+        name_index_update(file_index, new_file_path);
+        // Later uploads of the same content are linked to this file
+        if (announced) {
+            content_index_add(contents, received_digest, hash.total, file_fd, new_file_path);
+        }
         // Close the file after writing the data
         close(file_fd);
+        // The manifest is in place, it keeps its chunks from now on
+        chunk_writer_free(writer);
+        if (replaced) {
+            chunk_store_released(chunks);
+        }
+        if (chunked) {
+            chunk_store_print_stats(chunks);
+        }
 
         // Send confirmation to the client
         const char *success_message = "File Uploaded successfully.";
         printf("Sending responce to Smain.\n%s\n",success_message);
-        send(client_sock, success_message, strlen(success_message), 0);
+        dfs_send_text(client_sock, DFS_OP_OK, request_id, success_message);
 
         // Free the memory allocated for the new file path
         free(new_file_path);
@@ -164,31 +314,96 @@ void handle_ufile(int client_sock, char *command, char *file_data) {
         // Send an error message to the client if file uploading faile
         const char *failed_message = "File uploading failed!";
         printf("%s\n",failed_message);
-        send(client_sock, failed_message, strlen(failed_message), 0);
+        refuse_upload(client_sock, request_id, announced, failed_message);
+    }
+}
+
+// helper to answer an upload that can not be stored. Its content is consumed first, so the
+// connection stays in sync, unless the command only announced it
+void refuse_upload(int client_sock, uint32_t request_id, int announced, const char *message) {
+    if (!announced) {
+        dfs_recv_stream(client_sock, -1, NULL, NULL, 0);
     }
+    dfs_send_text(client_sock, DFS_OP_ERROR, request_id, message);
+}
+
+// Function to ask for the content of an announced upload to file_path. When that replaces a file
+// large enough, its signatures are sent (DELTA) and base is set up to rebuild the upload from a
+// delta; otherwise the reply is CONTINUE and base->apply stays NULL. Returns -1 if sending failed.
+int ask_for_content(int client_sock, uint32_t request_id, const char *file_path, struct delta_base *base) {
+    uint64_t size = 0;
+    unsigned char *signatures = NULL;
+    size_t signatures_len = 0;
+    if (name_index_lookup(file_index, file_path) == INDEX_FILE && (base->fd = open(file_path, O_RDONLY)) >= 0) {
+        // The chunks of a manifest stay pinned while the delta refers to them
+        base->content = chunk_store_content_open(chunks, base->fd, &size);
+    }
+    if (base->content != NULL && size >= DELTA_MIN_SIZE &&
+        dfs_delta_sign(chunk_store_content_read, base->content, size, &signatures, &signatures_len) == 0) {
+        base->apply = dfs_delta_apply_new(size, chunk_store_content_read, base->content);
+    }
+    if (base->apply == NULL) {
+        free(signatures);
+        release_delta_base(base);
+        return dfs_send_text(client_sock, DFS_OP_CONTINUE, request_id, "");
+    }
+    printf("Asking for a delta against %s (%zu bytes of signatures)\n", file_path, signatures_len);
+    int result = dfs_send_frame(client_sock, DFS_OP_DELTA, request_id, signatures, signatures_len);
+    free(signatures);
+    return result;
+}
+
+// helper to release the old version of a file once the upload is over
+void release_delta_base(struct delta_base *base) {
+    dfs_delta_apply_free(base->apply);
+    chunk_store_content_close(base->content);
+    if (base->fd >= 0) {
+        close(base->fd);
+    }
+    base->apply = NULL;
+    base->content = NULL;
+    base->fd = -1;
+}
+
+// Function to put a stored file with the announced content at file_path without receiving it,
+// through temp_path. Returns 0 if it is in place and -1 if the content has to be sent.
+int link_stored_content(const char *file_path, const char *temp_path, uint64_t size, const unsigned char *digest) {
+    if (content_index_link(contents, digest, size, temp_path) < 0) {
+        return -1;
+    }
+    // The chunks of a manifest are kept until the new name is in place, and must all be there
+    struct chunk_writer *writer = NULL;
+    int fd = open(temp_path, O_RDONLY);
+    if (fd < 0 || chunk_store_hold_file(chunks, fd, &writer) < 0 || rename(temp_path, file_path) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        chunk_writer_free(writer);
+        unlink(temp_path);
+        return -1;
+    }
+    close(fd);
+    // rename() leaves both names when they are links of the same file, the file was uploaded over itself
+    unlink(temp_path);
+    chunk_writer_free(writer);
+    return 0;
 }
 
 
 // function to handle the 'dfile' command, which would download a file from the server
-void handle_dfile(int client_sock, char *command) {
+void handle_dfile(int client_sock, uint32_t request_id, char *command) {
     // Buffer to store the file path
     char file_path[1024];
-    // Buffer to store data for transmission
-    char buffer[BUFSIZE];
-    // File descriptor for the file being read
-    int file_fd;
-    // Variable to store the number of bytes read
-    ssize_t bytes_read;
-
-    // Ensure command string is properly null-terminated
-    command[strcspn(command, "\r\n")] = '\0';
 
-    // Extract the file path from the command
-    if (sscanf(command, "dfile %s", file_path) != 1) {
+    // Extract the file path from the command, and the part of the file it may ask for
+    int end = 0;
+    struct dfs_range range;
+    int ranged = 0;
+    if (sscanf(command, "%1023s%n", file_path, &end) != 1 || (ranged = dfs_range_parse(command + end, &range)) < 0) {
         printf("Command parsing failed!\n");
         // Send rejction to the client
         const char *success_message = "ERROR: Command parsing failed!";
-        send(client_sock, success_message, strlen(success_message), 0);
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, success_message);
         return;
     }
 
@@ -198,30 +413,22 @@ void handle_dfile(int client_sock, char *command) {
     // Extract the file name from the full file path
     char *file_name = strrchr(file_path, '/') + 1;
 
-    // Send the requested file back to the client
-    send_file_back_to_smain(client_sock, new_file_path, file_name);
+    // Send the requested file (or its part) back to the client
+    send_file_back_to_smain(client_sock, request_id, new_file_path, file_name, ranged ? &range : NULL);
 
     // Free the memory allocated for the new file path
     free(new_file_path);
 }
 
 // function to handle the 'rmfile' command, which would remove a file from the server
-void handle_rmfile(int client_sock, char *command) {
+void handle_rmfile(int client_sock, uint32_t request_id, char *command) {
     // Buffer to store the file path
     char file_path[1024];
-    // Buffer to store data for transmission
-    char buffer[BUFSIZE];
-    // File descriptor for the file being read
-    int file_fd;
-    // Variable to store the number of bytes read
-    ssize_t bytes_read;
-
-    // Ensure command string is properly null-terminated
-    command[strcspn(command, "\r\n")] = '\0';
 
     // Extract the file path from the 'rmfile' command, and print error if any
-    if (sscanf(command, "rmfile %s", file_path) != 1) {
+    if (sscanf(command, "%1023s", file_path) != 1) {
         printf("Command parsing failed\n");
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, "ERROR: Command parsing failed!");
         return;
     }
 
@@ -229,11 +436,12 @@ void handle_rmfile(int client_sock, char *command) {
     char *new_file_path = create_pdf_path(file_path);
     if(new_file_path != NULL){
         // check if file exist or not
-        if (access(new_file_path, F_OK) == -1) {
+        if (name_index_lookup(file_index, new_file_path) == INDEX_MISSING) {
             // Send rejction to the client
             const char *success_message = "File not found!";
             printf("%s\n",success_message);
-            send(client_sock, success_message, strlen(success_message), 0);
+            dfs_send_text(client_sock, DFS_OP_ERROR, request_id, success_message);
+            free(new_file_path);
             return;
         }
 
@@ -242,107 +450,207 @@ void handle_rmfile(int client_sock, char *command) {
             // Send rejction to the client
             const char *success_message = "File remove Failed!";
             printf("%s\n",success_message);
-            send(client_sock, success_message, strlen(success_message), 0);
+            dfs_send_text(client_sock, DFS_OP_ERROR, request_id, success_message);
         }else{
             // Send confirmation to the client
             const char *success_message = "File has been removed!";
             printf("%s\n",success_message);
-            send(client_sock, success_message, strlen(success_message), 0);
+            dfs_send_text(client_sock, DFS_OP_OK, request_id, success_message);
         }
+        free(new_file_path);
     }else{
         // Send rejction to the client
         const char *success_message = "ERROR: File remove Failed!";
         printf("%s\n",success_message);
-        send(client_sock, success_message, strlen(success_message), 0);
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, success_message);
     }
 }
 
 // Function to handle the 'dtar' command from the client(Smain)
-void handle_dtar(int client_sock, char *command) {
+void handle_dtar(int client_sock, uint32_t request_id, char *command) {
     char path[BUFSIZE];
-    // Extract the file path from the command using sscanf
-    sscanf(command, "dtar %s", path);
+    char codec[32];
+    // The suffixes of the files to archive are on the second line
+    char *suffixes = strchr(command, '\n');
+    if (suffixes != NULL) {
+        *suffixes++ = '\0';
+    }
+    if (suffixes == NULL || suffixes[strspn(suffixes, " ")] == '\0') {
+        suffixes = DEFAULT_SUFFIXES;
+    }
+    // Extract the file path and the optional compression codec from the command using sscanf
+    int parsed = sscanf(command, "%1023s %31s", path, codec);
+    if (parsed < 1) {
+        path[0] = '\0';
+    }
+
+    // Without a codec, or one this server was built without, the archive is sent uncompressed;
+    // the name of the reply tells Smain and the client which codec was used
+    struct dfs_codec_spec spec = {DFS_CODEC_NONE, 0};
+    if (parsed == 2 && dfs_codec_parse(codec, &spec) < 0) {
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, "ERROR: Invalid compression codec!");
+        return;
+    }
+    if (!dfs_codec_supported(spec.codec)) {
+        printf("Codec %s is not supported, sending the archive uncompressed\n", dfs_codec_name(spec.codec));
+        spec.codec = DFS_CODEC_NONE;
+    }
 
     // Create a new file path by modifying the file path(Replace smain with spdf)
     char *new_file_path = create_pdf_path(path);
 
     // Check if the full_path exists and is a directory
-    struct stat path_stat;
-    if (stat(new_file_path, &path_stat) != 0 || !S_ISDIR(path_stat.st_mode)) {
+    if (name_index_lookup(file_index, new_file_path) != INDEX_DIR) {
         // If the path doesn't exist or isn't a directory, inform the client(Smain) and exit the function
         printf("ERROR: Server directory does not exist, expected : %s\n", new_file_path);
         const char *error_message = "ERROR: Server directory does not exist!";
-        send(client_sock, error_message, strlen(error_message), 0);
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, error_message);
+        free(new_file_path);
         return;
     }
-    // If the path is valid, create a tarball of .pdf files and send it to the client(Smain)
-    pdf_tar_file(client_sock,new_file_path);
+    // If the path is valid, create a tarball of the files and send it to the client(Smain)
+    pdf_tar_file(client_sock, request_id, new_file_path, suffixes, &spec);
+    free(new_file_path);
 }
 
 // function to handle the 'display' command
-void handle_display(int client_sock, char *command) {
-    // Buffer to store the directory path
-    char dir_path[1024];
-    // Structure to store information about the directory
-    struct stat path_stat;
-
-    // Ensure command string is properly null-terminated
-    command[strcspn(command, "\r\n")] = '\0';
-
+void handle_display(int client_sock, uint32_t request_id, char *command) {
+    // The directory path, the suffixes of the files to list, the size of the page and the name it starts after
+    char *dir_path;
+    char *suffixes;
+    size_t limit;
+    char *cursor;
     // Extract the file path from the 'display' command, and print error if any
-    if (sscanf(command, "display %s", dir_path) != 1) {
+    if (dfs_parse_display(command, &dir_path, &suffixes, &limit, &cursor) < 0) {
         printf("Command parsing failed\n");
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, "ERROR: Command parsing failed!");
         return;
     }
 
     // Create a new file path by modifying the file path(Replace smain with spdf)
     char *new_dir_path = create_pdf_path(dir_path);
 
-    // Check if the given path is a valid (Exist)
-    if (stat(new_dir_path, &path_stat) != 0) {
-        // Error in stat, path might not exist
-        const char *error_message = "ERROR: Invalid path or not a directory!";
-        send(client_sock, error_message, strlen(error_message), 0);
+    // Keep the first names after the cursor in sort order, only one page is held in memory
+    struct name_page page;
+    if (name_page_init(&page, limit, cursor) < 0) {
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, "ERROR: Listing failed!");
+        free(new_dir_path);
+        return;
+    }
+    // Find the files with the suffixes in the directory, the index answers from memory
+    if (suffixes[strspn(suffixes, " ")] == '\0') {
+        suffixes = DEFAULT_SUFFIXES;
+    }
+    int found = name_index_list(file_index, new_dir_path, suffixes, &page);
+    free(new_dir_path);
+    if (found != INDEX_DIR) {
+        // The path does not exist, or exists but is not a directory
+        const char *error_message = found == INDEX_MISSING ? "ERROR: Invalid path or not a directory!" : "ERROR: Not a directory!";
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, error_message);
         printf("%s\n",error_message);
+        name_page_free(&page);
         return;
     }
 
-    // Check if the path is a directory
-    if (!S_ISDIR(path_stat.st_mode)) {
-        // Path exists but is not a directory
-        const char *error_message = "ERROR: Not a directory!";
-        send(client_sock, error_message, strlen(error_message), 0);
+    // If no files were found, send an error message to the client
+    if (page.count == 0 && cursor[0] == '\0') {
+        const char *error_message = "ERROR: No files found or given path doesnot exist!";
         printf("%s\n",error_message);
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, error_message);
+    } else {
+        // Send the page of files to the client(Smain) in sorted order
+        name_page_sort(&page);
+        printf("Listed %zu %s files\n", page.count, suffixes);
+        dfs_send_page(client_sock, request_id, &page);
+    }
+    name_page_free(&page);
+}
+
+// Paths of the tree collected for handle_list(), NUL terminated one after the other
+struct path_list {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+};
+
+// helper adding a path of the tree to the list
+static void list_path(void *ctx, const char *path, size_t len) {
+    struct path_list *list = ctx;
+    if (list->len + len + 1 > list->cap) {
+        size_t cap = list->cap > 0 ? list->cap * 2 : 65536;
+        while (cap < list->len + len + 1) {
+            cap *= 2;
+        }
+        char *grown = realloc(list->buf, cap);
+        if (grown == NULL) {
+            list->failed = 1;
+            return;
+        }
+        list->buf = grown;
+        list->cap = cap;
+    }
+    memcpy(list->buf + list->len, path, len);
+    list->buf[list->len + len] = '\0';
+    list->len += len + 1;
+}
+
+// function to handle the 'list' request of Smain: "<size> <path>" of every file of the tree, the
+// path relative to it, NUL terminated, in DATA frames and the END frame. The size is the one of the
+// content for a manifest of the chunk store
+void handle_list(int client_sock, uint32_t request_id) {
+    // The index is walked under its lock, the files are looked at once it is released
+    struct path_list list = {NULL, 0, 0, 0};
+    if (name_index_walk(file_index, list_path, &list) < 0 || list.failed) {
+        free(list.buf);
+        printf("File list not available\n");
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, "ERROR: File list not available!");
         return;
     }
 
-    // Buffer to store the list of .pdf files
-    char pdf_files[BUFSIZE] = "";
-    // Open the directory
-    DIR *dir = opendir(new_dir_path);
-    struct dirent *entry;
-    // Read through the directory and find .pdf files
-    if (dir != NULL) {
-        while ((entry = readdir(dir)) != NULL) {
-            if (strstr(entry->d_name, ".pdf") != NULL) {
-                strcat(pdf_files, entry->d_name);
-                strcat(pdf_files, "\n");
+    char frame[DFS_CHUNK_SIZE];
+    size_t used = 0;
+    size_t files = 0;
+    for (size_t at = 0; at < list.len; at += strlen(list.buf + at) + 1) {
+        const char *path = list.buf + at;
+        char full_path[BUFSIZE];
+        snprintf(full_path, sizeof(full_path), "%s/%s", root, path);
+        // Directories and files that went away meanwhile are left out
+        struct stat st;
+        uint64_t size;
+        int file_fd = open(full_path, O_RDONLY | O_NOFOLLOW);
+        if (file_fd < 0) {
+            continue;
+        }
+        if (fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode) || chunk_store_file_size(chunks, file_fd, &size) < 0) {
+            close(file_fd);
+            continue;
+        }
+        close(file_fd);
+
+        char record[BUFSIZE];
+        int record_len = snprintf(record, sizeof(record), "%llu %s", (unsigned long long)size, path);
+        if (record_len < 0 || (size_t)record_len + 1 > sizeof(frame)) {
+            continue;
+        }
+        // Records never span two frames
+        if (used + (size_t)record_len + 1 > sizeof(frame)) {
+            if (dfs_send_frame(client_sock, DFS_OP_DATA, request_id, frame, used) < 0) {
+                free(list.buf);
+                return;
             }
+            used = 0;
         }
-        // Close the directory after reading
-        closedir(dir);
+        memcpy(frame + used, record, (size_t)record_len + 1);
+        used += (size_t)record_len + 1;
+        files++;
     }
-
-    // If no files were found, send an error message to the client
-    if(strlen(pdf_files) == 0){
-        const char *error_message = "ERROR: No files found or given path doesnot exist!";
-        printf("%s\n",error_message);
-    }else{
-        // Print the list of .pdf files
-        printf("%s\n",pdf_files);
-        // Send the list to the client(Smain)
-        send(client_sock, pdf_files, strlen(pdf_files), 0);
+    free(list.buf);
+    if ((used > 0 && dfs_send_frame(client_sock, DFS_OP_DATA, request_id, frame, used) < 0) ||
+        dfs_send_frame(client_sock, DFS_OP_END, request_id, NULL, 0) < 0) {
+        return;
     }
+    printf("Listed %zu files for Smain\n", files);
 }
 
 // Function to delete a file and handle errors
@@ -368,6 +676,8 @@ int delete_file(const char *file_path) {
     if (pdf_path != NULL) {
         // delete the file
         if (unlink(pdf_path) == 0) {
+            name_index_update(file_index, pdf_path);
+            chunk_store_released(chunks);
             return 0;
         } else {
             // Handle error based on errno
@@ -393,11 +703,13 @@ int delete_file(const char *file_path) {
 
 
 // helper function used to send data of requested doenload file to the client(Smain)
-void send_file_back_to_smain(int smain_sock, const char *file_path, const char *file_name) {
+// A ranged request gets the part of the file it names, after a NAME that describes the whole file
+void send_file_back_to_smain(int smain_sock, uint32_t request_id, const char *file_path, const char *file_name, struct dfs_range *range) {
     // Replace ~ with the value of the HOME environment variable
     const char *home_dir = getenv("HOME");
     if (home_dir == NULL) {
         fprintf(stderr, "Failed to get HOME environment variable\n");
+        dfs_send_text(smain_sock, DFS_OP_ERROR, request_id, "ERROR: Failed to serve request!");
         return;
     }
 
@@ -409,146 +721,119 @@ void send_file_back_to_smain(int smain_sock, const char *file_path, const char *
         snprintf(full_path, sizeof(full_path), "%s", file_path);
     }
 
-    // Open the file for reading
-    int file_fd = open(full_path, O_RDONLY);
+    // Open the file for reading, one the index does not know is not looked for on disk
+    int file_fd = -1;
+    if (name_index_lookup(file_index, full_path) != INDEX_MISSING) {
+        file_fd = open(full_path, O_RDONLY);
+    }
     if (file_fd < 0) {
-        perror("File not found!");
+        printf("File not found!\n");
         // Send rejction to the client
         const char *success_message = "ERROR: File not found!";
-        send(smain_sock, success_message, strlen(success_message), 0);
+        dfs_send_text(smain_sock, DFS_OP_ERROR, request_id, success_message);
         return;
     }
 
-    // Send the file name
-    send(smain_sock, file_name, strlen(file_name), 0);
-
-    // Read the file and send its contents to the client
-    char buffer_content[BUFSIZE];
-    ssize_t bytes_read, bytes_sent;
-    while ((bytes_read = read(file_fd, buffer_content, sizeof(buffer_content))) > 0) {
-        bytes_sent = send(smain_sock, buffer_content, bytes_read, 0);
-        if (bytes_sent < 0) {
-            perror("Error sending file");
-            // Send rejction to the client
-            const char *success_message = "ERROR: Download Failed!";
-            send(smain_sock, success_message, strlen(success_message), 0);
-            break;
-        }
+    // The size of the content, and the part that is sent: all of it unless the request names one
+    uint64_t size;
+    struct stat st;
+    struct dfs_range whole = {0, 0, ""};
+    struct dfs_range *part = range != NULL ? range : &whole;
+    if (fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode) || chunk_store_file_size(chunks, file_fd, &size) < 0) {
+        printf("File read failed\n");
+        dfs_send_text(smain_sock, DFS_OP_ERROR, request_id, "ERROR: Error reading file!");
+        close(file_fd);
+        return;
     }
-    if (bytes_read < 0) {
-        perror("Error reading file");
-        // Send rejction to the client
-        const char *success_message = "ERROR: Error reading file!";
-        send(smain_sock, success_message, strlen(success_message), 0);
+    char version[DFS_VERSION_MAX + 1];
+    dfs_range_version(&st, version);
+    if (dfs_range_resolve(part, size, version) < 0) {
+        printf("Requested range is past the end of the file\n");
+        dfs_send_text(smain_sock, DFS_OP_ERROR, request_id, "ERROR: Invalid range!");
+        close(file_fd);
+        return;
     }
-    close(file_fd);
 
-    // Send the end marker
-    if (send(smain_sock, CMD_END_MARKER, strlen(CMD_END_MARKER), 0) == -1) {
-        perror("Failed serve request");
-        // Send rejction to the client
-        const char *success_message = "ERROR: Failed to serve request!";
-        send(smain_sock, success_message, strlen(success_message), 0);
+    // Send the file name, with the size and version of the file and where the part starts when ranged
+    if (range != NULL) {
+        char name[BUFSIZE];
+        dfs_range_name(name, sizeof(name), file_name, size, range);
+        dfs_send_text(smain_sock, DFS_OP_NAME, request_id, name);
+    } else {
+        dfs_send_text(smain_sock, DFS_OP_NAME, request_id, file_name);
     }
-}
 
-// Function to create a tarball of .txt files and send it to the client
-void pdf_tar_file(int client_sock, const char *path) {
-    // variables to hold the command for creating the tarball and the target path
-    char tar_cmd[BUFSIZE];
-    char target_path[BUFSIZE];
-
-    // Create path for the tarball file, which will be stored in the given path
-    snprintf(target_path,sizeof(target_path), "%s/%s",path,TAR_FILE_PATH);
-    
-    // Check for the presence of .pdf files first
-    snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*.pdf' -print -quit", path);
-    // Run the command to check for .pdf files and store the result
-    FILE *check = popen(tar_cmd, "r");
-    // If the check command fails, inform the client(Smain) and exit the function
-    if (check == NULL) {
-        printf("ERROR: Failed to check for .pdf files.\n");
-        const char *error_message = "ERROR: Failed to check for .pdf files!";
-        send(client_sock, error_message, strlen(error_message), 0);
-        return;
+    // Send the file content as one DATA frame and the END frame, the kernel copies the
+    // bytes from the page cache to the socket with sendfile() where it can. A manifest of the
+    // chunk store is sent as the chunks it lists
+    if (chunk_store_send_file(chunks, smain_sock, request_id, file_fd, part->offset, part->length) == -1) {
+        // A partly sent frame can not be recovered, drop the connection
+        perror("Failed serve request");
+        shutdown(smain_sock, SHUT_RDWR);
     }
+    close(file_fd);
+}
 
-    // If no .pdf files found, send error to client(Smain)
-    if (fgetc(check) == EOF) {
-        printf("No .pdf files found.\n");
-        const char *error_message = "ERROR: No .pdf files found!";
-        send(client_sock, error_message, strlen(error_message), 0);
-        pclose(check);
+// Function to create a tarball of the files with the suffixes and send it to the client
+void pdf_tar_file(int client_sock, uint32_t request_id, const char *path, const char *suffixes, const struct dfs_codec_spec *spec) {
+    // Archive the files while they are sent, nothing is written to disk first.
+    // The first member is looked up right away, so a missing file is still reported as an error
+    struct tar_stream *tar = tar_stream_open(path, suffixes);
+    // If the directory can not be read, inform the client(Smain) and exit the function
+    if (tar == NULL) {
+        char error_message[128];
+        snprintf(error_message, sizeof(error_message), "ERROR: Failed to check for %s files!", suffixes);
+        printf("%s\n", error_message);
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, error_message);
         return;
     }
-    pclose(check);
 
-    // Create the tarball if .pdf files are found
-    snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*.pdf' -print0 | tar -cf %s --null -T - 2>/dev/null", path, target_path);
-    int result = system(tar_cmd);
-    // If the tarball creation fails, inform the client(Smain) and exit the function
-    if (result != 0) {
-        printf("ERROR: Failed to create tarball for .pdf files.\n");
-        const char *error_message = "ERROR: Tar file creation failed!";
-        send(client_sock, error_message, strlen(error_message), 0);
+    // Manifests of the chunk store are archived as the files they stand for
+    struct tar_content content;
+    chunk_store_tar_content(chunks, &content);
+    tar_stream_set_content(tar, &content);
+
+    // If no such files found, send error to client(Smain)
+    if (tar_stream_members(tar) == 0) {
+        char error_message[128];
+        snprintf(error_message, sizeof(error_message), "ERROR: No %s files found!", suffixes);
+        printf("%s\n", error_message);
+        dfs_send_text(client_sock, DFS_OP_ERROR, request_id, error_message);
+        tar_stream_close(tar);
         return;
     }
 
-    // send file name to client(Smain)
-    send(client_sock, TAR_FILE_PATH, strlen(TAR_FILE_PATH), 0);
+    // send file name to client(Smain), its suffix names the codec (text_files.tar.zst)
+    char tar_name[64];
+    snprintf(tar_name, sizeof(tar_name), "%s%s", TAR_FILE_PATH, dfs_codec_suffix(spec->codec));
+    dfs_send_text(client_sock, DFS_OP_NAME, request_id, tar_name);
 
-
-    // Check if the tarball file was successfully created
-    if (access(target_path, F_OK) != 0) {
-        printf("No .pdf files found or failed to create tarball.\n");
-        // Send rejction to the client
-        const char *success_message = "ERROR: Tar file creation failed!";
-        send(client_sock, success_message, strlen(success_message), 0);
-        return;
-    }
-
-    // Open the tarball file to read its contents
-    FILE *tarball = fopen(target_path, "rb");
-    // If the tarball file cannot be opened, inform the client(Smain)
-    if (tarball == NULL) {
-        printf("Failed to open tarball file.\n");
-        // Send rejction to the client
-        const char *success_message = "ERROR: Tar file creation failed!";
-        send(client_sock, success_message, strlen(success_message), 0);
-        return;
+    // Send the archive as DATA frames and the END frame. Uncompressed member contents go out
+    // with sendfile(), compressed archives as one frame per block compressed on the pool
+    int result;
+    if (spec->codec == DFS_CODEC_NONE) {
+        result = dfs_send_tar(client_sock, request_id, tar);
+    } else {
+        result = dfs_send_tar_compressed(client_sock, request_id, tar, spec, compressors);
     }
-
-    // Send the file content
-    char file_buffer[1024];
-    size_t bytes_read;
-    while ((bytes_read = fread(file_buffer, 1, sizeof(file_buffer), tarball)) > 0) {
-        ssize_t bytes_sent = send(client_sock, file_buffer, bytes_read, 0);
-        if (bytes_sent < 0) {
-            perror("Failed to send tarball data");
-            // Send rejction to the client
-            const char *success_message = "ERROR: Tar file creation failed!";
-            send(client_sock, success_message, strlen(success_message), 0);
-            fclose(tarball);
-            return;
-        }
+    if (result < 0) {
+        // A partly sent frame can not be recovered, drop the connection
+        perror("Failed to send tarball data");
+        shutdown(client_sock, SHUT_RDWR);
+    } else {
+        printf("Tarball sent to Smain.\n");
     }
-
-    // Send end-of-file marker
-    const char *end_marker = "END_CMD";
-    send(client_sock, end_marker, strlen(end_marker), 0);
-
-    fclose(tarball);
-    printf("Tarball sent to Smain.\n");
+    tar_stream_close(tar);
 }
 
-// helper function to create path for text sercer by replacing smain to stext
+// helper function to create the path in the tree of this server for a path below ~/smain
 char* create_pdf_path(const char *destination_path) {
     // Pointer to store the position of "smain" in the path
     char *pos;
-    // Calculate the size of the original path
-    size_t new_path_size = strlen(destination_path);
-    // Allocate memory for the new path 
-    char *new_path = malloc(new_path_size);
+    // Calculate the size of the new path at most, the root of this server replaces the one of Smain
+    size_t new_path_size = strlen(root) + strlen(destination_path);
+    // Allocate memory for the new path
+    char *new_path = malloc(new_path_size + 1);
 
     // Check if memory allocation was successful
     if (new_path == NULL) {
@@ -560,19 +845,8 @@ char* create_pdf_path(const char *destination_path) {
     // Find the position of "smain" in the original path
     pos = strstr(destination_path, "smain");
     if (pos != NULL) {
-        // If "smain" is found, copy the part before "smain" into the new path
-        // Calculate the length of the prefix before "smain"
-        size_t prefix_len = pos - destination_path;
-        // Copy the prefix to the new path
-        strncpy(new_path, destination_path, prefix_len);
-        // Null-terminate the string
-        new_path[prefix_len] = '\0';
-
-        // Append "spdf" to new_path
-        strcat(new_path, "spdf");
-
-        // Append the rest of the original path after "smain" to the new path
-        strcat(new_path, pos + strlen("smain"));
+        // If "smain" is found, the rest of the original path after it is the path in the tree of this server
+        snprintf(new_path, new_path_size + 1, "%s%s", root, pos + strlen("smain"));
     } else {
         // If "smain" is not found, simply copy the original path to the new path
         strcpy(new_path, destination_path);
@@ -581,11 +855,31 @@ char* create_pdf_path(const char *destination_path) {
     return new_path;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     int server_sock, client_sock;
     struct sockaddr_in server_addr, client_addr;
     socklen_t addr_size;
-    pid_t child_pid;
+    struct epoll_event events[EVENT_BATCH];
+
+    // Number of worker threads, one per core unless given on the command line
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) {
+        threads = atol(argv[1]);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    // The port is PORT unless DFS_PORT gives another, for more than one server on a host
+    int port = PORT;
+    const char *port_env = getenv("DFS_PORT");
+    if (port_env != NULL) {
+        port = atoi(port_env);
+        if (port < 1 || port > 65535) {
+            fprintf(stderr, "Invalid DFS_PORT: %s\n", port_env);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Create a socket for the server
     server_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -597,12 +891,16 @@ int main() {
     // Configure the server address
     server_addr.sin_family = AF_INET;
     // Set the port number, converting to network byte order
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
     // Accept connections
     server_addr.sin_addr.s_addr = INADDR_ANY;
     // Zero out the rest of the structure
     memset(server_addr.sin_zero, '\0', sizeof(server_addr.sin_zero));
 
+    // Allow a restarted server to bind while old connections are still in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Bind the socket to the specified port and address
     if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
@@ -610,47 +908,118 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    // Listen for incoming connections, with a backlog of 10 pending connections
-    if (listen(server_sock, 10) < 0) {
+    // Listen for incoming connections, bursts of new connections wait in the kernel queue
+    if (listen(server_sock, SOMAXCONN) < 0) {
         perror("Listen failed");
         close(server_sock);
         exit(EXIT_FAILURE);
     }
 
-    printf("Spdf server is listening on port %d\n", PORT);
+    // Smain dropping the connection during sendfile() must not kill the server with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
 
+    // Start the workers and the epoll set that watches the idle connections
+    workers = worker_pool_create("Spdf", (int)threads);
+    compressors = worker_pool_create("Spdf compression", (int)threads);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (workers == NULL || compressors == NULL || epoll_fd < 0) {
+        perror("Server startup failed");
+        close(server_sock);
+        exit(EXIT_FAILURE);
+    }
+    // The listening socket is watched too, it must never block the dispatcher
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = server_sock;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+        perror("epoll_ctl failed");
+        close(server_sock);
+        exit(EXIT_FAILURE);
+    }
+
+    // Workers log concurrently, write each line out as it is printed
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // Index ~/spdf (or DFS_ROOT) in the background, until it is ready requests are answered from the disk
+    const char *home_dir = getenv("HOME");
+    const char *root_env = getenv("DFS_ROOT");
+    if (root_env != NULL && root_env[0] == '/') {
+        snprintf(root, sizeof(root), "%s", root_env);
+        // A trailing '/' would leave the tree without a name
+        size_t root_len = strlen(root);
+        while (root_len > 1 && root[root_len - 1] == '/') {
+            root[--root_len] = '\0';
+        }
+    } else {
+        snprintf(root, sizeof(root), "%s/spdf", home_dir != NULL ? home_dir : "");
+    }
+    file_index = name_index_open(root);
+    feed = file_index != NULL ? path_feed_open(file_index) : NULL;
+    // The chunks and contents are kept next to the tree, hidden like its snapshot: ~/.spdf.chunks
+    const char *root_name = strrchr(root, '/') + 1;
+    int parent_len = (int)(root_name - root);
+    // Deduplicate uploads into ~/.spdf.chunks when DFS_CHUNK_STORE is 1, manifests are read either way
+    char chunk_dir[BUFSIZE];
+    snprintf(chunk_dir, sizeof(chunk_dir), "%.*s.%s.chunks", parent_len, root, root_name);
+    chunks = chunk_store_open(root, chunk_dir);
+    // Uploads that announce content stored already are linked, found through ~/.spdf.content
+    char content_dir[BUFSIZE];
+    snprintf(content_dir, sizeof(content_dir), "%.*s.%s.content", parent_len, root, root_name);
+    contents = content_index_open(content_dir);
+    printf("Spdf server is listening on port %d with %ld worker threads, storing files in %s\n", port, threads, root);
+
+    // This thread only dispatches: it accepts connections and hands every request to a worker
     while (1) {
-        // Accept a client connection
-        addr_size = sizeof(client_addr);
-        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_size);
-        if (client_sock < 0) {
-            // Continue to the next iteration if accept fails
-            perror("Accept failed");
-            continue;
+        int n = epoll_wait(epoll_fd, events, EVENT_BATCH, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
         }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd != server_sock) {
+                // A request arrived (or the connection was closed), a worker reads and serves it
+                int ready_sock = events[i].data.fd;
+                if (worker_pool_submit(workers, serve_request, (void *)(intptr_t)ready_sock) < 0) {
+                    close(ready_sock);
+                }
+                continue;
+            }
 
-        printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-
-        // Fork a child process to handle the client
-        child_pid = fork();
-        if (child_pid == 0) {
-            // In the child process
-            close(server_sock);  // Close the server socket in the child
-            handle_client(client_sock);  // Handle communication with the client
-            close(client_sock);  // Close the client socket in the child
-            exit(0);  // Exit the child process
-        } else if (child_pid > 0) {
-            // In the parent process
-            close(client_sock);  // Close the client socket in the parent
-            // Wait for terminated child processes to avoid zombie processes
-            while (waitpid(-1, NULL, WNOHANG) > 0) {
-                // Continue to reap any terminated child processes
+            // Accept a client connection
+            addr_size = sizeof(client_addr);
+            client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_size);
+            if (client_sock < 0) {
+                // Try again on the next event if accept fails
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("Accept failed");
+                }
+                continue;
+            }
+
+            printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+            // Replies are small frames that Smain waits for, do not let Nagle delay them
+            int one = 1;
+            setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            // Wait for the first request of the connection
+            if (watch_connection(client_sock, EPOLL_CTL_ADD) < 0) {
+                close(client_sock);
             }
-        } else {
-            perror("Fork failed");
         }
     }
 
+    worker_pool_destroy(workers);
+    worker_pool_destroy(compressors);
+    path_feed_close(feed);
+    name_index_close(file_index);
+    chunk_store_close(chunks);
+    content_index_close(contents);
     close(server_sock);  // Close the server socket
     return 0;
 }
\ No newline at end of file
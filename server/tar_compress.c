@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "../common/dfs_proto.h"
+#include "tar_compress.h"
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_RUNNING,
+    SLOT_DONE,
+    SLOT_FAILED
+};
+
+// One block of the archive on its way through the pool
+struct compress_slot {
+    struct tar_compress *tc;
+    enum slot_state state;
+    unsigned char *in;
+    size_t in_len;
+    void *out;
+    size_t out_len;
+};
+
+struct tar_compress {
+    struct tar_stream *tar;
+    struct dfs_codec_spec spec;
+    struct worker_pool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t done;  // a block finished
+    int notify_fd;
+    int refs;             // the owner plus every running task
+
+    // Ring of queued blocks, head is the next one to hand out
+    struct compress_slot slots[TAR_COMPRESS_MAX_INFLIGHT];
+    int inflight_max;
+    int head;
+    int count;
+    void *delivered;      // block returned by the last tar_compress_next()
+
+    // Piece of the archive being cut into blocks
+    struct tar_piece piece;
+    int have_piece;
+    uint64_t piece_offset;
+    int input_done;
+
+    // Without a tar_stream the archive is handed in by tar_compress_write() and collected here
+    unsigned char *pending;
+    size_t pending_len;
+    int failed;
+};
+
+// helper to release everything once the owner and all tasks are gone
+static void tc_destroy(struct tar_compress *tc) {
+    for (int i = 0; i < TAR_COMPRESS_MAX_INFLIGHT; i++) {
+        free(tc->slots[i].in);
+        free(tc->slots[i].out);
+    }
+    if (tc->notify_fd >= 0) {
+        close(tc->notify_fd);
+    }
+    pthread_mutex_destroy(&tc->lock);
+    pthread_cond_destroy(&tc->done);
+    free(tc);
+}
+
+// helper run on the pool: compress one block and report it
+static void compress_task(void *arg) {
+    struct compress_slot *slot = arg;
+    struct tar_compress *tc = slot->tc;
+
+    void *out = NULL;
+    size_t out_len = 0;
+    int rc = dfs_compress_block(&tc->spec, slot->in, slot->in_len, &out, &out_len);
+
+    pthread_mutex_lock(&tc->lock);
+    free(slot->in);
+    slot->in = NULL;
+    slot->out = out;
+    slot->out_len = out_len;
+    slot->state = rc == 0 ? SLOT_DONE : SLOT_FAILED;
+    // Signal under the lock, the descriptor is closed by whoever drops the last reference
+    pthread_cond_signal(&tc->done);
+    if (tc->notify_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t n = write(tc->notify_fd, &one, sizeof(one));
+        (void)n;
+    }
+    int last = --tc->refs == 0;
+    pthread_mutex_unlock(&tc->lock);
+    if (last) {
+        tc_destroy(tc);
+    }
+}
+
+// Function to start compressing an archive on a worker pool
+struct tar_compress *tar_compress_create(struct tar_stream *tar, const struct dfs_codec_spec *spec,
+                                         struct worker_pool *pool, int notify) {
+    struct tar_compress *tc = calloc(1, sizeof(*tc));
+    if (tc == NULL) {
+        perror("Compression state allocation failed");
+        return NULL;
+    }
+    tc->tar = tar;
+    tc->spec = *spec;
+    tc->pool = pool;
+    tc->refs = 1;
+    tc->notify_fd = -1;
+    pthread_mutex_init(&tc->lock, NULL);
+    pthread_cond_init(&tc->done, NULL);
+    for (int i = 0; i < TAR_COMPRESS_MAX_INFLIGHT; i++) {
+        tc->slots[i].tc = tc;
+    }
+
+    // Two blocks per worker keep every core busy while finished blocks are sent
+    struct worker_pool_stats stats;
+    worker_pool_get_stats(pool, &stats);
+    tc->inflight_max = stats.workers * 2;
+    if (tc->inflight_max < 2) {
+        tc->inflight_max = 2;
+    }
+    if (tc->inflight_max > TAR_COMPRESS_MAX_INFLIGHT) {
+        tc->inflight_max = TAR_COMPRESS_MAX_INFLIGHT;
+    }
+
+    if (notify && (tc->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd failed");
+        tc_destroy(tc);
+        return NULL;
+    }
+    return tc;
+}
+
+// helper to cut the next block out of the archive, returns its length (0 at the end) or -1
+static ssize_t read_block(struct tar_compress *tc, unsigned char *block) {
+    size_t len = 0;
+
+    while (len < TAR_COMPRESS_BLOCK) {
+        if (!tc->have_piece) {
+            if (tc->input_done) {
+                break;
+            }
+            if (tar_stream_next(tc->tar, &tc->piece) < 0) {
+                return -1;
+            }
+            if (tc->piece.kind == TAR_PIECE_END) {
+                tc->input_done = 1;
+                break;
+            }
+            tc->have_piece = 1;
+            tc->piece_offset = 0;
+        }
+
+        struct tar_piece *piece = &tc->piece;
+        uint64_t piece_len = piece->kind == TAR_PIECE_BYTES ? piece->len : piece->size;
+        uint64_t left = piece_len - tc->piece_offset;
+        size_t want = left < TAR_COMPRESS_BLOCK - len ? (size_t)left : TAR_COMPRESS_BLOCK - len;
+
+        if (piece->kind == TAR_PIECE_BYTES) {
+            memcpy(block + len, piece->data + tc->piece_offset, want);
+        } else {
+            ssize_t n = pread(piece->fd, block + len, want, (off_t)tc->piece_offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // The header already promised piece->size bytes, keep the archive aligned
+                printf("File shrank while it was archived, padding it with zeros\n");
+                memset(block + len, 0, want);
+                n = (ssize_t)want;
+            }
+            want = (size_t)n;
+        }
+        len += want;
+        tc->piece_offset += want;
+
+        if (tc->piece_offset == piece_len) {
+            if (piece->kind == TAR_PIECE_FILE) {
+                close(piece->fd);
+            }
+            tc->have_piece = 0;
+        }
+    }
+    return (ssize_t)len;
+}
+
+// helper to check whether another block can be queued
+static int have_room(struct tar_compress *tc) {
+    pthread_mutex_lock(&tc->lock);
+    int room = tc->count < tc->inflight_max;
+    pthread_mutex_unlock(&tc->lock);
+    return room;
+}
+
+// helper to hand a block (owned by the slot from now on) to the pool, the caller checked have_room()
+static void queue_block(struct tar_compress *tc, unsigned char *block, size_t len) {
+    // Only this thread touches a free slot
+    pthread_mutex_lock(&tc->lock);
+    struct compress_slot *slot = &tc->slots[(tc->head + tc->count) % TAR_COMPRESS_MAX_INFLIGHT];
+    slot->in = block;
+    slot->in_len = len;
+    slot->state = SLOT_RUNNING;
+    tc->count++;
+    tc->refs++;
+    pthread_mutex_unlock(&tc->lock);
+    if (worker_pool_submit(tc->pool, compress_task, slot) < 0) {
+        // No room in the pool, compress it here
+        compress_task(slot);
+    }
+}
+
+// Function to queue blocks of the archive until enough of them are being compressed
+int tar_compress_fill(struct tar_compress *tc) {
+    while (tc->tar != NULL && !tc->input_done && have_room(tc)) {
+        // The block is read without holding the lock
+        unsigned char *block = malloc(TAR_COMPRESS_BLOCK);
+        if (block == NULL) {
+            perror("Compression block allocation failed");
+            return -1;
+        }
+        ssize_t len = read_block(tc, block);
+        if (len <= 0) {
+            free(block);
+            if (len < 0) {
+                return -1;
+            }
+            break;
+        }
+        queue_block(tc, block, (size_t)len);
+    }
+    return 0;
+}
+
+// Function to add bytes of an archive that is not read from a tar_stream
+size_t tar_compress_write(struct tar_compress *tc, const void *data, size_t len) {
+    size_t taken = 0;
+
+    while (taken < len && !tc->input_done) {
+        if (tc->pending == NULL) {
+            if ((tc->pending = malloc(TAR_COMPRESS_BLOCK)) == NULL) {
+                perror("Compression block allocation failed");
+                // Reported by the next tar_compress_next()
+                tc->failed = 1;
+                break;
+            }
+            tc->pending_len = 0;
+        }
+        size_t want = len - taken < TAR_COMPRESS_BLOCK - tc->pending_len ? len - taken : TAR_COMPRESS_BLOCK - tc->pending_len;
+        memcpy(tc->pending + tc->pending_len, (const char *)data + taken, want);
+        tc->pending_len += want;
+        taken += want;
+
+        // A full block goes to the pool, or waits there until a slot is free
+        if (tc->pending_len == TAR_COMPRESS_BLOCK) {
+            if (!have_room(tc)) {
+                break;
+            }
+            queue_block(tc, tc->pending, tc->pending_len);
+            tc->pending = NULL;
+        }
+    }
+    return taken;
+}
+
+// Function to end an archive handed in by tar_compress_write()
+int tar_compress_close_input(struct tar_compress *tc) {
+    if (tc->input_done) {
+        return 0;
+    }
+    if (tc->pending != NULL && tc->pending_len > 0) {
+        if (!have_room(tc)) {
+            return 1;
+        }
+        queue_block(tc, tc->pending, tc->pending_len);
+        tc->pending = NULL;
+    }
+    tc->input_done = 1;
+    return 0;
+}
+
+// Function to hand out the next compressed block in archive order
+int tar_compress_next(struct tar_compress *tc, int wait, const void **data, size_t *len) {
+    free(tc->delivered);
+    tc->delivered = NULL;
+
+    pthread_mutex_lock(&tc->lock);
+    if (tc->notify_fd >= 0) {
+        // Finished blocks are checked below, clear the notification before that so none is lost
+        uint64_t count;
+        ssize_t n = read(tc->notify_fd, &count, sizeof(count));
+        (void)n;
+    }
+    while (1) {
+        if (tc->failed) {
+            pthread_mutex_unlock(&tc->lock);
+            return -1;
+        }
+        if (tc->count == 0) {
+            pthread_mutex_unlock(&tc->lock);
+            return tc->input_done ? 2 : 0;
+        }
+        struct compress_slot *slot = &tc->slots[tc->head];
+        if (slot->state == SLOT_FAILED) {
+            pthread_mutex_unlock(&tc->lock);
+            return -1;
+        }
+        if (slot->state == SLOT_DONE) {
+            tc->delivered = slot->out;
+            *data = slot->out;
+            *len = slot->out_len;
+            slot->out = NULL;
+            slot->state = SLOT_FREE;
+            tc->head = (tc->head + 1) % TAR_COMPRESS_MAX_INFLIGHT;
+            tc->count--;
+            pthread_mutex_unlock(&tc->lock);
+            return 1;
+        }
+        if (!wait) {
+            pthread_mutex_unlock(&tc->lock);
+            return 0;
+        }
+        pthread_cond_wait(&tc->done, &tc->lock);
+    }
+}
+
+// Function to get the descriptor signalling finished blocks
+int tar_compress_notify_fd(const struct tar_compress *tc) {
+    return tc->notify_fd;
+}
+
+// Function to release a compression stream, running tasks drop the last reference themselves
+void tar_compress_free(struct tar_compress *tc) {
+    if (tc == NULL) {
+        return;
+    }
+    free(tc->delivered);
+    tc->delivered = NULL;
+    free(tc->pending);
+    tc->pending = NULL;
+    if (tc->have_piece && tc->piece.kind == TAR_PIECE_FILE) {
+        close(tc->piece.fd);
+    }
+    pthread_mutex_lock(&tc->lock);
+    int last = --tc->refs == 0;
+    pthread_mutex_unlock(&tc->lock);
+    if (last) {
+        tc_destroy(tc);
+    }
+}
+
+// Function to send a compressed archive on a blocking socket
+int dfs_send_tar_compressed(int sock, uint32_t request_id, struct tar_stream *tar,
+                            const struct dfs_codec_spec *spec, struct worker_pool *pool) {
+    struct tar_compress *tc = tar_compress_create(tar, spec, pool, 0);
+    if (tc == NULL) {
+        return -1;
+    }
+
+    int result = -1;
+    while (1) {
+        const void *data;
+        size_t len;
+        if (tar_compress_fill(tc) < 0) {
+            break;
+        }
+        int rc = tar_compress_next(tc, 1, &data, &len);
+        if (rc == 2) {
+            result = dfs_send_frame(sock, DFS_OP_END, request_id, NULL, 0);
+            break;
+        }
+        // Every compressed block goes out as one DATA frame
+        if (rc < 0 || dfs_send_frame(sock, DFS_OP_DATA, request_id, data, len) < 0) {
+            break;
+        }
+    }
+    tar_compress_free(tc);
+    return result;
+}
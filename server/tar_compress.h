@@ -0,0 +1,60 @@
+#ifndef TAR_COMPRESS_H
+#define TAR_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../common/dfs_codec.h"
+#include "../common/tar_stream.h"
+#include "worker_pool.h"
+
+// Parallel compression of a dtar archive.
+//
+// The archive produced by a tar_stream is cut into blocks of TAR_COMPRESS_BLOCK bytes. Every block is
+// compressed on its own by a task on a worker pool, so several cores work on one archive, and the
+// compressed blocks are handed out in archive order. Each one is a complete gzip member or zstd frame.
+//
+// One thread (the connection's event loop or worker) reads the archive and collects the results;
+// only the compression itself runs on the pool. An archive that does not come from a tar_stream
+// (the merged one of 'dtar all') is handed in with tar_compress_write() instead.
+
+#define TAR_COMPRESS_BLOCK (1024 * 1024)
+
+// Upper bound of blocks being compressed at the same time for one archive
+#define TAR_COMPRESS_MAX_INFLIGHT 16
+
+struct tar_compress;
+
+// Start compressing tar (which stays owned by the caller) with the blocks compressed on pool.
+// A NULL tar takes the archive from tar_compress_write(). With notify set an eventfd becomes readable
+// whenever a block is done, see tar_compress_notify_fd().
+struct tar_compress *tar_compress_create(struct tar_stream *tar, const struct dfs_codec_spec *spec,
+                                         struct worker_pool *pool, int notify);
+
+// Read more of the archive and queue its blocks until enough are in flight. Returns -1 on failure.
+int tar_compress_fill(struct tar_compress *tc);
+
+// Add len bytes of the archive when there is no tar_stream. Returns how many were taken: fewer than len
+// once a full block waits for a free slot, then take finished blocks with tar_compress_next() first.
+size_t tar_compress_write(struct tar_compress *tc, const void *data, size_t len);
+
+// Mark the end of the written archive. Returns 0, or 1 if the last block still waits for a free slot.
+int tar_compress_close_input(struct tar_compress *tc);
+
+// Get the next compressed block in archive order; data stays valid until the next call.
+// Returns 1 for a block, 2 once the archive is complete, 0 if the next block is not ready yet
+// (only without wait) and -1 if compression failed.
+int tar_compress_next(struct tar_compress *tc, int wait, const void **data, size_t *len);
+
+// Descriptor for epoll that signals finished blocks, -1 without notify
+int tar_compress_notify_fd(const struct tar_compress *tc);
+
+// Release the stream; blocks still being compressed are dropped when their task finishes
+void tar_compress_free(struct tar_compress *tc);
+
+// Send the whole compressed archive on a blocking socket as DATA frames followed by END.
+// Returns 0 on success and -1 if the connection is no longer usable.
+int dfs_send_tar_compressed(int sock, uint32_t request_id, struct tar_stream *tar,
+                            const struct dfs_codec_spec *spec, struct worker_pool *pool);
+
+#endif
@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "tar_merge.h"
+
+// Header fields read while merging
+#define TAR_SIZE_OFFSET 124
+#define TAR_SIZE_LEN 12
+#define TAR_CHKSUM_OFFSET 148
+#define TAR_CHKSUM_LEN 8
+#define TAR_TYPE_OFFSET 156
+
+// An archive ends with two zero blocks
+#define TAR_TRAILER_SIZE (2 * TAR_BLOCK_SIZE)
+
+static const unsigned char zero_trailer[TAR_TRAILER_SIZE];
+
+// helper to parse an octal header field, leading spaces and NULs are allowed
+static int parse_octal(const unsigned char *field, size_t len, uint64_t *value) {
+    size_t i = 0;
+    while (i < len && (field[i] == ' ' || field[i] == '\0')) {
+        i++;
+    }
+    *value = 0;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        *value = *value * 8 + (uint64_t)(field[i] - '0');
+    }
+    // Only a terminator may follow the digits
+    return i == len || field[i] == ' ' || field[i] == '\0' ? 0 : -1;
+}
+
+// helper to parse the size of a member, octal or GNU base-256 for large files
+static int parse_size(const unsigned char *header, uint64_t *size) {
+    const unsigned char *field = header + TAR_SIZE_OFFSET;
+    if (field[0] & 0x80) {
+        *size = 0;
+        for (int i = 1; i < TAR_SIZE_LEN; i++) {
+            *size = (*size << 8) | field[i];
+        }
+        return 0;
+    }
+    return parse_octal(field, TAR_SIZE_LEN, size);
+}
+
+// helper to verify the checksum of a header block, so a stream that is not a tar archive is caught early
+static int check_header(const unsigned char *header) {
+    uint64_t expected;
+    if (parse_octal(header + TAR_CHKSUM_OFFSET, TAR_CHKSUM_LEN, &expected) < 0) {
+        return -1;
+    }
+    // The checksum field itself counts as spaces
+    uint64_t sum = 8 * ' ';
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (i < TAR_CHKSUM_OFFSET || i >= TAR_CHKSUM_OFFSET + TAR_CHKSUM_LEN) {
+            sum += header[i];
+        }
+    }
+    return sum == expected ? 0 : -1;
+}
+
+// helper to find the "size" record of a pax header, whose records look like "25 path=dir/file.pdf\n"
+static void parse_pax_size(struct merge_source *src, const unsigned char *records, uint64_t len) {
+    uint64_t pos = 0;
+    while (pos < len) {
+        uint64_t record_len = 0;
+        uint64_t i = pos;
+        while (i < len && records[i] >= '0' && records[i] <= '9') {
+            record_len = record_len * 10 + (uint64_t)(records[i] - '0');
+            i++;
+        }
+        if (record_len == 0 || pos + record_len > len || i >= len || records[i] != ' ') {
+            return;
+        }
+        const char *key = (const char *)records + i + 1;
+        size_t rest = (size_t)(pos + record_len - (i + 1));
+        if (rest > 5 && strncmp(key, "size=", 5) == 0) {
+            src->pax_size = strtoull(key + 5, NULL, 10);
+            src->have_pax_size = 1;
+        }
+        pos += record_len;
+    }
+}
+
+// helper to make room at the end of a source's buffer, returns the free space
+static size_t buffer_room(struct merge_source *src) {
+    if (src->start == src->end) {
+        src->start = src->end = 0;
+    } else if (src->end == TAR_MERGE_BUFFER && src->start > 0) {
+        memmove(src->buf, src->buf + src->start, src->end - src->start);
+        src->end -= src->start;
+        src->start = 0;
+    }
+    return TAR_MERGE_BUFFER - src->end;
+}
+
+// helper to fill the buffer of the local source from its tar_stream
+static int fill_local(struct merge_source *src) {
+    size_t room;
+    while (!src->eof && (room = buffer_room(src)) > 0) {
+        if (!src->have_piece) {
+            if (tar_stream_next(src->tar, &src->piece) < 0) {
+                return -1;
+            }
+            if (src->piece.kind == TAR_PIECE_END) {
+                src->eof = 1;
+                break;
+            }
+            src->have_piece = 1;
+            src->piece_offset = 0;
+        }
+
+        struct tar_piece *piece = &src->piece;
+        uint64_t piece_len = piece->kind == TAR_PIECE_BYTES ? piece->len : piece->size;
+        uint64_t left = piece_len - src->piece_offset;
+        size_t want = left < room ? (size_t)left : room;
+
+        if (piece->kind == TAR_PIECE_BYTES) {
+            memcpy(src->buf + src->end, piece->data + src->piece_offset, want);
+        } else {
+            ssize_t n = pread(piece->fd, src->buf + src->end, want, (off_t)src->piece_offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // The header already promised piece->size bytes, keep the archive aligned
+                printf("File shrank while it was archived, padding it with zeros\n");
+                memset(src->buf + src->end, 0, want);
+                n = (ssize_t)want;
+            }
+            want = (size_t)n;
+        }
+        src->end += want;
+        src->piece_offset += want;
+
+        if (src->piece_offset == piece_len) {
+            if (piece->kind == TAR_PIECE_FILE) {
+                close(piece->fd);
+            }
+            src->have_piece = 0;
+        }
+    }
+    return 0;
+}
+
+// helper called once the payload of a NAME or ERROR frame is complete
+static int finish_text_frame(struct merge_source *src) {
+    src->message[src->message_len] = '\0';
+    if (src->opcode == DFS_OP_NAME) {
+        src->named = 1;
+        return 0;
+    }
+    // The reply is over, the connection is ready for the next request
+    src->eof = 1;
+    src->clean = 1;
+    printf("%s: %s\n", src->name, src->message);
+    // Before NAME the server just has no such files, afterwards its archive is incomplete
+    return src->named ? -1 : 0;
+}
+
+// helper to tell an empty socket (0) from a closed or broken connection (-1) after recv() returned n
+static int recv_failed(struct merge_source *src, ssize_t n) {
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n == 0) {
+        printf("%s: connection closed by server\n", src->name);
+    } else {
+        perror("Receive from server failed");
+    }
+    return -1;
+}
+
+// helper to read the dtar reply of a server into the buffer until the socket is drained or the buffer full
+static int fill_server(struct merge_source *src) {
+    char discard[DFS_CHUNK_SIZE];
+
+    while (!src->eof) {
+        if (src->hdr_len < DFS_HDR_SIZE) {
+            ssize_t n = recv(src->fd, src->hdr + src->hdr_len, DFS_HDR_SIZE - src->hdr_len, 0);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                return recv_failed(src, n);
+            }
+            src->hdr_len += (size_t)n;
+            if (src->hdr_len < DFS_HDR_SIZE) {
+                continue;
+            }
+
+            struct dfs_hdr hdr;
+            if (dfs_unpack_hdr(src->hdr, &hdr) < 0) {
+                return -1;
+            }
+            src->opcode = hdr.opcode;
+            src->payload_left = hdr.length;
+            src->message_len = 0;
+            if (hdr.opcode == DFS_OP_END) {
+                src->eof = 1;
+                src->clean = hdr.length == 0;
+                return src->clean ? 0 : -1;
+            }
+            if ((hdr.opcode == DFS_OP_NAME || hdr.opcode == DFS_OP_ERROR) && hdr.length <= DFS_MAX_TEXT) {
+                if (hdr.length == 0 && finish_text_frame(src) < 0) {
+                    return -1;
+                }
+            } else if (hdr.opcode != DFS_OP_DATA || !src->named) {
+                fprintf(stderr, "%s: unexpected %s frame in dtar reply\n", src->name, dfs_opcode_name(hdr.opcode));
+                return -1;
+            }
+            if (hdr.length == 0) {
+                src->hdr_len = 0;
+            }
+            continue;
+        }
+
+        // Payload of the current frame
+        void *into;
+        size_t want;
+        if (src->opcode != DFS_OP_DATA) {
+            into = src->message + src->message_len;
+            want = (size_t)src->payload_left;
+        } else if (src->archive_done) {
+            // Whatever follows the end-of-archive marker is not part of the merged archive
+            into = discard;
+            want = src->payload_left < sizeof(discard) ? (size_t)src->payload_left : sizeof(discard);
+        } else {
+            size_t room = buffer_room(src);
+            if (room == 0) {
+                return 0;
+            }
+            into = src->buf + src->end;
+            want = src->payload_left < room ? (size_t)src->payload_left : room;
+        }
+        ssize_t n = recv(src->fd, into, want, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return recv_failed(src, n);
+        }
+        src->payload_left -= (uint64_t)n;
+        if (src->opcode != DFS_OP_DATA) {
+            src->message_len += (size_t)n;
+        } else if (!src->archive_done) {
+            src->end += (size_t)n;
+        }
+        if (src->payload_left == 0) {
+            src->hdr_len = 0;
+            if (src->opcode != DFS_OP_DATA && finish_text_frame(src) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// helper to start copying the next unit (header block and content) of a source.
+// Returns 1 when it started, 0 if the header is not buffered yet, 2 at the end-of-archive marker and -1 on failure.
+static int begin_unit(struct merge_source *src) {
+    size_t avail = src->end - src->start;
+    if (avail < TAR_BLOCK_SIZE) {
+        return 0;
+    }
+    const unsigned char *header = src->buf + src->start;
+
+    if (memcmp(header, zero_trailer, TAR_BLOCK_SIZE) == 0) {
+        // A pax or long name header must be followed by its member
+        if (src->chained) {
+            return -1;
+        }
+        src->archive_done = 1;
+        src->start = src->end = 0;
+        if (src->fd < 0) {
+            src->eof = 1;
+        }
+        return 2;
+    }
+
+    uint64_t size;
+    if (check_header(header) < 0 || parse_size(header, &size) < 0) {
+        fprintf(stderr, "%s: archive is not a valid tar stream\n", src->name);
+        return -1;
+    }
+    char type = (char)header[TAR_TYPE_OFFSET];
+    int extension = type == 'x' || type == 'g' || type == 'L' || type == 'K';
+    if (!extension && src->have_pax_size) {
+        size = src->pax_size;
+        src->have_pax_size = 0;
+    }
+    uint64_t unit = TAR_BLOCK_SIZE + (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+    // The records of a pax header are read before it is copied, they may change the size of the member
+    if (type == 'x' || type == 'g') {
+        if (unit > TAR_MERGE_BUFFER) {
+            fprintf(stderr, "%s: pax header too large\n", src->name);
+            return -1;
+        }
+        if (avail < unit) {
+            return 0;
+        }
+        if (type == 'x') {
+            parse_pax_size(src, header + TAR_BLOCK_SIZE, size);
+        }
+    }
+
+    src->chained = extension;
+    if (!extension) {
+        src->members++;
+    }
+    src->unit_left = unit;
+    return 1;
+}
+
+// helper to tell whether a source can not contribute any more members
+static int source_finished(const struct merge_source *src) {
+    return src->eof && (src->archive_done || src->start == src->end);
+}
+
+// Function to read what the sources have ready without blocking
+int tar_merge_read(struct tar_merge *merge) {
+    for (int i = 0; i < merge->count; i++) {
+        struct merge_source *src = &merge->sources[i];
+        if (src->failed) {
+            return -1;
+        }
+        int rc = src->fd >= 0 ? fill_server(src) : fill_local(src);
+        if (rc < 0) {
+            src->failed = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to prepare an empty merge
+void tar_merge_init(struct tar_merge *merge) {
+    memset(merge, 0, sizeof(*merge));
+    merge->current = -1;
+}
+
+// helper to take the next source slot
+static struct merge_source *add_source(struct tar_merge *merge, const char *name) {
+    if (merge->count == TAR_MERGE_MAX_SOURCES) {
+        return NULL;
+    }
+    struct merge_source *src = &merge->sources[merge->count];
+    memset(src, 0, sizeof(*src));
+    if ((src->buf = malloc(TAR_MERGE_BUFFER)) == NULL) {
+        perror("Merge buffer allocation failed");
+        return NULL;
+    }
+    src->name = name;
+    src->fd = -1;
+    merge->count++;
+    return src;
+}
+
+// Function to add the local archive as a source
+int tar_merge_add_local(struct tar_merge *merge, const char *name, struct tar_stream *tar) {
+    struct merge_source *src = add_source(merge, name);
+    if (src == NULL) {
+        tar_stream_close(tar);
+        return -1;
+    }
+    src->tar = tar;
+    return 0;
+}
+
+// Function to add the dtar reply of a server as a source
+int tar_merge_add_server(struct tar_merge *merge, const char *name, int sock) {
+    struct merge_source *src = add_source(merge, name);
+    if (src == NULL) {
+        return -1;
+    }
+    src->fd = sock;
+    return merge->count - 1;
+}
+
+// Function to get the next bytes of the merged archive
+int tar_merge_next(struct tar_merge *merge, const void **data, size_t *len) {
+    if (merge->trailer_state == 2) {
+        return TAR_MERGE_END;
+    }
+    if (tar_merge_read(merge) < 0) {
+        return TAR_MERGE_FAIL;
+    }
+
+    // Continue the member being copied, or the member behind a pax or long name header
+    if (merge->current >= 0) {
+        struct merge_source *src = &merge->sources[merge->current];
+        if (src->unit_left == 0) {
+            int rc = begin_unit(src);
+            if (rc != 1 && (rc != 0 || src->eof)) {
+                return TAR_MERGE_FAIL;
+            }
+        }
+        size_t avail = src->end - src->start;
+        if (avail == 0 || src->unit_left == 0) {
+            if (src->eof) {
+                fprintf(stderr, "%s: archive ended in the middle of a member\n", src->name);
+                return TAR_MERGE_FAIL;
+            }
+            return TAR_MERGE_WAIT;
+        }
+        *data = src->buf + src->start;
+        *len = avail < src->unit_left ? avail : (size_t)src->unit_left;
+        return TAR_MERGE_DATA;
+    }
+
+    // Between members: take the next one from whichever source has its header, in turns
+    if (merge->trailer_state == 0) {
+        int finished = 0;
+        for (int k = 0; k < merge->count; k++) {
+            int i = (merge->next + k) % merge->count;
+            struct merge_source *src = &merge->sources[i];
+            if (source_finished(src)) {
+                finished++;
+                continue;
+            }
+            int rc = src->archive_done ? 0 : begin_unit(src);
+            if (rc < 0) {
+                return TAR_MERGE_FAIL;
+            }
+            if (rc == 1) {
+                merge->current = i;
+                merge->next = (i + 1) % merge->count;
+                return tar_merge_next(merge, data, len);
+            }
+            if (source_finished(src)) {
+                finished++;
+            } else if (src->eof) {
+                // Ended without a complete header block or marker
+                fprintf(stderr, "%s: archive is truncated\n", src->name);
+                return TAR_MERGE_FAIL;
+            }
+        }
+        if (finished < merge->count) {
+            return TAR_MERGE_WAIT;
+        }
+        merge->trailer_state = 1;
+    }
+
+    // Every source is done, close the merged archive with a single marker
+    *data = zero_trailer + merge->trailer_sent;
+    *len = TAR_TRAILER_SIZE - merge->trailer_sent;
+    return TAR_MERGE_DATA;
+}
+
+// Function to mark bytes of the merged archive as sent
+void tar_merge_consume(struct tar_merge *merge, size_t len) {
+    if (merge->trailer_state == 1) {
+        merge->trailer_sent += len;
+        if (merge->trailer_sent == TAR_TRAILER_SIZE) {
+            merge->trailer_state = 2;
+        }
+        return;
+    }
+    struct merge_source *src = &merge->sources[merge->current];
+    src->start += len;
+    src->unit_left -= len;
+    // A member is done once its content is, a pax or long name header keeps its source for the member
+    if (src->unit_left == 0 && !src->chained) {
+        merge->current = -1;
+    }
+}
+
+// Function to check whether a server connection should be watched for reading
+int tar_merge_wants_read(const struct tar_merge *merge, int index) {
+    const struct merge_source *src = &merge->sources[index];
+    if (src->fd < 0 || src->eof || src->failed) {
+        return 0;
+    }
+    // A full buffer is not read, the server waits until its members are copied
+    return src->archive_done || src->hdr_len < DFS_HDR_SIZE || src->opcode != DFS_OP_DATA ||
+           src->end - src->start < TAR_MERGE_BUFFER;
+}
+
+// Function to count the members of the merged archive
+uint64_t tar_merge_members(const struct tar_merge *merge) {
+    uint64_t members = 0;
+    for (int i = 0; i < merge->count; i++) {
+        members += merge->sources[i].members;
+    }
+    return members;
+}
+
+// Function to release a merge
+void tar_merge_free(struct tar_merge *merge) {
+    for (int i = 0; i < merge->count; i++) {
+        struct merge_source *src = &merge->sources[i];
+        if (src->have_piece && src->piece.kind == TAR_PIECE_FILE) {
+            close(src->piece.fd);
+        }
+        tar_stream_close(src->tar);
+        free(src->buf);
+    }
+    merge->count = 0;
+}
@@ -0,0 +1,101 @@
+#ifndef TAR_MERGE_H
+#define TAR_MERGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../common/dfs_proto.h"
+#include "../common/tar_stream.h"
+
+// Merging of several tar archives into one, for 'dtar all'.
+//
+// Each source is a complete archive: the local one comes from a tar_stream, the others are the
+// replies (NAME, DATA..., END or ERROR) to dtar requests sent to the Spdf and Stext servers, read
+// from their connections without blocking. All sources are read at the same time and members are
+// copied whole, header and content, from whichever source has one ready, so the merged archive is
+// done about when the slowest source is. Every source's end-of-archive marker is dropped and a
+// single one closes the merged archive.
+
+// Sources of one merge: the local archive and one per backend server (ROUTE_MAX_SERVERS)
+#define TAR_MERGE_MAX_SOURCES 17
+
+// Archive bytes buffered per source, a server is only read while its buffer has room
+#define TAR_MERGE_BUFFER (256 * 1024)
+
+enum tar_merge_result {
+    TAR_MERGE_DATA,  // bytes of the merged archive are ready, pass their count to tar_merge_consume()
+    TAR_MERGE_WAIT,  // waiting for server connections, see tar_merge_wants_read()
+    TAR_MERGE_END,   // the merged archive is complete, its end-of-archive marker was the last data
+    TAR_MERGE_FAIL   // a source failed or sent something that is not a tar archive
+};
+
+struct merge_source {
+    const char *name;                 // for log messages
+    unsigned char *buf;               // archive bytes not copied yet, from start to end
+    size_t start;
+    size_t end;
+    uint64_t unit_left;               // bytes left of the header block and content being copied
+    int chained;                      // the unit was a pax or GNU long name header, its member follows
+    int have_pax_size;                // a pax header gave the size of the next member
+    uint64_t pax_size;
+    int archive_done;                 // end-of-archive marker seen, anything after it is dropped
+    int eof;                          // no more bytes will come
+    int failed;
+    uint64_t members;
+
+    // Local archive
+    struct tar_stream *tar;
+    struct tar_piece piece;
+    int have_piece;
+    uint64_t piece_offset;
+
+    // Server connection, fd -1 for the local archive
+    int fd;
+    unsigned char hdr[DFS_HDR_SIZE];  // frame header being read
+    size_t hdr_len;
+    int opcode;                       // frame whose payload is being read
+    uint64_t payload_left;
+    char message[DFS_MAX_TEXT + 1];   // NAME or ERROR text
+    size_t message_len;
+    int named;                        // NAME came first, the reply is an archive
+    int clean;                        // the reply was read up to its END or ERROR, the connection can be reused
+};
+
+struct tar_merge {
+    struct merge_source sources[TAR_MERGE_MAX_SOURCES];
+    int count;
+    int current;        // source whose member is being copied, -1 between members
+    int next;           // first source asked for the next member, so none is starved
+    int trailer_state;  // 0 before, 1 while and 2 after handing out the end-of-archive marker
+    size_t trailer_sent;
+};
+
+void tar_merge_init(struct tar_merge *merge);
+
+// Add the archive of tar (owned by the merge from now on) as a source. Returns -1 if it can not be added.
+int tar_merge_add_local(struct tar_merge *merge, const char *name, struct tar_stream *tar);
+
+// Add the reply of a dtar request already sent on the non-blocking socket sock (still owned by the
+// caller). Returns the index of the source, or -1.
+int tar_merge_add_server(struct tar_merge *merge, const char *name, int sock);
+
+// Read what the sources have ready into their buffers, without blocking. Returns -1 if a source failed.
+// tar_merge_next() does this itself; call it before waiting so the watched connections are drained.
+int tar_merge_read(struct tar_merge *merge);
+
+// Get the next bytes of the merged archive, see enum tar_merge_result
+int tar_merge_next(struct tar_merge *merge, const void **data, size_t *len);
+
+// Mark len bytes returned by tar_merge_next() as sent
+void tar_merge_consume(struct tar_merge *merge, size_t len);
+
+// 1 if the server connection of source index should be watched for reading
+int tar_merge_wants_read(const struct tar_merge *merge, int index);
+
+// Members copied into the merged archive so far
+uint64_t tar_merge_members(const struct tar_merge *merge);
+
+// Release the buffers and the local archive, server sockets stay with the caller
+void tar_merge_free(struct tar_merge *merge);
+
+#endif
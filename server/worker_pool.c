@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "worker_pool.h"
+
+// Initial capacity of every worker's queue, it grows when needed
+#define QUEUE_INITIAL_CAP 64
+
+struct task {
+    worker_task_fn fn;
+    void *arg;
+};
+
+// Double-ended queue of one worker: the owner takes from the head, thieves from the tail
+struct task_queue {
+    pthread_mutex_t lock;
+    struct task *tasks;  // ring buffer
+    int head;
+    int count;
+    int cap;
+};
+
+struct worker {
+    struct worker_pool *pool;
+    int id;
+    pthread_t thread;
+    struct task_queue queue;
+};
+
+struct worker_pool {
+    char name[32];
+    struct worker *workers;
+    int worker_count;
+    unsigned int next;     // queue that gets the next submitted task
+    int pending;           // tasks queued and not yet taken
+    int stopping;
+    // Sleeping workers wait here for pending to become non-zero
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint64_t submitted;
+    uint64_t run;
+    uint64_t stolen;
+};
+
+// helper to append a task at the tail of a queue
+static int queue_push(struct task_queue *queue, worker_task_fn fn, void *arg) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->cap) {
+        int cap = queue->cap * 2;
+        struct task *grown = malloc(cap * sizeof(*grown));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        // Unwrap the ring into the new buffer
+        for (int i = 0; i < queue->count; i++) {
+            grown[i] = queue->tasks[(queue->head + i) % queue->cap];
+        }
+        free(queue->tasks);
+        queue->tasks = grown;
+        queue->head = 0;
+        queue->cap = cap;
+    }
+    queue->tasks[(queue->head + queue->count) % queue->cap] = (struct task){fn, arg};
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+// helper to take the oldest task of a queue (owner) or the newest one (thief)
+static int queue_take(struct task_queue *queue, int from_tail, struct task *out) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+    if (from_tail) {
+        *out = queue->tasks[(queue->head + queue->count - 1) % queue->cap];
+    } else {
+        *out = queue->tasks[queue->head];
+        queue->head = (queue->head + 1) % queue->cap;
+    }
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+// helper to find the next task for a worker: its own queue first, then the others
+static int find_task(struct worker *self, struct task *out) {
+    struct worker_pool *pool = self->pool;
+
+    if (queue_take(&self->queue, 0, out)) {
+        return 1;
+    }
+    for (int i = 1; i < pool->worker_count; i++) {
+        struct worker *victim = &pool->workers[(self->id + i) % pool->worker_count];
+        if (queue_take(&victim->queue, 1, out)) {
+            __sync_fetch_and_add(&pool->stolen, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// helper running one worker until the pool is destroyed
+static void *worker_main(void *arg) {
+    struct worker *self = arg;
+    struct worker_pool *pool = self->pool;
+    struct task task;
+
+    while (1) {
+        if (find_task(self, &task)) {
+            __sync_fetch_and_sub(&pool->pending, 1);
+            task.fn(task.arg);
+            __sync_fetch_and_add(&pool->run, 1);
+            continue;
+        }
+
+        // Nothing queued anywhere: sleep until a task is submitted. pending is checked under
+        // the lock the submitter signals with, so a wake up can not be missed.
+        pthread_mutex_lock(&pool->lock);
+        while (__sync_fetch_and_add(&pool->pending, 0) == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        int stop = pool->stopping && __sync_fetch_and_add(&pool->pending, 0) == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+// Function to start a pool of worker threads
+struct worker_pool *worker_pool_create(const char *name, int workers) {
+    if (workers < 1) {
+        workers = 1;
+    }
+    struct worker_pool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        perror("Worker pool allocation failed");
+        return NULL;
+    }
+    pool->workers = calloc(workers, sizeof(*pool->workers));
+    if (pool->workers == NULL) {
+        perror("Worker pool allocation failed");
+        free(pool);
+        return NULL;
+    }
+    snprintf(pool->name, sizeof(pool->name), "%s", name);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (int i = 0; i < workers; i++) {
+        struct worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        pthread_mutex_init(&worker->queue.lock, NULL);
+        worker->queue.cap = QUEUE_INITIAL_CAP;
+        worker->queue.tasks = malloc(QUEUE_INITIAL_CAP * sizeof(*worker->queue.tasks));
+        if (worker->queue.tasks == NULL) {
+            perror("Worker pool allocation failed");
+            worker_pool_destroy(pool);
+            return NULL;
+        }
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            perror("Worker thread creation failed");
+            free(worker->queue.tasks);
+            worker_pool_destroy(pool);
+            return NULL;
+        }
+        // Only started workers are joined on destroy
+        pool->worker_count = i + 1;
+    }
+    return pool;
+}
+
+// Function to queue a task on the next worker
+int worker_pool_submit(struct worker_pool *pool, worker_task_fn fn, void *arg) {
+    unsigned int slot = __sync_fetch_and_add(&pool->next, 1) % pool->worker_count;
+    if (queue_push(&pool->workers[slot].queue, fn, arg) < 0) {
+        perror("Task queue allocation failed");
+        return -1;
+    }
+    __sync_fetch_and_add(&pool->submitted, 1);
+
+    // Wake one sleeping worker; whichever it is, it finds the task by stealing if needed
+    pthread_mutex_lock(&pool->lock);
+    __sync_fetch_and_add(&pool->pending, 1);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Function to copy the pool counters
+void worker_pool_get_stats(struct worker_pool *pool, struct worker_pool_stats *stats) {
+    stats->submitted = __sync_fetch_and_add(&pool->submitted, 0);
+    stats->run = __sync_fetch_and_add(&pool->run, 0);
+    stats->stolen = __sync_fetch_and_add(&pool->stolen, 0);
+    stats->workers = pool->worker_count;
+}
+
+// Function to print the pool counters as one log line
+void worker_pool_print_stats(struct worker_pool *pool) {
+    struct worker_pool_stats stats;
+    worker_pool_get_stats(pool, &stats);
+    printf("%s workers: %d threads, %llu tasks submitted, %llu run, %llu stolen\n",
+           pool->name, stats.workers, (unsigned long long)stats.submitted,
+           (unsigned long long)stats.run, (unsigned long long)stats.stolen);
+}
+
+// Function to stop the workers once the queued tasks are done and free the pool
+void worker_pool_destroy(struct worker_pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].queue.lock);
+        free(pool->workers[i].queue.tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,43 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdint.h>
+
+// A fixed set of worker threads: the request workers of the Spdf and Stext servers, and the
+// threads that compress dtar archives in every server (tar_compress.c).
+//
+// Every worker owns a double-ended queue of tasks. worker_pool_submit() spreads new tasks over
+// the queues round robin; a worker runs its own tasks oldest first and, when its queue is
+// empty, steals the newest task from another worker's queue. A worker stuck in a long task
+// (a large upload or a tarball) therefore does not hold up the tasks queued behind it.
+// Workers with nothing to do sleep until a task is submitted.
+
+struct worker_pool;
+
+// A unit of work, run once on one of the worker threads
+typedef void (*worker_task_fn)(void *arg);
+
+// Counters describing how the pool spreads its work
+struct worker_pool_stats {
+    uint64_t submitted;  // tasks handed to worker_pool_submit()
+    uint64_t run;        // tasks finished
+    uint64_t stolen;     // tasks run by a worker other than the one they were queued for
+    int workers;
+};
+
+// Start a pool with the given number of worker threads, name is only used in log messages. Returns NULL on failure.
+struct worker_pool *worker_pool_create(const char *name, int workers);
+
+// Queue fn(arg) to run on a worker, return -1 if the task could not be queued
+int worker_pool_submit(struct worker_pool *pool, worker_task_fn fn, void *arg);
+
+// Copy the current counters
+void worker_pool_get_stats(struct worker_pool *pool, struct worker_pool_stats *stats);
+
+// Print the counters as one log line
+void worker_pool_print_stats(struct worker_pool *pool);
+
+// Let the workers finish the queued tasks, join them and free the pool
+void worker_pool_destroy(struct worker_pool *pool);
+
+#endif